@@ -0,0 +1,134 @@
+//
+//  benchmark.hpp
+//  RefractionProject
+//
+//  Scalability sweep for the three-pass refraction: procedural shapes from 1k triangles
+//  upwards, 1 to N instances of them, rendered headless at several resolutions.
+//  Every pass gets a row in the CSV with its CPU submit time, GPU time and GL call counts.
+//
+//  RefractionProject --bench-scaling [--out scaling.csv] [--max-triangles 10000000]
+//                    [--max-instances 64] [--frames 10] [--software]
+//
+
+#ifndef benchmark_hpp
+#define benchmark_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+/*
+    Lays out instances unit-radius objects on a square grid facing the camera and returns
+    the camera distance that fits the whole grid inside the renderer's projection.
+*/
+inline float instanceGrid(int instances, const glm::mat4 &projection, vector<glm::mat4> &models)
+{
+    int side = (int)std::ceil(std::sqrt((double)instances));
+    const float spacing = 2.5f;
+    models.clear();
+    for (int i = 0; i < instances; i++) {
+        float x = ((i % side) - (side - 1) * 0.5f) * spacing;
+        float y = ((i / side) - (side - 1) * 0.5f) * spacing;
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(x, y, 0.0f));
+        // spin each one a little so the instances don't all look identical
+        model = glm::rotate(model, 17.0f * i, glm::vec3(0.3f, 1.0f, 0.1f));
+        models.push_back(model);
+    }
+    // projection[1][1] = 1 / tan(fovy / 2), so this distance makes the grid fill ~80% of the height
+    float extent = side * spacing;
+    return 1.25f * 0.5f * extent * projection[1][1];
+}
+
+inline int runScalingBenchmark(int argc, char *argv[])
+{
+    string outPath = argValue(argc, argv, "--out", "scaling.csv");
+    double maxTriangles = argNumber(argc, argv, "--max-triangles", 10000000);
+    int maxInstances = (int)argNumber(argc, argv, "--max-instances", 64);
+    int frames = (int)argNumber(argc, argv, "--frames", 10);
+    const int warmupFrames = 2;
+
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+
+    ofstream csv(outPath.c_str());
+    if (!csv) {
+        cout << "ERROR::BENCHMARK:: Could not open " << outPath << endl;
+        destroyHeadlessContext(window);
+        return -1;
+    }
+    csv << "shape,triangles,instances,width,height,pass,cpu_ms,gpu_ms,gl_calls,draw_calls" << endl;
+
+    unsigned int cubemapTexture = loadCubemap(skyboxFaces("skybox/sky"));
+
+    const int resolutions[][2] = { { 800, 600 }, { 1600, 1200 }, { 2560, 1920 } };
+    const ProceduralShape shapes[] = { SHAPE_SPHERE, SHAPE_TORUS, SHAPE_BLOB };
+
+    Renderer renderer(resolutions[0][0], resolutions[0][1], cubemapTexture);
+    renderer.profiling = true;
+
+    for (ProceduralShape shape : shapes) {
+        for (double triangles = 1000; triangles <= maxTriangles * 1.001; triangles *= 10) {
+            vector<Mesh> meshes;
+            meshes.push_back(generateShape(shape, (unsigned int)triangles));
+            unsigned long long realTriangles = meshes[0].indices.size() / 3;
+            Model object(std::move(meshes));
+            cout << proceduralShapeName(shape) << ": " << realTriangles << " triangles" << endl;
+
+            for (int instances = 1; instances <= maxInstances; instances *= 4) {
+                vector<glm::mat4> models;
+                for (const int *resolution : resolutions) {
+                    RenderTarget output = createRenderTarget(resolution[0], resolution[1], "benchmark output");
+                    renderer.resize(resolution[0], resolution[1]);
+                    float distance = instanceGrid(instances, renderer.projection, models);
+                    glm::vec3 cameraPos(0.0f, 0.0f, distance);
+                    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+                    PassStats total[PASS_COUNT] = {};
+                    for (int frame = 0; frame < warmupFrames + frames; frame++) {
+                        renderer.renderFrame(object, models, view, cameraPos, output.framebuffer);
+                        glFinish();
+                        if (frame < warmupFrames)
+                            continue;
+                        for (int pass = 0; pass < PASS_COUNT; pass++) {
+                            total[pass].cpuMs += renderer.stats[pass].cpuMs;
+                            total[pass].gpuMs += renderer.stats[pass].gpuMs;
+                            total[pass].glCalls += renderer.stats[pass].glCalls;
+                            total[pass].drawCalls += renderer.stats[pass].drawCalls;
+                        }
+                    }
+                    for (int pass = 0; pass < PASS_COUNT; pass++) {
+                        csv << proceduralShapeName(shape) << ',' << realTriangles << ',' << instances << ','
+                            << resolution[0] << ',' << resolution[1] << ',' << renderPassName(pass) << ','
+                            << total[pass].cpuMs / frames << ',' << total[pass].gpuMs / frames << ','
+                            << total[pass].glCalls / frames << ',' << total[pass].drawCalls / frames << endl;
+                    }
+                    deleteRenderTarget(output);
+                }
+            }
+            object.release();
+        }
+    }
+
+    cout << "Wrote " << outPath << endl;
+    renderer.release();
+    memoryRegistry().release(MEM_TEXTURE, cubemapTexture);
+    glDeleteTextures(1, &cubemapTexture);
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* benchmark_hpp */
@@ -0,0 +1,541 @@
+//
+//  bvh.hpp
+//  RefractionProject
+//
+//  Bounding volume hierarchy over world-space triangles, for the CPU ray queries (ray tracer, bakers).
+//  Nodes are 32 bytes: two corners and two ints. Children of an inner node are stored next to each
+//  other, so one index is enough; leaves point at a run of triangle indices.
+//
+//  Built top-down with the binned surface area heuristic: triangle centroids are dropped into 16 bins
+//  along each axis and we split where the expected cost of a ray (one traversal step + the triangle
+//  tests, weighted by how likely a ray is to hit each child's box) is lowest. The first big splits
+//  bin in parallel, after that every subtree is its own task. All nodes come out of one block sized for
+//  the worst case (2n - 1 nodes), handed out in pairs by an atomic counter, so tasks never allocate.
+//
+
+#ifndef bvh_hpp
+#define bvh_hpp
+
+#include "glm/glm.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+struct BvhNode {
+    float min[3];
+    unsigned int leftFirst;   // inner node: index of the left child (right = left + 1); leaf: first triangle
+    float max[3];
+    unsigned int count;       // triangles in the leaf, 0 for inner nodes
+};
+
+struct Ray {
+    glm::vec3 origin, direction;
+};
+
+struct RayHit {
+    float t, u, v;            // distance along the ray, barycentrics of vertex 1 and 2
+    unsigned int triangle;    // index into the triangles the BVH was built from
+};
+
+struct ClosestHit {
+    float distance;           // to the nearest point on any triangle
+    glm::vec3 point;
+    unsigned int triangle;
+};
+
+// nearest point of triangle abc to p, Ericson's Real-Time Collision Detection 5.1.5
+inline glm::vec3 closestPointOnTriangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+        return a;
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+        return b;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        return a + ab * (d1 / (d1 - d3));
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+        return c;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// no FMA contraction, the Bvh8 kernels have to get the same hits (bvh8kernels.hpp)
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+class Bvh {
+public:
+    std::vector<BvhNode> nodes;
+    std::vector<unsigned int> triangles;   // triangle indices, leaves point into this
+    std::vector<glm::vec3> vertices;       // 3 per triangle, in the original triangle order
+    int maxLeafSize;                       // bigger leaves are always split
+    float traversalCost;                   // SAH cost of visiting an inner node, relative to one triangle test
+
+    Bvh() : maxLeafSize(8), traversalCost(1.0f) {}
+
+    // positions holds 3 vertices per triangle; threads 0 = one per core
+    void build(std::vector<glm::vec3> positions, int threads = 0)
+    {
+        if (threads <= 0)
+            threads = hardwareThreads();
+        vertices.swap(positions);
+        unsigned int count = (unsigned int)(vertices.size() / 3);
+        nodes.assign(count > 0 ? 2 * count - 1 : 1, BvhNode());
+        nodeCount = 1;
+        refs.resize(count);
+        if (count == 0) {
+            setBounds(nodes[0], Bounds());
+            nodes[0].leftFirst = nodes[0].count = 0;
+            triangles.clear();
+            return;
+        }
+
+        const unsigned int chunk = 16384;
+        parallelFor((int)((count + chunk - 1) / chunk), threads, [&](int c, int) {
+            for (unsigned int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+                Bounds b;
+                for (int k = 0; k < 3; k++)
+                    b.grow(vertices[3 * i + k]);
+                refs[i].lo = b.lo;
+                refs[i].hi = b.hi;
+                refs[i].index = i;
+            }
+        });
+        Bounds rootBounds;
+        for (unsigned int i = 0; i < count; i++)
+            rootBounds.grow(refs[i]);
+        setBounds(nodes[0], rootBounds);
+
+        // split the big nodes with parallel binning until there are plenty of subtrees to hand out
+        unsigned int taskSize = threads > 1 ? std::max(4096u, count / (unsigned int)(8 * threads)) : count;
+        std::vector<BuildTask> pending(1, BuildTask(0, 0, count)), tasks;
+        while (!pending.empty()) {
+            BuildTask task = pending.back();
+            pending.pop_back();
+            if (task.count <= taskSize) {
+                tasks.push_back(task);
+                continue;
+            }
+            BuildTask children[2];
+            if (splitNode(task, threads, children)) {
+                pending.push_back(children[0]);
+                pending.push_back(children[1]);
+            }
+        }
+        // biggest first, so the last task to finish is a small one
+        std::sort(tasks.begin(), tasks.end(), [](const BuildTask &a, const BuildTask &b) { return a.count > b.count; });
+        parallelFor((int)tasks.size(), threads, [&](int i, int) { buildSubtree(tasks[i]); });
+
+        nodes.resize(nodeCount);
+        triangles.resize(count);
+        for (unsigned int i = 0; i < count; i++)
+            triangles[i] = refs[i].index;
+        refs.clear();
+        refs.shrink_to_fit();
+    }
+
+    size_t triangleCount() const { return triangles.size(); }
+
+    // expected cost of a random ray, relative to one triangle test: the sum over all nodes of
+    // (surface area / root surface area) * (traversalCost for inner nodes, triangle count for leaves)
+    float sahCost() const
+    {
+        float rootArea = nodeArea(nodes[0]);
+        if (rootArea <= 0.0f)
+            return 0.0f;
+        double cost = 0.0;
+        for (size_t i = 0; i < nodes.size(); i++)
+            cost += nodeArea(nodes[i]) * (nodes[i].count > 0 ? (float)nodes[i].count : traversalCost);
+        return (float)(cost / rootArea);
+    }
+
+    int depth() const
+    {
+        int deepest = 0;
+        std::vector<std::pair<unsigned int, int> > stack(1, std::make_pair(0u, 1));
+        while (!stack.empty()) {
+            std::pair<unsigned int, int> top = stack.back();
+            stack.pop_back();
+            deepest = std::max(deepest, top.second);
+            if (nodes[top.first].count == 0) {
+                stack.push_back(std::make_pair(nodes[top.first].leftFirst, top.second + 1));
+                stack.push_back(std::make_pair(nodes[top.first].leftFirst + 1, top.second + 1));
+            }
+        }
+        return deepest;
+    }
+
+    // nearest hit with t in (tMin, hit.t); hit.t should start at the maximum distance
+    bool intersect(const Ray &ray, RayHit &hit, float tMin = 0.0f) const
+    {
+        glm::vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+        unsigned int stack[128];
+        int top = 0;
+        unsigned int node = 0;
+        bool found = false;
+        if (boxDistance(nodes[0], ray, invDir, hit.t) == FLT_MAX)
+            return false;
+        for (;;) {
+            const BvhNode &n = nodes[node];
+            if (n.count > 0) {
+                for (unsigned int i = n.leftFirst; i < n.leftFirst + n.count; i++)
+                    if (intersectTriangle(ray, triangles[i], tMin, hit))
+                        found = true;
+            } else {
+                // visit the nearer child first, push the other one
+                unsigned int left = n.leftFirst, right = n.leftFirst + 1;
+                float dLeft = boxDistance(nodes[left], ray, invDir, hit.t);
+                float dRight = boxDistance(nodes[right], ray, invDir, hit.t);
+                if (dLeft > dRight) {
+                    std::swap(dLeft, dRight);
+                    std::swap(left, right);
+                }
+                if (dLeft != FLT_MAX) {
+                    if (dRight != FLT_MAX && top < 128)
+                        stack[top++] = right;
+                    node = left;
+                    continue;
+                }
+            }
+            if (top == 0)
+                break;
+            node = stack[--top];
+        }
+        return found;
+    }
+
+    /*
+        Nearest surface point to p within maxDistance. Children are visited nearest box first and a box
+        farther away than the best point so far is skipped, so a tight maxDistance makes this cheap.
+    */
+    bool closestPoint(const glm::vec3 &p, float maxDistance, ClosestHit &hit) const
+    {
+        float best = maxDistance * maxDistance;
+        bool found = false;
+        if (triangles.empty())
+            return false;
+        std::pair<unsigned int, float> stack[128];
+        int top = 0;
+        stack[top++] = std::make_pair(0u, pointBoxDistance2(nodes[0], p));
+        while (top > 0) {
+            std::pair<unsigned int, float> entry = stack[--top];
+            if (entry.second > best)
+                continue;
+            const BvhNode &n = nodes[entry.first];
+            if (n.count > 0) {
+                for (unsigned int i = n.leftFirst; i < n.leftFirst + n.count; i++) {
+                    unsigned int triangle = triangles[i];
+                    glm::vec3 q = closestPointOnTriangle(p, vertices[3 * triangle], vertices[3 * triangle + 1], vertices[3 * triangle + 2]);
+                    glm::vec3 offset = q - p;
+                    float d2 = glm::dot(offset, offset);
+                    if (d2 <= best) {
+                        best = d2;
+                        hit.point = q;
+                        hit.triangle = triangle;
+                        found = true;
+                    }
+                }
+                continue;
+            }
+            unsigned int left = n.leftFirst, right = n.leftFirst + 1;
+            float dLeft = pointBoxDistance2(nodes[left], p), dRight = pointBoxDistance2(nodes[right], p);
+            if (dLeft > dRight) {
+                std::swap(dLeft, dRight);
+                std::swap(left, right);
+            }
+            // far child first so the near one is popped next
+            if (dRight <= best && top < 128)
+                stack[top++] = std::make_pair(right, dRight);
+            if (dLeft <= best && top < 128)
+                stack[top++] = std::make_pair(left, dLeft);
+        }
+        if (found)
+            hit.distance = std::sqrt(best);
+        return found;
+    }
+
+    // Moller-Trumbore, updates hit if the triangle is nearer
+    bool intersectTriangle(const Ray &ray, unsigned int triangle, float tMin, RayHit &hit) const
+    {
+        const glm::vec3 &v0 = vertices[3 * triangle];
+        glm::vec3 e1 = vertices[3 * triangle + 1] - v0, e2 = vertices[3 * triangle + 2] - v0;
+        glm::vec3 p = glm::cross(ray.direction, e2);
+        float det = glm::dot(e1, p);
+        if (std::fabs(det) < 1e-12f)
+            return false;
+        float invDet = 1.0f / det;
+        glm::vec3 s = ray.origin - v0;
+        float u = glm::dot(s, p) * invDet;
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        glm::vec3 q = glm::cross(s, e1);
+        float v = glm::dot(ray.direction, q) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+        float t = glm::dot(e2, q) * invDet;
+        if (t <= tMin || t >= hit.t)
+            return false;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        hit.triangle = triangle;
+        return true;
+    }
+
+private:
+    static const int BINS = 16;
+
+    // a triangle's bounds while building, 32 bytes like a node
+    struct PrimRef {
+        glm::vec3 lo;
+        unsigned int index;
+        glm::vec3 hi;
+        unsigned int pad;
+        float centroid(int axis) const { return (lo[axis] + hi[axis]) * 0.5f; }
+    };
+
+    struct Bounds {
+        glm::vec3 lo, hi;
+        Bounds() : lo(FLT_MAX), hi(-FLT_MAX) {}
+        void grow(const glm::vec3 &p) { lo = glm::min(lo, p); hi = glm::max(hi, p); }
+        void grow(const PrimRef &r) { lo = glm::min(lo, r.lo); hi = glm::max(hi, r.hi); }
+        void grow(const Bounds &b) { lo = glm::min(lo, b.lo); hi = glm::max(hi, b.hi); }
+        float area() const
+        {
+            if (lo.x > hi.x)
+                return 0.0f;
+            glm::vec3 d = hi - lo;
+            return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+    };
+
+    struct BuildTask {
+        unsigned int node, first, count;
+        BuildTask() : node(0), first(0), count(0) {}
+        BuildTask(unsigned int node, unsigned int first, unsigned int count) : node(node), first(first), count(count) {}
+    };
+
+    struct Bin {
+        Bounds bounds;
+        unsigned int count;
+        Bin() : count(0) {}
+    };
+
+    struct BinSet {
+        Bin bins[3][BINS];
+        Bounds centroids;
+    };
+
+    std::vector<PrimRef> refs;
+    std::atomic<unsigned int> nodeCount;
+
+    static void setBounds(BvhNode &node, const Bounds &b)
+    {
+        for (int i = 0; i < 3; i++) {
+            node.min[i] = b.lo.x <= b.hi.x ? b.lo[i] : 0.0f;
+            node.max[i] = b.lo.x <= b.hi.x ? b.hi[i] : 0.0f;
+        }
+    }
+
+    static float nodeArea(const BvhNode &node)
+    {
+        float dx = node.max[0] - node.min[0], dy = node.max[1] - node.min[1], dz = node.max[2] - node.min[2];
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    // squared distance from p to the box, 0 inside it
+    static float pointBoxDistance2(const BvhNode &node, const glm::vec3 &p)
+    {
+        float d2 = 0.0f;
+        for (int i = 0; i < 3; i++) {
+            float d = std::max(std::max(node.min[i] - p[i], p[i] - node.max[i]), 0.0f);
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+    // distance to where the ray enters the box, FLT_MAX if it misses or the box is past maxT
+    static float boxDistance(const BvhNode &node, const Ray &ray, const glm::vec3 &invDir, float maxT)
+    {
+        float tNear = 0.0f, tFar = maxT;
+        for (int i = 0; i < 3; i++) {
+            float t0 = (node.min[i] - ray.origin[i]) * invDir[i];
+            float t1 = (node.max[i] - ray.origin[i]) * invDir[i];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            tNear = t0 > tNear ? t0 : tNear; // written this way so NaNs (0 * inf) are ignored
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        return tNear <= tFar ? tNear : FLT_MAX;
+    }
+
+    void makeLeaf(const BuildTask &task)
+    {
+        nodes[task.node].leftFirst = task.first;
+        nodes[task.node].count = task.count;
+    }
+
+    void buildSubtree(const BuildTask &root)
+    {
+        std::vector<BuildTask> stack(1, root);
+        while (!stack.empty()) {
+            BuildTask task = stack.back();
+            stack.pop_back();
+            BuildTask children[2];
+            if (splitNode(task, 1, children)) {
+                stack.push_back(children[0]);
+                stack.push_back(children[1]);
+            }
+        }
+    }
+
+    void binRange(unsigned int first, unsigned int end, const Bounds &centroids, const glm::vec3 &scale, BinSet &set) const
+    {
+        for (unsigned int i = first; i < end; i++) {
+            const PrimRef &r = refs[i];
+            for (int axis = 0; axis < 3; axis++) {
+                int b = std::min(BINS - 1, (int)((r.centroid(axis) - centroids.lo[axis]) * scale[axis]));
+                set.bins[axis][b].bounds.grow(r);
+                set.bins[axis][b].count++;
+            }
+        }
+    }
+
+    /*
+        Makes task's node a leaf, or gives it two children and returns their tasks. The node's own
+        bounds are already set (by its parent, or build() for the root).
+    */
+    bool splitNode(const BuildTask &task, int threads, BuildTask children[2])
+    {
+        if (task.count <= 1) {
+            makeLeaf(task);
+            return false;
+        }
+        unsigned int end = task.first + task.count;
+        Bounds centroids;
+        for (unsigned int i = task.first; i < end; i++) {
+            const PrimRef &r = refs[i];
+            centroids.grow((r.lo + r.hi) * 0.5f);
+        }
+        glm::vec3 extent = centroids.hi - centroids.lo, scale;
+        for (int axis = 0; axis < 3; axis++)
+            scale[axis] = extent[axis] > 0.0f ? BINS / extent[axis] : 0.0f;
+
+        BinSet set;
+        const unsigned int chunk = 65536;
+        if (threads > 1 && task.count > 2 * chunk) {
+            int chunks = (int)((task.count + chunk - 1) / chunk);
+            std::vector<BinSet> partial(chunks);
+            parallelFor(chunks, threads, [&](int c, int) {
+                binRange(task.first + c * chunk, std::min(end, task.first + (c + 1) * chunk), centroids, scale, partial[c]);
+            });
+            for (int c = 0; c < chunks; c++)
+                for (int axis = 0; axis < 3; axis++)
+                    for (int b = 0; b < BINS; b++) {
+                        set.bins[axis][b].bounds.grow(partial[c].bins[axis][b].bounds);
+                        set.bins[axis][b].count += partial[c].bins[axis][b].count;
+                    }
+        } else {
+            binRange(task.first, end, centroids, scale, set);
+        }
+
+        // sweep the bins from both sides; splitting after bin b costs area(left) * left + area(right) * right
+        int bestAxis = -1, bestBin = 0;
+        float bestCost = FLT_MAX;
+        Bounds bestLeft, bestRight;
+        unsigned int bestLeftCount = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f)
+                continue;
+            float rightCost[BINS];
+            Bounds rightBounds[BINS];
+            Bounds right;
+            unsigned int rightCount = 0;
+            for (int b = BINS - 1; b > 0; b--) {
+                right.grow(set.bins[axis][b].bounds);
+                rightCount += set.bins[axis][b].count;
+                rightBounds[b] = right;
+                rightCost[b] = right.area() * rightCount;
+            }
+            Bounds left;
+            unsigned int leftCount = 0;
+            for (int b = 0; b < BINS - 1; b++) {
+                left.grow(set.bins[axis][b].bounds);
+                leftCount += set.bins[axis][b].count;
+                if (leftCount == 0 || leftCount == task.count)
+                    continue;
+                float cost = left.area() * leftCount + rightCost[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                    bestLeft = left;
+                    bestRight = rightBounds[b + 1];
+                    bestLeftCount = leftCount;
+                }
+            }
+        }
+
+        const BvhNode &node = nodes[task.node];
+        float area = nodeArea(node);
+        float splitCost = traversalCost + (area > 0.0f ? bestCost / area : 0.0f);
+        if (bestAxis < 0) {
+            // every centroid in the same spot: no plane separates them, cut the list in half if it's too long
+            if (task.count <= (unsigned int)maxLeafSize) {
+                makeLeaf(task);
+                return false;
+            }
+            bestLeftCount = task.count / 2;
+            bestLeft = bestRight = Bounds();
+            for (unsigned int i = task.first; i < end; i++)
+                (i < task.first + bestLeftCount ? bestLeft : bestRight).grow(refs[i]);
+        } else {
+            if (task.count <= (unsigned int)maxLeafSize && splitCost >= (float)task.count) {
+                makeLeaf(task);
+                return false;
+            }
+            int axis = bestAxis;
+            float lo = centroids.lo[axis], s = scale[axis];
+            std::partition(refs.begin() + task.first, refs.begin() + end, [&](const PrimRef &r) {
+                return std::min(BINS - 1, (int)((r.centroid(axis) - lo) * s)) <= bestBin;
+            });
+        }
+
+        unsigned int left = nodeCount.fetch_add(2);
+        setBounds(nodes[left], bestLeft);
+        setBounds(nodes[left + 1], bestRight);
+        nodes[task.node].leftFirst = left;
+        nodes[task.node].count = 0;
+        children[0] = BuildTask(left, task.first, bestLeftCount);
+        children[1] = BuildTask(left + 1, task.first + bestLeftCount, task.count - bestLeftCount);
+        return true;
+    }
+};
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT DEFAULT
+#else
+#pragma GCC pop_options
+#endif
+
+#endif /* bvh_hpp */
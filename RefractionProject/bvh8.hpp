@@ -0,0 +1,263 @@
+//
+//  bvh8.hpp
+//  RefractionProject
+//
+//  An 8-wide copy of a Bvh for the CPU ray queries: every node holds the boxes of up to 8 children
+//  and every leaf is a block of up to 8 triangles, stored lane by lane so one ray is tested against
+//  8 boxes or 8 triangles with one set of vector instructions. Packets of 8 coherent rays (camera rays
+//  of a 4x2 pixel block) can also walk the tree together, testing all 8 rays against each box. That only
+//  pays off with AVX2 on coherent rays: with SSE2 a packet is about as fast as its rays one at a time,
+//  and on incoherent rays every packet kernel is slower, so the ray tracer traces rays one at a time.
+//
+//  The kernels (bvh8kernels.hpp) are compiled three times, once per 8-lane type in simd8.hpp: AVX2
+//  (one 256-bit register), SSE2/NEON (two vfloat4s) and plain scalar loops. The AVX2 copy is built with
+//  the target switched on just for those functions, so the program still runs on CPUs without it: we
+//  pick the best copy the CPU supports at runtime.
+//
+
+#ifndef bvh8_hpp
+#define bvh8_hpp
+
+#include "glm/glm.hpp"
+#include "bvh.hpp"
+#include "simd8.hpp"
+
+#include <cfloat>
+#include <vector>
+
+const unsigned int BVH8_LEAF = 0x80000000u;   // child points at a triangle block instead of a node
+const unsigned int BVH8_EMPTY = 0xffffffffu;  // unused triangle slot in a block
+const int BVH8_STACK = 256;
+
+struct Bvh8Node {                 // 256 bytes
+    float lo[3][8], hi[3][8];     // child boxes, [axis][child]
+    unsigned int child[8];        // node index, or BVH8_LEAF | block index
+    unsigned int validMask;       // bit per used child slot
+    unsigned int pad[7];
+};
+
+struct Bvh8Block {                // 320 bytes, unused slots are all zero (they never hit)
+    float v0[3][8], e1[3][8], e2[3][8];   // first vertex and the two edges from it, [axis][triangle]
+    unsigned int id[8];                   // triangle index in the Bvh's vertices, or BVH8_EMPTY
+};
+
+struct Bvh8StackEntry {
+    unsigned int node;
+    float dist;
+};
+
+// 8 rays, lane by lane
+struct RayPacket8 {
+    float origin[3][8], direction[3][8];
+};
+
+struct RayHit8 {
+    float t[8], u[8], v[8];
+    unsigned int triangle[8];
+};
+
+enum Bvh8Isa { BVH8_SCALAR = SIMD8_SCALAR, BVH8_SSE = SIMD8_SSE, BVH8_AVX2_ISA = SIMD8_AVX2_ISA, BVH8_ISA_COUNT = SIMD8_ISA_COUNT };
+
+class Bvh8;
+
+struct Bvh8Kernels {
+    const char *name;
+    bool (*intersect)(const Bvh8 &, const Ray &, RayHit &, float);
+    void (*intersectPacket)(const Bvh8 &, const RayPacket8 &, RayHit8 &, float);
+};
+
+inline int bvh8BestIsa();
+inline const Bvh8Kernels &bvh8Kernels(int isa);
+
+class Bvh8 {
+public:
+    std::vector<Bvh8Node> nodes;      // nodes[0] is the root
+    std::vector<Bvh8Block> blocks;
+    const Bvh8Kernels *kernels;
+
+    Bvh8() : kernels(0) {}
+
+    // collapses a built Bvh; its triangle indices are kept, so hits can be looked up in bvh.vertices
+    void build(const Bvh &bvh, int isa = -1)
+    {
+        kernels = &bvh8Kernels(isa < 0 ? bvh8BestIsa() : isa);
+        nodes.assign(1, Bvh8Node());
+        blocks.clear();
+        nodes[0].validMask = 0;
+        if (bvh.triangleCount() == 0)
+            return;
+        // triangle range under every binary node (children always come after their parent)
+        size_t count = bvh.nodes.size();
+        first.resize(count);
+        size.resize(count);
+        for (size_t i = count; i-- > 0;) {
+            const BvhNode &n = bvh.nodes[i];
+            if (n.count > 0) {
+                first[i] = n.leftFirst;
+                size[i] = n.count;
+            } else {
+                first[i] = first[n.leftFirst];
+                size[i] = size[n.leftFirst] + size[n.leftFirst + 1];
+            }
+        }
+        collapse(bvh, 0, 0);
+        first.clear();
+        size.clear();
+    }
+
+    void setIsa(int isa) { kernels = &bvh8Kernels(isa); }
+
+    // nearest hit with t in (tMin, hit.t), like Bvh::intersect
+    bool intersect(const Ray &ray, RayHit &hit, float tMin = 0.0f) const
+    {
+        return kernels->intersect(*this, ray, hit, tMin);
+    }
+
+    // the same for 8 rays at once; lanes with a negative hits.t are skipped
+    void intersect(const RayPacket8 &packet, RayHit8 &hits, float tMin = 0.0f) const
+    {
+        kernels->intersectPacket(*this, packet, hits, tMin);
+    }
+
+private:
+    std::vector<unsigned int> first, size;
+
+    static float area(const BvhNode &n)
+    {
+        float dx = n.max[0] - n.min[0], dy = n.max[1] - n.min[1], dz = n.max[2] - n.min[2];
+        return dx * dy + dy * dz + dz * dx;
+    }
+
+    unsigned int addBlock(const Bvh &bvh, unsigned int start, unsigned int count)
+    {
+        Bvh8Block block = Bvh8Block();
+        for (int i = 0; i < 8; i++) {
+            if ((unsigned int)i >= count) {
+                block.id[i] = BVH8_EMPTY;
+                continue;
+            }
+            unsigned int t = bvh.triangles[start + i];
+            const glm::vec3 *v = &bvh.vertices[3 * t];
+            glm::vec3 e1 = v[1] - v[0], e2 = v[2] - v[0];
+            for (int axis = 0; axis < 3; axis++) {
+                block.v0[axis][i] = v[0][axis];
+                block.e1[axis][i] = e1[axis];
+                block.e2[axis][i] = e2[axis];
+            }
+            block.id[i] = t;
+        }
+        blocks.push_back(block);
+        return (unsigned int)blocks.size() - 1;
+    }
+
+    /*
+        Fills wide node w from binary node b: start with b's two children and keep opening the biggest
+        child (by surface area) until there are 8. Anything with 8 triangles or fewer becomes one block.
+    */
+    void collapse(const Bvh &bvh, unsigned int b, unsigned int w)
+    {
+        std::vector<unsigned int> children;
+        if (bvh.nodes[b].count > 0 || size[b] <= 8) {
+            children.push_back(b);
+        } else {
+            children.push_back(bvh.nodes[b].leftFirst);
+            children.push_back(bvh.nodes[b].leftFirst + 1);
+        }
+        while (children.size() < 8) {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (size_t k = 0; k < children.size(); k++) {
+                const BvhNode &n = bvh.nodes[children[k]];
+                if (n.count == 0 && size[children[k]] > 8 && area(n) > bestArea) {
+                    best = (int)k;
+                    bestArea = area(n);
+                }
+            }
+            if (best < 0)
+                break;
+            unsigned int open = children[best];
+            children[best] = bvh.nodes[open].leftFirst;
+            children.push_back(bvh.nodes[open].leftFirst + 1);
+        }
+
+        Bvh8Node node = Bvh8Node();
+        for (size_t k = 0; k < children.size(); k++) {
+            const BvhNode &n = bvh.nodes[children[k]];
+            for (int axis = 0; axis < 3; axis++) {
+                node.lo[axis][k] = n.min[axis];
+                node.hi[axis][k] = n.max[axis];
+            }
+            node.validMask |= 1u << k;
+            node.child[k] = size[children[k]] <= 8 ? BVH8_LEAF | addBlock(bvh, first[children[k]], size[children[k]]) : 0;
+        }
+        nodes[w] = node;
+        for (size_t k = 0; k < children.size(); k++) {
+            if (size[children[k]] <= 8)
+                continue;
+            unsigned int index = (unsigned int)nodes.size();
+            nodes.push_back(Bvh8Node());
+            nodes[w].child[k] = index;
+            collapse(bvh, children[k], index);
+        }
+    }
+};
+
+// ---- the kernels once per instruction set, see simd8.hpp ----
+
+namespace bvh8_scalar {
+using namespace simd8_scalar;
+#include "bvh8kernels.hpp"
+}
+
+namespace bvh8_sse {
+using namespace simd8_sse;
+#include "bvh8kernels.hpp"
+}
+
+#ifdef SIMD8_AVX2
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace bvh8_avx2 {
+using namespace simd8_avx2;
+#include "bvh8kernels.hpp"
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif /* SIMD8_AVX2 */
+
+inline bool bvh8IsaSupported(int isa)
+{
+    return simd8IsaSupported(isa);
+}
+
+inline int bvh8BestIsa()
+{
+    return simd8BestIsa();
+}
+
+inline const Bvh8Kernels &bvh8Kernels(int isa)
+{
+    static const Bvh8Kernels kernels[BVH8_ISA_COUNT] = {
+        { simd8IsaName(SIMD8_SCALAR), bvh8_scalar::intersectRay, bvh8_scalar::intersectPacket },
+        { simd8IsaName(SIMD8_SSE), bvh8_sse::intersectRay, bvh8_sse::intersectPacket },
+#ifdef SIMD8_AVX2
+        { simd8IsaName(SIMD8_AVX2_ISA), bvh8_avx2::intersectRay, bvh8_avx2::intersectPacket },
+#else
+        { simd8IsaName(SIMD8_AVX2_ISA), bvh8_sse::intersectRay, bvh8_sse::intersectPacket },
+#endif
+    };
+    if (!bvh8IsaSupported(isa))
+        isa = bvh8BestIsa();
+    return kernels[isa];
+}
+
+#endif /* bvh8_hpp */
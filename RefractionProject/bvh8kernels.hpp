@@ -0,0 +1,206 @@
+//
+//  bvh8kernels.hpp
+//  RefractionProject
+//
+//  Bvh8 traversal with the ray/box and ray/triangle tests, written once against an 8-lane float type.
+//  bvh8.hpp includes this file once per instruction set, inside a namespace that defines vfloat8 and
+//  vmask8 for it (with the AVX2 target switched on for that one), so there is no include guard on purpose.
+//  The arithmetic is done in the same order as Bvh::intersectTriangle so the results match it. That only
+//  holds while neither side fuses a multiply and an add into an FMA (which -march=native lets the compiler
+//  do, with rounding of its own), so contraction is off here and in Bvh.
+//
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#else
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// one ray against the 8 triangles of a block; returns a bit per lane that hits in (tMin, tMax)
+inline int intersectBlock(const Bvh8Block &block, const vfloat8 o[3], const vfloat8 d[3], float tMin, float tMax,
+                          vfloat8 &t, vfloat8 &u, vfloat8 &v)
+{
+    vfloat8 e1x = vfloat8::load(block.e1[0]), e1y = vfloat8::load(block.e1[1]), e1z = vfloat8::load(block.e1[2]);
+    vfloat8 e2x = vfloat8::load(block.e2[0]), e2y = vfloat8::load(block.e2[1]), e2z = vfloat8::load(block.e2[2]);
+    vfloat8 px = d[1] * e2z - e2y * d[2], py = d[2] * e2x - e2z * d[0], pz = d[0] * e2y - e2x * d[1];
+    vfloat8 det = e1x * px + e1y * py + e1z * pz;
+    vfloat8 invDet = vfloat8(1.0f) / det;
+    vfloat8 sx = o[0] - vfloat8::load(block.v0[0]), sy = o[1] - vfloat8::load(block.v0[1]), sz = o[2] - vfloat8::load(block.v0[2]);
+    u = (sx * px + sy * py + sz * pz) * invDet;
+    vfloat8 qx = sy * e1z - e1y * sz, qy = sz * e1x - e1z * sx, qz = sx * e1y - e1x * sy;
+    v = (d[0] * qx + d[1] * qy + d[2] * qz) * invDet;
+    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    vfloat8 zero(0.0f), one(1.0f);
+    vmask8 hit = (abs(det) >= vfloat8(1e-12f)) & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one)
+               & (t > vfloat8(tMin)) & (t < vfloat8(tMax));
+    return maskBits(hit);
+}
+
+// 8 rays (one per lane) against one triangle of a block
+inline vmask8 intersectTrianglePacket(const Bvh8Block &block, int j, const vfloat8 o[3], const vfloat8 d[3], vfloat8 tMin,
+                                      const vfloat8 &tMax, vfloat8 &t, vfloat8 &u, vfloat8 &v)
+{
+    vfloat8 e1x(block.e1[0][j]), e1y(block.e1[1][j]), e1z(block.e1[2][j]);
+    vfloat8 e2x(block.e2[0][j]), e2y(block.e2[1][j]), e2z(block.e2[2][j]);
+    vfloat8 px = d[1] * e2z - e2y * d[2], py = d[2] * e2x - e2z * d[0], pz = d[0] * e2y - e2x * d[1];
+    vfloat8 det = e1x * px + e1y * py + e1z * pz;
+    vfloat8 invDet = vfloat8(1.0f) / det;
+    vfloat8 sx = o[0] - vfloat8(block.v0[0][j]), sy = o[1] - vfloat8(block.v0[1][j]), sz = o[2] - vfloat8(block.v0[2][j]);
+    u = (sx * px + sy * py + sz * pz) * invDet;
+    vfloat8 qx = sy * e1z - e1y * sz, qy = sz * e1x - e1z * sx, qz = sx * e1y - e1x * sy;
+    v = (d[0] * qx + d[1] * qy + d[2] * qz) * invDet;
+    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    vfloat8 zero(0.0f), one(1.0f);
+    return (abs(det) >= vfloat8(1e-12f)) & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one) & (t > tMin) & (t < tMax);
+}
+
+// slab test, NaNs (0 * inf) lose every min/max so they don't decide anything
+inline vmask8 slabTest(const vfloat8 lo[3], const vfloat8 hi[3], const vfloat8 o[3], const vfloat8 inv[3],
+                       const vfloat8 &tMax, vfloat8 &tNear)
+{
+    vfloat8 tFar = tMax;
+    tNear = vfloat8(0.0f);
+    for (int axis = 0; axis < 3; axis++) {
+        vfloat8 t0 = (lo[axis] - o[axis]) * inv[axis], t1 = (hi[axis] - o[axis]) * inv[axis];
+        tNear = max(min(t0, t1), tNear);
+        tFar = min(max(t0, t1), tFar);
+    }
+    return tNear <= tFar;
+}
+
+// keeps stack[first, top) sorted far to near so the nearest child is popped first
+inline void pushSorted(Bvh8StackEntry *stack, int first, int &top, unsigned int node, float dist)
+{
+    int i = top++;
+    while (i > first && stack[i - 1].dist < dist) {
+        stack[i] = stack[i - 1];
+        i--;
+    }
+    stack[i].node = node;
+    stack[i].dist = dist;
+}
+
+inline bool intersectRay(const Bvh8 &bvh, const Ray &ray, RayHit &hit, float tMin)
+{
+    vfloat8 o[3], d[3], inv[3];
+    for (int axis = 0; axis < 3; axis++) {
+        o[axis] = vfloat8(ray.origin[axis]);
+        d[axis] = vfloat8(ray.direction[axis]);
+        inv[axis] = vfloat8(1.0f / ray.direction[axis]);
+    }
+    Bvh8StackEntry stack[BVH8_STACK];
+    int top = 0;
+    stack[top].node = 0;
+    stack[top++].dist = 0.0f;
+    bool found = false;
+    while (top > 0) {
+        Bvh8StackEntry entry = stack[--top];
+        if (entry.dist > hit.t)
+            continue;
+        if (entry.node & BVH8_LEAF) {
+            const Bvh8Block &block = bvh.blocks[entry.node & ~BVH8_LEAF];
+            vfloat8 t, u, v;
+            int bits = intersectBlock(block, o, d, tMin, hit.t, t, u, v);
+            if (bits) {
+                float ts[8], us[8], vs[8];
+                t.store(ts);
+                u.store(us);
+                v.store(vs);
+                for (int i = 0; i < 8; i++) {
+                    if ((bits & (1 << i)) && ts[i] < hit.t) {
+                        hit.t = ts[i];
+                        hit.u = us[i];
+                        hit.v = vs[i];
+                        hit.triangle = block.id[i];
+                        found = true;
+                    }
+                }
+            }
+            continue;
+        }
+        const Bvh8Node &node = bvh.nodes[entry.node];
+        vfloat8 lo[3], hi[3], tNear;
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = vfloat8::load(node.lo[axis]);
+            hi[axis] = vfloat8::load(node.hi[axis]);
+        }
+        int bits = maskBits(slabTest(lo, hi, o, inv, vfloat8(hit.t), tNear)) & node.validMask;
+        if (!bits)
+            continue;
+        float dist[8];
+        tNear.store(dist);
+        int first = top;
+        for (int i = 0; i < 8; i++)
+            if ((bits & (1 << i)) && top < BVH8_STACK)
+                pushSorted(stack, first, top, node.child[i], dist[i]);
+    }
+    return found;
+}
+
+// lanes whose hits.t starts out negative are inactive and stay untouched
+inline void intersectPacket(const Bvh8 &bvh, const RayPacket8 &packet, RayHit8 &hits, float tMin)
+{
+    vfloat8 o[3], d[3], inv[3];
+    for (int axis = 0; axis < 3; axis++) {
+        o[axis] = vfloat8::load(packet.origin[axis]);
+        d[axis] = vfloat8::load(packet.direction[axis]);
+        inv[axis] = vfloat8(1.0f) / d[axis];
+    }
+    vfloat8 t = vfloat8::load(hits.t), u = vfloat8::load(hits.u), v = vfloat8::load(hits.v);
+    vfloat8 minT(tMin);
+    Bvh8StackEntry stack[BVH8_STACK];
+    int top = 0;
+    stack[top].node = 0;
+    stack[top++].dist = 0.0f;
+    while (top > 0) {
+        Bvh8StackEntry entry = stack[--top];
+        if (entry.node & BVH8_LEAF) {
+            const Bvh8Block &block = bvh.blocks[entry.node & ~BVH8_LEAF];
+            for (int j = 0; j < 8 && block.id[j] != BVH8_EMPTY; j++) {
+                vfloat8 tj, uj, vj;
+                vmask8 m = intersectTrianglePacket(block, j, o, d, minT, t, tj, uj, vj);
+                int bits = maskBits(m);
+                if (!bits)
+                    continue;
+                t = select(m, tj, t);
+                u = select(m, uj, u);
+                v = select(m, vj, v);
+                for (int lane = 0; lane < 8; lane++)
+                    if (bits & (1 << lane))
+                        hits.triangle[lane] = block.id[j];
+            }
+            continue;
+        }
+        // every child box against all 8 rays; a child is visited if any ray still hits it
+        const Bvh8Node &node = bvh.nodes[entry.node];
+        int first = top;
+        for (int i = 0; i < 8; i++) {
+            if (!(node.validMask & (1 << i)))
+                continue;
+            vfloat8 lo[3], hi[3], tNear;
+            for (int axis = 0; axis < 3; axis++) {
+                lo[axis] = vfloat8(node.lo[axis][i]);
+                hi[axis] = vfloat8(node.hi[axis][i]);
+            }
+            int bits = maskBits(slabTest(lo, hi, o, inv, t, tNear));
+            if (!bits || top >= BVH8_STACK)
+                continue;
+            float dist[8], nearest = FLT_MAX;
+            tNear.store(dist);
+            for (int lane = 0; lane < 8; lane++)
+                if ((bits & (1 << lane)) && dist[lane] < nearest)
+                    nearest = dist[lane];
+            pushSorted(stack, first, top, node.child[i], nearest);
+        }
+    }
+    t.store(hits.t);
+    u.store(hits.u);
+    v.store(hits.v);
+}
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT DEFAULT
+#else
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,40 @@
+//
+//  cmdline.hpp
+//  RefractionProject
+//
+//  Tiny helpers for the command line flags main() understands.
+//  Flags look like "--bench-scaling" and values follow their flag: "--out results.csv".
+//
+
+#ifndef cmdline_hpp
+#define cmdline_hpp
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+// true if the flag was given anywhere on the command line
+inline bool hasArg(int argc, char *argv[], const char *flag)
+{
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], flag) == 0)
+            return true;
+    return false;
+}
+
+// value after the flag, or fallback if the flag is missing (or is the last argument)
+inline std::string argValue(int argc, char *argv[], const char *flag, const std::string &fallback)
+{
+    for (int i = 1; i < argc - 1; i++)
+        if (strcmp(argv[i], flag) == 0)
+            return argv[i + 1];
+    return fallback;
+}
+
+inline double argNumber(int argc, char *argv[], const char *flag, double fallback)
+{
+    std::string value = argValue(argc, argv, flag, "");
+    return value.empty() ? fallback : atof(value.c_str());
+}
+
+#endif /* cmdline_hpp */
@@ -0,0 +1,122 @@
+//
+//  cubemap.hpp
+//  RefractionProject
+//
+//  The skybox cubemap on the CPU, sampled the way our GL cubemap is: GL_LINEAR inside a face,
+//  GL_CLAMP_TO_EDGE at face borders (no seamless filtering, we never enable it) and no mipmaps
+//  (the tool modes load it without them, only the viewer asks for --mips).
+//  Used by the CPU renderers so their output can be compared with the GPU's.
+//
+
+#ifndef cubemap_hpp
+#define cubemap_hpp
+
+#include "glm/glm.hpp"
+
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+    Face and face coordinates (s, t in [0, 1]) for a direction, from the table in the GL spec
+    (8.13 "Cube Map Texture Selection"). Faces are numbered like GL_TEXTURE_CUBE_MAP_POSITIVE_X + face.
+*/
+inline int cubeFaceCoords(const glm::vec3 &dir, float &s, float &t)
+{
+    float ax = std::fabs(dir.x), ay = std::fabs(dir.y), az = std::fabs(dir.z);
+    int face;
+    float sc, tc, ma;
+    if (ax >= ay && ax >= az) {
+        face = dir.x >= 0.0f ? 0 : 1;
+        sc = dir.x >= 0.0f ? -dir.z : dir.z;
+        tc = -dir.y;
+        ma = ax;
+    } else if (ay >= az) {
+        face = dir.y >= 0.0f ? 2 : 3;
+        sc = dir.x;
+        tc = dir.y >= 0.0f ? dir.z : -dir.z;
+        ma = ay;
+    } else {
+        face = dir.z >= 0.0f ? 4 : 5;
+        sc = dir.z >= 0.0f ? dir.x : -dir.x;
+        tc = -dir.y;
+        ma = az;
+    }
+    s = 0.5f * (sc / ma + 1.0f);
+    t = 0.5f * (tc / ma + 1.0f);
+    return face;
+}
+
+// the other way around: the (unnormalized) direction through s, t of face
+inline glm::vec3 cubeFaceDirection(int face, float s, float t)
+{
+    float sc = 2.0f * s - 1.0f, tc = 2.0f * t - 1.0f;
+    switch (face) {
+    case 0: return glm::vec3(1.0f, -tc, -sc);
+    case 1: return glm::vec3(-1.0f, -tc, sc);
+    case 2: return glm::vec3(sc, 1.0f, tc);
+    case 3: return glm::vec3(sc, -1.0f, -tc);
+    case 4: return glm::vec3(sc, -tc, 1.0f);
+    default: return glm::vec3(-sc, -tc, -1.0f);
+    }
+}
+
+struct CpuCubemap {
+    int size;                             // every face is size x size texels
+    std::vector<unsigned char> faces[6];  // RGB, first row is t = 0 (the first row glTexImage2D gets)
+
+    CpuCubemap() : size(0) {}
+
+    // Loads the six faces like loadCubemap does: RGB, the alpha of RGBA files (the space skyboxes) dropped
+    bool load(const std::vector<std::string> &paths)
+    {
+        for (int face = 0; face < 6 && face < (int)paths.size(); face++) {
+            int width, height, channels;
+            unsigned char *data = stbi_load(paths[face].c_str(), &width, &height, &channels, 3);
+            if (!data || width != height || (size != 0 && width != size)) {
+                std::cout << "ERROR::CUBEMAP:: Could not load face " << paths[face] << std::endl;
+                stbi_image_free(data);
+                return false;
+            }
+            size = width;
+            faces[face].assign(data, data + (size_t)width * height * 3);
+            stbi_image_free(data);
+        }
+        return size > 0;
+    }
+
+    bool empty() const { return size == 0; }
+
+    glm::vec3 texel(int face, int x, int y) const
+    {
+        const unsigned char *p = &faces[face][((size_t)y * size + x) * 3];
+        return glm::vec3(p[0], p[1], p[2]) * (1.0f / 255.0f);
+    }
+
+    // bilinear sample in [0, 1]; zero or NaN directions (GL leaves those undefined) give black
+    glm::vec3 sample(const glm::vec3 &dir) const
+    {
+        if (!(std::fabs(dir.x) + std::fabs(dir.y) + std::fabs(dir.z) > 0.0f))
+            return glm::vec3(0.0f);
+        float s, t;
+        int face = cubeFaceCoords(dir, s, t);
+        float x = s * size - 0.5f, y = t * size - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        int x0 = (int)fx, y0 = (int)fy;
+        float wx = x - fx, wy = y - fy;
+        int x1 = std::min(x0 + 1, size - 1), y1 = std::min(y0 + 1, size - 1);
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        glm::vec3 top = texel(face, x0, y0) * (1.0f - wx) + texel(face, x1, y0) * wx;
+        glm::vec3 bottom = texel(face, x0, y1) * (1.0f - wx) + texel(face, x1, y1) * wx;
+        return top * (1.0f - wy) + bottom * wy;
+    }
+};
+
+#endif /* cubemap_hpp */
@@ -0,0 +1,489 @@
+//
+//  cubesampler.hpp
+//  RefractionProject
+//
+//  The skybox on the CPU with what a GL cubemap does under textureLod(): a mip chain,
+//  GL_LINEAR_MIPMAP_LINEAR between levels and, if asked for, seamless filtering across face edges
+//  (GL_TEXTURE_CUBE_MAP_SEAMLESS) instead of clamping at them. For CPU refraction, reference renders
+//  and environment preprocessing; CpuCubemap stays the one-level version that matches our GL state.
+//
+//  Every face of every level is stored with a one texel border holding what bilinear filtering reads
+//  past the edge: the face's own edge texels when clamping, the neighbouring face's when seamless
+//  (at a corner, the average of the three texels that meet there). So the kernels never need to know
+//  where an edge is: 8 directions at a time they pick a face, gather 4 texels in each of two levels
+//  and blend. Like bvh8.hpp, the kernels (cubesamplerkernels.hpp) are compiled per instruction set and
+//  the best one the CPU has is picked at runtime.
+//
+//  RefractionProject --bench-cubemap [--skybox skybox/sky] [--samples 4000000] [--threads 1]
+//                    [--isa scalar|sse2|neon|avx2] [--no-gl] [--software]
+//
+
+#ifndef cubesampler_hpp
+#define cubesampler_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "headless.hpp"
+#include "parallel.hpp"
+#include "renderer.hpp"
+#include "shader.hpp"
+#include "simd8.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+class CubeSampler;
+
+struct CubeSamplerKernels {
+    const char *name;
+    void (*sample)(const CubeSampler &, const float[3][8], const float[8], float[3][8]);
+};
+
+inline const CubeSamplerKernels &cubeSamplerKernels(int isa);
+
+class CubeSampler {
+public:
+    int levels;
+    bool seamless;
+    vector<int> levelSize, levelOffset;  // face size and first texel of every level
+    vector<int> texels;                  // RGBA8, red in the low byte: [level][face][size + 2][size + 2]
+    const CubeSamplerKernels *kernels;
+
+    CubeSampler() : levels(0), seamless(false), kernels(0) {}
+
+    /*
+        Level 0 is the cubemap, every further level a 2x2 box filter of the one above it, down to 1x1
+        (mipmaps = false keeps only level 0). Faces that aren't a power of two lose their last row and
+        column on the way down, which is also where GL drivers differ from each other.
+    */
+    void build(const CpuCubemap &cubemap, bool seamlessEdges, bool mipmaps = true, int threads = 0, int isa = -1)
+    {
+        kernels = &cubeSamplerKernels(isa < 0 ? simd8BestIsa() : isa);
+        seamless = seamlessEdges;
+        levelSize.clear();
+        levelOffset.clear();
+        size_t total = 0;
+        for (int size = cubemap.size; size > 0; size = mipmaps ? size / 2 : 0) {
+            levelSize.push_back(size);
+            levelOffset.push_back((int)total);
+            total += 6 * (size_t)(size + 2) * (size + 2);
+        }
+        levels = (int)levelSize.size();
+        texels.assign(total, 0);
+        if (levels == 0)
+            return;
+        parallelFor(6, threads, [&](int face, int) {
+            const unsigned char *rgb = &cubemap.faces[face][0];
+            for (int y = 0; y < cubemap.size; y++)
+                for (int x = 0; x < cubemap.size; x++, rgb += 3)
+                    at(0, face, x, y) = rgb[0] | rgb[1] << 8 | rgb[2] << 16 | 0xff << 24;
+        });
+        for (int level = 1; level < levels; level++)
+            parallelFor(6, threads, [&](int face, int) {
+                for (int y = 0; y < levelSize[level]; y++)
+                    for (int x = 0; x < levelSize[level]; x++) {
+                        const int *quad[4] = { &at(level - 1, face, 2 * x, 2 * y), &at(level - 1, face, 2 * x + 1, 2 * y),
+                                               &at(level - 1, face, 2 * x, 2 * y + 1), &at(level - 1, face, 2 * x + 1, 2 * y + 1) };
+                        at(level, face, x, y) = average(quad, 4);
+                    }
+            });
+        // borders last: the seamless ones read the neighbours' finished texels
+        parallelFor(6 * levels, threads, [&](int job, int) { fillBorder(job / 6, job % 6); });
+    }
+
+    void setIsa(int isa) { kernels = &cubeSamplerKernels(isa); }
+
+    bool empty() const { return levels == 0; }
+
+    size_t bytes() const { return texels.size() * sizeof(int); }
+
+    /*
+        textureLod() for 8 directions, lane by lane: RGB in [0, 1]. The directions don't need to be
+        normalized; zero or NaN ones give black (GL leaves those undefined).
+    */
+    void sample(const float dir[3][8], const float lod[8], float out[3][8]) const
+    {
+        kernels->sample(*this, dir, lod, out);
+    }
+
+    // one direction, through the same kernel
+    glm::vec3 sample(const glm::vec3 &dir, float lod = 0.0f) const
+    {
+        float lanes[3][8], lods[8], out[3][8];
+        for (int i = 0; i < 8; i++) {
+            for (int axis = 0; axis < 3; axis++)
+                lanes[axis][i] = dir[axis];
+            lods[i] = lod;
+        }
+        sample(lanes, lods, out);
+        return glm::vec3(out[0][0], out[1][0], out[2][0]);
+    }
+
+    // one face of a level without its border, RGBA rows from t = 0, the way glTexImage2D wants them
+    void faceImage(int level, int face, vector<unsigned char> &rgba) const
+    {
+        int size = levelSize[level];
+        rgba.resize((size_t)size * size * 4);
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++) {
+                int texel = at(level, face, x, y);
+                for (int c = 0; c < 4; c++)
+                    rgba[((size_t)y * size + x) * 4 + c] = (unsigned char)(texel >> (8 * c));
+            }
+    }
+
+private:
+    // texel x, y of a face, -1 and size being the border
+    int &at(int level, int face, int x, int y)
+    {
+        int stride = levelSize[level] + 2;
+        return texels[levelOffset[level] + ((size_t)face * stride + y + 1) * stride + x + 1];
+    }
+    const int &at(int level, int face, int x, int y) const { return const_cast<CubeSampler *>(this)->at(level, face, x, y); }
+
+    // rounded per channel
+    static int average(const int *const *texel, int count)
+    {
+        int result = 0;
+        for (int c = 0; c < 4; c++) {
+            int sum = 0;
+            for (int i = 0; i < count; i++)
+                sum += (*texel[i] >> (8 * c)) & 0xff;
+            result |= ((sum + count / 2) / count) << (8 * c);
+        }
+        return result;
+    }
+
+    // the texel a border texel (x or y just outside the face) reads when seamless: the nearest one on the face next to it
+    const int &neighbour(int level, int face, int x, int y) const
+    {
+        int size = levelSize[level];
+        float s, t;
+        int other = cubeFaceCoords(cubeFaceDirection(face, (x + 0.5f) / size, (y + 0.5f) / size), s, t);
+        int nx = std::min(std::max((int)std::floor(s * size), 0), size - 1);
+        int ny = std::min(std::max((int)std::floor(t * size), 0), size - 1);
+        return at(level, other, nx, ny);
+    }
+
+    void fillBorder(int level, int face)
+    {
+        int size = levelSize[level];
+        for (int y = -1; y <= size; y++)
+            for (int x = -1; x <= size; x++) {
+                bool outX = x < 0 || x == size, outY = y < 0 || y == size;
+                if (!outX && !outY)
+                    continue;
+                int cx = std::min(std::max(x, 0), size - 1), cy = std::min(std::max(y, 0), size - 1);
+                if (!seamless) {
+                    at(level, face, x, y) = at(level, face, cx, cy);
+                } else if (outX && outY) {
+                    const int *corner[3] = { &at(level, face, cx, cy), &neighbour(level, face, x, cy), &neighbour(level, face, cx, y) };
+                    at(level, face, x, y) = average(corner, 3);
+                } else {
+                    at(level, face, x, y) = neighbour(level, face, x, y);
+                }
+            }
+    }
+};
+
+// ---- the kernels once per instruction set, see simd8.hpp ----
+
+namespace cubesampler_scalar {
+using namespace simd8_scalar;
+#include "cubesamplerkernels.hpp"
+}
+
+namespace cubesampler_sse {
+using namespace simd8_sse;
+#include "cubesamplerkernels.hpp"
+}
+
+#ifdef SIMD8_AVX2
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace cubesampler_avx2 {
+using namespace simd8_avx2;
+#include "cubesamplerkernels.hpp"
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif /* SIMD8_AVX2 */
+
+inline const CubeSamplerKernels &cubeSamplerKernels(int isa)
+{
+    static const CubeSamplerKernels kernels[SIMD8_ISA_COUNT] = {
+        { simd8IsaName(SIMD8_SCALAR), cubesampler_scalar::sampleCube },
+        { simd8IsaName(SIMD8_SSE), cubesampler_sse::sampleCube },
+#ifdef SIMD8_AVX2
+        { simd8IsaName(SIMD8_AVX2_ISA), cubesampler_avx2::sampleCube },
+#else
+        { simd8IsaName(SIMD8_AVX2_ISA), cubesampler_sse::sampleCube },
+#endif
+    };
+    if (!simd8IsaSupported(isa))
+        isa = simd8BestIsa();
+    return kernels[isa];
+}
+
+// ---- --bench-cubemap ----
+
+// pixel x, y (top row first) of a width x height latitude/longitude image, the same mapping cubeTestFshader uses
+inline glm::vec3 latLongDirection(int x, int y, int width, int height)
+{
+    const float pi = 3.14159265358979f;
+    float phi = ((x + 0.5f) / width * 2.0f - 1.0f) * pi;
+    float theta = ((height - y - 0.5f) / height - 0.5f) * pi;
+    return glm::vec3(std::cos(theta) * std::sin(phi), std::sin(theta), -std::cos(theta) * std::cos(phi));
+}
+
+// uploads every level of a sampler (without the borders) as a GL cubemap with trilinear filtering
+inline unsigned int createSamplerCubemap(const CubeSampler &cube)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    vector<unsigned char> rgba;
+    for (int level = 0; level < cube.levels; level++)
+        for (int face = 0; face < 6; face++) {
+            cube.faceImage(level, face, rgba);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGBA8, cube.levelSize[level], cube.levelSize[level], 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+        }
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, cube.levels - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+/*
+    Accuracy: GL samples the same levels with textureLod over a latitude/longitude image (every face,
+    edge and corner shows up in it) and we compare with what the sampler gives for the same pixels.
+    Differences are in 8-bit steps; GPUs filter with a few bits of subtexel precision, so 1-2 steps
+    are expected, anything more means we pick different texels.
+*/
+inline void compareWithGL(const CubeSampler &seamless, const CubeSampler &clamped, const CpuCubemap &cubemap, int threads)
+{
+    const int width = 1024, height = 512;
+    Shader shader("shaders/cubeTestVshader.txt", "shaders/cubeTestFshader.txt");
+    RenderTarget target = createRenderTarget(width, height, "cubemap accuracy");
+    unsigned int vao;
+    glGenVertexArrays(1, &vao);
+    unsigned int textures[2] = { createSamplerCubemap(seamless), createSamplerCubemap(clamped) };
+
+    struct Case {
+        const char *name;
+        int sampler;     // 0 seamless, 1 clamped, 2 CpuCubemap (one level, clamped)
+        float lod, ramp; // lod = lod + ramp * x / width
+    };
+    float top = (float)(seamless.levels - 1);
+    const Case cases[] = {
+        { "seamless lod 0", 0, 0.0f, 0.0f }, { "seamless lod 2.5", 0, 2.5f, 0.0f },
+        { "seamless lod ramp", 0, 0.0f, top }, { "seamless coarsest", 0, top - 0.5f, 0.0f },
+        { "clamped lod 0", 1, 0.0f, 0.0f }, { "clamped lod ramp", 1, 0.0f, top },
+        { "CpuCubemap lod 0", 2, 0.0f, 0.0f },
+    };
+    cout << "Accuracy against GL, " << width << "x" << height << " lat/long, differences in 8-bit steps" << endl;
+    cout << setw(20) << "case" << setw(10) << "max" << setw(10) << "mean" << setw(12) << "> 1 step" << setw(12) << "> 2 steps" << endl;
+    vector<unsigned char> gl;
+    vector<float> cpu((size_t)width * height * 3);
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        const Case &c = cases[k];
+        glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+        glViewport(0, 0, width, height);
+        glDisable(GL_DEPTH_TEST);
+        if (c.sampler == 0)
+            glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+        else
+            glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+        shader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, textures[c.sampler == 0 ? 0 : 1]);
+        glUniform1i(glGetUniformLocation(shader.ID, "cubemap"), 0);
+        glUniform2f(glGetUniformLocation(shader.ID, "size"), (float)width, (float)height);
+        glUniform2f(glGetUniformLocation(shader.ID, "lod"), c.lod, c.ramp);
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        readRenderTarget(target, gl);
+
+        const CubeSampler &cube = c.sampler == 0 ? seamless : clamped;
+        parallelFor(height, threads, [&](int y, int) {
+            for (int x = 0; x < width; x += 8) {
+                float dir[3][8], lod[8], out[3][8];
+                for (int i = 0; i < 8; i++) {
+                    glm::vec3 d = latLongDirection(x + i, y, width, height);
+                    for (int axis = 0; axis < 3; axis++)
+                        dir[axis][i] = d[axis];
+                    lod[i] = c.lod + c.ramp * (x + i + 0.5f) / width;
+                }
+                if (c.sampler == 2) {
+                    for (int i = 0; i < 8; i++) {
+                        glm::vec3 color = cubemap.sample(glm::vec3(dir[0][i], dir[1][i], dir[2][i]));
+                        for (int ch = 0; ch < 3; ch++)
+                            out[ch][i] = color[ch];
+                    }
+                } else {
+                    cube.sample(dir, lod, out);
+                }
+                for (int i = 0; i < 8; i++)
+                    for (int ch = 0; ch < 3; ch++)
+                        cpu[((size_t)y * width + x + i) * 3 + ch] = out[ch][i] * 255.0f;
+            }
+        });
+        double maxDiff = 0.0, sum = 0.0;
+        size_t over1 = 0, over2 = 0;
+        for (size_t i = 0; i < cpu.size(); i++) {
+            double diff = std::fabs(cpu[i] - gl[i]);
+            maxDiff = std::max(maxDiff, diff);
+            sum += diff;
+            over1 += diff > 1.5;
+            over2 += diff > 2.5;
+        }
+        cout << fixed << setprecision(2) << setw(20) << c.name << setw(10) << maxDiff << setw(10) << sum / cpu.size()
+             << setw(11) << 100.0 * over1 / cpu.size() << "%" << setw(11) << 100.0 * over2 / cpu.size() << "%" << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    glDeleteTextures(2, textures);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(shader.ID);
+    deleteRenderTarget(target);
+}
+
+inline int runCubemapBenchmark(int argc, char *argv[])
+{
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    size_t samples = (size_t)argNumber(argc, argv, "--samples", 4000000) / 8 * 8;
+    int threads = std::max(1, (int)argNumber(argc, argv, "--threads", 1));
+    string onlyIsa = argValue(argc, argv, "--isa", "");
+
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(skybox)))
+        return -1;
+    CubeSampler seamless, clamped;
+    auto start = std::chrono::steady_clock::now();
+    seamless.build(cubemap, true, true, threads);
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    clamped.build(cubemap, false, true, threads);
+    cout << "Cubemap sampler for " << skybox << ": " << cubemap.size << "x" << cubemap.size << " faces, " << seamless.levels
+         << " levels, " << seamless.bytes() / (1024.0 * 1024.0) << " MB, built in " << buildMs << " ms, best: "
+         << simd8IsaName(simd8BestIsa()) << endl;
+
+    // view: the directions of a square camera image; random: uniform on the sphere, lod 0 or anywhere in the chain
+    int side = (int)std::sqrt((double)samples) / 8 * 8;
+    vector<float> view((size_t)side * side * 3), random(samples * 3), randomLod(samples), zeroLod(samples, 0.0f);
+    for (int y = 0; y < side; y++)
+        for (int x = 0; x < side; x++) {
+            glm::vec3 d((x + 0.5f) / side * 2.0f - 1.0f, 1.0f - (y + 0.5f) / side * 2.0f, -1.0f);
+            for (int axis = 0; axis < 3; axis++)
+                view[((size_t)y * side + x) * 3 + axis] = d[axis];
+        }
+    std::mt19937 generator(7);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (size_t i = 0; i < samples; i++) {
+        for (int axis = 0; axis < 3; axis++)
+            random[i * 3 + axis] = normal(generator);
+        randomLod[i] = unit(generator) * (seamless.levels - 1);
+    }
+
+    struct Workload {
+        const char *name;
+        const vector<float> *dirs, *lods;
+    };
+    const Workload workloads[] = { { "view lod 0", &view, &zeroLod }, { "random lod 0", &random, &zeroLod },
+                                   { "random trilinear", &random, &randomLod } };
+    cout << setw(18) << "workload" << setw(12) << "kernel" << setw(18) << "Msamples/s/core" << setw(9) << "speedup"
+         << setw(16) << "max difference" << endl;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        const vector<float> &dirs = *workloads[w].dirs, &lods = *workloads[w].lods;
+        int blocks = (int)(dirs.size() / 24);
+        vector<float> reference(dirs.size()), results(dirs.size());
+        double referenceRate = 0.0;
+        // kernel -1 is CpuCubemap::sample, one direction at a time (it only has level 0, so not for trilinear)
+        for (int kernel = -1; kernel < SIMD8_ISA_COUNT; kernel++) {
+            if (kernel < 0 && lods[0] != 0.0f)
+                continue;
+            if (kernel >= 0 && (!simd8IsaSupported(kernel) || (!onlyIsa.empty() && onlyIsa != simd8IsaName(kernel))))
+                continue;
+            if (kernel >= 0)
+                seamless.setIsa(kernel);
+            vector<float> &out = kernel == SIMD8_SCALAR ? reference : results;
+            auto begin = std::chrono::steady_clock::now();
+            parallelFor((blocks + 255) / 256, threads, [&](int chunk, int) {
+                for (int b = chunk * 256; b < std::min(blocks, (chunk + 1) * 256); b++) {
+                    const float *d = &dirs[(size_t)b * 24];
+                    float *o = &out[(size_t)b * 24];
+                    if (kernel < 0) {
+                        for (int i = 0; i < 8; i++) {
+                            glm::vec3 color = cubemap.sample(glm::vec3(d[i * 3], d[i * 3 + 1], d[i * 3 + 2]));
+                            o[i * 3] = color.r, o[i * 3 + 1] = color.g, o[i * 3 + 2] = color.b;
+                        }
+                        continue;
+                    }
+                    float lanes[3][8], result[3][8];
+                    for (int i = 0; i < 8; i++)
+                        for (int axis = 0; axis < 3; axis++)
+                            lanes[axis][i] = d[i * 3 + axis];
+                    seamless.sample(lanes, &lods[(size_t)b * 8], result);
+                    for (int i = 0; i < 8; i++)
+                        for (int c = 0; c < 3; c++)
+                            o[i * 3 + c] = result[c][i];
+                }
+            });
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            double rate = dirs.size() / 3 / seconds / 1e6 / threads;
+            if (referenceRate == 0.0)
+                referenceRate = rate;
+            // against the scalar kernel; CpuCubemap is in the table for speed only, it clamps at the edges
+            string difference = "-";
+            if (kernel > SIMD8_SCALAR && (onlyIsa.empty() || onlyIsa == "scalar")) {
+                float maxDiff = 0.0f;
+                for (size_t i = 0; i < out.size(); i++)
+                    maxDiff = std::max(maxDiff, std::fabs(out[i] - reference[i]));
+                difference = to_string(maxDiff * 255.0f);
+            }
+            cout << fixed << setprecision(2) << setw(18) << workloads[w].name
+                 << setw(12) << (kernel < 0 ? "CpuCubemap" : simd8IsaName(kernel)) << setw(18) << rate
+                 << setw(9) << rate / referenceRate << setw(16) << difference << endl;
+        }
+    }
+    cout.unsetf(ios::floatfield);
+
+    if (hasArg(argc, argv, "--no-gl"))
+        return 0;
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    seamless.setIsa(simd8BestIsa());
+    clamped.setIsa(simd8BestIsa());
+    compareWithGL(seamless, clamped, cubemap, threads);
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* cubesampler_hpp */
@@ -0,0 +1,71 @@
+//
+//  cubesamplerkernels.hpp
+//  RefractionProject
+//
+//  CubeSampler's textureLod for 8 directions, written once against the 8-lane types of simd8.hpp.
+//  cubesampler.hpp includes this file once per instruction set, inside a namespace that pulls one of
+//  them in (with the AVX2 target switched on for that one), so there is no include guard on purpose.
+//
+
+// the 4 texels around (s, t) of face at level, blended; RGB in 0..255
+inline void bilinear(const CubeSampler &cube, const vint8 &face, const vfloat8 &s, const vfloat8 &t, const vint8 &level,
+                     vfloat8 rgb[3])
+{
+    vint8 size = gather(&cube.levelSize[0], level), offset = gather(&cube.levelOffset[0], level);
+    vint8 stride = size + vint8(2);
+    vfloat8 sizeF = toFloat(size), zero(0.0f), one(1.0f);
+    // texel k is centered on k + 0.5, plus one for the border column and row
+    vfloat8 x = s * sizeF + vfloat8(0.5f), y = t * sizeF + vfloat8(0.5f);
+    vfloat8 x0 = min(max(floor(x), zero), sizeF), y0 = min(max(floor(y), zero), sizeF);
+    vfloat8 wx = min(max(x - x0, zero), one), wy = min(max(y - y0, zero), one);
+    vint8 index = offset + (face * stride + toInt(y0)) * stride + toInt(x0);
+    const int *texels = &cube.texels[0];
+    vint8 t00 = gather(texels, index), t10 = gather(texels, index + vint8(1));
+    vint8 t01 = gather(texels, index + stride), t11 = gather(texels, index + stride + vint8(1));
+    vint8 byte(255);
+    for (int c = 0; c < 3; c++) {
+        vfloat8 c00 = toFloat((t00 >> (8 * c)) & byte), c10 = toFloat((t10 >> (8 * c)) & byte);
+        vfloat8 c01 = toFloat((t01 >> (8 * c)) & byte), c11 = toFloat((t11 >> (8 * c)) & byte);
+        vfloat8 top = c00 + (c10 - c00) * wx, bottom = c01 + (c11 - c01) * wx;
+        rgb[c] = top + (bottom - top) * wy;
+    }
+}
+
+inline void sampleCube(const CubeSampler &cube, const float dir[3][8], const float lod[8], float out[3][8])
+{
+    vfloat8 x = vfloat8::load(dir[0]), y = vfloat8::load(dir[1]), z = vfloat8::load(dir[2]);
+    vfloat8 zero(0.0f), one(1.0f);
+    vfloat8 ax = abs(x), ay = abs(y), az = abs(z);
+    // the table in the GL spec, lane by lane the same choices cubeFaceCoords makes
+    vmask8 majorX = (ax >= ay) & (ax >= az);
+    vmask8 majorY = andNot(ay >= az, majorX);
+    vmask8 positiveX = x >= zero, positiveY = y >= zero, positiveZ = z >= zero;
+    vfloat8 face = select(majorX, select(positiveX, zero, one),
+                          select(majorY, select(positiveY, vfloat8(2.0f), vfloat8(3.0f)),
+                                 select(positiveZ, vfloat8(4.0f), vfloat8(5.0f))));
+    vfloat8 sc = select(majorX, select(positiveX, zero - z, z), select(majorY, x, select(positiveZ, x, zero - x)));
+    vfloat8 tc = select(majorY, select(positiveY, z, zero - z), zero - y);
+    vfloat8 ma = select(majorX, ax, select(majorY, ay, az));
+    // zero, infinite and NaN directions read the middle of a face and come out black
+    vmask8 valid = (ma > zero) & (ma <= vfloat8(FLT_MAX));
+    vfloat8 half = vfloat8(0.5f) / select(valid, ma, one);
+    vfloat8 s = select(valid, sc * half + vfloat8(0.5f), vfloat8(0.5f));
+    vfloat8 t = select(valid, tc * half + vfloat8(0.5f), vfloat8(0.5f));
+    vint8 faceIndex = toInt(face);
+
+    // GL_LINEAR_MIPMAP_LINEAR: blend the two levels around lod (max() picks zero for NaN lods)
+    vfloat8 coarsest((float)(cube.levels - 1));
+    vfloat8 level = min(max(vfloat8::load(lod), zero), coarsest);
+    vfloat8 level0 = floor(level), blend = level - level0;
+    vfloat8 rgb[3];
+    bilinear(cube, faceIndex, s, t, toInt(level0), rgb);
+    if (maskBits(blend > zero)) {
+        vfloat8 coarser[3];
+        bilinear(cube, faceIndex, s, t, toInt(min(level0 + one, coarsest)), coarser);
+        for (int c = 0; c < 3; c++)
+            rgb[c] = rgb[c] + (coarser[c] - rgb[c]) * blend;
+    }
+    vfloat8 scale = select(valid, vfloat8(1.0f / 255.0f), zero);
+    for (int c = 0; c < 3; c++)
+        (rgb[c] * scale).store(out[c]);
+}
@@ -0,0 +1,373 @@
+//
+//  environment.hpp
+//  RefractionProject
+//
+//  The skyboxes the viewer can switch between while it runs (1, 2 and 3: sky, space and space2).
+//  A new one decodes on the workers (startCubemapLoad) while the current one keeps rendering; its faces
+//  are uploaded from the render loop as they come in, up to a byte budget per frame, so no frame has to
+//  take all six. Only once every face (and, for rough glass, the GGX prefilter) is on the GPU does the
+//  renderer switch over, between two frames, so it never samples a half-uploaded cubemap.
+//
+//  With the loader thread (--loader-thread, loader.hpp) the faces go up there instead, all at once
+//  when they are decoded, and the render loop uploads nothing.
+//
+//  The last few environments stay resident (least recently used goes first), so switching back to one
+//  is instant.
+//
+//  RefractionProject [--skybox skybox/sky] [--environments 3] [--upload-budget-mb 16]
+//  RefractionProject --bench-skybox-switch [--environments 3] [--upload-budget-mb 16] [--mips none|box|kaiser]
+//                    [--frames 600] [--loader-thread] [--software]
+//
+
+#ifndef environment_hpp
+#define environment_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "loader.hpp"
+#include "memory.hpp"
+#include "prefilter.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// A skybox on the GPU, with its GGX prefilter when the glass is rough
+struct Environment {
+    string folder;
+    unsigned int cubemap, prefilter;
+    float prefilterMaxLod;
+    float exposure;                // the renderer's, non-zero for an HDR probe (hdrenv.hpp)
+    unsigned long long lastUsed;   // frame
+};
+
+class EnvironmentManager {
+public:
+    size_t capacity;        // resident environments, the current one included
+    size_t uploadBudget;    // bytes uploaded per frame (at least one face)
+    bool prefiltered;       // build the GGX prefilter too (--roughness)
+    int prefilterSize, prefilterSamples;
+    bool prefilterCache;
+
+    EnvironmentManager(size_t capacity = 3, size_t uploadBudget = 16 << 20)
+        : capacity(std::max(capacity, (size_t)1)), uploadBudget(uploadBudget), prefiltered(false), prefilterSize(128),
+          prefilterSamples(128), prefilterCache(true), frame(0)
+    {
+    }
+
+    // the one the renderer starts with, loaded the usual way
+    void adopt(const string &folder, unsigned int cubemap, unsigned int prefilter = 0, float prefilterMaxLod = 0.0f, float exposure = 0.0f)
+    {
+        Environment environment = { folder, cubemap, prefilter, prefilterMaxLod, exposure, frame };
+        resident.push_back(environment);
+        active = wanted = folder;
+    }
+
+    // switch to folder as soon as it's resident; starts streaming it in if it isn't
+    void request(const string &folder)
+    {
+        if (folder == wanted)
+            return;
+        wanted = folder;
+        if (find(folder) || streamingIndex(folder) >= 0)
+            return;
+        Streaming stream;
+        stream.folder = folder;
+        stream.load = startCubemapLoad(skyboxFaces(folder), true);
+        stream.nextFace = 0;
+        stream.handedOff = false;
+        stream.frames = 0;
+        stream.bytes = 0;
+        stream.start = std::chrono::steady_clock::now();
+        if (prefiltered) {
+            std::shared_ptr<PrefilteredSky> sky = std::make_shared<PrefilteredSky>();
+            int size = prefilterSize, samples = prefilterSamples;
+            bool cache = prefilterCache;
+            stream.sky = sky;
+            stream.prefilterJob = jobSystem().submit([sky, folder, size, samples, cache] {
+                *sky = loadOrPrefilterSky(folder, size, samples, cache);
+            });
+        }
+        streaming.push_back(stream);
+        cout << "Streaming " << folder << " in" << endl;
+    }
+
+    /*
+        Main thread, once a frame before rendering: uploads what's ready within the budget, finishes the
+        environments that are complete, switches the renderer over and evicts. True if it switched.
+    */
+    bool update(Renderer &renderer)
+    {
+        frame++;
+        // without workers nobody else decodes, so take one job a frame while streaming
+        if (!streaming.empty() && jobSystem().threadCount() == 1)
+            jobSystem().runQueuedJobs(1);
+        size_t budget = uploadBudget;
+        bool uploaded = false;
+        // the wanted one first, the others (switched away from before they were done) after it
+        vector<int> order(1, streamingIndex(wanted));
+        for (int i = 0; i < (int)streaming.size(); i++)
+            if (i != order[0])
+                order.push_back(i);
+        for (size_t n = 0; n < order.size(); n++) {
+            if (order[n] < 0)
+                continue;
+            Streaming &stream = streaming[order[n]];
+            stream.frames++;
+            if (glLoader().running()) {
+                handOff(stream);
+                continue;
+            }
+            while (stream.nextFace < (int)stream.load.faces.size() && stream.load.ready[stream.nextFace].done() &&
+                   (!uploaded || budget > 0)) {
+                size_t bytes = uploadCubemapFace(stream.load, stream.nextFace++);
+                stream.bytes += bytes;
+                budget -= std::min(budget, bytes);
+                uploaded = true;
+            }
+        }
+        for (size_t i = 0; i < streaming.size();) {
+            Streaming &stream = streaming[i];
+            if (stream.nextFace < (int)stream.load.faces.size() || (stream.sky && !stream.prefilterJob.done())) {
+                i++;
+                continue;
+            }
+            Environment environment = { stream.folder, finishCubemapLoad(stream.load), 0, 0.0f, 0.0f, frame };
+            if (stream.sky && !stream.sky->empty()) {
+                environment.prefilter = createPrefilterTexture(*stream.sky, stream.folder + " prefilter");
+                environment.prefilterMaxLod = (float)(stream.sky->levels() - 1);
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stream.start).count();
+            cout << "Streamed " << stream.folder << " in " << stream.frames << " frames, " << fixed << setprecision(1) << ms
+                 << " ms, " << MemoryRegistry::formatBytes(stream.bytes) << " uploaded" << endl;
+            cout.unsetf(ios::floatfield);
+            resident.push_back(environment);
+            streaming.erase(streaming.begin() + i);
+        }
+        bool switched = false;
+        Environment *next = find(wanted);
+        if (wanted != active && next) {
+            renderer.cubemapTexture = next->cubemap;
+            renderer.prefilterTexture = next->prefilter;
+            renderer.prefilterMaxLod = next->prefilterMaxLod;
+            renderer.exposure = next->exposure;
+            active = wanted;
+            switched = true;
+        }
+        if (Environment *current = find(active))
+            current->lastUsed = frame;
+        evict();
+        return switched;
+    }
+
+    const string &current() const { return active; }
+    bool busy() const { return !streaming.empty(); }
+    size_t residentCount() const { return resident.size(); }
+
+    // deletes every texture, also waits for the loads still going
+    void release()
+    {
+        glLoader().finish(); // the faces it has are done after this
+        for (size_t i = 0; i < streaming.size(); i++) {
+            jobSystem().wait(streaming[i].load.ready);
+            while (streaming[i].nextFace < (int)streaming[i].load.faces.size())
+                uploadCubemapFace(streaming[i].load, streaming[i].nextFace++);
+            unsigned int texture = finishCubemapLoad(streaming[i].load);
+            memoryRegistry().release(MEM_TEXTURE, texture);
+            glDeleteTextures(1, &texture);
+            if (streaming[i].sky)
+                jobSystem().wait(streaming[i].prefilterJob);
+        }
+        streaming.clear();
+        for (size_t i = 0; i < resident.size(); i++)
+            deleteEnvironment(resident[i]);
+        resident.clear();
+    }
+
+private:
+    struct Streaming {
+        string folder;
+        CubemapLoad load;
+        int nextFace;
+        bool handedOff;         // to the loader thread, which sets nextFace past the last face when it's done
+        int frames;
+        size_t bytes;
+        std::chrono::steady_clock::time_point start;
+        std::shared_ptr<PrefilteredSky> sky;
+        JobHandle prefilterJob;
+    };
+    vector<Environment> resident;
+    vector<Streaming> streaming;
+    string active, wanted;
+    unsigned long long frame;
+
+    // once every face is decoded, one loader task uploads all of them
+    void handOff(Streaming &stream)
+    {
+        if (stream.handedOff)
+            return;
+        for (size_t i = 0; i < stream.load.ready.size(); i++)
+            if (!stream.load.ready[i].done())
+                return;
+        stream.handedOff = true;
+        // a copy for the loader thread, the vector of streams can move; the decoded faces are shared
+        std::shared_ptr<CubemapLoad> load = std::make_shared<CubemapLoad>(stream.load);
+        std::shared_ptr<size_t> bytes = std::make_shared<size_t>(0);
+        string folder = stream.folder;
+        glLoader().submit([load, bytes] {
+            for (int face = 0; face < (int)load->faces.size(); face++)
+                *bytes += uploadCubemapFace(*load, face);
+            return *bytes;
+        }, [this, folder, bytes] {
+            int index = streamingIndex(folder);
+            if (index < 0)
+                return;
+            streaming[index].nextFace = (int)streaming[index].load.faces.size();
+            streaming[index].bytes += *bytes;
+        });
+    }
+
+    Environment *find(const string &folder)
+    {
+        for (size_t i = 0; i < resident.size(); i++)
+            if (resident[i].folder == folder)
+                return &resident[i];
+        return 0;
+    }
+
+    int streamingIndex(const string &folder) const
+    {
+        for (size_t i = 0; i < streaming.size(); i++)
+            if (streaming[i].folder == folder)
+                return (int)i;
+        return -1;
+    }
+
+    // least recently used first, never the one on screen or the one about to be
+    void evict()
+    {
+        while (resident.size() > capacity) {
+            int oldest = -1;
+            for (size_t i = 0; i < resident.size(); i++)
+                if (resident[i].folder != active && resident[i].folder != wanted &&
+                    (oldest < 0 || resident[i].lastUsed < resident[oldest].lastUsed))
+                    oldest = (int)i;
+            if (oldest < 0)
+                return;
+            cout << "Evicted " << resident[oldest].folder << endl;
+            deleteEnvironment(resident[oldest]);
+            resident.erase(resident.begin() + oldest);
+        }
+    }
+
+    static void deleteEnvironment(Environment &environment)
+    {
+        memoryRegistry().release(MEM_TEXTURE, environment.cubemap);
+        glDeleteTextures(1, &environment.cubemap);
+        deletePrefilterTexture(environment.prefilter);
+    }
+};
+
+/*
+    Renders a sphere headless while switching sky -> space -> space2 -> sky -> space, and reports how long
+    each switch took and the slowest frame while it streamed, against loading each skybox the blocking way.
+*/
+inline int runEnvironmentBenchmark(int argc, char *argv[])
+{
+    int maxFrames = (int)argNumber(argc, argv, "--frames", 600);
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    configureMips(argc, argv, "none");
+    const char *folders[] = { "skybox/sky", "skybox/space", "skybox/space2" };
+    cout << "Blocking loadCubemap (--mips " << mipFilterName(mipSettings().filter) << "):" << endl;
+    unsigned int first = 0;
+    for (int i = 0; i < 3; i++) {
+        auto start = std::chrono::steady_clock::now();
+        unsigned int texture = loadCubemap(skyboxFaces(folders[i]));
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        cout << "  " << left << setw(16) << folders[i] << right << fixed << setprecision(1) << ms << " ms" << endl;
+        cout.unsetf(ios::floatfield);
+        if (i == 0) {
+            first = texture;
+        } else {
+            memoryRegistry().release(MEM_TEXTURE, texture);
+            glDeleteTextures(1, &texture);
+        }
+    }
+
+    vector<Mesh> meshes;
+    meshes.push_back(generateShape(SHAPE_SPHERE, 20000));
+    Model object(std::move(meshes));
+    Renderer renderer(800, 600, first);
+    RenderTarget output = createRenderTarget(800, 600, "benchmark output");
+    EnvironmentManager environments((size_t)argNumber(argc, argv, "--environments", 3),
+                                    (size_t)(argNumber(argc, argv, "--upload-budget-mb", 16) * 1048576));
+    environments.adopt(folders[0], first);
+    bool loaderThread = hasArg(argc, argv, "--loader-thread") && glLoader().start(window);
+    glm::vec3 cameraPos(0.0f, 0.0f, 3.0f);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    // sky -> space -> space2 -> sky -> space, the last two come back to resident ones (with 3 of them)
+    const int script[] = { 1, 2, 0, 1 };
+    const int switches = 4;
+    int step = 0, requestFrame = 10, steadyFrames = 0;
+    double slowest = 0.0, steady = 0.0;
+    cout << "Switching while rendering 800x600 (" << environments.capacity << " resident, "
+         << (loaderThread ? string("uploads on the loader thread") : MemoryRegistry::formatBytes(environments.uploadBudget) + " a frame")
+         << "):" << endl;
+    for (int frame = 0; frame < maxFrames && step < switches; frame++) {
+        if (frame == 10)
+            environments.request(folders[script[step]]);
+        auto start = std::chrono::steady_clock::now();
+        jobSystem().runMainThreadJobs();
+        glLoader().poll();
+        bool switched = environments.update(renderer);
+        renderer.renderFrame(object, vector<glm::mat4>(1, glm::mat4(1.0f)), view, cameraPos, output.framebuffer);
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (frame < 10) {
+            steady += ms;
+            steadyFrames++;
+            continue;
+        }
+        slowest = std::max(slowest, ms);
+        if (!switched)
+            continue;
+        cout << "  -> " << left << setw(16) << environments.current() << right << setw(4) << frame - requestFrame
+             << " frames, slowest frame " << fixed << setprecision(1) << slowest << " ms (steady "
+             << steady / std::max(steadyFrames, 1) << " ms), " << environments.residentCount() << " resident" << endl;
+        cout.unsetf(ios::floatfield);
+        slowest = 0.0;
+        if (++step < switches)
+            environments.request(folders[script[step]]);
+        requestFrame = frame + 1;
+    }
+    if (step < switches)
+        cout << "ERROR::ENVIRONMENT:: the switches didn't finish in " << maxFrames << " frames" << endl;
+    environments.release();
+    if (loaderThread) {
+        glLoader().printStats(cout);
+        glLoader().stop();
+    }
+    deleteRenderTarget(output);
+    renderer.release();
+    object.release();
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* environment_hpp */
@@ -0,0 +1,360 @@
+//
+//  envprobe.hpp
+//  RefractionProject
+//
+//  A dynamic environment probe: a cubemap rendered from the glass object's position (the skybox plus the
+//  opaque things around it), which the refraction pass samples instead of the skybox, so nearby objects
+//  show through the glass. Rendering all six faces every frame would be six more scene passes, so update()
+//  renders only facesPerFrame of them, the rest keep what they had. Which ones:
+//
+//    PROBE_ROUND_ROBIN  the next ones in turn, every face is at most 6 / facesPerFrame frames old
+//    PROBE_VIEW         the stalest ones, weighted by how much the camera sees of them through the glass:
+//                       the rays come out roughly the way the camera looks, so the faces along the view
+//                       direction get updated up to four times as often as the ones behind the camera
+//
+//  With mips the levels are box filtered (glGenerateMipmap) after every update, so rough glass can read the
+//  probe too (instead of the GGX prefiltered skybox, prefilter.hpp). frozen stops the updates once every face
+//  has been rendered, for scenes where nothing moves. The glass itself is never drawn into the probe.
+//
+//  RefractionProject --probe [--probe-size 256] [--probe-faces 1] [--probe-order round-robin|view] [--probe-mips]
+//                    [--probe-freeze] [--probe-objects 6] [--probe-report]
+//  RefractionProject --bench-probe [--probe-size 256] [--frames 48] [--out probe.ppm] [--software]
+//
+
+#ifndef envprobe_hpp
+#define envprobe_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "memory.hpp"
+#include "mesh.h"
+#include "procedural.hpp"
+#include "renderer.hpp"
+#include "shader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+enum ProbeOrder { PROBE_ROUND_ROBIN, PROBE_VIEW };
+
+inline int probeOrderFromName(const string &name)
+{
+    return name == "view" ? PROBE_VIEW : PROBE_ROUND_ROBIN;
+}
+
+inline const char *probeOrderName(int order)
+{
+    return order == PROBE_VIEW ? "view" : "round-robin";
+}
+
+class EnvironmentProbe {
+public:
+    struct Stats {
+        unsigned long long frames;      // update() calls
+        unsigned long long faces;       // faces rendered
+        unsigned long long mipUpdates;
+        double ms;                      // CPU time in update(), summed
+        int oldest;                     // frames since the stalest face was rendered, after the last update
+        int worstOldest;                // the most that has been
+    };
+
+    unsigned int texture;   // the cubemap, 0 until init()
+    int size, levels;
+    int facesPerFrame;      // 1 to 6
+    int order;              // a ProbeOrder
+    bool mips;
+    bool frozen;            // no more updates once every face has been rendered
+    glm::vec3 center;       // where it's rendered from, the glass object's position
+    float nearPlane, farPlane;
+    Stats stats;
+
+    EnvironmentProbe()
+        : texture(0), size(0), levels(1), facesPerFrame(1), order(PROBE_ROUND_ROBIN), mips(false), frozen(false),
+          center(0.0f), nearPlane(0.05f), farPlane(100.0f), framebuffer(0), depth(0), next(0)
+    {
+        invalidate();
+        resetStats();
+    }
+
+    /*
+        RGBA8 faces for an sRGB skybox; hdr (a linear probe, hdrenv.hpp) gets half floats, so the refraction
+        shader can tone map what it reads from the probe the same way as the skybox.
+    */
+    bool init(int faceSize, bool mipmapped, bool hdr)
+    {
+        release();
+        size = std::max(faceSize, 1);
+        mips = mipmapped;
+        levels = 1;
+        if (mips)
+            while ((size >> levels) > 0)
+                levels++;
+        GLenum format = hdr ? GL_RGBA16F : GL_RGBA8;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        for (int level = 0; level < levels; level++)
+            for (int face = 0; face < 6; face++)
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, format, std::max(size >> level, 1), std::max(size >> level, 1),
+                             0, GL_RGBA, hdr ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, mips ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, texture, 0);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!complete) {
+            cout << "ERROR::PROBE:: Framebuffer is not complete, no environment probe" << endl;
+            release();
+            return false;
+        }
+        memoryRegistry().track(MEM_TEXTURE, texture, textureBytes(format, size, size, 6, mips),
+                               describeImage(format, size, size, mips ? " cube, mipmapped" : " cube"), "environment probe");
+        memoryRegistry().track(MEM_FRAMEBUFFER, framebuffer, 0, "one face + depth", "environment probe");
+        memoryRegistry().track(MEM_RENDERBUFFER, depth, textureBytes(GL_DEPTH_COMPONENT24, size, size),
+                               describeImage(GL_DEPTH_COMPONENT24, size, size), "environment probe");
+        invalidate();
+        return true;
+    }
+
+    void release()
+    {
+        if (!texture)
+            return;
+        memoryRegistry().release(MEM_TEXTURE, texture);
+        memoryRegistry().release(MEM_FRAMEBUFFER, framebuffer);
+        memoryRegistry().release(MEM_RENDERBUFFER, depth);
+        glDeleteTextures(1, &texture);
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteRenderbuffers(1, &depth);
+        texture = framebuffer = depth = 0;
+    }
+
+    // every face has to be rendered again, e.g. after center moved
+    void invalidate()
+    {
+        for (int face = 0; face < 6; face++)
+            age[face] = -1;
+        next = 0;
+    }
+
+    // every face has been rendered since init() or invalidate()
+    bool complete() const
+    {
+        for (int face = 0; face < 6; face++)
+            if (age[face] < 0)
+                return false;
+        return true;
+    }
+
+    // the level rough glass reads for roughness 1, 0 without mips
+    float maxLod() const
+    {
+        return (float)(levels - 1);
+    }
+
+    /*
+        Renders the faces picked for this frame: drawScene(view, projection) draws the opaque objects, then
+        the renderer's skybox goes behind them. viewDirection is the way the camera looks at the probe
+        (center - camera position), only PROBE_VIEW uses it. Returns how many faces were rendered.
+    */
+    int update(Renderer &renderer, const glm::vec3 &viewDirection,
+               const std::function<void(const glm::mat4 &view, const glm::mat4 &projection)> &drawScene)
+    {
+        if (!texture)
+            return 0;
+        auto start = std::chrono::steady_clock::now();
+        stats.frames++;
+        for (int face = 0; face < 6; face++)
+            if (age[face] >= 0)
+                age[face]++;
+        vector<int> faces;
+        if (!frozen || !complete())
+            faces = pickFaces(viewDirection);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, size, size);
+        glEnable(GL_DEPTH_TEST);
+        glm::mat4 projection = faceProjection();
+        for (size_t i = 0; i < faces.size(); i++) {
+            int face = faces[i];
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, texture, 0);
+            glDepthFunc(GL_LESS);
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glm::mat4 view = faceView(face);
+            if (drawScene)
+                drawScene(view, projection);
+            // the skybox as renderFrame draws it, but untouched: a linear probe gets tone mapped when it's read
+            glDepthFunc(GL_LEQUAL);
+            renderer.skyboxShader.use();
+            glm::mat4 skyboxView = glm::mat4(glm::mat3(view));
+            glUniformMatrix4fv(glGetUniformLocation(renderer.skyboxShader.ID, "view"), 1, GL_FALSE, &skyboxView[0][0]);
+            glUniformMatrix4fv(glGetUniformLocation(renderer.skyboxShader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+            glUniform1f(glGetUniformLocation(renderer.skyboxShader.ID, "exposure"), 0.0f);
+            glBindVertexArray(renderer.skyboxVAO);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, renderer.cubemapTexture);
+            glDrawArrays(GL_TRIANGLES, 0, 36);
+            glBindVertexArray(0);
+            age[face] = 0;
+        }
+        glDepthFunc(GL_LESS);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (mips && !faces.empty()) {
+            glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+            glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+            stats.mipUpdates++;
+        }
+
+        stats.faces += faces.size();
+        stats.oldest = 0;
+        for (int face = 0; face < 6; face++)
+            stats.oldest = std::max(stats.oldest, age[face]);
+        stats.worstOldest = std::max(stats.worstOldest, stats.oldest);
+        stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return (int)faces.size();
+    }
+
+    // The usual cubemap face cameras: face i of GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, looked up by world direction
+    glm::mat4 faceView(int face) const
+    {
+        static const glm::vec3 directions[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+                                                 glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+        static const glm::vec3 ups[6] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1),
+                                          glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+        return glm::lookAt(center, center + directions[face], ups[face]);
+    }
+
+    glm::mat4 faceProjection() const
+    {
+        return glm::perspective(90.0f, 1.0f, nearPlane, farPlane); // degrees, see sceneProjection
+    }
+
+    void resetStats()
+    {
+        stats = Stats();
+    }
+
+    void printStats(std::ostream &out) const
+    {
+        out << "Environment probe: " << size << "^2 x6" << (mips ? " with mips" : "") << ", " << facesPerFrame << (facesPerFrame == 1 ? " face" : " faces") << " a frame ("
+            << probeOrderName(order) << (frozen ? ", frozen" : "") << "), " << stats.faces << " faces in " << stats.frames
+            << " frames, " << stats.mipUpdates << " mip updates, " << fixed << setprecision(2)
+            << (stats.frames ? stats.ms / stats.frames : 0.0) << " ms a frame to submit, stalest face " << stats.worstOldest
+            << " frames old at worst" << endl;
+        out.unsetf(ios::floatfield);
+    }
+
+private:
+    unsigned int framebuffer, depth;
+    int age[6];     // frames since each face was rendered, -1 = never
+    int next;       // round robin
+
+    vector<int> pickFaces(const glm::vec3 &viewDirection)
+    {
+        int count = std::min(std::max(facesPerFrame, 1), 6);
+        vector<int> faces;
+        if (order == PROBE_ROUND_ROBIN) {
+            for (int i = 0; i < count; i++)
+                faces.push_back((next + i) % 6);
+            next = (next + count) % 6;
+            return faces;
+        }
+        // faces never rendered first, then by age, the faces the camera looks into counting up to four times
+        static const glm::vec3 directions[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+                                                 glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+        glm::vec3 forward = glm::length(viewDirection) > 0.0f ? glm::normalize(viewDirection) : glm::vec3(0.0f, 0.0f, -1.0f);
+        float score[6];
+        for (int face = 0; face < 6; face++) {
+            float weight = 1.0f + 3.0f * std::max(glm::dot(directions[face], forward), 0.0f);
+            score[face] = age[face] < 0 ? 1e30f : (age[face] + 1) * weight;
+            faces.push_back(face);
+        }
+        std::stable_sort(faces.begin(), faces.end(), [&score](int a, int b) { return score[a] > score[b]; });
+        faces.resize(count);
+        return faces;
+    }
+};
+
+/*
+    Opaque shapes circling the glass object on tilted orbits, something nearby for the probe to capture.
+    Drawn flat colored with the lit shader, in the main view and into the probe's faces alike.
+*/
+class OrbitingShapes {
+public:
+    Shader shader;
+    vector<Mesh> meshes;        // sphere, torus, blob
+    vector<glm::mat4> models;   // one per shape, after animate()
+    float radius;               // of the orbits
+    float scale;                // of the shapes
+
+    OrbitingShapes(int count, float radius, float scale = 0.35f)
+        : shader("shaders/litVshader.txt", "shaders/litFshader.txt"), models(std::max(count, 0), glm::mat4(1.0f)), radius(radius),
+          scale(scale)
+    {
+        meshes.push_back(generateShape(SHAPE_SPHERE, 1500));
+        meshes.push_back(generateShape(SHAPE_TORUS, 1500));
+        meshes.push_back(generateShape(SHAPE_BLOB, 1500));
+    }
+
+    // where the shapes are seconds in, the same time gives the same scene
+    void animate(double seconds)
+    {
+        for (size_t i = 0; i < models.size(); i++) {
+            float phase = 360.0f * i / models.size();
+            float tilt = 25.0f * ((i % 3) - 1.0f);  // three orbit planes
+            float angle = phase + 40.0f * (float)seconds * (i % 2 ? -1.0f : 1.0f);
+            glm::mat4 model = glm::rotate(glm::mat4(1.0f), tilt, glm::vec3(1.0f, 0.0f, 0.0f)); // this glm takes degrees
+            model = glm::rotate(model, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+            model = glm::translate(model, glm::vec3(radius, 0.0f, 0.0f));
+            model = glm::rotate(model, 90.0f * (float)seconds + phase, glm::vec3(0.3f, 1.0f, 0.2f));
+            models[i] = glm::scale(model, glm::vec3(scale));
+        }
+    }
+
+    void draw(const glm::mat4 &view, const glm::mat4 &projection)
+    {
+        glEnable(GL_DEPTH_TEST);
+        shader.use();
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "view"), 1, GL_FALSE, &view[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+        for (size_t i = 0; i < models.size(); i++) {
+            float hue = (float)i / std::max((int)models.size(), 1);
+            glm::vec3 color = glm::clamp(glm::abs(glm::mod(glm::vec3(hue * 6.0f) + glm::vec3(0.0f, 4.0f, 2.0f), 6.0f) - 3.0f) - 1.0f,
+                                         0.0f, 1.0f); // around the color wheel
+            glUniform3fv(glGetUniformLocation(shader.ID, "color"), 1, &color[0]);
+            glUniformMatrix4fv(glGetUniformLocation(shader.ID, "model"), 1, GL_FALSE, &models[i][0][0]);
+            meshes[i % meshes.size()].Draw(shader);
+        }
+    }
+
+    void release()
+    {
+        for (size_t i = 0; i < meshes.size(); i++)
+            meshes[i].release();
+        meshes.clear();
+        glDeleteProgram(shader.ID);
+    }
+};
+
+#endif /* envprobe_hpp */
@@ -0,0 +1,404 @@
+//
+//  errorreport.hpp
+//  RefractionProject
+//
+//  Numbers for picking the refraction approximation to ship with an asset. Renders an orbit around it
+//  with every golden mode (golden.hpp) and with the ray tracer (raytrace.hpp) as the reference, and
+//  prints per frame and mode the error next to what the mode costs:
+//
+//    PSNR, SSIM  of the frame against the ray-traced one
+//    T2 error    angle between the direction the shader samples the skybox in and the direction the
+//                exact refracted path leaves the object in, mean and 95th percentile in degrees.
+//                "no T2" counts pixels where the shader's refract() returned nothing
+//    GPU, CPU    milliseconds for the mode's passes (GL_TIME_ELAPSED and submit time)
+//
+//  The modes that read the back normals at newUV (two-pass, baked) also get a heatmap of where that
+//  reprojection goes wrong, compared with where the exact path really leaves the object:
+//
+//    blue -> yellow -> red   newUV this many pixels away from the true exit point, red at 16
+//    magenta                 newUV is off the object, the back pass has nothing there (silhouettes)
+//    cyan                    the true exit is hidden behind a farther surface, which is the one the
+//                            back pass keeps (concavities)
+//    white                   newUV is off the screen
+//    black                   the exact path doesn't get out within the bounce limit
+//
+//  Everything also goes to <out>/error.csv. Images (reference, render, diff and newUV heatmaps) are
+//  written for the first frame, or every frame with --all-images.
+//
+//  RefractionProject --error-report [--frames 8] [--size 800x600] [--shape torus|sphere|blob]
+//                    [--triangles 20000] [--model path] [--skybox skybox/sky] [--no-fresnel]
+//                    [--sdf-resolution 64] [--out error-report] [--all-images] [--threads N] [--software]
+//
+
+#ifndef errorreport_hpp
+#define errorreport_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "benchmark.hpp"
+#include "cmdline.hpp"
+#include "golden.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "imagediff.hpp"
+#include "parallel.hpp"
+#include "procedural.hpp"
+#include "raytrace.hpp"
+#include "renderer.hpp"
+#include "sdf.hpp"
+#include "thickness.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Where the exact refracted path of one pixel's camera ray leaves the object
+struct ExactExit {
+    bool valid;          // the camera ray hits the object and the path gets out again
+    bool hidden;         // a farther surface is in front of the exit point, seen from the camera
+    glm::vec3 direction;
+    glm::vec2 uv;        // the exit point projected to the screen, like newUV
+};
+
+struct ModeError {
+    double psnr, ssim;
+    double t2Mean, t2P95;   // degrees
+    double noT2;            // fraction of object pixels
+    double gpuMs, cpuMs;
+    bool readsBack;         // the newUV columns below only mean something for these modes
+    double newUVMean;       // pixels, over the pixels where newUV lands on the object
+    double offObject, hidden, offScreen, overFour;  // fractions of object pixels
+};
+
+// frame of an orbit around the origin at distance, bobbing up and down a little
+inline glm::mat4 orbitView(int frame, int frames, float distance, glm::vec3 &cameraPos)
+{
+    float angle = 2.0f * 3.14159265f * frame / frames;
+    float elevation = 0.35f * std::sin(angle);
+    cameraPos = distance * glm::vec3(std::sin(angle) * std::cos(elevation), std::sin(elevation), std::cos(angle) * std::cos(elevation));
+    return glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// t of the last surface along ray, or -1 if it hits nothing
+inline float farthestHit(const TraceScene &scene, Ray ray)
+{
+    float farthest = -1.0f, tMin = 0.0f;
+    for (int i = 0; i < 64; i++) {
+        RayHit hit;
+        hit.t = FLT_MAX;
+        if (!scene.wide.intersect(ray, hit, tMin))
+            break;
+        farthest = hit.t;
+        tMin = hit.t + 1e-4f * std::max(1.0f, hit.t);
+    }
+    return farthest;
+}
+
+// the exact exit of every pixel, top row first like the images
+inline void exactExits(const RayTracer &tracer, const TraceScene &scene, const glm::mat4 &view, const glm::vec3 &cameraPos,
+                       vector<ExactExit> &exits)
+{
+    int width = tracer.width, height = tracer.height;
+    exits.assign((size_t)width * height, ExactExit());
+    glm::mat4 viewProjection = tracer.projection * view;
+    glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    parallelFor(height, tracer.threads, [&](int row, int) {
+        int y = height - 1 - row;
+        for (int x = 0; x < width; x++) {
+            ExactExit &exit = exits[(size_t)row * width + x];
+            exit.valid = false;
+            float ndcX = (x + 0.5f) / width * 2.0f - 1.0f, ndcY = (y + 0.5f) / height * 2.0f - 1.0f;
+            glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+            glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+            Ray ray;
+            ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+            ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+            glm::vec3 point;
+            if (!tracer.exitPath(scene, ray, point, exit.direction))
+                continue;
+            exit.valid = true;
+            glm::vec4 clip = viewProjection * glm::vec4(point, 1.0f);
+            exit.uv = glm::vec2(clip.x, clip.y) / clip.w * 0.5f + glm::vec2(0.5f);
+            Ray toExit;
+            toExit.origin = cameraPos;
+            toExit.direction = glm::normalize(point - cameraPos);
+            float distance = glm::length(point - cameraPos);
+            exit.hidden = farthestHit(scene, toExit) > distance + 1e-3f * std::max(1.0f, distance);
+        }
+    });
+}
+
+// the same ramp as diffHeatmap, 0 = blue, 1 = red
+inline void heatColor(float s, unsigned char *out)
+{
+    s = std::min(std::max(s, 0.0f), 1.0f);
+    if (s < 0.5f) {
+        out[0] = (unsigned char)(510 * s);
+        out[1] = (unsigned char)(510 * s);
+        out[2] = (unsigned char)(255 * (1.0f - 2 * s));
+    } else {
+        out[0] = 255;
+        out[1] = (unsigned char)(255 * (2.0f - 2 * s));
+        out[2] = 0;
+    }
+}
+
+/*
+    Compares one mode's T2 and newUV (read back from the float target, w = 2 on the object) with the
+    exact exits, fills in the T2 and newUV columns of error and draws the newUV heatmap over a dimmed
+    reference.
+*/
+inline void measureMode(const vector<float> &t2, const vector<float> &newUV, const vector<ExactExit> &exits,
+                        const Image &reference, int width, int height, ModeError &error, Image &heatmap)
+{
+    heatmap = Image(width, height);
+    vector<float> angles;
+    size_t objectPixels = 0, noT2 = 0, offObject = 0, hidden = 0, offScreen = 0, overFour = 0, onObject = 0;
+    double uvSum = 0.0;
+    for (size_t p = 0; p < exits.size(); p++) {
+        unsigned char *out = &heatmap.pixels[p * 3];
+        const unsigned char *r = &reference.pixels[p * 3];
+        out[0] = out[1] = out[2] = (unsigned char)((77 * r[0] + 150 * r[1] + 29 * r[2]) >> 10);
+        if (t2[p * 4 + 3] < 1.5f)
+            continue;
+        objectPixels++;
+        glm::vec3 direction(t2[p * 4], t2[p * 4 + 1], t2[p * 4 + 2]);
+        const ExactExit &exit = exits[p];
+        if (glm::length(direction) < 0.5f)
+            noT2++;
+        else if (exit.valid)
+            angles.push_back(std::acos(std::min(1.0f, glm::dot(glm::normalize(direction), exit.direction))) * 57.2957795f);
+
+        if (!error.readsBack)
+            continue;
+        glm::vec2 uv(newUV[p * 4], newUV[p * 4 + 1]);
+        int px = (int)std::floor(uv.x * width), py = height - 1 - (int)std::floor(uv.y * height);
+        if (!exit.valid) {
+            out[0] = out[1] = out[2] = 0;
+        } else if (px < 0 || px >= width || py < 0 || py >= height) {
+            offScreen++;
+            out[0] = out[1] = out[2] = 255;
+        } else if (t2[((size_t)py * width + px) * 4 + 3] < 1.5f) {
+            offObject++;
+            out[0] = 255, out[1] = 0, out[2] = 255;
+        } else if (exit.hidden) {
+            hidden++;
+            out[0] = 0, out[1] = 255, out[2] = 255;
+        } else {
+            double pixels = glm::length((uv - exit.uv) * glm::vec2((float)width, (float)height));
+            uvSum += pixels;
+            onObject++;
+            overFour += pixels > 4.0;
+            heatColor((float)(pixels / 16.0), out);
+        }
+    }
+    error.t2Mean = error.t2P95 = 0.0;
+    if (!angles.empty()) {
+        double sum = 0.0;
+        for (size_t i = 0; i < angles.size(); i++)
+            sum += angles[i];
+        error.t2Mean = sum / angles.size();
+        size_t p95 = angles.size() * 95 / 100;
+        std::nth_element(angles.begin(), angles.begin() + p95, angles.end());
+        error.t2P95 = angles[p95];
+    }
+    double pixels = std::max<size_t>(objectPixels, 1);
+    error.noT2 = noT2 / pixels;
+    error.newUVMean = onObject > 0 ? uvSum / onObject : 0.0;
+    error.offObject = offObject / pixels;
+    error.hidden = hidden / pixels;
+    error.offScreen = offScreen / pixels;
+    error.overFour = overFour / pixels;
+}
+
+inline bool parseShape(const string &name, ProceduralShape &shape)
+{
+    if (name == "sphere")
+        shape = SHAPE_SPHERE;
+    else if (name == "torus")
+        shape = SHAPE_TORUS;
+    else if (name == "blob")
+        shape = SHAPE_BLOB;
+    else
+        return false;
+    return true;
+}
+
+inline void printModeError(ostream &out, const string &frame, const string &mode, const ModeError &e)
+{
+    out << fixed << setprecision(2) << left << setw(7) << frame << setw(11) << mode << right << setw(8) << e.psnr
+        << setprecision(4) << setw(8) << e.ssim << setprecision(2) << setw(9) << e.t2Mean << setw(9) << e.t2P95
+        << setw(8) << 100.0 * e.noT2 << setw(9) << e.gpuMs << setw(9) << e.cpuMs;
+    if (e.readsBack)
+        out << setw(10) << e.newUVMean << setw(9) << 100.0 * e.overFour << setw(9) << 100.0 * e.offObject
+            << setw(9) << 100.0 * e.hidden << setw(9) << 100.0 * e.offScreen;
+    out << endl;
+    out.unsetf(ios::floatfield);
+}
+
+inline int runErrorReport(int argc, char *argv[])
+{
+    int width = 800, height = 600;
+    sscanf(argValue(argc, argv, "--size", "800x600").c_str(), "%dx%d", &width, &height);
+    int frames = std::max(1, (int)argNumber(argc, argv, "--frames", 8));
+    unsigned int triangles = (unsigned int)argNumber(argc, argv, "--triangles", 20000);
+    string modelPath = argValue(argc, argv, "--model", "");
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    string outDir = argValue(argc, argv, "--out", "error-report");
+    bool allImages = hasArg(argc, argv, "--all-images");
+    ProceduralShape shape;
+    if (!parseShape(argValue(argc, argv, "--shape", "torus"), shape)) {
+        cout << "ERROR::ERRORREPORT:: --shape is sphere, torus or blob" << endl;
+        return -1;
+    }
+
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(skybox)))
+        return -1;
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    makeDirectory(outDir);
+
+    Model *object;
+    if (!modelPath.empty()) {
+        object = new Model(modelPath);
+    } else {
+        vector<Mesh> meshes;
+        meshes.push_back(generateShape(shape, triangles));
+        object = new Model(std::move(meshes));
+    }
+    loadOrBakeThickness(*object, !modelPath.empty());
+    SdfGrid sdf = loadOrBakeSdf(*object, !modelPath.empty(), (int)argNumber(argc, argv, "--sdf-resolution", 64));
+    unsigned int sdfTexture = createSdfTexture(sdf, "error report");
+
+    Renderer renderer(width, height, loadCubemap(skyboxFaces(skybox)));
+    useSdf(renderer, sdfTexture, sdf);
+    RenderTarget color = createRenderTarget(width, height, "error report color");
+    RenderTarget debug = createRenderTarget(width, height, "error report T2/newUV", GL_RGBA32F);
+
+    RayTracer tracer(width, height, &cubemap);
+    tracer.threads = (int)argNumber(argc, argv, "--threads", 0);
+    tracer.fresnel = !hasArg(argc, argv, "--no-fresnel");
+    vector<glm::mat4> models;
+    float distance = instanceGrid(1, renderer.projection, models);
+    TraceScene scene;
+    buildTraceScene(meshViews(*object), models, scene, tracer.threads);
+
+    const vector<GoldenMode> &modes = goldenModes();
+    vector<ModeError> totals(modes.size(), ModeError());
+    double traceMs = 0.0;
+    ofstream csv((outDir + "/error.csv").c_str());
+    csv << "frame,mode,psnr,ssim,t2_mean_deg,t2_p95_deg,no_t2,gpu_ms,cpu_ms,newuv_mean_px,newuv_over_4px,"
+           "newuv_off_object,exit_hidden,newuv_off_screen" << endl;
+
+    cout << "Error report: " << width << "x" << height << ", " << scene.bvh.triangleCount() << " triangles, " << frames
+         << " frames, reference " << (tracer.fresnel ? "with" : "without") << " Fresnel" << endl;
+    cout << left << setw(7) << "frame" << setw(11) << "mode" << right << setw(8) << "PSNR" << setw(8) << "SSIM"
+         << setw(9) << "T2 mean" << setw(9) << "T2 p95" << setw(8) << "no T2%" << setw(9) << "GPU ms" << setw(9) << "CPU ms"
+         << setw(10) << "newUV px" << setw(9) << ">4px %" << setw(9) << "off obj%" << setw(9) << "hidden%"
+         << setw(9) << "off scr%" << endl;
+    vector<ExactExit> exits;
+    vector<float> t2, newUV;
+    for (int frame = 0; frame < frames; frame++) {
+        glm::vec3 cameraPos;
+        glm::mat4 view = orbitView(frame, frames, distance, cameraPos);
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%s/frame%02d_", outDir.c_str(), frame);
+        bool images = allImages || frame == 0;
+
+        auto start = std::chrono::steady_clock::now();
+        Image reference;
+        tracer.render(scene, view, reference);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        traceMs += ms;
+        exactExits(tracer, scene, view, cameraPos, exits);
+        cout << left << setw(7) << frame << setw(11) << "reference" << right << "  ray traced in " << ms << " ms, "
+             << tracer.rays << " rays" << endl;
+        if (images)
+            writePPM(string(prefix) + "reference.ppm", reference);
+
+        for (size_t m = 0; m < modes.size(); m++) {
+            ModeError error = ModeError();
+            modes[m].setup(renderer);
+            error.readsBack = renderer.thicknessMode == THICKNESS_DEPTH || renderer.thicknessMode == THICKNESS_BAKED;
+            // the first frame once untimed, so shader and texture warm-up doesn't count
+            if (frame == 0)
+                renderer.renderFrame(*object, models, view, cameraPos, color.framebuffer);
+            renderer.profiling = true;
+            renderer.renderFrame(*object, models, view, cameraPos, color.framebuffer);
+            renderer.profiling = false;
+            for (int pass = 0; pass < PASS_COUNT; pass++) {
+                error.gpuMs += renderer.stats[pass].gpuMs;
+                error.cpuMs += renderer.stats[pass].cpuMs;
+            }
+            Image rendered(width, height);
+            readRenderTarget(color, rendered.pixels);
+            renderer.debugOutput = 1;
+            renderer.renderFrame(*object, models, view, cameraPos, debug.framebuffer);
+            readRenderTargetFloats(debug, t2);
+            renderer.debugOutput = 2;
+            renderer.renderFrame(*object, models, view, cameraPos, debug.framebuffer);
+            readRenderTargetFloats(debug, newUV);
+            renderer.debugOutput = 0;
+            modes[m].restore(renderer);
+
+            ImageDiff diff;
+            compareImages(reference, rendered, diff);
+            error.psnr = diff.psnr;
+            error.ssim = diff.ssim;
+            Image heatmap;
+            measureMode(t2, newUV, exits, reference, width, height, error, heatmap);
+            printModeError(cout, to_string(frame), modes[m].name, error);
+            csv << frame << "," << modes[m].name << "," << error.psnr << "," << error.ssim << "," << error.t2Mean << ","
+                << error.t2P95 << "," << error.noT2 << "," << error.gpuMs << "," << error.cpuMs << ",";
+            if (error.readsBack)
+                csv << error.newUVMean << "," << error.overFour << "," << error.offObject << "," << error.hidden << "," << error.offScreen;
+            else
+                csv << ",,,,";
+            csv << endl;
+            if (images) {
+                writePPM(string(prefix) + modes[m].name + ".ppm", rendered);
+                writePPM(string(prefix) + modes[m].name + "_diff.ppm", diffHeatmap(reference, rendered));
+                if (error.readsBack)
+                    writePPM(string(prefix) + modes[m].name + "_newuv.ppm", heatmap);
+            }
+
+            ModeError &total = totals[m];
+            total.readsBack = error.readsBack;
+            total.psnr += error.psnr / frames, total.ssim += error.ssim / frames;
+            total.t2Mean += error.t2Mean / frames, total.t2P95 += error.t2P95 / frames, total.noT2 += error.noT2 / frames;
+            total.gpuMs += error.gpuMs / frames, total.cpuMs += error.cpuMs / frames;
+            total.newUVMean += error.newUVMean / frames, total.overFour += error.overFour / frames;
+            total.offObject += error.offObject / frames, total.hidden += error.hidden / frames;
+            total.offScreen += error.offScreen / frames;
+        }
+    }
+    cout << "Mean over " << frames << " frames (reference " << traceMs / frames << " ms per frame on the CPU):" << endl;
+    for (size_t m = 0; m < modes.size(); m++)
+        printModeError(cout, "mean", modes[m].name, totals[m]);
+    cout << "Wrote " << outDir << "/error.csv and the images of " << (allImages ? "every frame" : "frame 0") << endl;
+
+    deleteRenderTarget(color);
+    deleteRenderTarget(debug);
+    memoryRegistry().release(MEM_TEXTURE, renderer.cubemapTexture);
+    glDeleteTextures(1, &renderer.cubemapTexture);
+    renderer.release();
+    deleteSdfTexture(sdfTexture);
+    object->release();
+    delete object;
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* errorreport_hpp */
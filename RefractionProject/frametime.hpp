@@ -0,0 +1,399 @@
+//
+//  frametime.hpp
+//  RefractionProject
+//
+//  Per-frame timings for the interactive viewer: CPU time spent building the frame, GPU time
+//  (GL_TIME_ELAPSED, read back a few frames later so we never wait for it) and the interval between
+//  two swaps, which is what you actually see. Frames are kept in a lock-free ring buffer so another
+//  thread can read them while the main loop keeps writing.
+//
+//  A frame whose swap interval is more than hitchFactor x the rolling median is a hitch. Each frame
+//  records what expensive GL work happened during it (texture uploads, shader compiles/links,
+//  renderbuffer reallocations...) from the GL call counters in glstats.hpp, so a hitch says what caused it.
+//
+//  Don't turn on Renderer::profiling at the same time: GL_TIME_ELAPSED queries can't nest.
+//
+
+#ifndef frametime_hpp
+#define frametime_hpp
+
+#include <glad/glad.h>
+
+#include "glstats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// What happened during a frame, as bits
+enum FrameEvent {
+    FRAME_EVENT_TEXTURE_UPLOAD = 1 << 0,  // glTexImage2D/3D, glTexSubImage2D, glCompressedTexImage2D, glGenerateMipmap
+    FRAME_EVENT_BUFFER_UPLOAD  = 1 << 1,  // glBufferData
+    FRAME_EVENT_PROGRAM_LINK   = 1 << 2,  // glCompileShader, glLinkProgram
+    FRAME_EVENT_FBO_REALLOC    = 1 << 3,  // glRenderbufferStorage (a render target was (re)created)
+    FRAME_EVENT_RESIZE         = 1 << 4,  // the window changed size
+    FRAME_EVENT_COUNT          = 5
+};
+
+inline const char *frameEventName(int bit)
+{
+    static const char *names[] = { "texture upload", "buffer upload", "program link", "FBO realloc", "resize" };
+    return names[bit];
+}
+
+inline std::string describeFrameEvents(unsigned int events)
+{
+    std::string text;
+    for (int bit = 0; bit < FRAME_EVENT_COUNT; bit++) {
+        if (!(events & (1u << bit)))
+            continue;
+        if (!text.empty())
+            text += " + ";
+        text += frameEventName(bit);
+    }
+    return text.empty() ? "-" : text;
+}
+
+struct FrameRecord {
+    unsigned long long frame;
+    double startMs;     // since recording started
+    float cpuMs;        // beginFrame() to endFrame()
+    float gpuMs;        // -1 if the GPU time isn't known
+    float intervalMs;   // swap to swap
+    float medianMs;     // rolling median of intervalMs when this frame finished
+    unsigned int events;
+    bool hitch;
+};
+
+/*
+    Single-writer ring buffer. The writer never waits; readers copy a slot and check its sequence
+    number didn't change while they copied it (a seqlock), and skip slots that were overwritten.
+*/
+template <typename T>
+class FrameRing {
+public:
+    explicit FrameRing(size_t capacity) : slots(capacity), sequences(new std::atomic<unsigned long long>[capacity]), written(0)
+    {
+        for (size_t i = 0; i < capacity; i++)
+            sequences[i].store(0, std::memory_order_relaxed);
+    }
+    ~FrameRing() { delete[] sequences; }
+
+    void push(const T &value)
+    {
+        unsigned long long index = written.load(std::memory_order_relaxed);
+        size_t slot = index % slots.size();
+        sequences[slot].store(2 * index + 1, std::memory_order_relaxed); // odd = being written
+        std::atomic_thread_fence(std::memory_order_release);
+        slots[slot] = value;
+        sequences[slot].store(2 * index + 2, std::memory_order_release);
+        written.store(index + 1, std::memory_order_release);
+    }
+
+    unsigned long long pushed() const { return written.load(std::memory_order_acquire); }
+    size_t capacity() const { return slots.size(); }
+
+    // the newest (up to) count values, oldest first
+    void latest(size_t count, std::vector<T> &out) const
+    {
+        out.clear();
+        unsigned long long end = pushed();
+        unsigned long long begin = end > count ? end - count : 0;
+        if (end - begin > slots.size())
+            begin = end - slots.size();
+        for (unsigned long long index = begin; index < end; index++) {
+            size_t slot = index % slots.size();
+            unsigned long long before = sequences[slot].load(std::memory_order_acquire);
+            T value = slots[slot];
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before == 2 * index + 2 && sequences[slot].load(std::memory_order_relaxed) == before)
+                out.push_back(value);
+        }
+    }
+
+private:
+    std::vector<T> slots;
+    std::atomic<unsigned long long> *sequences;
+    std::atomic<unsigned long long> written;
+};
+
+struct FramePercentiles {
+    double p50, p90, p99, max, mean;
+};
+
+inline FramePercentiles framePercentiles(std::vector<float> values)
+{
+    FramePercentiles result = { 0, 0, 0, 0, 0 };
+    if (values.empty())
+        return result;
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); i++)
+        sum += values[i];
+    result.mean = sum / values.size();
+    result.p50 = values[(values.size() - 1) * 50 / 100];
+    result.p90 = values[(values.size() - 1) * 90 / 100];
+    result.p99 = values[(values.size() - 1) * 99 / 100];
+    result.max = values.back();
+    return result;
+}
+
+class FrameStats {
+public:
+    FrameRing<FrameRecord> frames;
+    std::vector<FrameRecord> hitches;   // every hitch, kept even after the ring wraps
+    float hitchFactor;                  // hitch = interval > hitchFactor x rolling median
+    int medianWindow;                   // frames in the rolling median
+    bool printHitches;                  // print a warning as each hitch is detected
+
+    FrameStats(size_t capacity = 16384)
+        : frames(capacity), hitchFactor(2.5f), medianWindow(240), printHitches(false),
+          gpuTimers(false), nextQuery(0), frameIndex(0), explicitEvents(0), haveSwap(false)
+    {
+        start = frameStart = lastSwap = std::chrono::steady_clock::now();
+        for (int i = 0; i < QUERY_COUNT; i++)
+            queries[i] = 0;
+        snapshotCounters(countersAtSwap);
+    }
+
+    // Creates the GPU timer queries, needs a current context. Without init() GPU times are -1.
+    void init()
+    {
+        glGenQueries(QUERY_COUNT, queries);
+        gpuTimers = true;
+        snapshotCounters(countersAtSwap);
+    }
+
+    // publishes the frames still waiting for their GPU time (waits for them), then deletes the queries
+    void release()
+    {
+        if (!gpuTimers)
+            return;
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            int q = (nextQuery + i) % QUERY_COUNT;
+            if (pending[q].waiting)
+                publish(pending[q], false, q);
+        }
+        glDeleteQueries(QUERY_COUNT, queries);
+        gpuTimers = false;
+    }
+
+    // top of the render loop
+    void beginFrame()
+    {
+        frameStart = std::chrono::steady_clock::now();
+        if (gpuTimers) {
+            // every query is reused QUERY_COUNT frames later; if the GPU is that far behind, give up on that one
+            Pending &slot = pending[nextQuery];
+            if (slot.waiting)
+                publish(slot, true);
+            glBeginQuery(GL_TIME_ELAPSED, queries[nextQuery]);
+        }
+    }
+
+    // after the last GL command of the frame, before swapping
+    void endFrame()
+    {
+        current.frame = frameIndex;
+        current.startMs = milliseconds(start, frameStart);
+        current.cpuMs = (float)milliseconds(frameStart, std::chrono::steady_clock::now());
+        current.gpuMs = -1.0f;
+        if (gpuTimers)
+            glEndQuery(GL_TIME_ELAPSED);
+    }
+
+    // right after glfwSwapBuffers
+    void afterSwap()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        current.intervalMs = haveSwap ? (float)milliseconds(lastSwap, now) : (float)milliseconds(frameStart, now);
+        lastSwap = now;
+        haveSwap = true;
+        // everything since the previous swap, so work done in event callbacks (resizes) counts too
+        current.events = eventsSince(countersAtSwap) | explicitEvents;
+        snapshotCounters(countersAtSwap);
+        explicitEvents = 0;
+        current.medianMs = 0.0f;
+        current.hitch = false;
+        frameIndex++;
+
+        if (!gpuTimers) {
+            Pending done;
+            done.record = current;
+            publish(done, false);
+            return;
+        }
+        pending[nextQuery].record = current;
+        pending[nextQuery].waiting = true;
+        nextQuery = (nextQuery + 1) % QUERY_COUNT;
+        // publish every frame whose GPU time has arrived, oldest first
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            int q = (nextQuery + i) % QUERY_COUNT;
+            if (!pending[q].waiting)
+                continue;
+            GLint available = 0;
+            glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            publish(pending[q], false, q);
+        }
+    }
+
+    // for things the GL counters can't see, e.g. FRAME_EVENT_RESIZE from the framebuffer size callback
+    void noteEvent(unsigned int events)
+    {
+        explicitEvents |= events;
+    }
+
+    void printSummary(std::ostream &out) const
+    {
+        std::vector<FrameRecord> all;
+        frames.latest(frames.capacity(), all);
+        std::vector<float> cpu, gpu, interval;
+        for (size_t i = 0; i < all.size(); i++) {
+            cpu.push_back(all[i].cpuMs);
+            interval.push_back(all[i].intervalMs);
+            if (all[i].gpuMs >= 0.0f)
+                gpu.push_back(all[i].gpuMs);
+        }
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << "---- Frame times (" << all.size() << " of " << frames.pushed() << " frames) ----" << std::endl;
+        out << std::fixed << std::setprecision(2);
+        out << std::left << std::setw(10) << "" << std::right << std::setw(9) << "mean" << std::setw(9) << "p50"
+            << std::setw(9) << "p90" << std::setw(9) << "p99" << std::setw(9) << "max" << "  (ms)" << std::endl;
+        printPercentiles(out, "interval", framePercentiles(interval));
+        printPercentiles(out, "CPU", framePercentiles(cpu));
+        if (!gpu.empty())
+            printPercentiles(out, "GPU", framePercentiles(gpu));
+        out << hitches.size() << " hitch(es) over " << hitchFactor << "x the rolling median" << std::endl;
+        std::vector<FrameRecord> worst = hitches;
+        std::sort(worst.begin(), worst.end(), [](const FrameRecord &a, const FrameRecord &b) { return a.intervalMs > b.intervalMs; });
+        for (size_t i = 0; i < worst.size() && i < 10; i++)
+            out << "  frame " << std::setw(6) << worst[i].frame << std::setw(9) << worst[i].intervalMs << " ms (median "
+                << worst[i].medianMs << ")  " << describeFrameEvents(worst[i].events) << std::endl;
+        out << "-------------------------------------" << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // every frame still in the ring, one row each
+    bool writeCsv(const std::string &path) const
+    {
+        std::ofstream csv(path.c_str());
+        if (!csv)
+            return false;
+        std::vector<FrameRecord> all;
+        frames.latest(frames.capacity(), all);
+        csv << "frame,start_ms,cpu_ms,gpu_ms,interval_ms,median_ms,hitch,events" << std::endl;
+        for (size_t i = 0; i < all.size(); i++)
+            csv << all[i].frame << ',' << all[i].startMs << ',' << all[i].cpuMs << ',' << all[i].gpuMs << ','
+                << all[i].intervalMs << ',' << all[i].medianMs << ',' << (all[i].hitch ? 1 : 0) << ','
+                << describeFrameEvents(all[i].events) << std::endl;
+        return true;
+    }
+
+private:
+    static const int QUERY_COUNT = 4;
+    struct Pending {
+        FrameRecord record;
+        bool waiting;
+        Pending() : waiting(false) {}
+    };
+
+    unsigned int queries[QUERY_COUNT];
+    Pending pending[QUERY_COUNT];
+    bool gpuTimers;
+    int nextQuery;
+    unsigned long long frameIndex;
+    unsigned int explicitEvents;
+    FrameRecord current;
+    unsigned long long countersAtSwap[GLCALL_COUNT];
+    std::chrono::steady_clock::time_point start, frameStart, lastSwap;
+    bool haveSwap;
+    std::vector<float> recentIntervals;
+
+    static double milliseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+    {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    static void printPercentiles(std::ostream &out, const char *name, const FramePercentiles &p)
+    {
+        out << std::left << std::setw(10) << name << std::right << std::setw(9) << p.mean << std::setw(9) << p.p50
+            << std::setw(9) << p.p90 << std::setw(9) << p.p99 << std::setw(9) << p.max << std::endl;
+    }
+
+    void snapshotCounters(unsigned long long *counters) const
+    {
+        for (int i = 0; i < GLCALL_COUNT; i++)
+            counters[i] = glCallCounts().calls[i];
+    }
+
+    unsigned int eventsSince(const unsigned long long *counters) const
+    {
+        const unsigned long long *now = glCallCounts().calls;
+        unsigned int events = 0;
+        if (now[GLCALL_glTexImage2D] != counters[GLCALL_glTexImage2D] || now[GLCALL_glTexSubImage2D] != counters[GLCALL_glTexSubImage2D]
+            || now[GLCALL_glTexImage3D] != counters[GLCALL_glTexImage3D]
+            || now[GLCALL_glCompressedTexImage2D] != counters[GLCALL_glCompressedTexImage2D]
+            || now[GLCALL_glGenerateMipmap] != counters[GLCALL_glGenerateMipmap])
+            events |= FRAME_EVENT_TEXTURE_UPLOAD;
+        if (now[GLCALL_glBufferData] != counters[GLCALL_glBufferData])
+            events |= FRAME_EVENT_BUFFER_UPLOAD;
+        if (now[GLCALL_glCompileShader] != counters[GLCALL_glCompileShader] || now[GLCALL_glLinkProgram] != counters[GLCALL_glLinkProgram])
+            events |= FRAME_EVENT_PROGRAM_LINK;
+        if (now[GLCALL_glRenderbufferStorage] != counters[GLCALL_glRenderbufferStorage])
+            events |= FRAME_EVENT_FBO_REALLOC;
+        return events;
+    }
+
+    // fills in the GPU time (if asked), checks for a hitch and pushes the frame into the ring
+    void publish(Pending &done, bool timedOut, int query = -1)
+    {
+        FrameRecord record = done.record;
+        done.waiting = false;
+        if (query >= 0 && !timedOut) {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &nanoseconds);
+            record.gpuMs = (float)(nanoseconds / 1.0e6);
+            // some drivers return garbage for the very first query; the GPU can't take longer than the wall clock
+            if (record.gpuMs > milliseconds(start, std::chrono::steady_clock::now()) - record.startMs)
+                record.gpuMs = -1.0f;
+        }
+
+        // rolling median of the intervals before this frame
+        if (recentIntervals.size() >= 8) {
+            std::vector<float> sorted(recentIntervals);
+            std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+            record.medianMs = sorted[sorted.size() / 2];
+            record.hitch = record.intervalMs > hitchFactor * record.medianMs;
+        }
+        recentIntervals.push_back(record.intervalMs);
+        if ((int)recentIntervals.size() > medianWindow)
+            recentIntervals.erase(recentIntervals.begin());
+
+        if (record.hitch) {
+            hitches.push_back(record);
+            if (printHitches)
+                std::cout << "WARNING::FRAME:: Hitch at frame " << record.frame << ": " << record.intervalMs << " ms (median "
+                          << record.medianMs << " ms), " << describeFrameEvents(record.events) << std::endl;
+        }
+        frames.push(record);
+    }
+};
+
+// the viewer's frame statistics
+inline FrameStats &frameStats()
+{
+    static FrameStats stats;
+    return stats;
+}
+
+#endif /* frametime_hpp */
@@ -0,0 +1,201 @@
+//
+//  glstats.hpp
+//  RefractionProject
+//
+//  Counts GL calls and measures GPU time per render pass.
+//
+//  GLAD keeps every GL function in a global pointer (glDrawElements is really glad_glDrawElements),
+//  so after gladLoadGLLoader we can swap the pointers we care about for small trampolines that bump a
+//  counter and then call the real driver function. Nothing at the call sites has to change.
+//
+
+#ifndef glstats_hpp
+#define glstats_hpp
+
+#include <glad/glad.h>
+
+#include <iostream>
+
+// The functions the render loop uses, and the expensive ones frametime.hpp blames hitches on.
+// Add to this list to count more of them.
+#define GLSTATS_FUNCTIONS(X) \
+    X(glDrawElements) \
+    X(glDrawArrays) \
+    X(glBindFramebuffer) \
+    X(glBindVertexArray) \
+    X(glBindTexture) \
+    X(glActiveTexture) \
+    X(glUseProgram) \
+    X(glGetUniformLocation) \
+    X(glUniform1i) \
+    X(glUniform1f) \
+    X(glUniform2f) \
+    X(glUniform3fv) \
+    X(glUniformMatrix4fv) \
+    X(glClear) \
+    X(glClearColor) \
+    X(glClearDepth) \
+    X(glDepthFunc) \
+    X(glEnable) \
+    X(glViewport) \
+    X(glTexImage2D) \
+    X(glTexSubImage2D) \
+    X(glTexImage3D) \
+    X(glCompressedTexImage2D) \
+    X(glGenerateMipmap) \
+    X(glBufferData) \
+    X(glCompileShader) \
+    X(glLinkProgram) \
+    X(glRenderbufferStorage)
+
+enum GLCallSlot {
+#define GLSTATS_SLOT(name) GLCALL_##name,
+    GLSTATS_FUNCTIONS(GLSTATS_SLOT)
+#undef GLSTATS_SLOT
+    GLCALL_COUNT
+};
+
+struct GLCallCounts {
+    unsigned long long calls[GLCALL_COUNT];
+    bool installed;
+
+    unsigned long long total() const
+    {
+        unsigned long long sum = 0;
+        for (int i = 0; i < GLCALL_COUNT; i++)
+            sum += calls[i];
+        return sum;
+    }
+    unsigned long long drawCalls() const
+    {
+        return calls[GLCALL_glDrawElements] + calls[GLCALL_glDrawArrays];
+    }
+};
+
+// the render thread's counters, the ones the profiler and frametime.hpp read
+inline GLCallCounts &glCallCounts()
+{
+    static GLCallCounts counts = {};
+    return counts;
+}
+
+/*
+    The counters the calling thread bumps. Another thread with its own context (the loader in loader.hpp)
+    points this at counters of its own, so the counts stay single-writer and don't need to be atomic,
+    and its uploads don't show up as the render thread's.
+*/
+inline GLCallCounts *&threadGLCallCounts()
+{
+    static thread_local GLCallCounts *counts = 0;
+    return counts;
+}
+
+inline const char *glCallName(int slot)
+{
+    static const char *names[] = {
+#define GLSTATS_NAME(name) #name,
+        GLSTATS_FUNCTIONS(GLSTATS_NAME)
+#undef GLSTATS_NAME
+    };
+    return names[slot];
+}
+
+/*
+    One trampoline per function. Slot keeps the instantiations apart, R and Args are deduced
+    from the GLAD pointer type so the trampoline has exactly the driver's signature.
+*/
+template <int Slot, typename R, typename... Args>
+struct CountedGLCall {
+    static R (APIENTRYP real)(Args...);
+    static R APIENTRY call(Args... args)
+    {
+        GLCallCounts *counts = threadGLCallCounts();
+        (counts ? *counts : glCallCounts()).calls[Slot]++;
+        return real(args...);
+    }
+};
+
+template <int Slot, typename R, typename... Args>
+R (APIENTRYP CountedGLCall<Slot, R, Args...>::real)(Args...) = NULL;
+
+template <int Slot, typename R, typename... Args>
+void hookGLCall(R (APIENTRYP &pointer)(Args...))
+{
+    if (pointer == NULL || pointer == &CountedGLCall<Slot, R, Args...>::call)
+        return;
+    CountedGLCall<Slot, R, Args...>::real = pointer;
+    pointer = &CountedGLCall<Slot, R, Args...>::call;
+}
+
+// Call once after gladLoadGLLoader, with the context current.
+inline void installGLCallCounters()
+{
+#define GLSTATS_HOOK(name) hookGLCall<GLCALL_##name>(glad_##name);
+    GLSTATS_FUNCTIONS(GLSTATS_HOOK)
+#undef GLSTATS_HOOK
+    glCallCounts().installed = true;
+}
+
+inline void resetGLCallCounters()
+{
+    for (int i = 0; i < GLCALL_COUNT; i++)
+        glCallCounts().calls[i] = 0;
+}
+
+inline void printGLCallCounters(std::ostream &out)
+{
+    for (int i = 0; i < GLCALL_COUNT; i++)
+        if (glCallCounts().calls[i] > 0)
+            out << glCallName(i) << ": " << glCallCounts().calls[i] << std::endl;
+}
+
+/*
+    GL_TIME_ELAPSED queries, one per pass. Queries can't nest, so passes are timed one after
+    another. results() blocks until the GPU is done with the frame, which is fine for benchmarks
+    but not for the interactive loop.
+*/
+class PassTimer {
+public:
+    unsigned int queries[8];
+    int count;
+    bool active[8];
+
+    PassTimer() : count(0) {}
+
+    void init(int passes)
+    {
+        count = passes;
+        glGenQueries(count, queries);
+        for (int i = 0; i < count; i++)
+            active[i] = false;
+    }
+    void release()
+    {
+        if (count > 0)
+            glDeleteQueries(count, queries);
+        count = 0;
+    }
+    void begin(int pass)
+    {
+        glBeginQuery(GL_TIME_ELAPSED, queries[pass]);
+        active[pass] = true;
+    }
+    // only a pass begin() started has a query to end, ending another would be a GL error
+    void end(int pass)
+    {
+        if (active[pass])
+            glEndQuery(GL_TIME_ELAPSED);
+    }
+    // milliseconds the GPU spent on the pass, 0 if it wasn't timed this frame
+    double milliseconds(int pass)
+    {
+        if (!active[pass])
+            return 0.0;
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(queries[pass], GL_QUERY_RESULT, &nanoseconds);
+        active[pass] = false;
+        return nanoseconds / 1.0e6;
+    }
+};
+
+#endif /* glstats_hpp */
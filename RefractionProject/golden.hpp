@@ -0,0 +1,337 @@
+//
+//  golden.hpp
+//  RefractionProject
+//
+//  Golden-image check. Renders a fixed set of scenes headless with every render mode and checks two things:
+//
+//    exact   every mode against the ray tracer's image of the same scene (raytrace.hpp), the exact answer.
+//            The reference mode (two-pass, the paper's method) sets the bar: another mode fails if its PSNR
+//            or SSIM there is more than the tolerance below two-pass'. A new approximation may look different
+//            from two-pass, but not be further from the truth.
+//    stored  every render against its golden in <golden-dir>, rendered with llvmpipe (--software) and
+//            committed. Catches any mode, the reference too, drifting between builds. A missing golden fails.
+//
+//  RefractionProject --golden [--golden-update] [--golden-dir golden] [--golden-size 400x300] [--software]
+//
+//  --golden-update writes the current renders as the new goldens. Renders and diff heatmaps of
+//  every run go to <golden-dir>/out/.
+//
+//  Tolerances live in <golden-dir>/tolerances.txt, one rule per line:
+//      exact   scene  mode  psnr_loss  ssim_loss
+//      stored  scene  mode  min_psnr   min_ssim   max_abs
+//  with * matching any scene or mode. The most specific matching rule of the kind wins.
+//
+
+#ifndef golden_hpp
+#define golden_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "benchmark.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "imagediff.hpp"
+#include "procedural.hpp"
+#include "raytrace.hpp"
+#include "renderer.hpp"
+#include "sdf.hpp"
+#include "thickness.hpp"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct GoldenScene {
+    const char *name;
+    ProceduralShape shape;
+    unsigned int triangles;
+    int instances;
+    const char *skybox;
+};
+
+// The scenes every mode is checked on. Procedural meshes, so they don't depend on model files.
+inline const vector<GoldenScene> &goldenScenes()
+{
+    static const vector<GoldenScene> scenes = {
+        { "sphere-sky",   SHAPE_SPHERE, 20000, 1, "skybox/sky" },
+        { "torus-space",  SHAPE_TORUS,  20000, 1, "skybox/space" },
+        { "blob-space2",  SHAPE_BLOB,   50000, 1, "skybox/space2" },
+        { "blobs-sky",    SHAPE_BLOB,   20000, 4, "skybox/sky" },
+    };
+    return scenes;
+}
+
+/*
+    A way of rendering the refraction that should look (almost) the same as the reference.
+    setup() switches the renderer into the mode before the scene is drawn and restore() puts it back.
+    New optimizations add themselves here and get a row in tolerances.txt.
+*/
+struct GoldenMode {
+    const char *name;
+    void (*setup)(Renderer &renderer);
+    void (*restore)(Renderer &renderer);
+};
+
+inline void noModeChange(Renderer &) {}
+inline void useBakedThickness(Renderer &renderer) { renderer.thicknessMode = THICKNESS_BAKED; }
+inline void useConvexThickness(Renderer &renderer) { renderer.thicknessMode = THICKNESS_BAKED_CONVEX; }
+inline void useDepthThickness(Renderer &renderer) { renderer.thicknessMode = THICKNESS_DEPTH; }
+inline void useSdfThickness(Renderer &renderer) { renderer.thicknessMode = THICKNESS_SDF; }
+
+inline const vector<GoldenMode> &goldenModes()
+{
+    static const vector<GoldenMode> modes = {
+        { "two-pass", noModeChange, noModeChange }, // front + back normals, the paper's method
+        { "baked", useBakedThickness, useDepthThickness }, // baked thickness + back normals
+        { "convex", useConvexThickness, useDepthThickness }, // baked thickness, no normal passes
+        { "sdf", useSdfThickness, useDepthThickness }, // sphere-traced 64^3 distance field, no normal passes
+    };
+    return modes;
+}
+
+/*
+    exact: psnr and ssim are how much a mode may lose against two-pass, both measured against the ray-traced
+    image (maxAbs isn't used, every mode misses the silhouettes by a lot). stored: psnr and ssim are minimums
+    and maxAbs the largest channel difference allowed.
+*/
+struct GoldenTolerance {
+    string kind, scene, mode;
+    double psnr, ssim;
+    int maxAbs;
+};
+
+// Reads tolerances.txt. Missing file = just the default rules.
+inline vector<GoldenTolerance> loadGoldenTolerances(const string &path)
+{
+    vector<GoldenTolerance> rules;
+    GoldenTolerance exact = { "exact", "*", "*", 1.0, 0.01, 255 };
+    GoldenTolerance stored = { "stored", "*", "*", 45.0, 0.99, 8 };
+    rules.push_back(exact);
+    rules.push_back(stored);
+    ifstream file(path.c_str());
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        istringstream fields(line);
+        GoldenTolerance rule;
+        rule.maxAbs = 255;
+        bool ok = (bool)(fields >> rule.kind >> rule.scene >> rule.mode >> rule.psnr >> rule.ssim);
+        if (ok && rule.kind == "stored")
+            ok = (bool)(fields >> rule.maxAbs);
+        if (ok && (rule.kind == "exact" || rule.kind == "stored"))
+            rules.push_back(rule);
+        else
+            cout << "ERROR::GOLDEN:: Bad tolerance line in " << path << ": " << line << endl;
+    }
+    return rules;
+}
+
+inline GoldenTolerance goldenTolerance(const vector<GoldenTolerance> &rules, const string &kind, const string &scene,
+                                       const string &mode)
+{
+    GoldenTolerance best = rules[0];
+    int bestScore = -1;
+    for (size_t i = 0; i < rules.size(); i++) {
+        bool sceneMatches = rules[i].scene == scene, modeMatches = rules[i].mode == mode;
+        if (rules[i].kind != kind || (!sceneMatches && rules[i].scene != "*") || (!modeMatches && rules[i].mode != "*"))
+            continue;
+        // an exact scene counts more than an exact mode, later lines win ties
+        int score = (sceneMatches ? 2 : 0) + (modeMatches ? 1 : 0);
+        if (score >= bestScore) {
+            best = rules[i];
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+inline void makeDirectory(const string &path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+// The camera used by the benchmarks, looking at scene's instances (models)
+inline glm::mat4 goldenView(const GoldenScene &scene, const glm::mat4 &projection, vector<glm::mat4> &models)
+{
+    float distance = instanceGrid(scene.instances, projection, models);
+    return glm::lookAt(glm::vec3(0.0f, 0.0f, distance), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// Renders one scene with that camera and reads it back
+inline void renderGoldenScene(Renderer &renderer, const GoldenScene &scene, Model &object, Image &image)
+{
+    RenderTarget output = createRenderTarget(renderer.width, renderer.height, "golden output");
+    vector<glm::mat4> models;
+    glm::mat4 view = goldenView(scene, renderer.projection, models);
+    renderer.renderFrame(object, models, view, glm::vec3(glm::inverse(view)[3]), output.framebuffer);
+    image.width = output.width;
+    image.height = output.height;
+    readRenderTarget(output, image.pixels);
+    deleteRenderTarget(output);
+}
+
+// The same scene and camera through the ray tracer, the exact answer every mode is measured against
+inline void traceGoldenScene(const GoldenScene &scene, Model &object, int width, int height, Image &image)
+{
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(scene.skybox)))
+        return;
+    RayTracer tracer(width, height, &cubemap);
+    vector<glm::mat4> models;
+    glm::mat4 view = goldenView(scene, tracer.projection, models);
+    TraceScene traced;
+    buildTraceScene(meshViews(object), models, traced, tracer.threads);
+    tracer.render(traced, view, image);
+}
+
+/*
+    Compares rendered with expected and writes the diff heatmap. False (and a FAILED row) if the sizes
+    differ and there's nothing to compare.
+*/
+inline bool diffGoldenImage(const Image &expected, const Image &rendered, const string &scene, const string &mode,
+                            const string &against, const string &heatmapPath, ImageDiff &diff, double &compareSeconds)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool sameSize = compareImages(expected, rendered, diff);
+    compareSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!sameSize) {
+        cout << left << setw(14) << scene << setw(12) << mode << setw(10) << against << " FAILED: expected " << expected.width << "x"
+             << expected.height << ", render is " << rendered.width << "x" << rendered.height << endl;
+        return false;
+    }
+    writePPM(heatmapPath, diffHeatmap(expected, rendered));
+    return true;
+}
+
+inline void printGoldenRow(const string &scene, const string &mode, const string &against, const ImageDiff &diff, const string &result)
+{
+    cout << left << setw(14) << scene << setw(12) << mode << setw(10) << against << right << fixed << setprecision(2) << setw(9)
+         << diff.psnr << setprecision(4) << setw(8) << diff.ssim << setw(8) << diff.maxAbs << "  " << result << endl;
+    cout.unsetf(ios::floatfield);
+}
+
+inline int runGoldenTests(int argc, char *argv[])
+{
+    string directory = argValue(argc, argv, "--golden-dir", "golden");
+    bool update = hasArg(argc, argv, "--golden-update");
+    int width = 400, height = 300;
+    sscanf(argValue(argc, argv, "--golden-size", "400x300").c_str(), "%dx%d", &width, &height);
+
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    makeDirectory(directory);
+    makeDirectory(directory + "/out");
+    vector<GoldenTolerance> tolerances = loadGoldenTolerances(directory + "/tolerances.txt");
+
+    Renderer renderer(width, height, 0);
+    int failures = 0, missing = 0, checked = 0;
+    double compareSeconds = 0.0;
+    cout << left << setw(14) << "scene" << setw(12) << "mode" << setw(10) << "against" << right << setw(9) << "PSNR" << setw(8)
+         << "SSIM" << setw(8) << "max" << "  result" << endl;
+    for (const GoldenScene &scene : goldenScenes()) {
+        vector<Mesh> meshes;
+        meshes.push_back(generateShape(scene.shape, scene.triangles));
+        Model object(std::move(meshes));
+        loadOrBakeThickness(object, false);
+        SdfGrid sdf = loadOrBakeSdf(object, false, 64);
+        unsigned int sdfTexture = createSdfTexture(sdf, scene.name);
+        useSdf(renderer, sdfTexture, sdf);
+        renderer.cubemapTexture = loadCubemap(skyboxFaces(scene.skybox));
+        Image exact;
+        traceGoldenScene(scene, object, width, height, exact);
+        writePPM(directory + "/out/" + scene.name + "_exact.ppm", exact);
+
+        // the first mode is the reference, how close it gets to the exact image is the bar for the others
+        const vector<GoldenMode> &modes = goldenModes();
+        ImageDiff reference;
+        for (size_t m = 0; m < modes.size(); m++) {
+            const GoldenMode &mode = modes[m];
+            string name = string(scene.name) + "_" + mode.name;
+            Image rendered;
+            mode.setup(renderer);
+            renderGoldenScene(renderer, scene, object, rendered);
+            mode.restore(renderer);
+            writePPM(directory + "/out/" + name + ".ppm", rendered);
+
+            ImageDiff diff;
+            checked++;
+            if (!diffGoldenImage(exact, rendered, scene.name, mode.name, "exact", directory + "/out/" + name + "_diff.ppm", diff,
+                                 compareSeconds)) {
+                failures++;
+            } else if (m == 0) {
+                reference = diff;
+                printGoldenRow(scene.name, mode.name, "exact", diff, "reference");
+            } else {
+                GoldenTolerance tolerance = goldenTolerance(tolerances, "exact", scene.name, mode.name);
+                bool passed = diff.psnr >= reference.psnr - tolerance.psnr && diff.ssim >= reference.ssim - tolerance.ssim;
+                printGoldenRow(scene.name, mode.name, "exact", diff, passed ? "ok" : "FAILED");
+                if (!passed)
+                    failures++;
+            }
+
+            string goldenPath = directory + "/" + name + ".ppm";
+            if (update) {
+                if (!writePPM(goldenPath, rendered))
+                    cout << "ERROR::GOLDEN:: Could not write " << goldenPath << endl;
+                cout << left << setw(26) << name << " golden updated" << endl;
+                continue;
+            }
+            checked++;
+            Image golden;
+            if (!loadImage(goldenPath, golden)) {
+                cout << left << setw(14) << scene.name << setw(12) << mode.name << setw(10) << "golden" << " FAILED: no " << goldenPath
+                     << endl;
+                missing++;
+                failures++;
+                continue;
+            }
+            GoldenTolerance tolerance = goldenTolerance(tolerances, "stored", scene.name, mode.name);
+            if (!diffGoldenImage(golden, rendered, scene.name, mode.name, "golden", directory + "/out/" + name + "_golden_diff.ppm",
+                                 diff, compareSeconds)) {
+                failures++;
+                continue;
+            }
+            bool passed = diff.psnr >= tolerance.psnr && diff.ssim >= tolerance.ssim && diff.maxAbs <= tolerance.maxAbs;
+            printGoldenRow(scene.name, mode.name, "golden", diff, passed ? "ok" : "FAILED");
+            if (!passed)
+                failures++;
+        }
+        object.release();
+        deleteSdfTexture(sdfTexture);
+        memoryRegistry().release(MEM_TEXTURE, renderer.cubemapTexture);
+        glDeleteTextures(1, &renderer.cubemapTexture);
+    }
+
+    if (checked > 0)
+        cout << "Compared " << checked << " images in " << compareSeconds * 1000.0 << " ms" << endl;
+    if (missing > 0)
+        cout << missing << " render(s) have no stored golden in " << directory << " (--golden-update stores them)" << endl;
+    renderer.release();
+    destroyHeadlessContext(window);
+    if (failures > 0)
+        cout << failures << " golden image check(s) FAILED, see " << directory << "/out/*_diff.ppm" << endl;
+    return failures > 0 ? 1 : 0;
+}
+
+#endif /* golden_hpp */
@@ -0,0 +1,559 @@
+//
+//  hdrenv.hpp
+//  RefractionProject
+//
+//  HDR light probes: an equirectangular Radiance .hdr (stbi_loadf) resampled to a float16 cubemap, with
+//  box mips and, for rough glass, the GGX prefilter of prefilter.hpp done in HDR. The shaders tone map
+//  it with an exponential curve and --exposure, then encode to sRGB (the LDR skyboxes are already sRGB).
+//  OpenEXR needs a library we don't have here, so .exr files are refused with an error.
+//
+//  The resampling is bilinear. A probe much bigger than the cube would alias, so it is first box-filtered
+//  down while its width is more than twice the four faces around the horizon (an 8k probe for a
+//  512 cube: 4096 wide). Then every row of every face is split across the workers and done four
+//  texels at a time: the directions, an atan2 polynomial (under 3e-6 radians off, 0.003 of a texel of
+//  an 8k probe, the max error --bench-hdr measures) and the bilinear weights in vfloat4 lanes, and the
+//  four taps of each texel as one vfloat4 of RGBA each.
+//
+//  The cube (and the prefilter) are cached as texture packs (texpack.hpp) next to the probe,
+//  probe.hdr.cube512.tpk and probe.hdr.ggx128x128.tpk, and mapped the next time.
+//
+//  RefractionProject --hdr probe.hdr [--hdr-size 512] [--exposure 1] [--roughness 0.3] [--no-hdr-cache]
+//  RefractionProject --bench-hdr [--hdr probe.hdr] [--sizes 256,512,1024] [--threads N] [--software]
+//    (without --hdr it makes an 8192x4096 probe with a sun in it to time)
+//
+
+#ifndef hdrenv_hpp
+#define hdrenv_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "prefilter.hpp"
+#include "simd.hpp"
+#include "texcompress.hpp"
+#include "texpack.hpp"
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// An equirectangular probe, linear RGBA floats (alpha is padding for vfloat4), row 0 looks up (+y)
+struct EquirectImage {
+    int width, height;
+    vector<float> rgba;
+
+    EquirectImage() : width(0), height(0) {}
+    bool empty() const { return rgba.empty(); }
+};
+
+// atan2 with an eleventh degree polynomial on [0, 1] (under 3e-6 radians off, 0.003 of a texel of an 8k
+// probe), four at a time
+inline vfloat4 atan2Lanes(vfloat4 y, vfloat4 x)
+{
+    vfloat4 ax = abs(x), ay = abs(y);
+    vfloat4 a = min(ax, ay) / max(max(ax, ay), vfloat4(1e-30f));
+    vfloat4 s = a * a;
+    vfloat4 r = vfloat4(-0.0117212f) * s + vfloat4(0.05265332f);
+    r = r * s - vfloat4(0.11643287f);
+    r = r * s + vfloat4(0.19354346f);
+    r = r * s - vfloat4(0.33262347f);
+    r = (r * s + vfloat4(0.99997726f)) * a;
+    r = select(ay > ax, vfloat4(1.57079637f) - r, r);
+    r = select(x < vfloat4(0.0f), vfloat4(3.14159274f) - r, r);
+    return select(y < vfloat4(0.0f), vfloat4(0.0f) - r, r);
+}
+
+/*
+    Reads the probe, box-filtered down by the power of two that keeps it no wider than maxWidth (0 = as
+    it is). False, with a message, if it can't be read.
+*/
+inline bool loadEquirect(const string &path, int maxWidth, EquirectImage &image, int threads = 0)
+{
+    string extension = path.substr(std::min(path.find_last_of('.'), path.size()));
+    if (extension == ".exr" || extension == ".EXR") {
+        cout << "ERROR::HDRENV:: " << path << ": OpenEXR isn't supported, convert it to Radiance .hdr" << endl;
+        return false;
+    }
+    int width, height, channels;
+    float *pixels = stbi_loadf(path.c_str(), &width, &height, &channels, 3);
+    if (!pixels) {
+        cout << "ERROR::HDRENV:: could not load " << path << ": " << stbi_failure_reason() << endl;
+        return false;
+    }
+    int factor = 1;
+    while (maxWidth > 0 && width / factor > maxWidth && height / (factor * 2) > 0)
+        factor *= 2;
+    image.width = width / factor;
+    image.height = height / factor;
+    image.rgba.assign((size_t)image.width * image.height * 4, 1.0f);
+    float scale = 1.0f / (factor * factor);
+    parallelFor(image.height, threads, [&](int y, int) {
+        for (int x = 0; x < image.width; x++) {
+            float sum[3] = { 0.0f, 0.0f, 0.0f };
+            for (int dy = 0; dy < factor; dy++) {
+                const float *row = pixels + ((size_t)(y * factor + dy) * width + (size_t)x * factor) * 3;
+                for (int dx = 0; dx < factor * 3; dx += 3)
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += row[dx + c];
+            }
+            for (int c = 0; c < 3; c++)
+                image.rgba[((size_t)y * image.width + x) * 4 + c] = sum[c] * scale;
+        }
+    });
+    stbi_image_free(pixels);
+    return true;
+}
+
+// the widest the probe needs to be for a size x size cube: four faces around the horizon, twice over
+inline int equirectWidthFor(int size) { return 8 * size; }
+
+// cube sizes are powers of two (boxMipsHDR halves every level exactly); others are rounded up, with a note
+inline int hdrCubeSize(int requested)
+{
+    int size = 1;
+    while (size < requested && size < 8192)
+        size *= 2;
+    if (size != requested)
+        cout << "HDR cube size " << requested << " isn't a power of two up to 8192, using " << size << endl;
+    return size;
+}
+
+// the equirect position (in texels, texel centers at .5) of directions, u from atan2(z, x) and v from the elevation
+inline void equirectCoords(vfloat4 dx, vfloat4 dy, vfloat4 dz, int width, int height, vfloat4 &u, vfloat4 &v)
+{
+    const float inversePi = 0.318309886f;
+    vfloat4 horizontal = sqrt(dx * dx + dz * dz);
+    u = (vfloat4(0.5f) + atan2Lanes(dz, dx) * vfloat4(0.5f * inversePi)) * vfloat4((float)width);
+    v = (vfloat4(0.5f) - atan2Lanes(dy, horizontal) * vfloat4(inversePi)) * vfloat4((float)height);
+}
+
+/*
+    Resamples the probe to a size x size cube: cube.levels[face][0], RGBA floats. Four texels of a row
+    at a time, the rows of all faces split across the workers.
+*/
+inline void resampleEquirect(const EquirectImage &image, int size, LinearSky &cube, int threads = 0)
+{
+    cube.size = size;
+    for (int face = 0; face < 6; face++)
+        cube.levels[face].assign(1, vector<float>((size_t)size * size * 4));
+    int width = image.width, height = image.height;
+    parallelFor(6 * size, threads, [&](int row, int) {
+        int face = row / size, y = row % size;
+        float *out = &cube.levels[face][0][(size_t)y * size * 4];
+        vfloat4 tc(2.0f * (y + 0.5f) / size - 1.0f);
+        for (int x = 0; x < size; x += 4) {
+            vfloat4 sc = vfloat4(2.0f * (x + 0.5f) / size - 1.0f) + vfloat4(0.0f, 2.0f, 4.0f, 6.0f) * vfloat4(1.0f / size);
+            // cubeFaceDirection, four at a time
+            vfloat4 one(1.0f), zero(0.0f), dx, dy, dz;
+            switch (face) {
+            case 0: dx = one; dy = zero - tc; dz = zero - sc; break;
+            case 1: dx = zero - one; dy = zero - tc; dz = sc; break;
+            case 2: dx = sc; dy = one; dz = tc; break;
+            case 3: dx = sc; dy = zero - one; dz = zero - tc; break;
+            case 4: dx = sc; dy = zero - tc; dz = one; break;
+            default: dx = zero - sc; dy = zero - tc; dz = zero - one; break;
+            }
+            vfloat4 u, v;
+            equirectCoords(dx, dy, dz, width, height, u, v);
+            u = u - vfloat4(0.5f);
+            v = min(max(v - vfloat4(0.5f), vfloat4(0.0f)), vfloat4((float)(height - 1)));
+            vfloat4 fu = floor(u), fv = floor(v);
+            float wu[4], wv[4], iu[4], iv[4];
+            (u - fu).store(wu);
+            (v - fv).store(wv);
+            fu.store(iu);
+            fv.store(iv);
+            for (int lane = 0; lane < 4 && x + lane < size; lane++) {
+                // wrap around horizontally, clamp at the poles
+                int x0 = ((int)iu[lane] % width + width) % width, x1 = (x0 + 1) % width;
+                int y0 = (int)iv[lane], y1 = std::min(y0 + 1, height - 1);
+                const float *r0 = &image.rgba[(size_t)y0 * width * 4], *r1 = &image.rgba[(size_t)y1 * width * 4];
+                vfloat4 a = vfloat4::load(r0 + x0 * 4), b = vfloat4::load(r0 + x1 * 4);
+                vfloat4 c = vfloat4::load(r1 + x0 * 4), d = vfloat4::load(r1 + x1 * 4);
+                vfloat4 top = a + (b - a) * vfloat4(wu[lane]), bottom = c + (d - c) * vfloat4(wu[lane]);
+                (top + (bottom - top) * vfloat4(wv[lane])).store(out + (size_t)(x + lane) * 4);
+            }
+        }
+    });
+}
+
+// how far (in probe texels) the kernel's coordinates for a cube texel are from std::atan2's
+inline double equirectCoordError(int width, int height, int face, int size, int x, int y)
+{
+    glm::vec3 dir = cubeFaceDirection(face, (x + 0.5f) / size, (y + 0.5f) / size);
+    double u = (0.5 + std::atan2((double)dir.z, (double)dir.x) / (2.0 * M_PI)) * width;
+    double v = (0.5 - std::atan2((double)dir.y, std::sqrt((double)dir.x * dir.x + (double)dir.z * dir.z)) / M_PI) * height;
+    vfloat4 ku, kv;
+    equirectCoords(vfloat4(dir.x), vfloat4(dir.y), vfloat4(dir.z), width, height, ku, kv);
+    float lanes[4];
+    ku.store(lanes);
+    double du = std::fabs(lanes[0] - u);
+    du = std::min(du, std::fabs(width - du)); // the seam is the same place
+    kv.store(lanes);
+    return std::max(du, std::fabs(lanes[0] - v));
+}
+
+// box mips of every face down to 1x1 (the size is a power of two, so no level reads past an edge)
+inline void boxMipsHDR(LinearSky &cube, int threads = 0)
+{
+    int levels = mipLevelCount(cube.size, cube.size);
+    for (int level = 1; level < levels; level++) {
+        int n = std::max(cube.size >> level, 1), previous = std::max(cube.size >> (level - 1), 1);
+        for (int face = 0; face < 6; face++)
+            cube.levels[face].push_back(vector<float>((size_t)n * n * 4));
+        parallelFor(6 * n, threads, [&](int row, int) {
+            int face = row / n, y = row % n;
+            const float *source = cube.levels[face][level - 1].data();
+            float *out = &cube.levels[face][level][(size_t)y * n * 4];
+            int y0 = std::min(2 * y, previous - 1), y1 = std::min(2 * y + 1, previous - 1);
+            for (int x = 0; x < n; x++) {
+                int x0 = std::min(2 * x, previous - 1), x1 = std::min(2 * x + 1, previous - 1);
+                vfloat4 sum = vfloat4::load(source + ((size_t)y0 * previous + x0) * 4) + vfloat4::load(source + ((size_t)y0 * previous + x1) * 4) +
+                              vfloat4::load(source + ((size_t)y1 * previous + x0) * 4) + vfloat4::load(source + ((size_t)y1 * previous + x1) * 4);
+                (sum * vfloat4(0.25f)).store(out + (size_t)x * 4);
+            }
+        });
+    }
+}
+
+// RGBA floats to RGB halves, what GL_RGB16F gets
+inline void halfLevel(const vector<float> &rgba, vector<unsigned short> &rgb)
+{
+    size_t texels = rgba.size() / 4;
+    rgb.resize(texels * 3);
+    for (size_t i = 0; i < texels; i++)
+        for (int c = 0; c < 3; c++)
+            rgb[i * 3 + c] = floatToHalf(std::max(rgba[i * 4 + c], 0.0f));
+}
+
+// A probe on its way to the GPU: float16 levels of the cube and the prefilter, computed or mapped from the cache
+struct HdrEnvironment {
+    string source;
+    int size, prefilterSize;
+    vector<vector<unsigned short> > cube[6], prefiltered[6];
+    TexturePack cubePack, prefilterPack;
+    double loadMs, resampleMs, mipMs, prefilterMs;
+
+    HdrEnvironment() : size(0), prefilterSize(0), loadMs(0.0), resampleMs(0.0), mipMs(0.0), prefilterMs(0.0) {}
+
+    bool empty() const { return cube[0].empty() && cubePack.empty(); }
+    bool hasPrefilter() const { return !prefiltered[0].empty() || !prefilterPack.empty(); }
+    int prefilterLevels() const { return prefilterPack.empty() ? (int)prefiltered[0].size() : prefilterPack.levels; }
+};
+
+inline string hdrCubePath(const string &source, int size)
+{
+    ostringstream path;
+    path << source << ".cube" << size << ".tpk";
+    return path.str();
+}
+
+inline string hdrPrefilterPath(const string &source, int size, int samples)
+{
+    ostringstream path;
+    path << source << ".ggx" << size << "x" << samples << ".tpk";
+    return path.str();
+}
+
+inline bool saveHalfCube(const string &path, const string &source, int size, const vector<vector<unsigned short> > faces[6])
+{
+    vector<const unsigned char *> slices;
+    vector<size_t> sizes;
+    for (int face = 0; face < 6; face++)
+        for (size_t level = 0; level < faces[face].size(); level++) {
+            slices.push_back((const unsigned char *)faces[face][level].data());
+            sizes.push_back(faces[face][level].size() * sizeof(unsigned short));
+        }
+    return writeTexturePack(path, 6, (int)faces[0].size(), size, size, GL_RGB16F, GL_RGB, GL_HALF_FLOAT,
+                            sourceStamp(vector<string>(1, source)), slices, sizes);
+}
+
+inline bool openHalfCube(const string &path, const string &source, TexturePack &pack)
+{
+    if (!openTexturePack(path, sourceStamp(vector<string>(1, source)), pack) || pack.faces != 6 || pack.internalFormat != GL_RGB16F) {
+        pack = TexturePack();
+        return false;
+    }
+    return true;
+}
+
+/*
+    The probe as a size x size float16 cube with mips and, if prefilterSize > 0, its GGX prefilter, from
+    the cache if it's there. Any thread; nothing here touches GL.
+*/
+inline HdrEnvironment loadHdrEnvironment(const string &source, int size, int prefilterSize, int samples, bool cache, int threads = 0)
+{
+    HdrEnvironment environment;
+    environment.source = source;
+    environment.size = size;
+    environment.prefilterSize = prefilterSize;
+    bool cubeCached = cache && openHalfCube(hdrCubePath(source, size), source, environment.cubePack);
+    bool prefilterCached = prefilterSize <= 0 ||
+                           (cache && openHalfCube(hdrPrefilterPath(source, prefilterSize, samples), source, environment.prefilterPack));
+    if (cubeCached && prefilterCached) {
+        cout << "Mapped the " << size << " cube" << (prefilterSize > 0 ? " and its prefilter" : "") << " of " << source << endl;
+        return environment;
+    }
+    auto start = std::chrono::steady_clock::now();
+    EquirectImage image;
+    if (!loadEquirect(source, equirectWidthFor(size), image, threads)) {
+        environment.cubePack = environment.prefilterPack = TexturePack();
+        return environment;
+    }
+    auto loaded = std::chrono::steady_clock::now();
+    environment.loadMs = std::chrono::duration<double, std::milli>(loaded - start).count();
+    LinearSky sky;
+    resampleEquirect(image, size, sky, threads);
+    auto resampled = std::chrono::steady_clock::now();
+    environment.resampleMs = std::chrono::duration<double, std::milli>(resampled - loaded).count();
+    image = EquirectImage();
+    boxMipsHDR(sky, threads);
+    environment.mipMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - resampled).count();
+    if (!cubeCached) {
+        for (int face = 0; face < 6; face++) {
+            environment.cube[face].resize(sky.levels[face].size());
+            for (size_t level = 0; level < sky.levels[face].size(); level++)
+                halfLevel(sky.levels[face][level], environment.cube[face][level]);
+        }
+        if (cache)
+            saveHalfCube(hdrCubePath(source, size), source, size, environment.cube);
+    }
+    if (!prefilterCached) {
+        auto prefilterStart = std::chrono::steady_clock::now();
+        // from the level no bigger than twice the output, like prefilterSky
+        LinearSky from;
+        int first = 0;
+        while (first + 1 < (int)sky.levels[0].size() && (sky.size >> first) > 2 * prefilterSize)
+            first++;
+        from.size = sky.size >> first;
+        for (int face = 0; face < 6; face++)
+            from.levels[face].assign(sky.levels[face].begin() + first, sky.levels[face].end());
+        vector<vector<float> > linear[6];
+        prefilterLinearSky(from, prefilterSize, samples, prefilterLevelCount(prefilterSize), linear, threads);
+        for (int face = 0; face < 6; face++) {
+            environment.prefiltered[face].resize(linear[face].size());
+            for (size_t level = 0; level < linear[face].size(); level++)
+                halfLevel(linear[face][level], environment.prefiltered[face][level]);
+        }
+        environment.prefilterMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - prefilterStart).count();
+        if (cache)
+            saveHalfCube(hdrPrefilterPath(source, prefilterSize, samples), source, prefilterSize, environment.prefiltered);
+    }
+    cout << "Converted " << source << " to a " << size << " float16 cube: load " << fixed << setprecision(1) << environment.loadMs << " ms, resample "
+         << environment.resampleMs << " ms, mips " << environment.mipMs << " ms";
+    if (!prefilterCached)
+        cout << ", prefilter " << environment.prefilterMs << " ms";
+    cout << endl;
+    cout.unsetf(ios::floatfield);
+    return environment;
+}
+
+// a GL_RGB16F cubemap of the levels (or the mapped pack), main thread; frees the CPU copy
+inline unsigned int createHalfCubemap(vector<vector<unsigned short> > faces[6], TexturePack &pack, int size, const string &owner)
+{
+    int levels = pack.empty() ? (int)faces[0].size() : pack.levels;
+    if (!pack.empty())
+        size = pack.width;
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int face = 0; face < 6; face++) {
+        if (!pack.empty()) {
+            uploadTexturePack(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, pack, face);
+            continue;
+        }
+        for (int level = 0; level < levels; level++) {
+            int n = std::max(size >> level, 1);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB16F, n, n, 0, GL_RGB, GL_HALF_FLOAT, faces[face][level].data());
+        }
+        faces[face].clear();
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    pack = TexturePack();
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    memoryRegistry().track(MEM_TEXTURE, texture, textureBytes(GL_RGB16F, size, size, 6, levels > 1),
+                           describeImage(GL_RGB16F, size, size, levels > 1 ? " cubemap +mips" : " cubemap"), owner);
+    return texture;
+}
+
+// the environment's cubemap, and its prefilter into prefilter (0 without one) with its last level
+inline unsigned int uploadHdrEnvironment(HdrEnvironment &environment, unsigned int &prefilter, float &prefilterMaxLod)
+{
+    prefilter = 0;
+    prefilterMaxLod = 0.0f;
+    if (environment.hasPrefilter()) {
+        prefilterMaxLod = (float)(environment.prefilterLevels() - 1);
+        prefilter = createHalfCubemap(environment.prefiltered, environment.prefilterPack, environment.prefilterSize,
+                                      environment.source + " prefilter");
+    }
+    return createHalfCubemap(environment.cube, environment.cubePack, environment.size, environment.source);
+}
+
+// an 8-bit tone mapped strip of one row of the cube's faces, like the shaders show it (exposure, sRGB)
+inline void writeToneMappedFaces(const LinearSky &cube, float exposure, const string &path)
+{
+    int n = cube.size;
+    Image strip(n * 6, n);
+    for (int face = 0; face < 6; face++)
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++)
+                for (int c = 0; c < 3; c++) {
+                    float value = cube.levels[face][0][((size_t)y * n + x) * 4 + c];
+                    float mapped = std::pow(1.0f - std::exp(-value * exposure), 1.0f / 2.2f);
+                    strip.row(y)[(face * n + x) * 3 + c] = (unsigned char)(std::min(std::max(mapped, 0.0f), 1.0f) * 255.0f + 0.5f);
+                }
+    writePPM(path, strip);
+}
+
+// a probe to time against: a sky gradient, a bright sun and some bands so a wrong resample shows
+inline void syntheticProbe(int width, int height, EquirectImage &image)
+{
+    image.width = width;
+    image.height = height;
+    image.rgba.assign((size_t)width * height * 4, 1.0f);
+    glm::vec3 sun = glm::normalize(glm::vec3(0.4f, 0.5f, 0.6f));
+    parallelFor(height, 0, [&](int y, int) {
+        float elevation = (0.5f - (y + 0.5f) / height) * 3.14159265f;
+        for (int x = 0; x < width; x++) {
+            float azimuth = ((x + 0.5f) / width - 0.5f) * 2.0f * 3.14159265f;
+            glm::vec3 dir(std::cos(elevation) * std::cos(azimuth), std::sin(elevation), std::cos(elevation) * std::sin(azimuth));
+            glm::vec3 sky = elevation > 0.0f ? glm::mix(glm::vec3(0.9f, 0.95f, 1.0f), glm::vec3(0.2f, 0.4f, 0.9f), dir.y)
+                                             : glm::vec3(0.3f, 0.25f, 0.2f);
+            sky *= 0.75f + 0.25f * (std::sin(azimuth * 12.0f) > 0.0f ? 1.0f : 0.0f);
+            if (glm::dot(dir, sun) > 0.9995f)
+                sky = glm::vec3(5000.0f, 4500.0f, 4000.0f);
+            float *p = &image.rgba[((size_t)y * width + x) * 4];
+            p[0] = sky.r;
+            p[1] = sky.g;
+            p[2] = sky.b;
+        }
+    });
+}
+
+/*
+    Times the conversion of a probe (the one given, or a synthetic 8k one) at a few cube sizes: the
+    resample, the mips and the upload, and how far the SIMD kernel's lookups land from std::atan2's, in probe texels.
+*/
+inline int runHdrBenchmark(int argc, char *argv[])
+{
+    string source = argValue(argc, argv, "--hdr", "");
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    string out = argValue(argc, argv, "--out", "");
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    EquirectImage full;
+    auto start = std::chrono::steady_clock::now();
+    if (source.empty())
+        syntheticProbe(8192, 4096, full);
+    else if (!loadEquirect(source, 0, full, threads)) {
+        destroyHeadlessContext(window);
+        return -1;
+    }
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "HDR probe " << (source.empty() ? "synthetic" : source) << ", " << full.width << "x" << full.height << ", "
+         << (source.empty() ? "made" : "loaded") << " in " << fixed << setprecision(1) << loadMs << " ms, "
+         << (threads > 0 ? threads : hardwareThreads()) << " threads" << endl;
+    cout << right << setw(6) << "size" << setw(12) << "probe" << setw(12) << "shrink ms" << setw(13) << "resample ms" << setw(12)
+         << "Mtexels/s" << setw(10) << "mips ms" << setw(12) << "upload ms" << setw(14) << "max err px" << endl;
+    string sizeList = argValue(argc, argv, "--sizes", "256,512,1024") + ",";
+    for (size_t begin = 0, comma; (comma = sizeList.find(',', begin)) != string::npos; begin = comma + 1) {
+        int size = atoi(sizeList.substr(begin, comma - begin).c_str());
+        if (size <= 0)
+            continue;
+        size = hdrCubeSize(size);
+        // the same box filter loadEquirect applies, on the image we already have
+        auto shrinkStart = std::chrono::steady_clock::now();
+        EquirectImage shrunk;
+        const EquirectImage *probe = &full;
+        int factor = 1;
+        while (full.width / factor > equirectWidthFor(size))
+            factor *= 2;
+        if (factor > 1) {
+            EquirectImage &image = shrunk;
+            probe = &shrunk;
+            image.width = full.width / factor;
+            image.height = full.height / factor;
+            image.rgba.assign((size_t)image.width * image.height * 4, 1.0f);
+            parallelFor(image.height, threads, [&](int y, int) {
+                for (int x = 0; x < image.width; x++) {
+                    vfloat4 sum(0.0f);
+                    for (int dy = 0; dy < factor; dy++)
+                        for (int dx = 0; dx < factor; dx++)
+                            sum += vfloat4::load(&full.rgba[((size_t)(y * factor + dy) * full.width + x * factor + dx) * 4]);
+                    (sum * vfloat4(1.0f / (factor * factor))).store(&image.rgba[((size_t)y * image.width + x) * 4]);
+                }
+            });
+        }
+        double shrinkMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shrinkStart).count();
+        LinearSky cube;
+        auto resampleStart = std::chrono::steady_clock::now();
+        const EquirectImage &image = *probe;
+        resampleEquirect(image, size, cube, threads);
+        double resampleMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - resampleStart).count();
+        // the kernel's lookups against std::atan2 on a grid of texels
+        double maxError = 0.0;
+        for (int face = 0; face < 6; face++)
+            for (int y = 0; y < size; y += std::max(size / 64, 1))
+                for (int x = 0; x < size; x += std::max(size / 64, 1))
+                    maxError = std::max(maxError, equirectCoordError(image.width, image.height, face, size, x, y));
+        auto mipStart = std::chrono::steady_clock::now();
+        boxMipsHDR(cube, threads);
+        double mipMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - mipStart).count();
+        if (!out.empty()) {
+            ostringstream path;
+            path << out << size << ".ppm";
+            writeToneMappedFaces(cube, 1.0f, path.str());
+        }
+        HdrEnvironment environment;
+        environment.size = size;
+        for (int face = 0; face < 6; face++) {
+            environment.cube[face].resize(cube.levels[face].size());
+            for (size_t level = 0; level < cube.levels[face].size(); level++)
+                halfLevel(cube.levels[face][level], environment.cube[face][level]);
+        }
+        glFinish();
+        auto uploadStart = std::chrono::steady_clock::now();
+        unsigned int prefilter;
+        float maxLod;
+        unsigned int texture = uploadHdrEnvironment(environment, prefilter, maxLod);
+        glFinish();
+        double uploadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - uploadStart).count();
+        memoryRegistry().release(MEM_TEXTURE, texture);
+        glDeleteTextures(1, &texture);
+
+        ostringstream dimensions;
+        dimensions << image.width << "x" << image.height;
+        cout << setw(6) << size << setw(12) << dimensions.str() << setw(12) << shrinkMs << setw(13) << resampleMs << setw(12)
+             << 6.0 * size * size / (resampleMs * 1000.0) << setw(10) << mipMs << setw(12) << uploadMs << setprecision(3) << setw(14)
+             << maxError << setprecision(1) << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* hdrenv_hpp */
@@ -0,0 +1,104 @@
+//
+//  headless.hpp
+//  RefractionProject
+//
+//  Running the renderer without showing a window. We still need a GL context, so GLFW
+//  creates a hidden window and everything is drawn into offscreen RenderTargets instead.
+//
+//  Machines without a GPU: pass softwareGL = true (--software on the command line) and Mesa
+//  will use llvmpipe. On Linux without a display, run under xvfb-run.
+//
+
+#ifndef headless_hpp
+#define headless_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "renderer.hpp"
+#include "glstats.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <iostream>
+
+inline void requestSoftwareGL()
+{
+#ifndef _WIN32
+    // Must happen before glfwInit, Mesa reads these when the first context is created
+    setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+    setenv("GALLIUM_DRIVER", "llvmpipe", 0);
+#endif
+}
+
+// Returns a current GL context with GLAD loaded and the GL call counters installed, or NULL.
+inline GLFWwindow *createHeadlessContext(bool softwareGL)
+{
+    if (softwareGL)
+        requestSoftwareGL();
+    if (!glfwInit())
+        return NULL;
+    // Same version as the windowed viewer so the shaders behave the same
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    // Nothing is drawn to the window itself, so its size doesn't matter
+    GLFWwindow *window = glfwCreateWindow(64, 64, "Headless", NULL, NULL);
+    if (!window)
+    {
+        std::cout << "Failed to create headless GLFW window" << std::endl;
+        glfwTerminate();
+        return NULL;
+    }
+    glfwMakeContextCurrent(window);
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        glfwTerminate();
+        return NULL;
+    }
+    installGLCallCounters();
+    std::cout << "Headless GL: " << glGetString(GL_RENDERER) << " (" << glGetString(GL_VERSION) << ")" << std::endl;
+    return window;
+}
+
+inline void destroyHeadlessContext(GLFWwindow *window)
+{
+    glfwDestroyWindow(window);
+    glfwTerminate();
+}
+
+/*
+    Copies the color texture of a render target to the CPU as tightly packed RGB,
+    top row first (the way image files store them, GL has the bottom row first).
+*/
+inline void readRenderTarget(const RenderTarget &target, std::vector<unsigned char> &rgb)
+{
+    rgb.resize((size_t)target.width * target.height * 3);
+    std::vector<unsigned char> flipped(rgb.size());
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, target.width, target.height, GL_RGB, GL_UNSIGNED_BYTE, &flipped[0]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    size_t row = (size_t)target.width * 3;
+    for (int y = 0; y < target.height; y++)
+        memcpy(&rgb[y * row], &flipped[(target.height - 1 - y) * row], row);
+}
+
+// The same for a GL_RGBA32F target: 4 floats per pixel, top row first
+inline void readRenderTargetFloats(const RenderTarget &target, std::vector<float> &rgba)
+{
+    rgba.resize((size_t)target.width * target.height * 4);
+    std::vector<float> flipped(rgba.size());
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glReadPixels(0, 0, target.width, target.height, GL_RGBA, GL_FLOAT, &flipped[0]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    size_t row = (size_t)target.width * 4;
+    for (int y = 0; y < target.height; y++)
+        memcpy(&rgba[y * row], &flipped[(target.height - 1 - y) * row], row * sizeof(float));
+}
+
+#endif /* headless_hpp */
@@ -0,0 +1,57 @@
+//
+//  image.hpp
+//  RefractionProject
+//
+//  8-bit RGB images on the CPU: rendered frames read back from GL, golden references, diff heatmaps.
+//  Written as binary PPM (no extra library needed), read with stb_image which handles PPM as well
+//  as PNG/JPG.
+//
+
+#ifndef image_hpp
+#define image_hpp
+
+// model.hpp includes stb_image.h with STB_IMAGE_IMPLEMENTATION defined, including it again after that
+// would compile the implementation twice
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct Image {
+    int width, height;
+    std::vector<unsigned char> pixels; // RGB, top row first
+
+    Image() : width(0), height(0) {}
+    Image(int width, int height) : width(width), height(height), pixels((size_t)width * height * 3, 0) {}
+
+    bool empty() const { return pixels.empty(); }
+    unsigned char *row(int y) { return &pixels[(size_t)y * width * 3]; }
+    const unsigned char *row(int y) const { return &pixels[(size_t)y * width * 3]; }
+};
+
+inline bool loadImage(const std::string &path, Image &image)
+{
+    int channels;
+    unsigned char *data = stbi_load(path.c_str(), &image.width, &image.height, &channels, 3);
+    if (!data)
+        return false;
+    image.pixels.assign(data, data + (size_t)image.width * image.height * 3);
+    stbi_image_free(data);
+    return true;
+}
+
+inline bool writePPM(const std::string &path, const Image &image)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+    size_t written = fwrite(&image.pixels[0], 1, image.pixels.size(), file);
+    fclose(file);
+    return written == image.pixels.size();
+}
+
+#endif /* image_hpp */
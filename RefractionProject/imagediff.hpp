@@ -0,0 +1,317 @@
+//
+//  imagediff.hpp
+//  RefractionProject
+//
+//  How different two renders are: PSNR over all RGB channels, SSIM on luma and the largest
+//  per-channel difference, plus a heatmap showing where they differ.
+//
+//  The inner loops use SSE2 on x86 and NEON on ARM (both are always there on the machines we build for),
+//  with a plain C++ version for anything else. A 1600x1200 comparison takes a few milliseconds, so CI can
+//  check thousands of frames; --bench-imagediff measures it.
+//
+//  SSIM uses 8x8 windows with a stride of 4 and no Gaussian weighting, built from 4x4 block sums.
+//  It is not bit-identical to the reference implementation, but it reacts to the same things
+//  (structure, contrast, brightness) and is much cheaper.
+//
+
+#ifndef imagediff_hpp
+#define imagediff_hpp
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define IMAGEDIFF_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGEDIFF_NEON 1
+#endif
+
+#include "image.hpp"
+#include "cmdline.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct ImageDiff {
+    double psnr;        // dB, 100 when the images are identical
+    double ssim;        // 1 = identical
+    int maxAbs;         // largest difference of any channel of any pixel, 0-255
+    double mse;
+};
+
+inline const char *imageDiffInstructionSet()
+{
+#if defined(IMAGEDIFF_SSE2)
+    return "SSE2";
+#elif defined(IMAGEDIFF_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+/*
+    Sum of squared differences and largest absolute difference over count bytes.
+    The SIMD loops keep 32 bit sums per row and only widen to 64 bit at the end: even a full
+    1600x1200 row of 255 differences stays far below 2^31.
+*/
+inline void diffBytes(const unsigned char *a, const unsigned char *b, size_t count, unsigned long long &squares, int &maxAbs)
+{
+    size_t i = 0;
+    unsigned long long sum = 0;
+    int largest = 0;
+#if defined(IMAGEDIFF_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = zero, maxima = zero;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        maxima = _mm_max_epu8(maxima, _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x)));
+        __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+        __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+        sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+    }
+    unsigned int lanes[4];
+    unsigned char bytes[16];
+    _mm_storeu_si128((__m128i *)lanes, sums);
+    _mm_storeu_si128((__m128i *)bytes, maxima);
+    sum = (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    largest = *std::max_element(bytes, bytes + 16);
+#elif defined(IMAGEDIFF_NEON)
+    uint32x4_t sums = vdupq_n_u32(0);
+    uint8x16_t maxima = vdupq_n_u8(0);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        maxima = vmaxq_u8(maxima, d);
+        uint16x8_t low = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+        uint16x8_t high = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+        sums = vpadalq_u16(vpadalq_u16(sums, low), high);
+    }
+    unsigned int lanes[4];
+    unsigned char bytes[16];
+    vst1q_u32(lanes, sums);
+    vst1q_u8(bytes, maxima);
+    sum = (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    largest = *std::max_element(bytes, bytes + 16);
+#endif
+    for (; i < count; i++) {
+        int d = std::abs((int)a[i] - (int)b[i]);
+        sum += d * d;
+        largest = std::max(largest, d);
+    }
+    squares += sum;
+    maxAbs = std::max(maxAbs, largest);
+}
+
+// Integer luma (Rec. 601 weights out of 256), one byte per pixel
+inline void lumaPlane(const Image &image, std::vector<unsigned char> &luma)
+{
+    luma.resize((size_t)image.width * image.height);
+    const unsigned char *rgb = &image.pixels[0];
+    for (size_t i = 0; i < luma.size(); i++, rgb += 3)
+        luma[i] = (unsigned char)((77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8);
+}
+
+// sums over one 4x4 block of luma: x, y, x*x, y*y, x*y
+struct BlockSums {
+    int x, y, xx, yy, xy;
+};
+
+/*
+    4x4 block sums for a strip of 4 rows, blocksWide blocks across.
+    SSE2: 8 pixels of a row at a time widened to 16 bit, _mm_madd_epi16 gives sums of pixel pairs,
+    and adding the lane shifted down by 32 bits joins two pairs into one 4 pixel block.
+*/
+inline void blockSumsStrip(const unsigned char *x, const unsigned char *y, int stride, int blocksWide, BlockSums *out)
+{
+    int block = 0;
+#if defined(IMAGEDIFF_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; block + 2 <= blocksWide; block += 2) {
+        __m128i sx = zero, sy = zero, sxx = zero, syy = zero, sxy = zero;
+        for (int r = 0; r < 4; r++) {
+            __m128i vx = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(x + r * stride + block * 4)), zero);
+            __m128i vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + r * stride + block * 4)), zero);
+            sx = _mm_add_epi32(sx, _mm_madd_epi16(vx, ones));
+            sy = _mm_add_epi32(sy, _mm_madd_epi16(vy, ones));
+            sxx = _mm_add_epi32(sxx, _mm_madd_epi16(vx, vx));
+            syy = _mm_add_epi32(syy, _mm_madd_epi16(vy, vy));
+            sxy = _mm_add_epi32(sxy, _mm_madd_epi16(vx, vy));
+        }
+        int lanes[5][4];
+        _mm_storeu_si128((__m128i *)lanes[0], _mm_add_epi32(sx, _mm_srli_epi64(sx, 32)));
+        _mm_storeu_si128((__m128i *)lanes[1], _mm_add_epi32(sy, _mm_srli_epi64(sy, 32)));
+        _mm_storeu_si128((__m128i *)lanes[2], _mm_add_epi32(sxx, _mm_srli_epi64(sxx, 32)));
+        _mm_storeu_si128((__m128i *)lanes[3], _mm_add_epi32(syy, _mm_srli_epi64(syy, 32)));
+        _mm_storeu_si128((__m128i *)lanes[4], _mm_add_epi32(sxy, _mm_srli_epi64(sxy, 32)));
+        for (int half = 0; half < 2; half++) {
+            BlockSums &sums = out[block + half];
+            sums.x = lanes[0][half * 2];
+            sums.y = lanes[1][half * 2];
+            sums.xx = lanes[2][half * 2];
+            sums.yy = lanes[3][half * 2];
+            sums.xy = lanes[4][half * 2];
+        }
+    }
+#elif defined(IMAGEDIFF_NEON)
+    for (; block + 2 <= blocksWide; block += 2) {
+        uint32x4_t sx = vdupq_n_u32(0), sy = sx, sxx = sx, syy = sx, sxy = sx;
+        for (int r = 0; r < 4; r++) {
+            uint8x8_t vx = vld1_u8(x + r * stride + block * 4);
+            uint8x8_t vy = vld1_u8(y + r * stride + block * 4);
+            sx = vpadalq_u16(sx, vmovl_u8(vx));
+            sy = vpadalq_u16(sy, vmovl_u8(vy));
+            sxx = vpadalq_u16(sxx, vmull_u8(vx, vx));
+            syy = vpadalq_u16(syy, vmull_u8(vy, vy));
+            sxy = vpadalq_u16(sxy, vmull_u8(vx, vy));
+        }
+        // lanes hold pixel pair sums, pairwise add gives the two 4 pixel blocks
+        uint32x2_t bx = vpadd_u32(vget_low_u32(sx), vget_high_u32(sx));
+        uint32x2_t by = vpadd_u32(vget_low_u32(sy), vget_high_u32(sy));
+        uint32x2_t bxx = vpadd_u32(vget_low_u32(sxx), vget_high_u32(sxx));
+        uint32x2_t byy = vpadd_u32(vget_low_u32(syy), vget_high_u32(syy));
+        uint32x2_t bxy = vpadd_u32(vget_low_u32(sxy), vget_high_u32(sxy));
+        out[block].x = vget_lane_u32(bx, 0); out[block + 1].x = vget_lane_u32(bx, 1);
+        out[block].y = vget_lane_u32(by, 0); out[block + 1].y = vget_lane_u32(by, 1);
+        out[block].xx = vget_lane_u32(bxx, 0); out[block + 1].xx = vget_lane_u32(bxx, 1);
+        out[block].yy = vget_lane_u32(byy, 0); out[block + 1].yy = vget_lane_u32(byy, 1);
+        out[block].xy = vget_lane_u32(bxy, 0); out[block + 1].xy = vget_lane_u32(bxy, 1);
+    }
+#endif
+    for (; block < blocksWide; block++) {
+        BlockSums sums = { 0, 0, 0, 0, 0 };
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                int px = x[r * stride + block * 4 + c], py = y[r * stride + block * 4 + c];
+                sums.x += px; sums.y += py;
+                sums.xx += px * px; sums.yy += py * py; sums.xy += px * py;
+            }
+        }
+        out[block] = sums;
+    }
+}
+
+/*
+    Mean SSIM of the luma of two images of the same size. Each window is 2x2 blocks (8x8 pixels),
+    windows step by one block. Pixels past the last whole block on the right/bottom are ignored.
+*/
+inline double lumaSSIM(const std::vector<unsigned char> &x, const std::vector<unsigned char> &y, int width, int height)
+{
+    int blocksWide = width / 4, blocksHigh = height / 4;
+    if (blocksWide < 2 || blocksHigh < 2)
+        return x == y ? 1.0 : 0.0;
+    std::vector<BlockSums> blocks((size_t)blocksWide * blocksHigh);
+    for (int by = 0; by < blocksHigh; by++)
+        blockSumsStrip(&x[(size_t)by * 4 * width], &y[(size_t)by * 4 * width], width, blocksWide, &blocks[(size_t)by * blocksWide]);
+
+    const double C1 = (0.01 * 255) * (0.01 * 255), C2 = (0.03 * 255) * (0.03 * 255);
+    const double n = 64.0;
+    double total = 0.0;
+    for (int by = 0; by + 1 < blocksHigh; by++) {
+        const BlockSums *top = &blocks[(size_t)by * blocksWide];
+        const BlockSums *bottom = top + blocksWide;
+        for (int bx = 0; bx + 1 < blocksWide; bx++) {
+            double sx = top[bx].x + top[bx + 1].x + bottom[bx].x + bottom[bx + 1].x;
+            double sy = top[bx].y + top[bx + 1].y + bottom[bx].y + bottom[bx + 1].y;
+            double sxx = top[bx].xx + top[bx + 1].xx + bottom[bx].xx + bottom[bx + 1].xx;
+            double syy = top[bx].yy + top[bx + 1].yy + bottom[bx].yy + bottom[bx + 1].yy;
+            double sxy = top[bx].xy + top[bx + 1].xy + bottom[bx].xy + bottom[bx + 1].xy;
+            double mx = sx / n, my = sy / n;
+            double vx = sxx / n - mx * mx, vy = syy / n - my * my, cov = sxy / n - mx * my;
+            total += ((2 * mx * my + C1) * (2 * cov + C2)) / ((mx * mx + my * my + C1) * (vx + vy + C2));
+        }
+    }
+    return total / ((double)(blocksWide - 1) * (blocksHigh - 1));
+}
+
+// Compares two images of the same size. Returns false (and leaves result alone) if the sizes differ.
+inline bool compareImages(const Image &a, const Image &b, ImageDiff &result)
+{
+    if (a.width != b.width || a.height != b.height || a.empty())
+        return false;
+    unsigned long long squares = 0;
+    int maxAbs = 0;
+    // one row at a time keeps the SIMD lane sums from overflowing
+    size_t rowBytes = (size_t)a.width * 3;
+    for (int y = 0; y < a.height; y++)
+        diffBytes(a.row(y), b.row(y), rowBytes, squares, maxAbs);
+    result.mse = (double)squares / a.pixels.size();
+    result.maxAbs = maxAbs;
+    result.psnr = result.mse > 0.0 ? std::min(100.0, 10.0 * std::log10(255.0 * 255.0 / result.mse)) : 100.0;
+
+    std::vector<unsigned char> lumaA, lumaB;
+    lumaPlane(a, lumaA);
+    lumaPlane(b, lumaB);
+    result.ssim = lumaSSIM(lumaA, lumaB, a.width, a.height);
+    return true;
+}
+
+/*
+    Heatmap of the per-pixel largest channel difference. Pixels that match are drawn as a dim
+    grey copy of the reference so you can tell where you are; differences go blue -> yellow -> red,
+    reaching red at fullScale.
+*/
+inline Image diffHeatmap(const Image &reference, const Image &test, int fullScale = 32)
+{
+    Image heatmap(reference.width, reference.height);
+    if (reference.width != test.width || reference.height != test.height)
+        return heatmap;
+    for (size_t i = 0; i < reference.pixels.size(); i += 3) {
+        const unsigned char *r = &reference.pixels[i], *t = &test.pixels[i];
+        int d = std::max(std::abs(r[0] - t[0]), std::max(std::abs(r[1] - t[1]), std::abs(r[2] - t[2])));
+        unsigned char *out = &heatmap.pixels[i];
+        if (d == 0) {
+            out[0] = out[1] = out[2] = (unsigned char)((77 * r[0] + 150 * r[1] + 29 * r[2]) >> 10);
+            continue;
+        }
+        float s = std::min(1.0f, (float)d / fullScale);
+        if (s < 0.5f) {
+            out[0] = (unsigned char)(510 * s);
+            out[1] = (unsigned char)(510 * s);
+            out[2] = (unsigned char)(255 * (1.0f - 2 * s));
+        } else {
+            out[0] = 255;
+            out[1] = (unsigned char)(255 * (2.0f - 2 * s));
+            out[2] = 0;
+        }
+    }
+    return heatmap;
+}
+
+/*
+    RefractionProject --bench-imagediff [--frames 500] [--size 1600x1200]
+    Times compareImages() on two synthetic images that differ a little everywhere.
+*/
+inline int runImageDiffBenchmark(int argc, char *argv[])
+{
+    int frames = (int)argNumber(argc, argv, "--frames", 500);
+    int width = 1600, height = 1200;
+    sscanf(argValue(argc, argv, "--size", "1600x1200").c_str(), "%dx%d", &width, &height);
+    Image a(width, height), b(width, height);
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < a.pixels.size(); i++) {
+        seed = seed * 1664525u + 1013904223u;
+        a.pixels[i] = (unsigned char)((i / 3 % width) * 255 / width); // horizontal gradient
+        b.pixels[i] = (unsigned char)std::min(255, std::max(0, a.pixels[i] + (int)(seed >> 29) - 4));
+    }
+
+    ImageDiff diff = ImageDiff();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+        compareImages(a, b, diff);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Image diff (" << imageDiffInstructionSet() << "), " << width << "x" << height << ", " << frames << " frames" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "  PSNR " << diff.psnr << " dB, SSIM " << diff.ssim << ", max abs " << diff.maxAbs << std::endl;
+    std::cout << "  " << seconds * 1000.0 / frames << " ms per frame, " << frames / seconds << " frames/s, "
+              << (double)a.pixels.size() * 2 * frames / seconds / (1 << 30) << " GB/s" << std::endl;
+    return 0;
+}
+
+#endif /* imagediff_hpp */
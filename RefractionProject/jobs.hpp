@@ -0,0 +1,575 @@
+//
+//  jobs.hpp
+//  RefractionProject
+//
+//  Work-stealing job system that everything running off the render loop goes through (parallelFor
+//  in parallel.hpp, cubemap and model loading, the bakers and CPU renderers).
+//
+//  Every worker has its own deque (Chase-Lev, fixed size): it pushes and pops its own jobs at the
+//  bottom, idle workers steal the oldest ones from the top of a random victim, so big pieces of work
+//  get stolen and small ones stay local. Threads that aren't workers hand their jobs in through a
+//  shared queue. The thread that created the system (the main thread, with the GL context) is worker 0:
+//  it has a deque like the others and runs jobs while it waits.
+//
+//  A job can wait for other jobs (submit(work, after)) and only gets queued once they are all done.
+//  Jobs submitted with submitMain() run on the main thread only, from wait() or runMainThreadJobs(),
+//  which the render loop calls every frame: that's where GL calls go (uploads after a decode, ...).
+//
+//  RefractionProject --bench-jobs [--jobs 1000000] [--max-threads 64]
+//  Any mode: --job-threads N sizes the shared system (default one worker per core)
+//
+
+#ifndef jobs_hpp
+#define jobs_hpp
+
+#include "cmdline.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int hardwareThreads()
+{
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? (int)cores : 1;
+}
+
+struct Job {
+    std::function<void()> work;
+    std::atomic<int> pending;       // unfinished jobs this one waits for, +1 until it is submitted
+    std::atomic<int> references;    // one for the scheduler until it finishes, one per JobHandle
+    std::atomic<bool> finished;
+    bool mainThread;                // only runs on the main thread
+    std::mutex lock;                // guards dependents
+    std::vector<Job *> dependents;  // jobs waiting for this one
+
+    Job() : pending(1), references(1), finished(false), mainThread(false) {}
+};
+
+inline void releaseJob(Job *job)
+{
+    if (job && --job->references == 0)
+        delete job;
+}
+
+// What submit() gives back: wait for it or make other jobs depend on it. Copies share the job.
+class JobHandle {
+public:
+    JobHandle() : job(0) {}
+    explicit JobHandle(Job *job) : job(job) { if (job) job->references++; }
+    JobHandle(const JobHandle &other) : job(other.job) { if (job) job->references++; }
+    JobHandle &operator=(const JobHandle &other)
+    {
+        if (other.job)
+            other.job->references++;
+        releaseJob(job);
+        job = other.job;
+        return *this;
+    }
+    ~JobHandle() { releaseJob(job); }
+
+    bool valid() const { return job != 0; }
+    bool done() const { return !job || job->finished.load(std::memory_order_acquire); }
+    Job *get() const { return job; }
+
+private:
+    Job *job;
+};
+
+/*
+    Chase-Lev deque as fixed in Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+    push() and pop() are for the owner only, steal() for everyone else. A full deque makes push() fail
+    and the job goes to the shared queue instead of growing the buffer.
+*/
+class JobDeque {
+public:
+    static const long CAPACITY = 4096;
+
+    JobDeque() : top(0), bottom(0)
+    {
+        for (long i = 0; i < CAPACITY; i++)
+            buffer[i].store(0, std::memory_order_relaxed);
+    }
+
+    bool push(Job *job)
+    {
+        long b = bottom.load(std::memory_order_relaxed);
+        long t = top.load(std::memory_order_acquire);
+        if (b - t >= CAPACITY)
+            return false;
+        buffer[b & (CAPACITY - 1)].store(job, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    Job *pop()
+    {
+        long b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = top.load(std::memory_order_relaxed);
+        Job *job = 0;
+        if (t <= b) {
+            job = buffer[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (t == b) {
+                // the last job: race the thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    job = 0;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    Job *steal()
+    {
+        long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return 0;
+        Job *job = buffer[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return 0;
+        return job;
+    }
+
+private:
+    std::atomic<long> top;
+    char pad0[64];           // keeps the thieves' top and the owner's bottom on different cache lines
+    std::atomic<long> bottom;
+    char pad1[64];
+    std::atomic<Job *> buffer[CAPACITY];
+};
+
+class JobSystem {
+public:
+    // threads counts the calling thread, which becomes worker 0; 0 = one per core
+    explicit JobSystem(int threads = 0)
+        : injectedCount(0), queued(0), sleeping(0), stopping(false), mainThread(std::this_thread::get_id())
+    {
+        if (threads <= 0)
+            threads = hardwareThreads();
+        for (int i = 0; i < threads; i++)
+            deques.push_back(new JobDeque());
+        for (int i = 1; i < threads; i++)
+            workers.push_back(std::thread(&JobSystem::workerLoop, this, i));
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        for (size_t i = 0; i < deques.size(); i++)
+            delete deques[i];
+    }
+
+    int threadCount() const { return (int)deques.size(); }
+
+    // worker index of the calling thread, -1 for threads that aren't ours
+    int currentWorker() const
+    {
+        if (currentSystem() == this)
+            return currentIndex();
+        return std::this_thread::get_id() == mainThread ? 0 : -1;
+    }
+
+    // runs work on any worker once every job in after has finished
+    JobHandle submit(std::function<void()> work, const std::vector<JobHandle> &after = std::vector<JobHandle>())
+    {
+        return enqueue(std::move(work), after, false);
+    }
+
+    // the same, but only the main thread runs it (GL calls)
+    JobHandle submitMain(std::function<void()> work, const std::vector<JobHandle> &after = std::vector<JobHandle>())
+    {
+        return enqueue(std::move(work), after, true);
+    }
+
+    // runs other jobs until job has finished; the main thread also runs main-thread jobs meanwhile
+    void wait(const JobHandle &job)
+    {
+        int index = currentWorker();
+        while (!job.done()) {
+            if (index == 0 && runMainThreadJobs(1) > 0)
+                continue;
+            Job *next = index >= 0 ? findJob(index) : 0;
+            if (next)
+                run(next);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    void wait(const std::vector<JobHandle> &jobs)
+    {
+        for (size_t i = 0; i < jobs.size(); i++)
+            wait(jobs[i]);
+    }
+
+    // main thread only: runs up to limit queued main-thread jobs (-1 = all), returns how many ran
+    int runMainThreadJobs(int limit = -1)
+    {
+        int ran = 0;
+        while (limit < 0 || ran < limit) {
+            Job *job = 0;
+            {
+                std::lock_guard<std::mutex> lock(mainMutex);
+                if (mainQueue.empty())
+                    break;
+                job = mainQueue.front();
+                mainQueue.pop_front();
+            }
+            run(job);
+            ran++;
+        }
+        return ran;
+    }
+
+    // runs up to limit queued worker jobs on the calling worker, returns how many ran; for a loop that
+    // polls jobs without waiting on any, with no other workers to run them (one core)
+    int runQueuedJobs(int limit)
+    {
+        int index = currentWorker(), ran = 0;
+        while (index >= 0 && ran < limit) {
+            Job *next = findJob(index);
+            if (!next)
+                break;
+            run(next);
+            ran++;
+        }
+        return ran;
+    }
+
+    /*
+        body(i, worker) for every i in [0, count). The range is split in halves down to grain items
+        (0 = about 4 pieces per worker); one half is pushed for thieves and the other one is split further,
+        so a thief always takes the biggest piece left.
+    */
+    template <typename Body>
+    void parallelFor(int count, int grain, const Body &body)
+    {
+        if (count <= 0)
+            return;
+        if (grain <= 0)
+            grain = std::max(1, count / (4 * threadCount()));
+        std::atomic<int> remaining(count);
+        splitRange(0, count, grain, body, remaining);
+        int index = currentWorker();
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            Job *next = index >= 0 ? findJob(index) : 0;
+            if (next)
+                run(next);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    std::vector<JobDeque *> deques;
+    std::vector<std::thread> workers;
+    std::mutex injectMutex;          // jobs from threads that aren't workers, or from a full deque
+    std::deque<Job *> injected;
+    std::atomic<int> injectedCount;  // so workers can skip the lock when it's empty
+    std::mutex mainMutex;
+    std::deque<Job *> mainQueue;
+    std::atomic<int> queued;         // jobs sitting in a deque or the injected queue
+    std::atomic<int> sleeping;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    bool stopping;
+    std::thread::id mainThread;
+
+    static const JobSystem *&currentSystem() { static thread_local const JobSystem *system = 0; return system; }
+    static int &currentIndex() { static thread_local int index = -1; return index; }
+
+    static unsigned int &randomState()
+    {
+        static thread_local unsigned int state = 0;
+        if (state == 0)
+            state = (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1u;
+        return state;
+    }
+
+    JobHandle enqueue(std::function<void()> work, const std::vector<JobHandle> &after, bool onMain)
+    {
+        Job *job = new Job();
+        job->work = std::move(work);
+        job->mainThread = onMain;
+        JobHandle handle(job);
+        for (size_t i = 0; i < after.size(); i++) {
+            Job *dependency = after[i].get();
+            if (!dependency)
+                continue;
+            std::lock_guard<std::mutex> lock(dependency->lock);
+            if (!dependency->finished.load(std::memory_order_acquire)) {
+                job->pending++;
+                dependency->dependents.push_back(job);
+            }
+        }
+        if (--job->pending == 0)
+            schedule(job);
+        return handle;
+    }
+
+    // a job whose dependencies are all done goes to the main queue, our own deque or the shared one
+    void schedule(Job *job)
+    {
+        if (job->mainThread) {
+            std::lock_guard<std::mutex> lock(mainMutex);
+            mainQueue.push_back(job);
+            return;
+        }
+        int index = currentWorker();
+        if (index < 0 || !deques[index]->push(job)) {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            injected.push_back(job);
+            injectedCount++;
+        }
+        queued++;
+        if (sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wakeup.notify_one();
+        }
+    }
+
+    template <typename Body>
+    void splitRange(int begin, int end, int grain, const Body &body, std::atomic<int> &remaining)
+    {
+        while (end - begin > grain) {
+            int middle = begin + (end - begin) / 2;
+            const Body *bodyPointer = &body;
+            std::atomic<int> *remainingPointer = &remaining;
+            int splitEnd = end;
+            Job *job = new Job();
+            job->work = [this, middle, splitEnd, grain, bodyPointer, remainingPointer] {
+                splitRange(middle, splitEnd, grain, *bodyPointer, *remainingPointer);
+            };
+            job->pending = 0;
+            schedule(job);
+            end = middle;
+        }
+        int worker = std::max(currentWorker(), 0);
+        for (int i = begin; i < end; i++)
+            body(i, worker);
+        remaining.fetch_sub(end - begin, std::memory_order_release);
+    }
+
+    Job *findJob(int index)
+    {
+        Job *job = deques[index]->pop();
+        if (!job && injectedCount.load() > 0) {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            if (!injected.empty()) {
+                job = injected.front();
+                injected.pop_front();
+                injectedCount--;
+            }
+        }
+        if (!job && deques.size() > 1) {
+            // xorshift for the first victim, then everyone in turn
+            unsigned int &state = randomState();
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            size_t first = state % deques.size();
+            for (size_t i = 0; i < deques.size() && !job; i++) {
+                size_t victim = (first + i) % deques.size();
+                if ((int)victim != index)
+                    job = deques[victim]->steal();
+            }
+        }
+        if (job)
+            queued--;
+        return job;
+    }
+
+    void run(Job *job)
+    {
+        job->work();
+        job->work = std::function<void()>(); // free the captures now, handles may keep the job around
+        std::vector<Job *> ready;
+        {
+            std::lock_guard<std::mutex> lock(job->lock);
+            job->finished.store(true, std::memory_order_release);
+            ready.swap(job->dependents);
+        }
+        for (size_t i = 0; i < ready.size(); i++)
+            if (--ready[i]->pending == 0)
+                schedule(ready[i]);
+        releaseJob(job);
+    }
+
+    void workerLoop(int index)
+    {
+        currentSystem() = this;
+        currentIndex() = index;
+        for (;;) {
+            Job *job = findJob(index);
+            for (int spin = 0; !job && spin < 64; spin++) {
+                std::this_thread::yield();
+                job = findJob(index);
+            }
+            if (job) {
+                run(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping++;
+            wakeup.wait(lock, [this] { return queued.load() > 0 || stopping; });
+            sleeping--;
+            if (stopping && queued.load() == 0)
+                return;
+        }
+    }
+};
+
+/*
+    The one everybody shares. The first call creates it, with threads workers (0 = one per core), and
+    should come from the main thread so that is worker 0.
+*/
+inline JobSystem &jobSystem(int threads = 0)
+{
+    static JobSystem system(threads);
+    return system;
+}
+
+inline long fibonacci(int n)
+{
+    return n < 2 ? n : fibonacci(n - 1) + fibonacci(n - 2);
+}
+
+// the textbook spawn tree: every call above the cutoff submits one half and waits for it
+inline long fibonacciJobs(JobSystem &jobs, int n)
+{
+    if (n < 20)
+        return fibonacci(n);
+    long left = 0;
+    JobHandle job = jobs.submit([&jobs, &left, n] { left = fibonacciJobs(jobs, n - 1); });
+    long right = fibonacciJobs(jobs, n - 2);
+    jobs.wait(job);
+    return left + right;
+}
+
+/*
+    What a job costs and how well the scheduler scales: empty jobs, parallelFor items, a chain of
+    dependent jobs, the cost of a small parallelFor compared to starting threads for it (what parallel.hpp
+    did before), and then two workloads on 1, 2, 4, ... max threads: a flat parallelFor over cheap items
+    and a recursive spawn tree (every level submits one half and waits for it, all stealing).
+*/
+inline int runJobBenchmark(int argc, char *argv[])
+{
+    using namespace std;
+    int jobCount = (int)argNumber(argc, argv, "--jobs", 1000000);
+    int maxThreads = (int)argNumber(argc, argv, "--max-threads", 64);
+    typedef std::chrono::steady_clock Clock;
+    auto since = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+
+    JobSystem &jobs = jobSystem();
+    cout << "Job system: " << jobs.threadCount() << " workers (" << hardwareThreads() << " cores)" << endl;
+    {
+        std::atomic<int> counter(0);
+        vector<JobHandle> handles;
+        handles.reserve(jobCount);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < jobCount; i++)
+            handles.push_back(jobs.submit([&counter] { counter++; }));
+        jobs.wait(handles);
+        double ms = since(start);
+        cout << "  empty jobs:            " << ms * 1e6 / jobCount << " ns per job (submit + run + wait)" << endl;
+    }
+    {
+        std::atomic<int> counter(0);
+        Clock::time_point start = Clock::now();
+        jobs.parallelFor(jobCount, 1, [&counter](int, int) { counter.fetch_add(1, std::memory_order_relaxed); });
+        double grain1 = since(start);
+        start = Clock::now();
+        jobs.parallelFor(jobCount, 0, [&counter](int, int) { counter.fetch_add(1, std::memory_order_relaxed); });
+        double grainAuto = since(start);
+        cout << "  parallelFor items:     " << grain1 * 1e6 / jobCount << " ns per item at grain 1, "
+             << grainAuto * 1e6 / jobCount << " ns with the default grain" << endl;
+    }
+    {
+        int links = std::min(jobCount, 100000);
+        Clock::time_point start = Clock::now();
+        JobHandle previous;
+        for (int i = 0; i < links; i++)
+            previous = jobs.submit([] {}, vector<JobHandle>(1, previous));
+        jobs.wait(previous);
+        cout << "  dependency chain:      " << since(start) * 1e6 / links << " ns per link" << endl;
+    }
+    {
+        // 64 small items, like a frame's worth of tiles: the pool vs starting threads every call
+        const int calls = 1000, items = 64;
+        int threadCount = std::max(2, jobs.threadCount());
+        std::atomic<int> counter(0);
+        Clock::time_point start = Clock::now();
+        for (int c = 0; c < calls; c++)
+            jobs.parallelFor(items, items / threadCount, [&counter](int, int) { counter++; });
+        double pool = since(start);
+        start = Clock::now();
+        for (int c = 0; c < calls; c++) {
+            std::atomic<int> next(0);
+            vector<std::thread> threads;
+            auto worker = [&] { for (int i = next++; i < items; i = next++) counter++; };
+            for (int t = 1; t < threadCount; t++)
+                threads.push_back(std::thread(worker));
+            worker();
+            for (size_t t = 0; t < threads.size(); t++)
+                threads[t].join();
+        }
+        double spawned = since(start);
+        cout << "  parallelFor of " << items << ":     " << pool * 1000.0 / calls << " us per call, "
+             << spawned * 1000.0 / calls << " us starting " << threadCount << " threads instead" << endl;
+    }
+
+    cout << endl << "Scaling (efficiency = speedup / threads, " << hardwareThreads() << " cores):" << endl;
+    cout << setw(8) << "threads" << setw(12) << "flat ms" << setw(10) << "speedup" << setw(12) << "efficiency"
+         << setw(12) << "spawn ms" << setw(10) << "speedup" << setw(12) << "efficiency" << endl;
+    const int flatItems = 1 << 22;
+    vector<float> values(flatItems);
+    double flatBase = 0.0, spawnBase = 0.0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        JobSystem pool(threads);
+        Clock::time_point start = Clock::now();
+        pool.parallelFor(flatItems, 4096, [&values](int i, int) {
+            float x = (float)i;
+            for (int k = 0; k < 16; k++)
+                x = std::sqrt(x * 1.0001f + 1.0f);
+            values[i] = x;
+        });
+        double flat = since(start);
+        start = Clock::now();
+        long fib = fibonacciJobs(pool, 36);
+        double spawn = since(start);
+        if (threads == 1) {
+            flatBase = flat;
+            spawnBase = spawn;
+        }
+        cout << fixed << setprecision(1) << setw(8) << threads << setw(12) << flat << setprecision(2) << setw(10)
+             << flatBase / flat << setw(11) << 100.0 * flatBase / flat / threads << "%" << setprecision(1) << setw(12)
+             << spawn << setprecision(2) << setw(10) << spawnBase / spawn << setw(11)
+             << 100.0 * spawnBase / spawn / threads << "%" << (fib == 14930352 ? "" : "  WRONG RESULT") << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    return 0;
+}
+
+#endif /* jobs_hpp */
@@ -0,0 +1,279 @@
+//
+//  loader.hpp
+//  RefractionProject
+//
+//  A loader thread with a GL context of its own that shares objects (textures, buffers, sync objects)
+//  with the main one, so big uploads (glTexImage2D, glGenerateMipmap, glBufferData) don't have to
+//  happen on the render thread between two frames.
+//
+//  submit() queues an upload. The loader thread runs it in its context, puts a glFenceSync behind it and
+//  flushes. poll(), on the render thread once a frame, checks the fences without waiting (timeout 0) and
+//  hands the finished ones over, oldest first, by calling their done callback there. Until then the
+//  render thread never touches the objects, and once the fence has signalled they are complete for
+//  every context in the share group (the render thread binds them again before using them, which is
+//  what GL wants to see the other context's changes).
+//
+//  What can't be shared stays on the render thread: vertex arrays belong to the context that made them,
+//  so the loader uploads a mesh's buffers and the done callback makes the VAO (uploadMeshAsync in
+//  model.hpp, next to uploadTextureAsync). Marks from the loader thread don't go into the startup
+//  timeline, and its GL calls are counted apart from the render thread's (glstats.hpp).
+//
+//  RefractionProject --loader-thread   uploads the model's textures and meshes (model.hpp) and the skyboxes
+//                                      switched to at runtime (environment.hpp)
+//  RefractionProject --bench-loader [--textures 12] [--meshes 4] [--triangles 200000] [--out gallery.ppm] [--software]
+//  RefractionProject --bench-skybox-switch --loader-thread
+//
+
+#ifndef loader_hpp
+#define loader_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glstats.hpp"
+#include "memory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+class GLLoader {
+public:
+    // what the loader thread did, read on the render thread once it's idle (after finish())
+    struct Stats {
+        unsigned long long uploads;
+        size_t bytes;
+        double busyMs;          // loader thread, in the uploads
+        double latencyMs;       // submit() to done, summed
+        double slowestMs;       // the longest of those
+        unsigned long long unsignalled; // fences poll() found not done yet and left for the next frame
+        GLCallCounts calls;     // the loader thread's GL calls
+    };
+
+    GLLoader() : context(0), quit(false), busy(false)
+    {
+        resetStats();
+    }
+
+    bool running() const { return context != 0; }
+
+    /*
+        Main thread, with shared's context current: makes a hidden window whose context shares shared's
+        objects (windows have to be made on the main thread) and starts the thread that makes it current.
+    */
+    bool start(GLFWwindow *shared)
+    {
+        if (context)
+            return true;
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        context = glfwCreateWindow(1, 1, "Loader", NULL, shared);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        if (!context) {
+            cout << "ERROR::LOADER:: Could not create a shared GL context, uploading on the render thread" << endl;
+            return false;
+        }
+        quit = false;
+        thread = std::thread(&GLLoader::run, this);
+        return true;
+    }
+
+    /*
+        upload runs on the loader thread with its context current and returns the bytes it sent; done runs
+        on the render thread (from poll() or finish()) once the GPU has them. Without a loader thread both
+        run right here.
+    */
+    void submit(std::function<size_t()> upload, std::function<void()> done)
+    {
+        if (!context) {
+            stats.bytes += upload();
+            stats.uploads++;
+            if (done)
+                done();
+            return;
+        }
+        Task task;
+        task.upload = std::move(upload);
+        task.done = std::move(done);
+        task.fence = 0;
+        task.submitted = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    // Render thread, once a frame: publishes the uploads whose fences have signalled, never waits. Returns how many.
+    int poll()
+    {
+        return publish(false);
+    }
+
+    // Render thread: waits for everything submitted so far and publishes it
+    void finish()
+    {
+        if (!context)
+            return;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [this] { return queue.empty() && !busy; });
+        }
+        publish(true);
+    }
+
+    // submitted and not published yet
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size() + uploaded.size() + (busy ? 1 : 0);
+    }
+
+    // finishes what's queued, then joins the thread and destroys the context (main thread)
+    void stop()
+    {
+        if (!context)
+            return;
+        finish();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+        glfwDestroyWindow(context);
+        context = 0;
+    }
+
+    const Stats &statistics() const { return stats; }
+
+    void resetStats()
+    {
+        stats = Stats();
+    }
+
+    void printStats(std::ostream &out) const
+    {
+        out << "Loader thread: " << stats.uploads << " uploads, " << MemoryRegistry::formatBytes(stats.bytes) << ", busy " << fixed
+            << setprecision(1) << stats.busyMs << " ms, submit to done " << (stats.uploads ? stats.latencyMs / stats.uploads : 0.0)
+            << " ms mean, " << stats.slowestMs << " ms slowest, " << stats.unsignalled << " fences left for a later frame, "
+            << stats.calls.total() << " GL calls" << endl;
+        out.unsetf(ios::floatfield);
+    }
+
+private:
+    struct Task {
+        std::function<size_t()> upload;
+        std::function<void()> done;
+        GLsync fence;
+        size_t bytes;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    GLFWwindow *context;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wakeup, idle;
+    std::deque<Task> queue;     // waiting for the loader thread
+    std::deque<Task> uploaded;  // fenced, waiting for the render thread
+    bool quit, busy;
+    Stats stats;
+
+    void run()
+    {
+#ifdef __linux__
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+        glfwMakeContextCurrent(context);
+        threadGLCallCounts() = &stats.calls;
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [this] { return quit || !queue.empty(); });
+                if (queue.empty())
+                    break;
+                task = std::move(queue.front());
+                queue.pop_front();
+                busy = true;
+            }
+            auto start = std::chrono::steady_clock::now();
+            task.bytes = task.upload();
+            task.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush(); // or the fence might never reach the GPU, and the render thread would wait for it forever
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.busyMs += ms;
+                uploaded.push_back(std::move(task));
+                busy = false;
+            }
+            idle.notify_all();
+        }
+        threadGLCallCounts() = 0;
+        glfwMakeContextCurrent(NULL);
+    }
+
+    // in submission order, so done callbacks see the uploads the way they were asked for
+    int publish(bool wait)
+    {
+        int count = 0;
+        for (;;) {
+            Task task;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (uploaded.empty())
+                    break;
+                GLenum status = glClientWaitSync(uploaded.front().fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                                 wait ? 1000000000ull : 0);
+                if (status == GL_TIMEOUT_EXPIRED) {
+                    if (wait)
+                        continue;
+                    stats.unsignalled++;
+                    break;
+                }
+                if (status == GL_WAIT_FAILED)
+                    cout << "ERROR::LOADER:: glClientWaitSync failed, publishing the upload anyway" << endl;
+                task = std::move(uploaded.front());
+                uploaded.pop_front();
+            }
+            glDeleteSync(task.fence);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - task.submitted).count();
+            stats.uploads++;
+            stats.bytes += task.bytes;
+            stats.latencyMs += ms;
+            stats.slowestMs = std::max(stats.slowestMs, ms);
+            // outside the lock, the callback may submit more
+            if (task.done)
+                task.done();
+            count++;
+        }
+        return count;
+    }
+};
+
+inline GLLoader &glLoader()
+{
+    static GLLoader loader;
+    return loader;
+}
+
+#endif /* loader_hpp */
@@ -0,0 +1,232 @@
+//
+//  loaderbench.hpp
+//  RefractionProject
+//
+//  Renders the glass sphere headless while a batch of assets comes in (skybox faces as 2D textures,
+//  mipmapped, and big generated meshes), decoded before the clock starts so only the uploads are
+//  measured. Once on the render thread, one asset a frame through the same helpers with no loader
+//  thread, and once with all of them handed to the loader thread of loader.hpp. Prints the frame times
+//  while they come in, how long it took until the last one could be used, and the upload calls the
+//  render thread made meanwhile. The assets are drawn in a grid at the end of both runs, the two
+//  images have to be the same.
+//
+//  RefractionProject --bench-loader [--textures 12] [--meshes 4] [--triangles 200000] [--out gallery.ppm] [--software]
+//
+
+#ifndef loaderbench_hpp
+#define loaderbench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "glstats.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "jobs.hpp"
+#include "loader.hpp"
+#include "memory.hpp"
+#include "model.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct LoaderRun {
+    double steadyMs, meanMs, slowestMs, loadMs;
+    int loadFrames;
+    unsigned long long renderUploads;   // glTexImage2D, glGenerateMipmap and glBufferData on the render thread while loading
+    Image gallery;
+};
+
+inline unsigned long long uploadCallCount()
+{
+    const GLCallCounts &counts = glCallCounts();
+    return counts.calls[GLCALL_glTexImage2D] + counts.calls[GLCALL_glCompressedTexImage2D] + counts.calls[GLCALL_glGenerateMipmap] +
+           counts.calls[GLCALL_glBufferData];
+}
+
+inline LoaderRun runLoaderFlight(GLFWwindow *window, bool threaded, const vector<string> &files, int meshCount, int triangles,
+                                 Renderer &renderer, Model &object, Shader &textured)
+{
+    LoaderRun run = LoaderRun();
+    const int warmup = 10;
+    if (threaded && !glLoader().start(window))
+        return run;
+    vector<DecodedImage> images(files.size());
+    vector<JobHandle> decodes;
+    for (size_t i = 0; i < files.size(); i++) {
+        DecodedImage *out = &images[i];
+        string file = files[i];
+        decodes.push_back(jobSystem().submit([out, file] { *out = decodeImage(file); }));
+    }
+    jobSystem().wait(decodes);
+    const ProceduralShape shapes[] = { SHAPE_SPHERE, SHAPE_TORUS, SHAPE_BLOB };
+    vector<MeshData> shapeData;
+    for (int i = 0; i < meshCount; i++)
+        shapeData.push_back(buildShape(shapes[i % 3], (unsigned int)triangles));
+    glLoader().resetStats();
+
+    RenderTarget output = createRenderTarget(800, 600, "loader benchmark");
+    glm::vec3 cameraPos(0.0f, 0.0f, 3.0f);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    vector<unsigned int> textures(files.size(), 0);
+    vector<Mesh> meshes;
+    int total = (int)(files.size() + shapeData.size()), submitted = 0, arrived = 0;
+    // both runs go through the async helpers; without the loader thread they upload right away
+    auto submitNext = [&]() {
+        int index = submitted++;
+        if (index < (int)images.size()) {
+            uploadTextureAsync(std::move(images[index]), false, [&textures, &arrived, index](unsigned int texture) {
+                textures[index] = texture;
+                arrived++;
+            });
+        } else {
+            uploadMeshAsync(std::move(shapeData[index - images.size()]), vector<Texture>(), [&meshes, &arrived](Mesh &mesh) {
+                meshes.push_back(mesh);
+                arrived++;
+            });
+        }
+    };
+    glFinish();
+    double loadingMs = 0.0;
+    unsigned long long callsBefore = 0;
+    std::chrono::steady_clock::time_point loadStart;
+    for (int frame = 0; arrived < total; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        if (frame == warmup) {
+            loadStart = start;
+            callsBefore = uploadCallCount();
+            if (threaded)
+                while (submitted < total)
+                    submitNext();
+        }
+        if (frame >= warmup) {
+            if (threaded)
+                glLoader().poll();
+            else if (submitted < total)
+                submitNext();
+        }
+        renderer.renderFrame(object, vector<glm::mat4>(1, glm::mat4(1.0f)), view, cameraPos, output.framebuffer);
+        glFinish();
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        if (frame < warmup) {
+            run.steadyMs += ms / warmup;
+            continue;
+        }
+        loadingMs += ms;
+        run.slowestMs = std::max(run.slowestMs, ms);
+        run.loadFrames = frame - warmup + 1;
+        run.loadMs = std::chrono::duration<double, std::milli>(end - loadStart).count();
+    }
+    run.meanMs = loadingMs / std::max(run.loadFrames, 1);
+    run.renderUploads = uploadCallCount() - callsBefore;
+
+    // the textures in a grid, each on one of the meshes, flat colored by the textured shader
+    int cols = (int)std::ceil(std::sqrt((double)textures.size())), rows = ((int)textures.size() + cols - 1) / cols;
+    glBindFramebuffer(GL_FRAMEBUFFER, output.framebuffer);
+    glViewport(0, 0, 800, 600);
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    textured.use();
+    glm::mat4 projection = glm::ortho(-(float)cols, (float)cols, -(float)rows, (float)rows, -10.0f, 10.0f);
+    glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(glGetUniformLocation(textured.ID, "view"), 1, GL_FALSE, &identity[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(textured.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+    for (size_t i = 0; i < textures.size() && !meshes.empty(); i++) {
+        int col = (int)i % cols, row = (int)i / cols;
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(2.0f * col - cols + 1.0f, rows - 1.0f - 2.0f * row, 0.0f));
+        model = glm::rotate(model, 30.0f, glm::vec3(1.0f, 1.0f, 0.0f)); // this glm takes degrees
+        model = glm::scale(model, glm::vec3(0.7f));
+        glUniformMatrix4fv(glGetUniformLocation(textured.ID, "model"), 1, GL_FALSE, &model[0][0]);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        meshes[i % meshes.size()].Draw(textured);
+    }
+    run.gallery = Image(800, 600);
+    readRenderTarget(output, run.gallery.pixels);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (threaded)
+        glLoader().printStats(cout);
+    glLoader().stop();
+    for (size_t i = 0; i < textures.size(); i++) {
+        memoryRegistry().release(MEM_TEXTURE, textures[i]);
+        glDeleteTextures(1, &textures[i]);
+    }
+    for (size_t i = 0; i < meshes.size(); i++)
+        meshes[i].release();
+    deleteRenderTarget(output);
+    return run;
+}
+
+inline int runLoaderBenchmark(int argc, char *argv[])
+{
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    int textureCount = std::max((int)argNumber(argc, argv, "--textures", 12), 1);
+    int meshCount = std::max((int)argNumber(argc, argv, "--meshes", 4), 1);
+    int triangles = std::max((int)argNumber(argc, argv, "--triangles", 200000), 1);
+    string out = argValue(argc, argv, "--out", "");
+    // the faces of the three skyboxes, in turn
+    vector<string> files;
+    const char *folders[] = { "skybox/sky", "skybox/space", "skybox/space2" };
+    for (int i = 0; (int)files.size() < textureCount; i++)
+        files.push_back(skyboxFaces(folders[(i / 6) % 3])[i % 6]);
+
+    vector<Mesh> sphere;
+    sphere.push_back(generateShape(SHAPE_SPHERE, 20000));
+    Model object(std::move(sphere));
+    unsigned int cubemap = loadCubemap(skyboxFaces(folders[0]));
+    Renderer renderer(800, 600, cubemap);
+    Shader textured("shaders/texturedVshader.txt", "shaders/texturedFshader.txt");
+    cout << "Loading " << textureCount << " textures (mipmapped) and " << meshCount << " meshes of " << triangles
+         << " triangles while rendering 800x600" << endl;
+
+    LoaderRun runs[2];
+    runs[0] = runLoaderFlight(window, false, files, meshCount, triangles, renderer, object, textured);
+    runs[1] = runLoaderFlight(window, true, files, meshCount, triangles, renderer, object, textured);
+    const char *names[] = { "render thread", "loader thread" };
+    cout << left << setw(16) << "" << right << setw(10) << "steady" << setw(12) << "mean" << setw(12) << "slowest" << setw(10)
+         << "frames" << setw(12) << "loaded in" << setw(16) << "upload calls" << endl;
+    for (int i = 0; i < 2; i++)
+        cout << left << setw(16) << names[i] << right << fixed << setprecision(1) << setw(7) << runs[i].steadyMs << " ms"
+             << setw(9) << runs[i].meanMs << " ms" << setw(9) << runs[i].slowestMs << " ms" << setw(10) << runs[i].loadFrames
+             << setw(9) << runs[i].loadMs << " ms" << setw(16) << runs[i].renderUploads << endl;
+    cout.unsetf(ios::floatfield);
+
+    size_t different = 0;
+    for (size_t i = 0; i < runs[0].gallery.pixels.size(); i += 3)
+        if (runs[0].gallery.pixels[i] != runs[1].gallery.pixels[i] || runs[0].gallery.pixels[i + 1] != runs[1].gallery.pixels[i + 1] ||
+            runs[0].gallery.pixels[i + 2] != runs[1].gallery.pixels[i + 2])
+            different++;
+    if (different)
+        cout << "ERROR::LOADER:: " << different << " pixels differ between the render thread's and the loader thread's assets" << endl;
+    else
+        cout << "Both runs drew the same assets" << endl;
+    if (!out.empty() && !writePPM(out, runs[1].gallery))
+        cout << "ERROR::LOADER:: Could not write " << out << endl;
+
+    glDeleteProgram(textured.ID);
+    renderer.release();
+    object.release();
+    memoryRegistry().release(MEM_TEXTURE, cubemap);
+    glDeleteTextures(1, &cubemap);
+    destroyHeadlessContext(window);
+    return different ? 1 : 0;
+}
+
+#endif /* loaderbench_hpp */
@@ -6,56 +6,38 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp" //For matrix transformations
 #include "model.hpp"
+#include "renderer.hpp"
+#include "glstats.hpp"
+#include "cmdline.hpp"
+#include "memory.hpp"
+#include "timeline.hpp"
+#include "benchmark.hpp"
+#include "cubesampler.hpp"
+#include "golden.hpp"
+#include "imagediff.hpp"
+#include "frametime.hpp"
+#include "swrender.hpp"
+#include "raytrace.hpp"
+#include "jobs.hpp"
+#include "sdf.hpp"
+#include "thickness.hpp"
+#include "errorreport.hpp"
+#include "progressive.hpp"
+#include "texcompressbench.hpp"
+#include "mipgenbench.hpp"
+#include "prefilter.hpp"
+#include "environment.hpp"
+#include "texpackbench.hpp"
+#include "hdrenv.hpp"
+#include "texresidencybench.hpp"
+#include "loaderbench.hpp"
+#include "stagingbench.hpp"
+#include "envprobe.hpp"
+#include "probebench.hpp"
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
-unsigned int loadCubemap(vector<std::string> faces);
-unsigned int setupNormalMapFrontVAO(unsigned int VAO);
-
-// A 3D cube
-float skyboxVertices[] = {
-    -1.0f,  1.0f, -1.0f,
-    -1.0f, -1.0f, -1.0f,
-     1.0f, -1.0f, -1.0f,
-     1.0f, -1.0f, -1.0f,
-     1.0f,  1.0f, -1.0f,
-    -1.0f,  1.0f, -1.0f,
-
-    -1.0f, -1.0f,  1.0f,
-    -1.0f, -1.0f, -1.0f,
-    -1.0f,  1.0f, -1.0f,
-    -1.0f,  1.0f, -1.0f,
-    -1.0f,  1.0f,  1.0f,
-    -1.0f, -1.0f,  1.0f,
-
-     1.0f, -1.0f, -1.0f,
-     1.0f, -1.0f,  1.0f,
-     1.0f,  1.0f,  1.0f,
-     1.0f,  1.0f,  1.0f,
-     1.0f,  1.0f, -1.0f,
-     1.0f, -1.0f, -1.0f,
-
-    -1.0f, -1.0f,  1.0f,
-    -1.0f,  1.0f,  1.0f,
-     1.0f,  1.0f,  1.0f,
-     1.0f,  1.0f,  1.0f,
-     1.0f, -1.0f,  1.0f,
-    -1.0f, -1.0f,  1.0f,
-
-    -1.0f,  1.0f, -1.0f,
-     1.0f,  1.0f, -1.0f,
-     1.0f,  1.0f,  1.0f,
-     1.0f,  1.0f,  1.0f,
-    -1.0f,  1.0f,  1.0f,
-    -1.0f,  1.0f, -1.0f,
-
-    -1.0f, -1.0f, -1.0f,
-    -1.0f, -1.0f,  1.0f,
-     1.0f, -1.0f, -1.0f,
-     1.0f, -1.0f, -1.0f,
-    -1.0f, -1.0f,  1.0f,
-     1.0f, -1.0f,  1.0f
-};
+bool reportStartup(int argc, char *argv[]);
 
 /*
     Will use this structure for the normal and depth maps (front & back).
@@ -73,41 +55,9 @@ float quadVertices[] = { // vertex attributes for a quad that fills the entire s
      1.0f,  1.0f,  1.0f, 1.0f
 };
 
-//Paths to faces of the cubemap
-
-/*
-vector<std::string> faces
-{
-    "skybox/space/right.jpg",
-    "skybox/space/left.jpg",
-    "skybox/space/top.jpg",
-    "skybox/space/bottom.jpg",
-    "skybox/space/front.jpg",
-    "skybox/space/back.jpg"
-};*/
-
-/*
-vector<std::string> faces
-{
-    "skybox/space2/right.jpg",
-    "skybox/space2/left.jpg",
-    "skybox/space2/top.jpg",
-    "skybox/space2/bottom.jpg",
-    "skybox/space2/front.jpg",
-    "skybox/space2/back.jpg"
-};*/
-
-
-
-vector<std::string> faces
-{
-    "skybox/sky/right.jpg",
-    "skybox/sky/left.jpg",
-    "skybox/sky/top.jpg",
-    "skybox/sky/bottom.jpg",
-    "skybox/sky/front.jpg",
-    "skybox/sky/back.jpg"
-};
+//The skyboxes the viewer switches between with 1, 2 and 3 (--skybox picks the one it starts with, environment.hpp)
+const char *skyboxFolders[] = { "skybox/sky", "skybox/space", "skybox/space2" };
+EnvironmentManager *environments = 0;
 
 //vec3 color(0.7f, 0.5f, 0.2f);
 glm::vec3 cameraPos   = glm::vec3(0.0f, 0.0f,  3.0f);
@@ -117,8 +67,62 @@ glm::vec3 cameraUp    = glm::vec3(0.0f, 1.0f,  0.0f);
 const int SCREEN_HEIGHT = 1200;
 const int SCREEN_WIDTH = 1600;
 
-int main()
+bool startupFailed = false; //set when --startup-budget-ms is exceeded, main() then returns an error
+
+int main(int argc, char *argv[])
 {
+    startupTimeline().restart(); //Everything until the first frame is on screen gets timed
+    jobSystem((int)argNumber(argc, argv, "--job-threads", 0)); //Start the workers from here so the main thread is worker 0 (see jobs.hpp)
+    // Command line tools run headless and exit when they are done
+    if (hasArg(argc, argv, "--bench-jobs"))
+        return runJobBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-scaling"))
+        return runScalingBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--golden"))
+        return runGoldenTests(argc, argv);
+    if (hasArg(argc, argv, "--bench-imagediff"))
+        return runImageDiffBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-swrender"))
+        return runSoftwareBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--raytrace"))
+        return runRayTracer(argc, argv);
+    if (hasArg(argc, argv, "--bench-bvh"))
+        return runBvhBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-rays"))
+        return runRayKernelBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bake-thickness"))
+        return runThicknessBaker(argc, argv);
+    if (hasArg(argc, argv, "--bench-cubemap"))
+        return runCubemapBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-compress"))
+        return runCompressionBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-mips"))
+        return runMipBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-prefilter"))
+        return runPrefilterBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-skybox-switch"))
+        return runEnvironmentBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--pack-textures"))
+        return runTexturePacker(argc, argv);
+    if (hasArg(argc, argv, "--bench-texture-pack"))
+        return runTexturePackBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-hdr"))
+        return runHdrBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-residency"))
+        return runResidencyBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-loader"))
+        return runLoaderBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-staging"))
+        return runStagingBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--bench-probe"))
+        return runProbeBenchmark(argc, argv);
+    if (hasArg(argc, argv, "--progressive"))
+        return runProgressiveRender(argc, argv);
+    if (hasArg(argc, argv, "--error-report"))
+        return runErrorReport(argc, argv);
+    if (hasArg(argc, argv, "--bake-sdf"))
+        return runSdfBaker(argc, argv);
+
     GLFWwindow* window;
     
     // Initialize the library
@@ -152,6 +156,7 @@ int main()
     // Mathe the window's context current
     glfwMakeContextCurrent(window);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    startupTimeline().mark("create window");
     
     // Initialize the OpenGL API with GLAD
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
@@ -159,147 +164,170 @@ int main()
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
-    //glViewport(0, 0, SCREEN_WIDTH*2.0, SCREEN_HEIGHT*2.0);
+    installGLCallCounters();
+    startupTimeline().mark("load GLAD");
+    //--vram-budget-mb 512 warns as soon as our GPU allocations go over 512 MB
+    memoryRegistry().setGpuBudget((size_t)(argNumber(argc, argv, "--vram-budget-mb", 0) * 1024 * 1024));
+    //--compress fast|quality block-compresses the skybox and material textures (texcompress.hpp)
+    configureTextureCompression(argc, argv);
+    //--mips none|box|kaiser filters the mip chains on the workers (box unless told otherwise, mipgen.hpp)
+    configureMips(argc, argv, "box");
+    //textures with a pack (--pack-textures) are mapped and uploaded as they are, --no-texture-packs ignores them (texpack.hpp)
+    configureTexturePacks(argc, argv);
+    //--texture-budget-mb 64 keeps only the mip levels the model textures need on screen, streamed in as they're needed (texresidency.hpp)
+    configureTextureResidency(argc, argv);
+    //--staging-ring-mb 64 sends the uploads through a persistently mapped ring instead of client memory (stagingring.hpp)
+    configureStagingRing(argc, argv);
     glEnable(GL_DEPTH_TEST);
-    //Create a shader using our shader class
-    Shader shader("shaders/objVshader.txt", "shaders/objFshader.txt");
-    Shader skyboxShader("shaders/skyboxVshader.txt", "shaders/skyboxFshader.txt");
+    //--roughness 0.3 frosts the glass, the skybox is prefiltered for it on a worker meanwhile (prefilter.hpp)
+    float roughness = (float)argNumber(argc, argv, "--roughness", 0);
+    int prefilterSize = (int)argNumber(argc, argv, "--prefilter-size", 128);
+    int prefilterSamples = (int)argNumber(argc, argv, "--prefilter-samples", 128);
+    bool prefilterCache = !hasArg(argc, argv, "--no-prefilter-cache");
+    //--hdr probe.hdr uses an equirectangular HDR probe instead of the skybox faces, converted on a worker (hdrenv.hpp)
+    std::string hdrPath = argValue(argc, argv, "--hdr", "");
+    std::shared_ptr<HdrEnvironment> hdr = std::make_shared<HdrEnvironment>();
+    JobHandle hdrJob;
+    //The skybox faces decode on the workers while the cat is imported
+    CubemapLoad skyboxLoad;
+    if (hdrPath.empty()) {
+        skyboxLoad = startCubemapLoad(skyboxFaces(argValue(argc, argv, "--skybox", skyboxFolders[0])));
+    } else {
+        int hdrSize = hdrCubeSize((int)argNumber(argc, argv, "--hdr-size", 512));
+        int hdrPrefilterSize = roughness > 0.0f ? prefilterSize : 0;
+        bool hdrCache = !hasArg(argc, argv, "--no-hdr-cache");
+        hdrJob = jobSystem().submit([=] { *hdr = loadHdrEnvironment(hdrPath, hdrSize, hdrPrefilterSize, prefilterSamples, hdrCache); });
+    }
+    std::shared_ptr<PrefilteredSky> prefiltered = std::make_shared<PrefilteredSky>();
+    JobHandle prefilterJob;
+    if (roughness > 0.0f && hdrPath.empty()) {
+        std::string folder = skyboxLoad.folder;
+        prefilterJob = jobSystem().submit([=] { *prefiltered = loadOrPrefilterSky(folder, prefilterSize, prefilterSamples, prefilterCache); });
+    }
+    //--loader-thread uploads the cat's textures and meshes, and the skyboxes switched to later, from a second,
+    //shared context (loader.hpp); the cat shows up once its uploads are published, a few frames in
+    if (hasArg(argc, argv, "--loader-thread"))
+        glLoader().start(window);
     Model catModel("models/cat/cat.obj");
     //Model backPack("models/backpack/backpack.obj");
     
-    //VAO and VBO for skybox
-    unsigned int skyboxVAO, skyboxVBO;
-    glGenVertexArrays(1, &skyboxVAO);
-    glGenBuffers(1, &skyboxVBO);
-    glBindVertexArray(skyboxVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    
-    unsigned int cubemapTexture = loadCubemap(faces);
-    skyboxShader.use();
-    //set the int
-    glUniform1i(glGetUniformLocation(skyboxShader.ID, "skybox"), 0); //0 represents GL_TEXTURE0
-    
-    glUseProgram(shader.ID);
-    /*
-        Drawing in 3D.
-        1. We need a model matrix, which turns local coordinates to world coordinates.
-     
-        2. View matrix: We put the coordinates to cameras point of view before projecting them to clip coordinates.
-     
-        3. Projection matrix (perspective or orthographic)
-    */
-    glm::mat4 projection = glm::mat4(1.0f);
-    projection = glm::perspective(glm::radians(180.0f), (float)SCREEN_WIDTH/(float)SCREEN_HEIGHT, 0.1f, 1000.0f); //first param is field of view
-    
-    shader.use(); //Activate the shader before setting its values! important
-    //Set the matrices to vertice shaders uniform variables
-    glUniformMatrix4fv(glGetUniformLocation(shader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
-    //Put in the uniform variables inside the shaders
-    glUniform1i(glGetUniformLocation(shader.ID, "skybox"), 0);
-    glUniform3fv(glGetUniformLocation(shader.ID, "cameraPos"), 1, &cameraPos[0]); //param2 = 1 because we are putting in 1 vec3
-    
-    /*
-     Generate your normal and depth textures here.
-     Create a VAO for each of the settings. When you have done that you can simply call
-     that VAO with glBindVertexArray(thisVAO) and draw => catModel.Draw() and the catmodel will
-     be drawn on that texture.
-    */
-    /*
-    unsigned int normalFrontVAO, normalFrontFB; //FB stands for framebuffer
-    glGenVertexArrays(1, &normalFrontVAO);
-    glBindVertexArray(normalFrontVAO);
-    normalFrontFB = setupNormalMapFrontVAO(normalFrontVAO); //Put the normalFrontTexture into refraction shader uniform variable
-    Shader normalShader("shaders/normVshader.txt", "shaders/normFshader.txt");
-    */
-    Shader normalShader("shaders/normVshader.txt", "shaders/normFshader.txt");
-    normalShader.use(); //Remember to activate it first!
-    glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
-    
-    //Framebuffer for normal front texture
-    unsigned int framebuffer;
-    glGenFramebuffers(1, &framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    // create a color attachment texture
-    unsigned int textureColorbuffer;
-    glGenTextures(1, &textureColorbuffer);
-    /*
-     Here we must bind the texture, and then if we want to pass the
-     texture to the default shader we do.
-     1. shader.use();
-     2. glUniform1i(glGetUniformLocation(shader.ID, "normalFrontTexture"), 0??);
-    */
-    glActiveTexture(GL_TEXTURE0 + 1); //Default at 0, here we just set the texture unit of the shader, this unit (0) is used later in glUniform1i(glGetUniformLocation(shader.ID, "normalFrontTexture"), 0); when we want to assign the shader uniform variable to THIS texture-
-        //Also GL_TEXTURE0 + 2 = GL_TEXTURE2
-    glBindTexture(GL_TEXTURE_2D, textureColorbuffer); //Just remember the openGL process is always, unsigned int X, glgenerateObj(1,&X), glBindObj(GL_BUILT_IN_VALUE_ X); Then you have created your object
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL); //Craete the texture, no data inside=NULL
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-    
-    //glViewport(0, 0, 1800.0, 1600.0);
-    //Attach your texture to the framebuffer's color buffer
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorbuffer, 0);
-    // create a renderbuffer object for depth and stencil attachment (we won't be sampling these)
-    unsigned int rbo;
-    glGenRenderbuffers(1, &rbo);
-    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, SCREEN_WIDTH, SCREEN_HEIGHT); // use a single renderbuffer object for both a depth AND stencil buffer.
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo); // now actually attach it
-    // now that we actually created the framebuffer and added all attachments we want to check if it is actually complete now
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-        cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << endl;
-    //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
-    /*------------------------------------------------------------------------------*/
-    
-    normalShader.use();
-    //Framebuffer for normal back texture
-    unsigned int framebuffer2;
-    glGenFramebuffers(1, &framebuffer2);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer2);
-    // create a color attachment texture
-    unsigned int textureColorbuffer2;
-    glGenTextures(1, &textureColorbuffer2);
-    glActiveTexture(GL_TEXTURE0 + 2);
-    glBindTexture(GL_TEXTURE_2D, textureColorbuffer2);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    
-    //Attach your texture to the framebuffer's color buffer
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorbuffer2, 0);
-    // create a renderbuffer object for depth and stencil attachment (we won't be sampling these)
-    unsigned int rbo2;
-    glGenRenderbuffers(1, &rbo2);
-    glBindRenderbuffer(GL_RENDERBUFFER, rbo2);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, SCREEN_WIDTH, SCREEN_HEIGHT); // use a single renderbuffer object for both a depth AND stencil buffer.
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo2); // now actually attach it
-    // now that we actually created the framebuffer and added all attachments we want to check if it is actually complete now
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-        cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << endl;
-    
-    /*------------------------------------------------------------------------------*/
+    unsigned int cubemapTexture = 0, prefilterTexture = 0;
+    float prefilterMaxLod = 0.0f;
+    if (!hdrPath.empty()) {
+        jobSystem().wait(hdrJob);
+        if (!hdr->empty()) {
+            cubemapTexture = uploadHdrEnvironment(*hdr, prefilterTexture, prefilterMaxLod);
+        } else {
+            //couldn't read it, the default skybox it is
+            hdrPath.clear();
+            skyboxLoad = startCubemapLoad(skyboxFaces(skyboxFolders[0]));
+            std::string folder = skyboxLoad.folder;
+            if (roughness > 0.0f)
+                prefilterJob = jobSystem().submit([=] { *prefiltered = loadOrPrefilterSky(folder, prefilterSize, prefilterSamples, prefilterCache); });
+        }
+        hdr.reset();
+    }
+    if (hdrPath.empty())
+        cubemapTexture = finishCubemapLoad(skyboxLoad);
     
     /*
-        Here we set the normalFrontTexture in default shader to the framebuffers texture.
+        The renderer compiles the refraction, skybox and normal shaders and creates the two framebuffers
+        the normals are rendered to (front and back). See renderer.hpp.
     */
-    shader.use();
-    glUniform1i(glGetUniformLocation(shader.ID, "normalFrontTexture"), 1); //0 is the texture unit. We set the framebuffer texture to unit 0 (which openGL does automatically).
-    glUniform1i(glGetUniformLocation(shader.ID, "normalBackTexture"), 2);
-    
+    int framebufferWidth = SCREEN_WIDTH, framebufferHeight = SCREEN_HEIGHT;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    Renderer renderer(framebufferWidth, framebufferHeight, cubemapTexture);
+    glfwSetWindowUserPointer(window, &renderer); //So framebuffer_size_callback can resize the normal textures
+    //--thickness baked|convex uses the baked per-vertex thickness (cat.obj.thickness, baked on first use)
+    //instead of the front/back distance; convex also skips both normal passes
+    std::string thickness = argValue(argc, argv, "--thickness", "");
+    //the bakers and the probe's size need every mesh of the cat now
+    if (!thickness.empty() || hasArg(argc, argv, "--probe"))
+        catModel.finishLoading();
+    if (thickness == "baked" || thickness == "convex") {
+        loadOrBakeThickness(catModel, true);
+        renderer.thicknessMode = thickness == "baked" ? THICKNESS_BAKED : THICKNESS_BAKED_CONVEX;
+    }
+    //--thickness sdf sphere-traces a distance field of the cat instead (cat.obj.sdf128, --sdf-resolution to change it)
+    unsigned int sdfTexture = 0;
+    if (thickness == "sdf") {
+        SdfGrid sdf = loadOrBakeSdf(catModel, true, (int)argNumber(argc, argv, "--sdf-resolution", 128));
+        sdfTexture = createSdfTexture(sdf, "cat");
+        useSdf(renderer, sdfTexture, sdf);
+        renderer.thicknessMode = THICKNESS_SDF;
+    }
+    if (prefilterTexture) {
+        //the HDR probe's, prefiltered with it
+        renderer.prefilterTexture = prefilterTexture;
+        renderer.prefilterMaxLod = prefilterMaxLod;
+        renderer.roughness = std::min(roughness, 1.0f);
+    } else if (roughness > 0.0f && prefilterJob.valid()) {
+        jobSystem().wait(vector<JobHandle>(1, prefilterJob));
+        if (!prefiltered->empty()) {
+            prefilterTexture = createPrefilterTexture(*prefiltered, skyboxLoad.folder + " prefilter");
+            usePrefilter(renderer, prefilterTexture, *prefiltered);
+            renderer.roughness = std::min(roughness, 1.0f);
+        }
+        prefiltered.reset();
+    }
+    //The other skyboxes stream in when asked for; the last few stay on the GPU
+    EnvironmentManager environmentManager((size_t)argNumber(argc, argv, "--environments", 3),
+                                          (size_t)(argNumber(argc, argv, "--upload-budget-mb", 16) * 1024 * 1024));
+    environmentManager.prefiltered = prefilterTexture != 0;
+    environmentManager.prefilterSize = prefilterSize;
+    environmentManager.prefilterSamples = prefilterSamples;
+    environmentManager.prefilterCache = prefilterCache;
+    //--exposure 1 for the HDR probe's tone mapping
+    renderer.exposure = hdrPath.empty() ? 0.0f : std::max((float)argNumber(argc, argv, "--exposure", 1), 1e-3f);
+    environmentManager.adopt(hdrPath.empty() ? skyboxLoad.folder : hdrPath, cubemapTexture, prefilterTexture, renderer.prefilterMaxLod,
+                             renderer.exposure);
+    environments = &environmentManager;
+    //--probe puts shapes around the cat and an environment probe at it, so they show through the glass;
+    //--probe-faces 1 of its faces are rendered a frame, --probe-order view picks the ones the camera sees (envprobe.hpp)
+    EnvironmentProbe probe;
+    OrbitingShapes *orbiters = 0;
+    auto drawOrbiters = [&orbiters](const glm::mat4 &faceView, const glm::mat4 &faceProjection) { orbiters->draw(faceView, faceProjection); };
+    if (hasArg(argc, argv, "--probe")) {
+        float reach = 1.0f; //the cat's size
+        for (size_t i = 0; i < catModel.meshes.size(); i++)
+            reach = std::max(reach, glm::length(catModel.meshes[i].boundsCenter) + catModel.meshes[i].boundsRadius);
+        orbiters = new OrbitingShapes((int)argNumber(argc, argv, "--probe-objects", 6), 2.2f * reach, 0.35f * reach);
+        probe.farPlane = 100.0f * reach;
+        if (probe.init((int)argNumber(argc, argv, "--probe-size", 256), hasArg(argc, argv, "--probe-mips"), renderer.exposure > 0.0f)) {
+            probe.facesPerFrame = std::min(std::max((int)argNumber(argc, argv, "--probe-faces", 1), 1), 6);
+            probe.order = probeOrderFromName(argValue(argc, argv, "--probe-order", "round-robin"));
+            probe.frozen = hasArg(argc, argv, "--probe-freeze");
+            renderer.probeTexture = probe.texture;
+            //all six faces before the first frame, the glass would show black for the ones not rendered yet
+            orbiters->animate(0.0);
+            while (!probe.complete())
+                probe.update(renderer, probe.center - 40.0f*cameraPos, drawOrbiters);
+            probe.resetStats();
+            //rough glass reads the probe's box filtered mips
+            if (probe.mips) {
+                renderer.probeMaxLod = probe.maxLod();
+                renderer.roughness = std::min(roughness, 1.0f);
+            }
+        }
+    }
+    unsigned int probedSkybox = renderer.cubemapTexture;
+    //--memory-report prints what was allocated during startup, and again with the peaks on exit
+    bool memoryReport = hasArg(argc, argv, "--memory-report");
+    if (memoryReport)
+        memoryRegistry().report(std::cout, true);
+    //--frame-stats <file.csv> prints hitches as they happen and writes every frame's timings on exit
+    std::string frameStatsPath = argValue(argc, argv, "--frame-stats", "");
+    frameStats().hitchFactor = (float)argNumber(argc, argv, "--hitch-factor", 2.5);
+    frameStats().printHitches = !frameStatsPath.empty();
+    frameStats().init();
     
     // Loop until the user closes the window
     
     while(!glfwWindowShouldClose(window))
     {
-        glEnable(GL_DEPTH_TEST);
+        frameStats().beginFrame();
         //Input
         processInput(window);
-        //glViewport(0,0,800*2,600*2);
         //Camera settings
         const float radius = 150.0f; //Lower this to make object come closer
         float speed = 0.2f;
@@ -313,139 +341,105 @@ int main()
         model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
         model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));    // it's a bit too big for our scene, so scale it down
         
-        //First Pass
-        //Render the front normals
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
-        glClearColor(0.0f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        //Draw the catModel with normalShader and it will end up in our framebuffer
-        //Remember to activate the shader before putting in the variables
-        normalShader.use();
-        glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "view"), 1, GL_FALSE, &view[0][0]);
-        glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "model"), 1, GL_FALSE, &model[0][0]);
-        glUniform3fv(glGetUniformLocation(normalShader.ID, "cameraPos"), 1, &cameraPos[0]);
-        catModel.Draw(normalShader);
-        
-        //Render the back normals
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer2);
-        glEnable(GL_DEPTH_TEST);
-        glClearDepth(0.0f);
-        glDepthFunc(GL_GREATER);
-        glClearColor(1.0f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // we're not using the stencil buffer now, this function is what sets the depth to 0.0 as we told the program on glClearDepth(0.0);
-        normalShader.use();
-        catModel.Draw(normalShader);
-        
-        //Second pass
-        glClearDepth(1.0f); //This goes into effect when doing glClear(GL_DEPTH_BUFFER_BIT)
-        glBindFramebuffer(GL_FRAMEBUFFER, 0); //0 = our main screen (default screen)
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
-        //glDisable(GL_DEPTH_TEST);
-        //glDepthFunc(GL_LESS);
-        glClearColor(0.0f, 0.1f, 0.0f, 0.3f);
-        glClear(GL_COLOR_BUFFER_BIT |GL_DEPTH_BUFFER_BIT);
-        shader.use();//glUseProgram(shader.ID);
-        model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f));
-        glUniform3fv(glGetUniformLocation(shader.ID, "cameraPos"), 1, &cameraPos[0]); //Update uniform cameraPos in fragment shader every frame
-        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "view"), 1, GL_FALSE, &view[0][0]);
-        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "model"), 1, GL_FALSE, &model[0][0]);
-        catModel.Draw(shader);
-        /*
-           AFTER SETTING THE MODEL, VIEW, PROJ MATRICES => RENDER YOUR TEXTURES
-           1. Front normals
-        */
-        /*
-        glBindVertexArray(normalFrontVAO); //Bind the corresponding VAO to use its settings.
-        glBindFramebuffer(GL_FRAMEBUFFER, normalFrontFB); //Bind them before drawing on them
-        //Turn on the shader that visualizes the normals
-        normalShader.use();
-        //Assign the relevant uniform variables in the shader
-        glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "model"), 1, GL_FALSE, &model[0][0]);
-        //Draw your model
-        catModel.Draw(normalShader);
-        //The cat model has been drawn on the texture, repeat this process for the other side as well
-        */
         //TURN THIS ON FOR AUTOMATIC CAMERA ROTATION AROUND OBJECT
         /*
         glm::vec3 rot = glm::vec3(camX, 0.0f, camZ);
         view = glm::lookAt(rot, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        glUniform3fv(glGetUniformLocation(shader.ID, "cameraPos"), 1, &rot[0]); //Third param is probably wrong..
-        */
-        
-        //CODE FOR CUBE
-        /*
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::rotate(model, glm::radians(20.0f), glm::vec3(1.0f, 1.0f, 1.0f));
-        //view = glm::translate(view, glm::vec3(1.5f*cos(time*0.2f), 1.5f*sin(time*0.2f), -100.0f)); //Moves the scene back a bit
-        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "model"), 1, GL_FALSE, &model[0][0]);
         */
         
-        //THIS IS FOR 3D MODEL!
-         // render the loaded model
-        /*
-         glm::mat4 model = glm::mat4(1.0f);
-         model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
-         model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));    // it's a bit too big for our scene, so scale it down
-         shader.setMat4("model", model);
-        */
-        
-        //Before drawing on your main screen, bind the default VAO and change to the default frameBuffer
-        //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        //glBindVertexArray(VAO);
-        
-        /*
-         Remember the vertices have gone through the shaders and are being colored
-         so when finally drawing the cube, the shaders will have done the job before it's drawn.
-        */
-        //glBindVertexArray(VAO); //Put this before Drawing
-        //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE ); //To draw wireframe
-        //catModel.Draw(shader);
-        //backPack.Draw(shader);
-        //glDrawArrays(GL_TRIANGLES, 0, 36); //36 is # vertices
-        /*
-        shader.use();
-        glBindVertexArray(skyboxVAO);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture); //??? what does this do?
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
-        */
-        
-        // draw skybox as last
-        glDepthFunc(GL_LEQUAL); // change depth function so depth test passes when values are equal to depth buffer's content
-        skyboxShader.use();
-        view = glm::mat4(glm::mat3(view)); // remove translation from the view matrix
-        //fov should be larger for cubemap
-        projection = glm::perspective(glm::radians(5000.0f), (float)SCREEN_WIDTH/(float)SCREEN_HEIGHT, 0.1f, 1000.0f);
-        glUniformMatrix4fv(glGetUniformLocation(skyboxShader.ID, "view"), 1, GL_FALSE, &view[0][0]);
-        glUniformMatrix4fv(glGetUniformLocation(skyboxShader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
-        // skybox cube
-        glBindVertexArray(skyboxVAO);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture); //??? what does this do?
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
-        glDepthFunc(GL_LESS); // set depth function back to default
+        //Hands over what the loader thread finished uploading
+        glLoader().poll();
+        //Uploads some of a skybox that's on its way in, switches to it once it's all there
+        environmentManager.update(renderer);
+        //Streams in the texture levels the last frame asked for, evicts what nobody asked for
+        if (textureResidency().enabled)
+            textureResidency().update();
+        //A face or two of the probe; after a skybox switch every face is rendered again, frozen or not
+        if (orbiters) {
+            orbiters->animate(glfwGetTime());
+            if (renderer.cubemapTexture != probedSkybox)
+                probe.invalidate();
+            probedSkybox = renderer.cubemapTexture;
+            probe.update(renderer, probe.center - 40.0f*cameraPos, drawOrbiters);
+        }
+        //Front normals, back normals, refraction and skybox, drawn to our main screen (framebuffer 0)
+        renderer.renderFrame(catModel, vector<glm::mat4>(1, model), view, cameraPos, 0);
+        if (orbiters)
+            orbiters->draw(view, renderer.projection);
+        frameStats().endFrame();
         
         // Swap front and back buffers
         glfwSwapBuffers(window);
+        frameStats().afterSwap();
+        if (!startupTimeline().isFinished() && !reportStartup(argc, argv))
+            glfwSetWindowShouldClose(window, true);
         // Poll for and process events like joystick/inputs mouse movement etc
         glfwPollEvents();
+        //GL work the job system's jobs left for the main thread
+        jobSystem().runMainThreadJobs();
     }
     
+    if (memoryReport)
+        memoryRegistry().report(std::cout);
+    //--upload-report prints the MB/s and stalls of the uploads, direct and through the staging ring
+    if (hasArg(argc, argv, "--upload-report"))
+        stagingRing().printStats(std::cout);
+    //--probe-report prints how many faces the environment probe rendered and what that took
+    if (probe.texture && hasArg(argc, argv, "--probe-report"))
+        probe.printStats(std::cout);
+    frameStats().release();
+    //--residency-csv <file.csv> writes what the texture residency did each frame
+    std::string residencyPath = argValue(argc, argv, "--residency-csv", "");
+    if (!residencyPath.empty() && !textureResidency().writeCsv(residencyPath))
+        std::cout << "ERROR::RESIDENCY:: Could not write " << residencyPath << std::endl;
+    if (!frameStatsPath.empty()) {
+        frameStats().printSummary(std::cout);
+        if (!frameStats().writeCsv(frameStatsPath))
+            std::cout << "ERROR::FRAME:: Could not write " << frameStatsPath << std::endl;
+    }
     //De-allocate recourses
-    glDeleteVertexArrays(1, &skyboxVAO);
-    glDeleteBuffers(1, &skyboxVBO);
-    //glDeleteProgram(shaderProgram);
+    renderer.release();
+    deleteSdfTexture(sdfTexture);
+    environments = 0;
+    environmentManager.release(); //the skyboxes and their prefilters
+    probe.release();
+    if (orbiters) {
+        orbiters->release();
+        delete orbiters;
+    }
+    if (glLoader().running()) {
+        glLoader().printStats(std::cout);
+        glLoader().stop();
+    }
+    catModel.release();
+    stagingRing().release();
 
     glfwTerminate();
-    return 0;
+    return startupFailed ? 3 : 0;
+}
+
+/*
+    Called after the first frame has been swapped. Prints the startup timeline, writes it as JSON with
+    --startup-json <file>, and checks it against --startup-budget-ms <ms> so CI can fail on slow startups.
+    Returns false when the viewer should quit (--exit-after-first-frame, or the budget was blown).
+*/
+bool reportStartup(int argc, char *argv[])
+{
+    startupTimeline().finish();
+    startupTimeline().print(std::cout);
+    std::string jsonPath = argValue(argc, argv, "--startup-json", "");
+    if (!jsonPath.empty() && !startupTimeline().writeJson(jsonPath))
+        std::cout << "ERROR::TIMELINE:: Could not write " << jsonPath << std::endl;
+    double budget = argNumber(argc, argv, "--startup-budget-ms", 0);
+    if (budget > 0 && startupTimeline().timeToFirstFrameMs > budget) {
+        std::cout << "FAILED: time to first frame " << startupTimeline().timeToFirstFrameMs << " ms is over the budget of "
+                  << budget << " ms" << std::endl;
+        startupFailed = true;
+        return false;
+    }
+    return !hasArg(argc, argv, "--exit-after-first-frame");
 }
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width
@@ -453,6 +447,11 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     //glViewport(0, 0, width*2, height*2);
     //std::cout << width << " " << height << std::endl;
     glViewport(0, 0, width, height);
+    // the normal textures have to match the new size, or the refraction shader reads the wrong uv
+    Renderer *renderer = (Renderer*)glfwGetWindowUserPointer(window);
+    if (renderer)
+        renderer->resize(width, height);
+    frameStats().noteEvent(FRAME_EVENT_RESIZE);
 }
 
 void processInput(GLFWwindow *window) {
@@ -467,35 +466,17 @@ void processInput(GLFWwindow *window) {
         cameraPos -= glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
         cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
-}
-
-unsigned int loadCubemap(vector<std::string> faces) {
-    //Texture for cubemap
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-    
-    int width, height, nrChannels;
-    unsigned char *data;
-    for(GLuint i = 0; i < faces.size(); i++) {
-        data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-        if(data) {
-            //If you use sky, change GL_RGBA to GL_RGB
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-            stbi_image_free(data);
-        } else {
-            std::cout << "Cubemap texture failed to load at path: " << faces[i] <<std::endl;
-            stbi_image_free(data);
-        }
-    }
-    //Settings for cubemap
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    
-    return textureID;
+    // [ and ] make the glass smoother or rougher, with --roughness
+    Renderer *renderer = (Renderer*)glfwGetWindowUserPointer(window);
+    if (renderer && glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+        renderer->roughness = std::max(renderer->roughness - 0.01f, 0.0f);
+    if (renderer && glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+        renderer->roughness = std::min(renderer->roughness + 0.01f, 1.0f);
+    // 1, 2 and 3 switch the skybox
+    const int skyboxKeys[] = { GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3 };
+    for (int i = 0; i < 3; i++)
+        if (environments && glfwGetKey(window, skyboxKeys[i]) == GLFW_PRESS)
+            environments->request(skyboxFolders[i]);
 }
 
 /*
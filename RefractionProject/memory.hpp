@@ -0,0 +1,302 @@
+//
+//  memory.hpp
+//  RefractionProject
+//
+//  Bookkeeping for everything we allocate: GL buffers, textures, renderbuffers and framebuffers
+//  on the GPU side, mesh vectors and decoded images on the CPU side. Every allocation is recorded
+//  with its size, format and owner (model path, pass name...), so we can print where the memory
+//  goes and how high it ever got, and warn when the GPU side goes over a budget.
+//
+//  GPU sizes are estimates: width * height * bytes per texel (+1/3 with mipmaps). Drivers are free
+//  to pad, most store RGB8 as RGBA8, so RGB textures are counted as 4 bytes per texel. Block-compressed
+//  formats (texcompress.hpp) are counted by their 4x4 blocks.
+//
+
+#ifndef memory_hpp
+#define memory_hpp
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// glad only has GL 4.1 core, the S3TC and BPTC formats come from extensions (BPTC is core in 4.2)
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#define GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM 0x8E8D
+#define GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT 0x8E8F
+#endif
+
+enum MemoryKind {
+    MEM_BUFFER,
+    MEM_TEXTURE,
+    MEM_RENDERBUFFER,
+    MEM_FRAMEBUFFER,
+    MEM_CPU_MESH,
+    MEM_CPU_IMAGE,
+    MEM_KIND_COUNT
+};
+
+inline const char *memoryKindName(int kind)
+{
+    static const char *names[] = { "buffer", "texture", "renderbuffer", "framebuffer", "cpu mesh", "cpu image" };
+    return names[kind];
+}
+
+inline bool isGpuMemory(int kind)
+{
+    return kind <= MEM_FRAMEBUFFER;
+}
+
+struct MemoryRecord {
+    MemoryKind kind;
+    unsigned long long key;   // GL object name, or whatever identifies a CPU allocation
+    size_t bytes;
+    std::string format;       // "GL_RGBA8 1600x1200", "vertices+indices"...
+    std::string owner;        // model path, pass name, skybox folder...
+};
+
+class MemoryRegistry {
+public:
+    MemoryRegistry() : gpuBudget(0), overBudget(false)
+    {
+        for (int i = 0; i < MEM_KIND_COUNT; i++)
+            current[i] = highWater[i] = 0;
+        gpuHighWater = cpuHighWater = 0;
+    }
+
+    // Records an allocation. Tracking the same kind + key again replaces the old record (e.g. a resize).
+    void track(MemoryKind kind, unsigned long long key, size_t bytes, const std::string &format, const std::string &owner)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::pair<int, unsigned long long> id(kind, key);
+        std::map<std::pair<int, unsigned long long>, MemoryRecord>::iterator old = records.find(id);
+        if (old != records.end())
+            current[kind] -= old->second.bytes;
+        MemoryRecord record;
+        record.kind = kind;
+        record.key = key;
+        record.bytes = bytes;
+        record.format = format;
+        record.owner = owner;
+        records[id] = record;
+        current[kind] += bytes;
+        updateHighWater(kind);
+    }
+
+    void release(MemoryKind kind, unsigned long long key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::pair<int, unsigned long long>, MemoryRecord>::iterator it = records.find(std::make_pair((int)kind, key));
+        if (it == records.end())
+            return;
+        current[kind] -= it->second.bytes;
+        records.erase(it);
+        if (totalGpu() <= gpuBudget)
+            overBudget = false;
+    }
+
+    // 0 = no budget. Going over prints a warning once, until usage drops below the budget again.
+    void setGpuBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        gpuBudget = bytes;
+        overBudget = false;
+    }
+
+    size_t currentBytes(MemoryKind kind) { std::lock_guard<std::mutex> lock(mutex); return current[kind]; }
+    size_t highWaterBytes(MemoryKind kind) { std::lock_guard<std::mutex> lock(mutex); return highWater[kind]; }
+    size_t gpuBytes() { std::lock_guard<std::mutex> lock(mutex); return totalGpu(); }
+    size_t cpuBytes() { std::lock_guard<std::mutex> lock(mutex); return totalCpu(); }
+    size_t gpuHighWaterBytes() { std::lock_guard<std::mutex> lock(mutex); return gpuHighWater; }
+    size_t cpuHighWaterBytes() { std::lock_guard<std::mutex> lock(mutex); return cpuHighWater; }
+
+    // copy of every live record, largest first
+    std::vector<MemoryRecord> snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<MemoryRecord> result;
+        for (std::map<std::pair<int, unsigned long long>, MemoryRecord>::iterator it = records.begin(); it != records.end(); ++it)
+            result.push_back(it->second);
+        std::sort(result.begin(), result.end(), [](const MemoryRecord &a, const MemoryRecord &b) { return a.bytes > b.bytes; });
+        return result;
+    }
+
+    /*
+        Human readable report: totals per kind with high-water marks, then usage per owner,
+        then (detailed = true) every allocation.
+    */
+    void report(std::ostream &out, bool detailed = false)
+    {
+        std::vector<MemoryRecord> all = snapshot();
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "---- Memory report ----" << std::endl;
+        out << std::left << std::setw(14) << "kind" << std::right << std::setw(12) << "current" << std::setw(12) << "peak" << std::endl;
+        for (int kind = 0; kind < MEM_KIND_COUNT; kind++)
+            out << std::left << std::setw(14) << memoryKindName(kind) << std::right << std::setw(12) << formatBytes(current[kind])
+                << std::setw(12) << formatBytes(highWater[kind]) << std::endl;
+        out << std::left << std::setw(14) << "GPU total" << std::right << std::setw(12) << formatBytes(totalGpu())
+            << std::setw(12) << formatBytes(gpuHighWater);
+        if (gpuBudget > 0)
+            out << "  (budget " << formatBytes(gpuBudget) << ")";
+        out << std::endl;
+        out << std::left << std::setw(14) << "CPU total" << std::right << std::setw(12) << formatBytes(totalCpu())
+            << std::setw(12) << formatBytes(cpuHighWater) << std::endl;
+
+        std::map<std::string, std::pair<size_t, size_t> > owners; // owner -> (gpu, cpu)
+        for (size_t i = 0; i < all.size(); i++) {
+            std::pair<size_t, size_t> &usage = owners[all[i].owner];
+            (isGpuMemory(all[i].kind) ? usage.first : usage.second) += all[i].bytes;
+        }
+        out << std::left << std::setw(40) << "owner" << std::right << std::setw(12) << "gpu" << std::setw(12) << "cpu" << std::endl;
+        for (std::map<std::string, std::pair<size_t, size_t> >::iterator it = owners.begin(); it != owners.end(); ++it)
+            out << std::left << std::setw(40) << it->first << std::right << std::setw(12) << formatBytes(it->second.first)
+                << std::setw(12) << formatBytes(it->second.second) << std::endl;
+
+        if (detailed) {
+            for (size_t i = 0; i < all.size(); i++)
+                out << "  " << std::left << std::setw(13) << memoryKindName(all[i].kind) << std::setw(6) << all[i].key
+                    << std::right << std::setw(12) << formatBytes(all[i].bytes) << "  " << all[i].format << "  (" << all[i].owner << ")" << std::endl;
+        }
+        out << "-----------------------" << std::endl;
+    }
+
+    static std::string formatBytes(size_t bytes)
+    {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(1);
+        if (bytes >= (size_t)1 << 30)
+            text << bytes / double(1 << 30) << " GB";
+        else if (bytes >= (size_t)1 << 20)
+            text << bytes / double(1 << 20) << " MB";
+        else if (bytes >= (size_t)1 << 10)
+            text << bytes / double(1 << 10) << " KB";
+        else
+            text << bytes << " B";
+        return text.str();
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::pair<int, unsigned long long>, MemoryRecord> records;
+    size_t current[MEM_KIND_COUNT];
+    size_t highWater[MEM_KIND_COUNT];
+    size_t gpuHighWater, cpuHighWater;
+    size_t gpuBudget;
+    bool overBudget;
+
+    size_t totalGpu() const
+    {
+        size_t sum = 0;
+        for (int kind = 0; kind < MEM_KIND_COUNT; kind++)
+            if (isGpuMemory(kind))
+                sum += current[kind];
+        return sum;
+    }
+    size_t totalCpu() const
+    {
+        size_t sum = 0;
+        for (int kind = 0; kind < MEM_KIND_COUNT; kind++)
+            if (!isGpuMemory(kind))
+                sum += current[kind];
+        return sum;
+    }
+    void updateHighWater(MemoryKind kind)
+    {
+        highWater[kind] = std::max(highWater[kind], current[kind]);
+        gpuHighWater = std::max(gpuHighWater, totalGpu());
+        cpuHighWater = std::max(cpuHighWater, totalCpu());
+        if (gpuBudget > 0 && !overBudget && totalGpu() > gpuBudget) {
+            overBudget = true;
+            std::cout << "WARNING::MEMORY:: GPU usage " << formatBytes(totalGpu()) << " is over the budget of "
+                      << formatBytes(gpuBudget) << std::endl;
+        }
+    }
+};
+
+// the one registry the whole program reports to
+inline MemoryRegistry &memoryRegistry()
+{
+    static MemoryRegistry registry;
+    return registry;
+}
+
+// Estimated bytes per texel for the formats we use
+inline size_t bytesPerTexel(GLenum format)
+{
+    switch (format) {
+        case GL_RED: case GL_R8: return 1;
+        case GL_RG: case GL_RG8: return 2;
+        case GL_RGB: case GL_RGB8: case GL_SRGB: case GL_SRGB8: return 4; // padded to RGBA by most drivers
+        case GL_RGBA: case GL_RGBA8: case GL_SRGB_ALPHA: case GL_SRGB8_ALPHA8: return 4;
+        case GL_DEPTH24_STENCIL8: case GL_DEPTH_COMPONENT24: case GL_DEPTH_COMPONENT32F: return 4;
+        case GL_R16F: return 2;
+        case GL_R32F: return 4;
+        case GL_RGB16F: case GL_RGBA16F: return 8;
+        case GL_RGB32F: case GL_RGBA32F: return 16;
+        default: return 4;
+    }
+}
+
+inline const char *formatName(GLenum format)
+{
+    switch (format) {
+        case GL_RED: return "GL_RED";
+        case GL_RGB: return "GL_RGB";
+        case GL_RGBA: return "GL_RGBA";
+        case GL_RGBA8: return "GL_RGBA8";
+        case GL_DEPTH24_STENCIL8: return "GL_DEPTH24_STENCIL8";
+        case GL_DEPTH_COMPONENT24: return "GL_DEPTH_COMPONENT24";
+        case GL_R16F: return "GL_R16F";
+        case GL_R32F: return "GL_R32F";
+        case GL_RGB16F: return "GL_RGB16F";
+        case GL_RGBA16F: return "GL_RGBA16F";
+        case GL_SRGB8: return "GL_SRGB8";
+        case GL_SRGB8_ALPHA8: return "GL_SRGB8_ALPHA8";
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: return "BC1";
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: return "BC3";
+        case GL_COMPRESSED_RGBA_BPTC_UNORM: return "BC7";
+        case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT: return "BC1 sRGB";
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT: return "BC3 sRGB";
+        case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM: return "BC7 sRGB";
+        case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT: return "BC6H";
+        default: return "GL_FORMAT";
+    }
+}
+
+// bytes for a width x height image with faces layers, plus a full mip chain if mipmapped
+inline size_t textureBytes(GLenum format, int width, int height, int faces = 1, bool mipmapped = false)
+{
+    size_t bytes = bytesPerTexel(format) * (size_t)width * height * faces;
+    if (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == GL_COMPRESSED_RGBA_BPTC_UNORM || format == GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT ||
+        format == GL_COMPRESSED_SRGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT ||
+        format == GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM)
+        bytes = (size_t)((width + 3) / 4) * ((height + 3) / 4) * faces *
+                (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_SRGB_S3TC_DXT1_EXT ? 8 : 16);
+    return mipmapped ? bytes + bytes / 3 : bytes;
+}
+
+inline std::string describeImage(GLenum format, int width, int height, const char *extra = "")
+{
+    std::ostringstream text;
+    text << formatName(format) << " " << width << "x" << height << extra;
+    return text.str();
+}
+
+#endif /* memory_hpp */
@@ -13,9 +13,14 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 #include "shader.hpp"
+#include "memory.hpp"
+#include "stagingring.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
+#include <utility>
 using namespace std;
 
 struct Vertex {
@@ -37,13 +42,45 @@ public:
     vector<unsigned int> indices;
     vector<Texture>      textures;
     unsigned int VAO;
+    unsigned int thicknessVBO; //optional attribute 3, see setThickness
+    string owner; //who the memory registry should blame for this mesh, e.g. the model path
+    glm::vec3 boundsCenter; //bounding sphere in model space
+    float boundsRadius;
+    float uvDensity; //texture coordinate units per model space unit, for texture streaming (texresidency.hpp)
     
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures) {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, string owner = "mesh") {
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->textures = std::move(textures);
+        this->owner = owner;
+        thicknessVBO = 0;
         //glfwInit();
         setupMesh();
+        measure();
+    }
+    // For buffers uploadBuffers filled already (on the loader thread, loader.hpp); only the VAO is made here
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, string owner, unsigned int VBO, unsigned int EBO) {
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->textures = std::move(textures);
+        this->owner = owner;
+        this->VBO = VBO;
+        this->EBO = EBO;
+        thicknessVBO = 0;
+        setupVertexArray();
+        measure();
+    }
+    // Buffers are shared between contexts, so this works in any of them. VAOs aren't, they stay with the
+    // context that made them, so the vertex array is set up by the constructor on the render thread.
+    static void uploadBuffers(const vector<Vertex> &vertices, const vector<unsigned int> &indices, const string &owner,
+                              unsigned int &VBO, unsigned int &EBO) {
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+        //the element array binding belongs to a VAO, so both go through GL_COPY_WRITE_BUFFER (buffers don't have a type)
+        stagedBufferData(VBO, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        stagedBufferData(EBO, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        memoryRegistry().track(MEM_BUFFER, VBO, vertices.size() * sizeof(Vertex), "vertices", owner);
+        memoryRegistry().track(MEM_BUFFER, EBO, indices.size() * sizeof(unsigned int), "indices", owner);
     }
     void Draw(Shader shader) {
         unsigned int diffuseNr = 1;
@@ -69,6 +106,36 @@ public:
         glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
         glBindVertexArray(0); //Remove the VAO settings
     }
+    // Per-vertex thickness (thickness.hpp) as vertex attribute 3, one float per vertex.
+    // Meshes without it read 0 there, which is what GL gives disabled attributes.
+    void setThickness(const vector<float> &thickness) {
+        if (thickness.size() != vertices.size())
+            return;
+        if (thicknessVBO == 0)
+            glGenBuffers(1, &thicknessVBO);
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, thicknessVBO);
+        glBufferData(GL_ARRAY_BUFFER, thickness.size() * sizeof(float), &thickness[0], GL_STATIC_DRAW);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+        glBindVertexArray(0);
+        memoryRegistry().track(MEM_BUFFER, thicknessVBO, thickness.size() * sizeof(float), "thickness", owner);
+    }
+    // Frees the GL objects. Meshes get copied around by value, so this isn't done in a destructor.
+    void release() {
+        if (thicknessVBO != 0) {
+            memoryRegistry().release(MEM_BUFFER, thicknessVBO);
+            glDeleteBuffers(1, &thicknessVBO);
+            thicknessVBO = 0;
+        }
+        memoryRegistry().release(MEM_BUFFER, VBO);
+        memoryRegistry().release(MEM_BUFFER, EBO);
+        memoryRegistry().release(MEM_CPU_MESH, VAO);
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &EBO);
+        VAO = VBO = EBO = 0;
+    }
 private:
     //render data
     /*
@@ -83,18 +150,35 @@ private:
      prevent vertices from being drawn more than one time.
      */
     unsigned int VBO, EBO;
+    // the bounding sphere (around the box's center, not the smallest one) and how densely the uvs are laid out
+    void measure() {
+        glm::vec3 low(0.0f), high(0.0f);
+        for (size_t i = 0; i < vertices.size(); i++) {
+            low = i ? glm::min(low, vertices[i].Position) : vertices[i].Position;
+            high = i ? glm::max(high, vertices[i].Position) : vertices[i].Position;
+        }
+        boundsCenter = 0.5f * (low + high);
+        boundsRadius = 0.0f;
+        for (size_t i = 0; i < vertices.size(); i++)
+            boundsRadius = std::max(boundsRadius, glm::length(vertices[i].Position - boundsCenter));
+        double area = 0.0, uvArea = 0.0;
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            const Vertex &a = vertices[indices[i]], &b = vertices[indices[i + 1]], &c = vertices[indices[i + 2]];
+            area += 0.5 * glm::length(glm::cross(b.Position - a.Position, c.Position - a.Position));
+            glm::vec2 u = b.TexCoords - a.TexCoords, v = c.TexCoords - a.TexCoords;
+            uvArea += 0.5 * std::fabs(u.x * v.y - u.y * v.x);
+        }
+        uvDensity = area > 0.0 ? (float)std::sqrt(uvArea / area) : 0.0f;
+    }
     void setupMesh() {
+        uploadBuffers(vertices, indices, owner, VBO, EBO);
+        setupVertexArray();
+    }
+    void setupVertexArray() {
         glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
-        
         glBindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0] ,GL_STATIC_DRAW);
-        
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
         
         //vertex positions
         glEnableVertexAttribArray(0);
@@ -105,6 +189,10 @@ private:
         //vertex texture coords
         glEnableVertexAttribArray(2);
         glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+        
+        //The vectors stay around on the CPU after the upload, so the mesh costs memory on both sides
+        memoryRegistry().track(MEM_CPU_MESH, VAO, vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(unsigned int),
+                               "vertices+indices", owner);
     }
 };
 
@@ -0,0 +1,405 @@
+//
+//  mipgen.hpp
+//  RefractionProject
+//
+//  Mip chains built on the CPU while the textures load, instead of glGenerateMipmap on the GL thread
+//  (whose filter is up to the driver) or no mips at all (the skybox, which then aliases at our wide FOVs).
+//
+//  Every level is filtered from the one above it in float, one texel per 4-wide vector (simd.hpp), in
+//  two separable passes whose taps are worked out once per row and column:
+//
+//    box     the 2x2 average (any size: each texel weighs what it covers)
+//    kaiser  a Kaiser-windowed sinc, 6 taps across (alpha 4), sharper without ringing much
+//
+//  sRGB texels are linearized before filtering and encoded again after, so a level doesn't get darker
+//  than the one above it (alpha always stays linear). Textures wrap around their edges like GL_REPEAT.
+//  The six cubemap faces are filtered together: taps past a face's edge read the neighbouring face
+//  (through cubeFaceDirection / cubeFaceCoords), so there are no seams at the edges of the small levels.
+//
+//  With --mip-cache the levels are written next to the source (right.jpg -> right.jpg.box-srgb.mips,
+//  with a hash of the file); with --compress they go into the compressed cache instead (texcompress.hpp).
+//
+//  RefractionProject [--mips none|box|kaiser] [--mip-cache]
+//  (--bench-mips is in mipgenbench.hpp)
+//
+
+#ifndef mipgen_hpp
+#define mipgen_hpp
+
+#include "glm/glm.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+enum MipFilter { MIP_NONE, MIP_BOX, MIP_KAISER };
+
+inline const char *mipFilterName(int filter)
+{
+    return filter == MIP_BOX ? "box" : filter == MIP_KAISER ? "kaiser" : "none";
+}
+
+// what the loaders do, set from the command line (nothing, unless the viewer asks)
+struct MipSettings {
+    int filter;
+    bool cache;
+    MipSettings() : filter(MIP_NONE), cache(false) {}
+};
+
+inline MipSettings &mipSettings()
+{
+    static MipSettings settings;
+    return settings;
+}
+
+// --mips none|box|kaiser (fallback when it isn't given) [--mip-cache]
+inline void configureMips(int argc, char *argv[], const string &fallback)
+{
+    string filter = argValue(argc, argv, "--mips", fallback);
+    mipSettings().filter = filter == "kaiser" ? MIP_KAISER : filter == "box" ? MIP_BOX : MIP_NONE;
+    mipSettings().cache = hasArg(argc, argv, "--mip-cache");
+}
+
+// 8-bit levels, level 0 (the full size) first
+struct MipChain {
+    int width, height, components;
+    vector<vector<unsigned char> > levels;
+
+    MipChain() : width(0), height(0), components(0) {}
+
+    bool empty() const { return levels.empty(); }
+    int levelWidth(int level) const { return std::max(width >> level, 1); }
+    int levelHeight(int level) const { return std::max(height >> level, 1); }
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+            total += levels[i].size();
+        return total;
+    }
+};
+
+inline int mipLevelCount(int width, int height)
+{
+    int levels = 1;
+    while (width > 1 || height > 1) {
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        levels++;
+    }
+    return levels;
+}
+
+// sRGB <-> linear through tables, the encode table is fine enough to stay within a step everywhere
+struct SrgbTables {
+    float toLinear[256];
+    unsigned char toSrgb[16384];
+
+    SrgbTables()
+    {
+        for (int i = 0; i < 256; i++) {
+            float c = i / 255.0f;
+            toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for (int i = 0; i < 16384; i++) {
+            float c = i / 16383.0f;
+            float s = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+            toSrgb[i] = (unsigned char)(s * 255.0f + 0.5f);
+        }
+    }
+};
+
+inline const SrgbTables &srgbTables()
+{
+    static SrgbTables tables;
+    return tables;
+}
+
+// One axis of a downsample: for every output texel the source texels it reads (may be outside the image) and their weights
+struct MipTaps {
+    vector<int> first, count;
+    vector<float> weights;  // count[j] of them for output texel j, from offset[j]
+    vector<int> offset;
+    int lowest, highest;    // the extreme source indices read, for the border
+
+    void build(int source, int target, int filter)
+    {
+        first.assign(target, 0);
+        count.assign(target, 0);
+        offset.assign(target, 0);
+        weights.clear();
+        lowest = 0;
+        highest = source - 1;
+        float scale = (float)source / target;
+        for (int j = 0; j < target; j++) {
+            offset[j] = (int)weights.size();
+            if (filter == MIP_KAISER) {
+                // kernel over output texels: sinc(x) windowed by Kaiser over |x| < 1.5
+                const float radius = 1.5f, alpha = 4.0f;
+                float center = (j + 0.5f) * scale;
+                int lo = (int)std::floor(center - radius * scale), hi = (int)std::ceil(center + radius * scale);
+                float sum = 0.0f;
+                first[j] = lo;
+                for (int i = lo; i <= hi; i++) {
+                    float x = (i + 0.5f - center) / scale, w = 0.0f;
+                    if (std::fabs(x) < radius) {
+                        float r = x / radius;
+                        float sinc = x == 0.0f ? 1.0f : std::sin(3.14159265f * x) / (3.14159265f * x);
+                        w = sinc * besselI0(alpha * std::sqrt(1.0f - r * r)) / besselI0(alpha);
+                    }
+                    weights.push_back(w);
+                    sum += w;
+                }
+                for (size_t k = offset[j]; k < weights.size(); k++)
+                    weights[k] /= sum;
+            } else {
+                // how much of each source texel the output texel covers
+                float start = j * scale, end = (j + 1) * scale;
+                first[j] = (int)std::floor(start);
+                for (int i = first[j]; i < end; i++)
+                    weights.push_back((std::min(end, i + 1.0f) - std::max(start, (float)i)) / scale);
+            }
+            count[j] = (int)weights.size() - offset[j];
+            lowest = std::min(lowest, first[j]);
+            highest = std::max(highest, first[j] + count[j] - 1);
+        }
+    }
+
+private:
+    static float besselI0(float x)
+    {
+        float sum = 1.0f, term = 1.0f;
+        for (int k = 1; k < 20; k++) {
+            term *= (x / (2.0f * k)) * (x / (2.0f * k));
+            sum += term;
+        }
+        return sum;
+    }
+};
+
+/*
+    One level of one or six images as linear RGBA floats (or the 8-bit level 0, linearized as it's read),
+    and the neighbourhood rules for texels outside an image: wrap for textures, the next face for cubemaps.
+*/
+struct MipSource {
+    int width, height, components, faceCount;
+    bool srgb;
+    const unsigned char *bytes[6];
+    const float *floats[6];
+
+    vfloat4 texel(int face, int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= width || y >= height) {
+            if (faceCount == 6) {
+                float s, t;
+                glm::vec3 dir = cubeFaceDirection(face, (x + 0.5f) / width, (y + 0.5f) / height);
+                face = cubeFaceCoords(dir, s, t);
+                x = std::min(std::max((int)(s * width), 0), width - 1);
+                y = std::min(std::max((int)(t * height), 0), height - 1);
+            } else {
+                x = ((x % width) + width) % width;
+                y = ((y % height) + height) % height;
+            }
+        }
+        size_t index = (size_t)y * width + x;
+        if (floats[face])
+            return vfloat4::load(floats[face] + index * 4);
+        const unsigned char *p = bytes[face] + index * components;
+        const SrgbTables &tables = srgbTables();
+        // gray (and gray + alpha) images have one color byte, it goes into all three channels
+        int colors = components < 3 ? 1 : 3;
+        float rgb[3];
+        for (int c = 0; c < colors; c++)
+            rgb[c] = srgb ? tables.toLinear[p[c]] : p[c] * (1.0f / 255.0f);
+        if (colors == 1)
+            rgb[1] = rgb[2] = rgb[0];
+        float alpha = components == 4 || components == 2 ? p[components - 1] * (1.0f / 255.0f) : 1.0f;
+        return vfloat4(rgb[0], rgb[1], rgb[2], alpha);
+    }
+};
+
+// linear RGBA floats back to components bytes
+inline void encodeMipLevel(const vector<float> &floats, int components, bool srgb, vector<unsigned char> &bytes)
+{
+    size_t texels = floats.size() / 4;
+    bytes.resize(texels * components);
+    const SrgbTables &tables = srgbTables();
+    for (size_t i = 0; i < texels; i++) {
+        float texel[4];
+        (min(max(vfloat4::load(&floats[i * 4]), vfloat4(0.0f)), vfloat4(1.0f))).store(texel);
+        for (int c = 0; c < components; c++) {
+            int channel = components == 2 && c == 1 ? 3 : c; // gray + alpha
+            bytes[i * components + c] = srgb && channel < 3 ? tables.toSrgb[(int)(texel[channel] * 16383.0f + 0.5f)]
+                                                            : (unsigned char)(texel[channel] * 255.0f + 0.5f);
+        }
+    }
+}
+
+/*
+    The next level of one face of source into out (RGBA floats): the rows first, into a scratch image
+    that has the extra rows the columns need, then the columns.
+*/
+inline void downsampleFace(const MipSource &source, int face, int filter, int width, int height, vector<float> &out, int threads)
+{
+    MipTaps columns, rows;
+    columns.build(source.width, width, filter);
+    rows.build(source.height, height, filter);
+    int rowCount = rows.highest - rows.lowest + 1;
+    vector<float> horizontal((size_t)rowCount * width * 4);
+    parallelFor(rowCount, threads, [&](int r, int) {
+        int y = rows.lowest + r;
+        float *line = &horizontal[(size_t)r * width * 4];
+        for (int x = 0; x < width; x++) {
+            vfloat4 sum(0.0f);
+            const float *w = &columns.weights[columns.offset[x]];
+            for (int k = 0; k < columns.count[x]; k++)
+                sum += vfloat4(w[k]) * source.texel(face, columns.first[x] + k, y);
+            sum.store(line + x * 4);
+        }
+    });
+    out.assign((size_t)width * height * 4, 0.0f);
+    parallelFor(height, threads, [&](int y, int) {
+        const float *w = &rows.weights[rows.offset[y]];
+        for (int x = 0; x < width; x++) {
+            vfloat4 sum(0.0f);
+            for (int k = 0; k < rows.count[y]; k++)
+                sum += vfloat4(w[k]) * vfloat4::load(&horizontal[((size_t)(rows.first[y] + k - rows.lowest) * width + x) * 4]);
+            sum.store(&out[((size_t)y * width + x) * 4]);
+        }
+    });
+}
+
+/*
+    Fills chains[0..faceCount) from their 8-bit level 0 (pixels, stbi_load layout): one texture, or
+    the six faces of a cubemap (square, same size) which are filtered across their shared edges.
+*/
+inline void buildMipChains(const unsigned char *const *pixels, int faceCount, int width, int height, int components,
+                           int filter, bool srgb, MipChain *chains, int threads = 0)
+{
+    MipSource source;
+    source.width = width;
+    source.height = height;
+    source.components = components;
+    source.faceCount = faceCount;
+    source.srgb = srgb;
+    for (int f = 0; f < 6; f++) {
+        source.bytes[f] = f < faceCount ? pixels[f] : 0;
+        source.floats[f] = 0;
+    }
+    int levels = filter == MIP_NONE ? 1 : mipLevelCount(width, height);
+    for (int f = 0; f < faceCount; f++) {
+        chains[f].width = width;
+        chains[f].height = height;
+        chains[f].components = components;
+        chains[f].levels.assign(levels, vector<unsigned char>());
+        chains[f].levels[0].assign(pixels[f], pixels[f] + (size_t)width * height * components);
+    }
+    vector<vector<float> > current(faceCount), next(faceCount);
+    for (int level = 1; level < levels; level++) {
+        int levelWidth = std::max(width >> level, 1), levelHeight = std::max(height >> level, 1);
+        for (int f = 0; f < faceCount; f++) {
+            downsampleFace(source, f, filter, levelWidth, levelHeight, next[f], threads);
+            encodeMipLevel(next[f], components, srgb, chains[f].levels[level]);
+        }
+        // the floats of this level are the source of the next one
+        current.swap(next);
+        source.width = levelWidth;
+        source.height = levelHeight;
+        for (int f = 0; f < faceCount; f++)
+            source.floats[f] = current[f].data();
+    }
+}
+
+// FNV-1a of a file's bytes, 0 if it can't be read (the caches use it to notice a changed source)
+inline unsigned int fileHash(const string &path)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return 0;
+    unsigned int hash = 2166136261u;
+    char buffer[1 << 16];
+    while (file) {
+        file.read(buffer, sizeof(buffer));
+        for (std::streamsize i = 0; i < file.gcount(); i++)
+            hash = (hash ^ (unsigned char)buffer[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// "box-srgb", "kaiser", ... what the caches are named after; "" without mips
+inline string mipCacheTag(int filter, bool srgb)
+{
+    if (filter == MIP_NONE)
+        return "";
+    return string(mipFilterName(filter)) + (srgb ? "-srgb" : "");
+}
+
+// Cache layout, little endian: "MIP1", width, height, components, level count, source hash, then the levels
+inline bool saveMipChain(const string &path, const MipChain &chain, unsigned int sourceHash)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    int header[4] = { chain.width, chain.height, chain.components, (int)chain.levels.size() };
+    file.write("MIP1", 4);
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)&sourceHash, sizeof(sourceHash));
+    for (size_t i = 0; i < chain.levels.size(); i++)
+        file.write((const char *)chain.levels[i].data(), chain.levels[i].size());
+    return (bool)file;
+}
+
+inline bool loadMipChain(const string &path, unsigned int sourceHash, MipChain &chain)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    char magic[4];
+    int header[4];
+    unsigned int hash = 0;
+    file.read(magic, 4);
+    file.read((char *)header, sizeof(header));
+    file.read((char *)&hash, sizeof(hash));
+    if (!file || string(magic, 4) != "MIP1" || hash != sourceHash || header[2] < 1 || header[2] > 4 ||
+        header[3] != mipLevelCount(header[0], header[1]))
+        return false;
+    chain.width = header[0];
+    chain.height = header[1];
+    chain.components = header[2];
+    chain.levels.resize(header[3]);
+    for (int i = 0; i < header[3]; i++) {
+        chain.levels[i].resize((size_t)chain.levelWidth(i) * chain.levelHeight(i) * chain.components);
+        file.read((char *)chain.levels[i].data(), chain.levels[i].size());
+    }
+    return (bool)file;
+}
+
+// the cached chain of source if --mip-cache is on and it matches the file
+inline bool loadCachedMips(const string &source, bool srgb, MipChain &chain)
+{
+    const MipSettings &settings = mipSettings();
+    if (!settings.cache || settings.filter == MIP_NONE)
+        return false;
+    MipChain cached;
+    if (!loadMipChain(source + "." + mipCacheTag(settings.filter, srgb) + ".mips", fileHash(source), cached))
+        return false;
+    chain = cached;
+    return true;
+}
+
+inline void saveCachedMips(const string &source, bool srgb, const MipChain &chain)
+{
+    const MipSettings &settings = mipSettings();
+    if (settings.cache && chain.levels.size() > 1)
+        saveMipChain(source + "." + mipCacheTag(settings.filter, srgb) + ".mips", chain, fileHash(source));
+}
+
+#endif /* mipgen_hpp */
@@ -0,0 +1,234 @@
+//
+//  mipgenbench.hpp
+//  RefractionProject
+//
+//  Times the mip filters of mipgen.hpp on the skybox (as a cube, and each face as a plain texture)
+//  against glGenerateMipmap, and measures what they are for:
+//
+//    seam   mean difference (8-bit steps) between the texels on either side of the cube's edges,
+//           over the levels below the first; filtering across the edges should bring it down
+//    1x1    how far the last level is from the true average color of level 0 (in linear light,
+//           8-bit steps of sRGB), which is what filtering the bytes directly gets wrong
+//
+//  and checks that one and two channel (gray, gray + alpha) images come out right too.
+//
+//  RefractionProject --bench-mips [--skybox skybox/sky] [--image path] [--threads N] [--no-gl] [--software]
+//
+
+#ifndef mipgenbench_hpp
+#define mipgenbench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "renderer.hpp"
+#include "mipgen.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// mean RGB difference across the face edges of six chains, levels 1 and below
+inline double cubeSeamError(const MipChain chains[6])
+{
+    double total = 0.0;
+    long long count = 0;
+    int components = chains[0].components;
+    for (size_t level = 1; level < chains[0].levels.size(); level++) {
+        int size = chains[0].levelWidth((int)level);
+        for (int face = 0; face < 6; face++)
+            for (int i = 0; i < size; i++) {
+                // the texel on each edge and the one just past it
+                int edge[4][4] = { { i, 0, 0, -1 }, { i, size - 1, 0, 1 }, { 0, i, -1, 0 }, { size - 1, i, 1, 0 } };
+                for (int e = 0; e < 4; e++) {
+                    float s, t;
+                    glm::vec3 dir = cubeFaceDirection(face, (edge[e][0] + edge[e][2] + 0.5f) / size, (edge[e][1] + edge[e][3] + 0.5f) / size);
+                    int other = cubeFaceCoords(dir, s, t);
+                    int x = std::min((int)(s * size), size - 1), y = std::min((int)(t * size), size - 1);
+                    const unsigned char *a = &chains[face].levels[level][((size_t)edge[e][1] * size + edge[e][0]) * components];
+                    const unsigned char *b = &chains[other].levels[level][((size_t)y * size + x) * components];
+                    for (int c = 0; c < 3; c++)
+                        total += std::abs((int)a[c] - (int)b[c]);
+                    count += 3;
+                }
+            }
+    }
+    return count > 0 ? total / count : 0.0;
+}
+
+// difference between the last level and the linear-light average of level 0, in sRGB steps
+inline double averageColorError(const MipChain &chain)
+{
+    const SrgbTables &tables = srgbTables();
+    const vector<unsigned char> &top = chain.levels[0], &last = chain.levels.back();
+    size_t texels = top.size() / chain.components;
+    double error = 0.0;
+    int colors = chain.components < 3 ? 1 : 3; // gray images have one
+    for (int c = 0; c < colors; c++) {
+        double sum = 0.0;
+        for (size_t i = 0; i < texels; i++)
+            sum += tables.toLinear[top[i * chain.components + c]];
+        float average = (float)(sum / texels);
+        error += std::abs((int)tables.toSrgb[(int)(average * 16383.0f + 0.5f)] - (int)last[c]) / colors;
+    }
+    return error;
+}
+
+/*
+    Gray and gray + alpha images (one and two bytes a texel, like grayscale model textures), in buffers of
+    exactly their size: the last level has to be the average gray (in linear light with srgb) and the
+    average alpha (never sRGB). Prints a line for each, false if one is off by more than an 8-bit step.
+*/
+inline bool checkGrayMips(int threads)
+{
+    const int size = 64;
+    const SrgbTables &tables = srgbTables();
+    bool ok = true;
+    for (int components = 1; components <= 2; components++)
+        for (int srgb = 0; srgb < 2; srgb++) {
+            vector<unsigned char> pixels((size_t)size * size * components);
+            double graySum = 0.0, alphaSum = 0.0;
+            for (int y = 0; y < size; y++)
+                for (int x = 0; x < size; x++) {
+                    unsigned char *p = &pixels[((size_t)y * size + x) * components];
+                    p[0] = (unsigned char)((x * 7 + y * 3) & 255);
+                    graySum += srgb ? tables.toLinear[p[0]] : p[0] / 255.0;
+                    if (components == 2) {
+                        p[1] = (unsigned char)(255 - y * 4);
+                        alphaSum += p[1] / 255.0;
+                    }
+                }
+            const unsigned char *source = pixels.data();
+            MipChain chain;
+            buildMipChains(&source, 1, size, size, components, MIP_BOX, srgb != 0, &chain, threads);
+            double texels = (double)size * size;
+            int gray = srgb ? tables.toSrgb[(int)(graySum / texels * 16383.0 + 0.5)] : (int)(graySum / texels * 255.0 + 0.5);
+            int grayError = std::abs((int)chain.levels.back()[0] - gray);
+            int alphaError = components == 2 ? std::abs((int)chain.levels.back()[1] - (int)(alphaSum / texels * 255.0 + 0.5)) : 0;
+            bool good = chain.levels.size() == 7 && grayError <= 1 && alphaError <= 1;
+            cout << (components == 1 ? "gray" : "gray + alpha") << (srgb ? ", srgb" : "") << ": 1x1 off by " << grayError
+                 << (components == 2 ? " (gray), " + to_string(alphaError) + " (alpha)" : "") << (good ? ", ok" : ", FAILED") << endl;
+            ok = ok && good;
+        }
+    return ok;
+}
+
+// glGenerateMipmap on an uploaded texture (or cubemap), ms, waiting for the driver to finish
+inline double timeDriverMips(GLenum target, const vector<unsigned char *> &pixels, int width, int height, int components)
+{
+    GLenum format = components == 4 ? GL_RGBA : components == 3 ? GL_RGB : components == 2 ? GL_RG : GL_RED;
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(target, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (size_t i = 0; i < pixels.size(); i++)
+        glTexImage2D(target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i : target, 0, format, width, height, 0,
+                     format, GL_UNSIGNED_BYTE, pixels[i]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glFinish();
+    auto start = std::chrono::steady_clock::now();
+    glGenerateMipmap(target);
+    glFinish();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    glDeleteTextures(1, &texture);
+    return ms;
+}
+
+inline int runMipBenchmark(int argc, char *argv[])
+{
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    string image = argValue(argc, argv, "--image", "");
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    bool useGL = !hasArg(argc, argv, "--no-gl");
+
+    vector<string> paths = skyboxFaces(skybox);
+    vector<unsigned char *> faces;
+    int size = 0, components = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        int width, height, channels;
+        unsigned char *pixels = stbi_load(paths[i].c_str(), &width, &height, &channels, 0);
+        if (!pixels || width != height || (size && (width != size || channels != components))) {
+            cout << "ERROR::MIPGEN:: " << paths[i] << " is missing or doesn't match the other faces" << endl;
+            stbi_image_free(pixels);
+            for (size_t f = 0; f < faces.size(); f++)
+                stbi_image_free(faces[f]);
+            return -1;
+        }
+        size = width;
+        components = channels;
+        faces.push_back(pixels);
+    }
+    int imageWidth = size, imageHeight = size, imageComponents = components;
+    unsigned char *imagePixels = faces[0];
+    if (!image.empty()) {
+        imagePixels = stbi_load(image.c_str(), &imageWidth, &imageHeight, &imageComponents, 0);
+        if (!imagePixels) {
+            cout << "ERROR::MIPGEN:: could not load " << image << endl;
+            imagePixels = faces[0];
+            imageWidth = imageHeight = size;
+            imageComponents = components;
+        }
+    }
+
+    GLFWwindow *window = 0;
+    if (useGL) {
+        window = createHeadlessContext(hasArg(argc, argv, "--software"));
+        if (!window)
+            return -1;
+    }
+
+    cout << "Mip generation, " << (threads > 0 ? threads : hardwareThreads()) << " threads, " << skybox << " (6 x " << size << "x"
+         << size << ")" << (image.empty() ? "" : ", " + image) << endl;
+    cout << left << setw(9) << "filter" << setw(7) << "srgb" << setw(12) << "edges" << right << setw(10) << "ms" << setw(11)
+         << "Mpixels/s" << setw(8) << "seam" << setw(8) << "1x1" << setw(12) << "image ms" << setw(8) << "1x1" << endl;
+    int filters[2] = { MIP_BOX, MIP_KAISER };
+    for (int f = 0; f < 2; f++)
+        for (int srgb = 0; srgb < 2; srgb++)
+            for (int across = 1; across >= 0; across--) {
+                MipChain chains[6];
+                auto start = std::chrono::steady_clock::now();
+                if (across)
+                    buildMipChains(&faces[0], 6, size, size, components, filters[f], srgb != 0, chains, threads);
+                else
+                    for (int face = 0; face < 6; face++)
+                        buildMipChains(&faces[face], 1, size, size, components, filters[f], srgb != 0, &chains[face], threads);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                double pixels = 6.0 * size * size;
+
+                MipChain single;
+                start = std::chrono::steady_clock::now();
+                buildMipChains(&imagePixels, 1, imageWidth, imageHeight, imageComponents, filters[f], srgb != 0, &single, threads);
+                double imageMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+                double averageError = 0.0;
+                for (int face = 0; face < 6; face++)
+                    averageError += averageColorError(chains[face]) / 6.0;
+                cout << left << setw(9) << mipFilterName(filters[f]) << setw(7) << (srgb ? "yes" : "no") << setw(12)
+                     << (across ? "across" : "per face") << right << fixed << setprecision(1) << setw(10) << ms << setw(11)
+                     << pixels / (ms * 1000.0) << setprecision(2) << setw(8) << cubeSeamError(chains) << setw(8) << averageError
+                     << setprecision(1) << setw(12) << imageMs << setprecision(2) << setw(8) << averageColorError(single) << endl;
+                cout.unsetf(ios::floatfield);
+            }
+    bool grayOk = checkGrayMips(threads);
+    if (useGL) {
+        double cubeMs = timeDriverMips(GL_TEXTURE_CUBE_MAP, faces, size, size, components);
+        double imageMs = timeDriverMips(GL_TEXTURE_2D, vector<unsigned char *>(1, imagePixels), imageWidth, imageHeight, imageComponents);
+        cout << "glGenerateMipmap: cube " << fixed << setprecision(1) << cubeMs << " ms (" << 6.0 * size * size / (cubeMs * 1000.0)
+             << " Mpixels/s), image " << imageMs << " ms, on the GL thread" << endl;
+        cout.unsetf(ios::floatfield);
+        destroyHeadlessContext(window);
+    }
+    if (imagePixels != faces[0])
+        stbi_image_free(imagePixels);
+    for (size_t f = 0; f < faces.size(); f++)
+        stbi_image_free(faces[f]);
+    return grayOk ? 0 : 1;
+}
+
+#endif /* mipgenbench_hpp */
@@ -18,7 +18,18 @@
 
 #include "mesh.h"
 #include "shader.hpp"
+#include "memory.hpp"
+#include "timeline.hpp"
+#include "jobs.hpp"
+#include "loader.hpp"
+#include "procedural.hpp"
+#include "texcompress.hpp"
+#include "texpack.hpp"
+#include "texresidency.hpp"
 
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -29,6 +40,22 @@ using namespace std;
 
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
 
+// An image decoded by stbi_load, waiting to be uploaded (decodeImage works on any thread, uploadTexture needs GL)
+struct DecodedImage {
+    unsigned char *data;
+    int width, height, components;
+    string filename;
+    MipChain mips;                // with --mips, in place of data
+    CompressedTexture compressed; // with --compress, in place of both
+    TexturePack pack;             // mapped from a texture pack, in place of all three
+};
+
+DecodedImage decodeImage(const string &filename, bool gamma = false);
+unsigned int uploadTexture(DecodedImage &image, bool gamma = false);
+// the same two uploads on the loader thread (loader.hpp), done runs on the render thread once they're on the GPU
+void uploadTextureAsync(DecodedImage image, bool gamma, std::function<void(unsigned int)> done);
+void uploadMeshAsync(MeshData data, vector<Texture> textures, std::function<void(Mesh &)> done);
+
 class Model
 {
 public:
@@ -36,28 +63,76 @@ public:
     vector<Texture> textures_loaded;    // stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
     vector<Mesh>    meshes;
     string directory;
+    string path;        // file the model was loaded from, used as the owner in the memory registry
     bool gammaCorrection;
 
-    // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    /*
+        constructor, expects a filepath to a 3D model. With the loader thread running (--loader-thread) the
+        textures and buffers are uploaded there and each mesh is added once its upload is published by
+        glLoader().poll(), so the model has to stay where it is until then; finishLoading() waits for them.
+    */
+    Model(string const &path, bool gamma = false) : path(path), gammaCorrection(gamma), pendingMeshes(0)
     {
         loadModel(path);
     }
 
+    // constructor for meshes made in code instead of loaded from a file (see procedural.hpp)
+    Model(vector<Mesh> generated) : meshes(std::move(generated)), gammaCorrection(false), pendingMeshes(0)
+    {
+        if(!meshes.empty())
+            path = meshes[0].owner;
+    }
+
     // draws the model, and thus all its meshes
     void Draw(Shader shader)
     {
         for(unsigned int i = 0; i < meshes.size(); i++)
             meshes[i].Draw(shader);
     }
+
+    // meshes still on the loader thread
+    int pending() const { return pendingMeshes; }
+
+    // waits for the loader thread's uploads, for code that needs every mesh now (the bakers)
+    void finishLoading()
+    {
+        if (pendingMeshes > 0)
+            glLoader().finish();
+    }
+
+    // deletes the GL buffers of all meshes and the textures, the model can't be drawn afterwards
+    void release()
+    {
+        finishLoading();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].release();
+        for(unsigned int i = 0; i < textures_loaded.size(); i++)
+        {
+            if (textureResidency().release(textures_loaded[i].id))
+                continue;
+            memoryRegistry().release(MEM_TEXTURE, textures_loaded[i].id);
+            glDeleteTextures(1, &textures_loaded[i].id);
+        }
+        textures_loaded.clear();
+    }
     
 private:
+    // vertices and indices of one aiMesh, converted on a worker
+    struct ConvertedMesh {
+        vector<Vertex> vertices;
+        vector<unsigned int> indices;
+    };
+    vector<aiMesh *> sceneMeshes;           // in the order processNode meets them
+    map<string, DecodedImage> decoded;      // material textures decoded ahead, by their path in the material
+    int pendingMeshes;
+
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const &path)
     {
         // read file via ASSIMP
         Assimp::Importer importer;
         const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        startupTimeline().mark("assimp import " + path);
         // check for errors
         if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
         {
@@ -69,6 +144,44 @@ private:
 
         // process ASSIMP's root node recursively
         processNode(scene->mRootNode, scene);
+        /*
+            Converting the meshes and decoding their textures doesn't need GL, so that runs on the job
+            system: a job per mesh and per texture. The GL objects are made here afterwards, in order.
+        */
+        vector<ConvertedMesh> converted(sceneMeshes.size());
+        vector<string> texturePaths;
+        for(unsigned int i = 0; i < sceneMeshes.size(); i++)
+            collectTexturePaths(scene->mMaterials[sceneMeshes[i]->mMaterialIndex], texturePaths);
+        JobSystem &jobs = jobSystem();
+        vector<JobHandle> work;
+        for(unsigned int i = 0; i < sceneMeshes.size(); i++)
+        {
+            aiMesh *mesh = sceneMeshes[i];
+            ConvertedMesh *out = &converted[i];
+            work.push_back(jobs.submit([mesh, out] { convertMesh(mesh, *out); }));
+        }
+        vector<DecodedImage> images(texturePaths.size());
+        for(unsigned int i = 0; i < texturePaths.size(); i++)
+        {
+            DecodedImage *out = &images[i];
+            string filename = directory + '/' + texturePaths[i];
+            bool gamma = gammaCorrection;
+            work.push_back(jobs.submit([out, filename, gamma] { *out = decodeImage(filename, gamma); }));
+        }
+        jobs.wait(work);
+        for(unsigned int i = 0; i < texturePaths.size(); i++)
+            decoded[texturePaths[i]] = std::move(images[i]); // moved, the mip levels are tracked by address
+        startupTimeline().mark("convert meshes " + path);
+
+        for(unsigned int i = 0; i < sceneMeshes.size(); i++)
+        {
+            if(glLoader().running())
+                submitMesh(sceneMeshes[i], converted[i], scene);
+            else
+                meshes.push_back(processMesh(sceneMeshes[i], converted[i], scene));
+        }
+        sceneMeshes.clear();
+        decoded.clear();
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
@@ -79,8 +192,7 @@ private:
         {
             // the node object only contains indices to index the actual objects in the scene.
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            sceneMeshes.push_back(scene->mMeshes[node->mMeshes[i]]);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
@@ -90,14 +202,31 @@ private:
 
     }
     
+    // The texture paths of a material, for decoding them ahead
+    void collectTexturePaths(aiMaterial *material, vector<string> &paths)
+    {
+        const aiTextureType types[] = { aiTextureType_DIFFUSE, aiTextureType_SPECULAR };
+        for(int t = 0; t < 2; t++)
+        {
+            for(unsigned int i = 0; i < material->GetTextureCount(types[t]); i++)
+            {
+                aiString str;
+                material->GetTexture(types[t], i, &str);
+                if(std::find(paths.begin(), paths.end(), string(str.C_Str())) == paths.end())
+                    paths.push_back(str.C_Str());
+            }
+        }
+    }
+
     /*
-        Converts the aiMesh object to our mesh object
+        Converts the aiMesh's vertices and faces to ours, runs on any thread
     */
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    static void convertMesh(aiMesh *mesh, ConvertedMesh &out)
     {
-        vector<Vertex> vertices;
-        vector<unsigned int> indices;
-        vector<Texture> textures;
+        vector<Vertex> &vertices = out.vertices;
+        vector<unsigned int> &indices = out.indices;
+        vertices.reserve(mesh->mNumVertices);
+        indices.reserve(mesh->mNumFaces * 3);
         
         for(unsigned int i = 0; i < mesh->mNumVertices; i++)
         {
@@ -132,7 +261,41 @@ private:
             for(unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);
         }
-        
+    }
+
+    /*
+        Converts the aiMesh object to our mesh object
+    */
+    Mesh processMesh(aiMesh *mesh, ConvertedMesh &converted, const aiScene *scene)
+    {
+        return Mesh(converted.vertices, converted.indices, meshTextures(mesh, scene), path);
+    }
+
+    /*
+        processMesh for the loader thread: the buffers go up there and the mesh joins meshes when the render
+        thread publishes it. Its textures were submitted before it and publish in order, so their ids are in
+        textures_loaded by then.
+    */
+    void submitMesh(aiMesh *mesh, ConvertedMesh &converted, const aiScene *scene)
+    {
+        MeshData data;
+        data.vertices = std::move(converted.vertices);
+        data.indices = std::move(converted.indices);
+        data.owner = path;
+        pendingMeshes++;
+        uploadMeshAsync(std::move(data), meshTextures(mesh, scene), [this](Mesh &uploaded) {
+            for(unsigned int t = 0; t < uploaded.textures.size(); t++)
+                for(unsigned int j = 0; j < textures_loaded.size(); j++)
+                    if(textures_loaded[j].path == uploaded.textures[t].path)
+                        uploaded.textures[t].id = textures_loaded[j].id;
+            meshes.push_back(uploaded);
+            pendingMeshes--;
+        });
+    }
+
+    vector<Texture> meshTextures(aiMesh *mesh, const aiScene *scene)
+    {
+        vector<Texture> textures;
         if(mesh->mMaterialIndex >= 0) {
             aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
             vector<Texture> diffuseMaps = loadMaterialTextures(material,
@@ -142,7 +305,7 @@ private:
                                                 aiTextureType_SPECULAR, "texture_specular");
             textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
         }
-        return Mesh(vertices, indices, textures);
+        return textures;
     }
     
     vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
@@ -165,28 +328,140 @@ private:
             if(!skip)
             {   // if texture hasn't been loaded already, load it
                 Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), directory);
+                map<string, DecodedImage>::iterator ahead = decoded.find(str.C_Str());
+                texture.id = 0;
+                if(!glLoader().running())
+                    texture.id = ahead != decoded.end() ? uploadTexture(ahead->second, gammaCorrection)
+                                                         : TextureFromFile(str.C_Str(), directory, gammaCorrection);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
                 textures_loaded.push_back(texture); // add to loaded textures
+                if(glLoader().running())
+                {
+                    //the id arrives when the upload is published, before the meshes using it (submitMesh)
+                    size_t slot = textures_loaded.size() - 1;
+                    DecodedImage image = ahead != decoded.end() ? std::move(ahead->second)
+                                                                : decodeImage(directory + '/' + str.C_Str(), gammaCorrection);
+                    uploadTextureAsync(std::move(image), gammaCorrection, [this, slot](unsigned int id) { textures_loaded[slot].id = id; });
+                }
             }
         }
         return textures;
     }
 };
 
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
+DecodedImage decodeImage(const string &filename, bool gamma)
 {
-    string filename = string(path);
-    filename = directory + '/' + filename;
+    DecodedImage image;
+    image.filename = filename;
+    image.data = 0;
+    //mips are filtered in linear space when the texels are sRGB; compressed textures always get mips
+    int filter = mipSettings().filter;
+    if (filter == MIP_NONE && textureCompression().enabled)
+        filter = MIP_BOX;
+    string mipTag = mipCacheTag(filter, gamma);
+    //a texture pack has every level ready to upload (texpack.hpp)
+    if (openImagePack(filename, gamma, image.pack)) {
+        image.width = image.pack.width;
+        image.height = image.pack.height;
+        image.components = image.pack.format == GL_RED ? 1 : image.pack.format == GL_RG ? 2 : image.pack.format == GL_RGB ? 3 : 4;
+        return image;
+    }
+    //with --compress a cached texture doesn't need decoding at all
+    if (loadCachedTexture(filename, mipTag, image.compressed)) {
+        image.width = image.compressed.width;
+        image.height = image.compressed.height;
+        image.components = 4;
+        return image;
+    }
+    if (loadCachedMips(filename, gamma, image.mips)) {
+        image.width = image.mips.width;
+        image.height = image.mips.height;
+        image.components = image.mips.components;
+    } else {
+        image.data = stbi_load(filename.c_str(), &image.width, &image.height, &image.components, 0);
+        if (image.data && filter != MIP_NONE) {
+            buildMipChains(&image.data, 1, image.width, image.height, image.components, filter, gamma && image.components >= 3,
+                           &image.mips);
+            if (filter == mipSettings().filter)
+                saveCachedMips(filename, gamma, image.mips);
+            stbi_image_free(image.data);
+            image.data = 0;
+        }
+    }
+    const unsigned char *pixels = image.mips.empty() ? image.data : image.mips.levels[0].data();
+    if (compressDecoded(filename, pixels, image.width, image.height, image.components, &image.mips, mipTag, image.compressed)) {
+        stbi_image_free(image.data);
+        image.data = 0;
+        image.mips = MipChain();
+    }
+    //the decoded pixels only live until the upload is done, but they count towards the peak
+    if (image.data)
+        memoryRegistry().track(MEM_CPU_IMAGE, (unsigned long long)(size_t)image.data, (size_t)image.width * image.height * image.components, "decoded image", filename);
+    if (!image.mips.empty())
+        memoryRegistry().track(MEM_CPU_IMAGE, (unsigned long long)(size_t)image.mips.levels[0].data(), image.mips.bytes(), "mip chain", filename);
+    return image;
+}
+
+unsigned int uploadTexture(DecodedImage &image, bool gamma)
+{
+    unsigned char *data = image.data;
+    int width = image.width, height = image.height, nrComponents = image.components;
+    const string &filename = image.filename;
+    //gamma: the texels are sRGB, sampling linearizes them (GL_RED stays as it is)
+    bool srgb = gamma && nrComponents >= 3;
+    //with --texture-budget-mb only the small levels go up now, the rest streams in as it's needed (texresidency.hpp)
+    if (textureResidency().enabled && (data || !image.mips.empty() || !image.compressed.empty() || !image.pack.empty()))
+    {
+        if (data)
+        {
+            buildMipChains((const unsigned char *const *)&image.data, 1, width, height, nrComponents, MIP_BOX, srgb, &image.mips);
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)data);
+            stbi_image_free(data);
+            image.data = 0;
+        }
+        else if (!image.mips.empty())
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)image.mips.levels[0].data());
+        return textureResidency().add(filename, width, height, srgb, image.pack, image.compressed, image.mips);
+    }
 
     unsigned int textureID;
     glGenTextures(1, &textureID);
+    if (!image.pack.empty())
+    {
+        //straight from the mapping, the pages are read as the driver copies them
+        const TexturePack &pack = image.pack;
+        glBindTexture(GL_TEXTURE_2D, textureID);
+        uploadTexturePack(GL_TEXTURE_2D, pack, 0, srgb);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, pack.levels - 1);
+        GLenum format = srgb ? srgbInternalFormat(pack.internalFormat) : pack.internalFormat;
+        memoryRegistry().track(MEM_TEXTURE, textureID, textureBytes(format, width, height, 1, pack.levels > 1),
+                               describeImage(format, width, height, pack.levels > 1 ? " +mips" : ""), filename);
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, pack.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        image.pack = TexturePack();
+    }
+    else if (!image.compressed.empty())
+    {
+        const CompressedTexture &compressed = image.compressed;
+        glBindTexture(GL_TEXTURE_2D, textureID);
+        uploadCompressedTexture(GL_TEXTURE_2D, compressed, srgb);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)compressed.levels.size() - 1);
+        GLenum format = blockFormatGL(compressed.format, srgb);
+        memoryRegistry().track(MEM_TEXTURE, textureID, textureBytes(format, width, height, 1, compressed.levels.size() > 1),
+                               describeImage(format, width, height, " +mips"), filename);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        image.compressed = CompressedTexture();
+    }
+    else if (data || !image.mips.empty())
     {
         GLenum format;
         if (nrComponents == 1)
@@ -195,25 +470,107 @@ unsigned int TextureFromFile(const char *path, const string &directory, bool gam
             format = GL_RGB;
         else if (nrComponents == 4)
             format = GL_RGBA;
+        GLenum internalFormat = srgb ? (nrComponents == 4 ? GL_SRGB8_ALPHA8 : GL_SRGB8) : format;
 
         glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        if (!image.mips.empty())
+        {
+            //the levels mipgen.hpp made on the loading thread, rows are tightly packed
+            const MipChain &mips = image.mips;
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            for (size_t i = 0; i < mips.levels.size(); i++)
+                stagedTexImage2D(GL_TEXTURE_2D, (GLint)i, internalFormat, mips.levelWidth((int)i), mips.levelHeight((int)i), format,
+                                 GL_UNSIGNED_BYTE, mips.levels[i].data(), mips.levels[i].size());
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)mips.levels.size() - 1);
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)mips.levels[0].data());
+            image.mips = MipChain();
+        }
+        else
+        {
+            stagedTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, format, GL_UNSIGNED_BYTE, data,
+                             (size_t)width * height * nrComponents);
+            glGenerateMipmap(GL_TEXTURE_2D);
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)data);
+            stbi_image_free(data);
+            image.data = 0;
+        }
+        memoryRegistry().track(MEM_TEXTURE, textureID, textureBytes(internalFormat, width, height, 1, true),
+                               describeImage(internalFormat, width, height, " +mips"), filename);
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
     }
     else
     {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        std::cout << "Texture failed to load at path: " << filename << std::endl;
     }
 
     return textureID;
 }
 
+unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
+{
+    string filename = string(path);
+    filename = directory + '/' + filename;
+    DecodedImage image = decodeImage(filename, gamma);
+    return uploadTexture(image, gamma);
+}
+
+// bytes an upload of image sends (what uploadTexture is about to free)
+size_t decodedImageBytes(const DecodedImage &image)
+{
+    if (!image.pack.empty())
+        return textureBytes(image.pack.internalFormat, image.width, image.height, image.pack.faces, image.pack.levels > 1);
+    if (!image.compressed.empty())
+        return image.compressed.bytes();
+    if (!image.mips.empty())
+        return image.mips.bytes();
+    return image.data ? (size_t)image.width * image.height * image.components : 0;
+}
+
+/*
+    uploadTexture on the loader thread; done gets the texture on the render thread once it's on the GPU.
+    With texture streaming (texresidency.hpp) the residency manager owns the texture and is render thread
+    only, so then it's uploaded right away like before.
+*/
+void uploadTextureAsync(DecodedImage image, bool gamma, std::function<void(unsigned int)> done)
+{
+    if (textureResidency().enabled) {
+        done(uploadTexture(image, gamma));
+        return;
+    }
+    // moved, the mip levels are tracked by address
+    std::shared_ptr<DecodedImage> pending = std::make_shared<DecodedImage>(std::move(image));
+    std::shared_ptr<unsigned int> texture = std::make_shared<unsigned int>(0);
+    glLoader().submit([pending, gamma, texture] {
+        size_t bytes = decodedImageBytes(*pending);
+        *texture = uploadTexture(*pending, gamma);
+        return bytes;
+    }, [texture, done] { done(*texture); });
+}
+
+// The buffers on the loader thread, the VAO on the render thread (they can't be shared), done gets the mesh there
+void uploadMeshAsync(MeshData data, vector<Texture> textures, std::function<void(Mesh &)> done)
+{
+    struct Pending {
+        MeshData data;
+        vector<Texture> textures;
+        unsigned int VBO, EBO;
+    };
+    std::shared_ptr<Pending> pending = std::make_shared<Pending>();
+    pending->data = std::move(data);
+    pending->textures = std::move(textures);
+    glLoader().submit([pending] {
+        Mesh::uploadBuffers(pending->data.vertices, pending->data.indices, pending->data.owner, pending->VBO, pending->EBO);
+        return pending->data.vertices.size() * sizeof(Vertex) + pending->data.indices.size() * sizeof(unsigned int);
+    }, [pending, done] {
+        Mesh mesh(std::move(pending->data.vertices), std::move(pending->data.indices), std::move(pending->textures),
+                  pending->data.owner, pending->VBO, pending->EBO);
+        done(mesh);
+    });
+}
+
 #endif
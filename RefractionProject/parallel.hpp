@@ -0,0 +1,47 @@
+//
+//  parallel.hpp
+//  RefractionProject
+//
+//  parallelFor for the CPU-side renderers and bakers: runs body(i) for every i in [0, count) on
+//  up to threads threads (0 = one per core). Items are handed out one at a time from a shared counter,
+//  so uneven items (tiles with lots of triangles, ...) balance themselves. The threads are the job
+//  system's workers (jobs.hpp): threads - 1 helper jobs pull items next to the calling thread, so a
+//  call no longer starts and joins its own threads, and asking for more threads than there are
+//  workers just means some helpers find nothing left to do.
+//
+
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include "jobs.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// body(item, thread) where thread is in [0, threads used), handy for per-thread scratch memory
+template <typename Body>
+void parallelFor(int count, int threads, const Body &body)
+{
+    if (threads <= 0)
+        threads = hardwareThreads();
+    threads = std::max(1, std::min(threads, count));
+    if (threads == 1) {
+        for (int i = 0; i < count; i++)
+            body(i, 0);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto worker = [&](int thread) {
+        for (int i = next++; i < count; i = next++)
+            body(i, thread);
+    };
+    JobSystem &jobs = jobSystem();
+    std::vector<JobHandle> helpers;
+    for (int t = 1; t < threads; t++)
+        helpers.push_back(jobs.submit([&worker, t] { worker(t); }));
+    worker(0); // the calling thread works too
+    jobs.wait(helpers);
+}
+
+#endif /* parallel_hpp */
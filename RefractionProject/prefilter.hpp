@@ -0,0 +1,427 @@
+//
+//  prefilter.hpp
+//  RefractionProject
+//
+//  The skybox convolved with the GGX lobe for rough (frosted) glass: a second, smaller cubemap whose
+//  mip levels go from roughness 0 (level 0) to 1 (the last level), so the refraction shader gets a blurry
+//  sample with one textureLod(prefilteredSkybox, T2, roughness * maxLod) instead of many taps.
+//
+//  Every texel of every level importance-samples the lobe around its own direction (N = V = R, like
+//  Karis' split sum), with a Hammersley set that is the same for every texel of a level. Each sample
+//  reads the skybox's mip chain (mipgen.hpp, filtered across the face edges) at the level whose texels
+//  cover the solid angle the sample stands for (Colbert and Krivanek's filtered importance sampling), so
+//  a hundred or so samples come out smooth. Filtering happens in linear light; the result is encoded
+//  back to sRGB bytes because the shader samples the skybox as it is.
+//
+//  The texels are split across the workers; a prefiltered skybox is cached in its folder
+//  (skybox/sky/prefilter128x128.ggx: size x samples) with a hash of the six faces.
+//
+//  RefractionProject --roughness 0.3 [--prefilter-size 128] [--prefilter-samples 128] [--no-prefilter-cache]
+//  RefractionProject --bench-prefilter [--skybox skybox/sky] [--sizes 32,64,128,256] [--samples 128]
+//                    [--threads N] [--out prefilter]
+//
+
+#ifndef prefilter_hpp
+#define prefilter_hpp
+
+#include "glm/glm.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "mipgen.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// The prefiltered cubemap: level i of every face is roughness i / (levels - 1), RGB bytes, sRGB encoded
+struct PrefilteredSky {
+    int size, samples;
+    MipChain faces[6];
+
+    PrefilteredSky() : size(0), samples(0) {}
+
+    bool empty() const { return faces[0].empty(); }
+    int levels() const { return (int)faces[0].levels.size(); }
+    float roughness(int level) const { return levels() > 1 ? (float)level / (levels() - 1) : 0.0f; }
+};
+
+// levels down to 4x4 at most, smaller ones just smear the faces into blocks
+inline int prefilterLevelCount(int size) { return std::max(1, mipLevelCount(size, size) - 2); }
+
+// The skybox's mip chain as linear RGBA floats, from the first level no bigger than needed
+struct LinearSky {
+    int size;                        // of levels[.][0]
+    vector<vector<float> > levels[6];
+
+    vfloat4 bilinear(int face, int level, float s, float t) const
+    {
+        int n = std::max(size >> level, 1);
+        float x = s * n - 0.5f, y = t * n - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float wx = x - fx, wy = y - fy;
+        int x0 = std::max((int)fx, 0), y0 = std::max((int)fy, 0);
+        int x1 = std::min((int)fx + 1, n - 1), y1 = std::min((int)fy + 1, n - 1);
+        x0 = std::min(x0, n - 1);
+        y0 = std::min(y0, n - 1);
+        const float *p = levels[face][level].data();
+        vfloat4 top = vfloat4::load(p + ((size_t)y0 * n + x0) * 4) * vfloat4(1.0f - wx) + vfloat4::load(p + ((size_t)y0 * n + x1) * 4) * vfloat4(wx);
+        vfloat4 bottom = vfloat4::load(p + ((size_t)y1 * n + x0) * 4) * vfloat4(1.0f - wx) + vfloat4::load(p + ((size_t)y1 * n + x1) * 4) * vfloat4(wx);
+        return top * vfloat4(1.0f - wy) + bottom * vfloat4(wy);
+    }
+
+    // trilinear, lod relative to levels[.][0]
+    vfloat4 sample(const glm::vec3 &dir, float lod) const
+    {
+        float s, t;
+        int face = cubeFaceCoords(dir, s, t);
+        int last = (int)levels[face].size() - 1;
+        lod = std::min(std::max(lod, 0.0f), (float)last);
+        int level = std::min((int)lod, last), next = std::min(level + 1, last);
+        float blend = lod - level;
+        vfloat4 a = bilinear(face, level, s, t);
+        return blend > 0.0f ? a + (bilinear(face, next, s, t) - a) * vfloat4(blend) : a;
+    }
+};
+
+inline void linearSkyFromChains(const MipChain chains[6], int largest, LinearSky &sky)
+{
+    const SrgbTables &tables = srgbTables();
+    int first = 0;
+    while (first + 1 < (int)chains[0].levels.size() && chains[0].levelWidth(first) > largest)
+        first++;
+    sky.size = chains[0].levelWidth(first);
+    for (int face = 0; face < 6; face++) {
+        sky.levels[face].clear();
+        for (size_t level = first; level < chains[face].levels.size(); level++) {
+            const vector<unsigned char> &bytes = chains[face].levels[level];
+            int components = chains[face].components;
+            size_t texels = bytes.size() / components;
+            vector<float> floats(texels * 4, 1.0f);
+            for (size_t i = 0; i < texels; i++)
+                for (int c = 0; c < 3; c++)
+                    floats[i * 4 + c] = tables.toLinear[bytes[i * components + c]];
+            sky.levels[face].push_back(floats);
+        }
+    }
+}
+
+// One importance sample of the GGX lobe around +z, with the source lod it should read
+struct LobeSample {
+    glm::vec3 direction;
+    float weight, lod;
+};
+
+inline float radicalInverseBase2(unsigned int bits)
+{
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return bits * 2.3283064365386963e-10f;
+}
+
+// the reflected directions L of count half vectors H, weighted by N.L; sourceSize is the sky's level 0
+inline vector<LobeSample> ggxLobe(float roughness, int count, int sourceSize)
+{
+    vector<LobeSample> lobe;
+    float a = roughness * roughness, a2 = a * a;
+    float texelSolidAngle = 4.0f * 3.14159265f / (6.0f * sourceSize * sourceSize);
+    for (int i = 0; i < count; i++) {
+        float u = (i + 0.5f) / count, v = radicalInverseBase2((unsigned int)i);
+        float phi = 2.0f * 3.14159265f * u;
+        float cosTheta = std::sqrt((1.0f - v) / (1.0f + (a2 - 1.0f) * v)), sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+        // V = N = +z: L = 2 (V.H) H - V
+        LobeSample sample;
+        sample.direction = glm::vec3(2.0f * cosTheta * sinTheta * std::cos(phi), 2.0f * cosTheta * sinTheta * std::sin(phi),
+                                     2.0f * cosTheta * cosTheta - 1.0f);
+        sample.weight = sample.direction.z;
+        if (sample.weight <= 0.0f)
+            continue;
+        // pdf of L = D(H) (N.H) / (4 V.H) = D / 4 here
+        float d = cosTheta * cosTheta * (a2 - 1.0f) + 1.0f;
+        float pdf = a2 / (3.14159265f * d * d) / 4.0f;
+        float sampleSolidAngle = 1.0f / (count * pdf + 1e-4f);
+        sample.lod = std::max(0.5f * std::log2(sampleSolidAngle / texelSolidAngle) + 1.0f, 0.0f);
+        lobe.push_back(sample);
+    }
+    return lobe;
+}
+
+/*
+    Prefilters sky to a size x size cubemap with levels levels, as linear RGBA floats: levels[face][level].
+    Level i is roughness i / (levels - 1).
+*/
+inline void prefilterLinearSky(const LinearSky &sky, int size, int samples, int levels, vector<vector<float> > out[6], int threads = 0)
+{
+    for (int face = 0; face < 6; face++)
+        out[face].assign(levels, vector<float>());
+    for (int level = 0; level < levels; level++) {
+        int n = std::max(size >> level, 1);
+        float roughness = levels > 1 ? (float)level / (levels - 1) : 0.0f;
+        // roughness 0 is one tap at the level as coarse as the output
+        vector<LobeSample> lobe;
+        if (roughness > 0.0f) {
+            lobe = ggxLobe(roughness, samples, sky.size);
+        } else {
+            LobeSample mirror = { glm::vec3(0.0f, 0.0f, 1.0f), 1.0f, std::log2((float)sky.size / n) };
+            lobe.push_back(mirror);
+        }
+        for (int face = 0; face < 6; face++)
+            out[face][level].resize((size_t)n * n * 4);
+        parallelFor(6 * n, threads, [&](int row, int) {
+            int face = row / n, y = row % n;
+            for (int x = 0; x < n; x++) {
+                glm::vec3 normal = glm::normalize(cubeFaceDirection(face, (x + 0.5f) / n, (y + 0.5f) / n));
+                glm::vec3 up = std::fabs(normal.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+                glm::vec3 tangent = glm::normalize(glm::cross(up, normal)), bitangent = glm::cross(normal, tangent);
+                vfloat4 sum(0.0f);
+                float weight = 0.0f;
+                for (size_t i = 0; i < lobe.size(); i++) {
+                    const LobeSample &l = lobe[i];
+                    glm::vec3 dir = tangent * l.direction.x + bitangent * l.direction.y + normal * l.direction.z;
+                    sum += sky.sample(dir, l.lod) * vfloat4(l.weight);
+                    weight += l.weight;
+                }
+                (sum / vfloat4(weight)).store(&out[face][level][((size_t)y * n + x) * 4]);
+            }
+        });
+    }
+}
+
+/*
+    Prefilters the skybox whose box-filtered mip chains are chains (six faces, filtered together) to a
+    size x size cubemap. ms gets the time it took, not counting the mip chain.
+*/
+inline void prefilterSky(const MipChain chains[6], int size, int samples, PrefilteredSky &out, int threads = 0, double *ms = 0)
+{
+    auto start = std::chrono::steady_clock::now();
+    LinearSky sky;
+    linearSkyFromChains(chains, 2 * size, sky);
+    out.size = size;
+    out.samples = samples;
+    int levels = prefilterLevelCount(size);
+    vector<vector<float> > linear[6];
+    prefilterLinearSky(sky, size, samples, levels, linear, threads);
+    for (int face = 0; face < 6; face++) {
+        out.faces[face].width = out.faces[face].height = size;
+        out.faces[face].components = 3;
+        out.faces[face].levels.assign(levels, vector<unsigned char>());
+        for (int level = 0; level < levels; level++)
+            encodeMipLevel(linear[face][level], 3, true, out.faces[face].levels[level]);
+    }
+    if (ms)
+        *ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the box-filtered, edge-aware mip chains of the six faces the way the GL cubemap gets them (CpuCubemap's bytes)
+inline bool skyMipChains(const vector<string> &paths, MipChain chains[6], int threads = 0)
+{
+    CpuCubemap cube;
+    if (paths.size() < 6 || !cube.load(paths))
+        return false;
+    const unsigned char *faces[6];
+    for (int f = 0; f < 6; f++)
+        faces[f] = cube.faces[f].data();
+    buildMipChains(faces, 6, cube.size, cube.size, 3, MIP_BOX, true, chains, threads);
+    return true;
+}
+
+inline unsigned int skyHash(const vector<string> &paths)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < paths.size(); i++)
+        hash = (hash ^ fileHash(paths[i])) * 16777619u;
+    return hash;
+}
+
+inline string prefilterCachePath(const string &folder, int size, int samples)
+{
+    ostringstream path;
+    path << folder << "/prefilter" << size << "x" << samples << ".ggx";
+    return path.str();
+}
+
+// Cache layout, little endian: "GGX1", size, samples, level count, hash of the faces, then every level of every face
+inline bool savePrefilteredSky(const string &path, const PrefilteredSky &sky, unsigned int hash)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    int header[3] = { sky.size, sky.samples, sky.levels() };
+    file.write("GGX1", 4);
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)&hash, sizeof(hash));
+    for (int level = 0; level < sky.levels(); level++)
+        for (int face = 0; face < 6; face++)
+            file.write((const char *)sky.faces[face].levels[level].data(), sky.faces[face].levels[level].size());
+    return (bool)file;
+}
+
+inline bool loadPrefilteredSky(const string &path, unsigned int hash, PrefilteredSky &sky)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    char magic[4];
+    int header[3];
+    unsigned int fileHashValue = 0;
+    file.read(magic, 4);
+    file.read((char *)header, sizeof(header));
+    file.read((char *)&fileHashValue, sizeof(fileHashValue));
+    if (!file || string(magic, 4) != "GGX1" || fileHashValue != hash || header[0] < 1 || header[2] != prefilterLevelCount(header[0]))
+        return false;
+    sky.size = header[0];
+    sky.samples = header[1];
+    for (int face = 0; face < 6; face++) {
+        sky.faces[face].width = sky.faces[face].height = sky.size;
+        sky.faces[face].components = 3;
+        sky.faces[face].levels.resize(header[2]);
+    }
+    for (int level = 0; level < header[2]; level++)
+        for (int face = 0; face < 6; face++) {
+            int n = std::max(sky.size >> level, 1);
+            sky.faces[face].levels[level].resize((size_t)n * n * 3);
+            file.read((char *)sky.faces[face].levels[level].data(), sky.faces[face].levels[level].size());
+        }
+    return (bool)file;
+}
+
+// the cached prefilter of the skybox in folder, or a new one (cached if cache is set); empty if the faces don't load
+inline PrefilteredSky loadOrPrefilterSky(const string &folder, int size, int samples, bool cache, int threads = 0)
+{
+    vector<string> paths = skyboxFaces(folder);
+    string path = prefilterCachePath(folder, size, samples);
+    unsigned int hash = skyHash(paths);
+    PrefilteredSky sky;
+    if (cache && loadPrefilteredSky(path, hash, sky)) {
+        cout << "Loaded the GGX prefilter of " << folder << " from " << path << endl;
+        return sky;
+    }
+    MipChain chains[6];
+    if (!skyMipChains(paths, chains, threads))
+        return PrefilteredSky();
+    double ms = 0.0;
+    prefilterSky(chains, size, samples, sky, threads, &ms);
+    cout << "Prefiltered " << folder << " for roughness to " << size << "x" << size << " (" << sky.levels() << " levels, "
+         << samples << " samples) in " << ms << " ms" << endl;
+    if (cache)
+        savePrefilteredSky(path, sky, hash);
+    return sky;
+}
+
+inline unsigned int createPrefilterTexture(const PrefilteredSky &sky, const string &owner)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int face = 0; face < 6; face++)
+        for (int level = 0; level < sky.levels(); level++) {
+            int n = sky.faces[face].levelWidth(level);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB, n, n, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                         sky.faces[face].levels[level].data());
+        }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, sky.levels() - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    memoryRegistry().track(MEM_TEXTURE, texture, textureBytes(GL_RGB, sky.size, sky.size, 6, true),
+                           describeImage(GL_RGB, sky.size, sky.size, " cubemap, GGX levels"), owner);
+    return texture;
+}
+
+inline void deletePrefilterTexture(unsigned int &texture)
+{
+    if (!texture)
+        return;
+    memoryRegistry().release(MEM_TEXTURE, texture);
+    glDeleteTextures(1, &texture);
+    texture = 0;
+}
+
+inline void usePrefilter(Renderer &renderer, unsigned int texture, const PrefilteredSky &sky)
+{
+    renderer.prefilterTexture = texture;
+    renderer.prefilterMaxLod = (float)(sky.levels() - 1);
+}
+
+// --out: the front face of every level side by side, scaled up to the size of level 0
+inline void writePrefilterStrip(const string &path, const PrefilteredSky &sky)
+{
+    Image strip(sky.size * sky.levels(), sky.size);
+    for (int level = 0; level < sky.levels(); level++) {
+        int n = sky.faces[4].levelWidth(level);
+        for (int y = 0; y < sky.size; y++)
+            for (int x = 0; x < sky.size; x++) {
+                const unsigned char *p = &sky.faces[4].levels[level][((size_t)(y * n / sky.size) * n + x * n / sky.size) * 3];
+                unsigned char *q = strip.row(y) + (level * sky.size + x) * 3;
+                q[0] = p[0];
+                q[1] = p[1];
+                q[2] = p[2];
+            }
+    }
+    writePPM(path, strip);
+}
+
+inline int runPrefilterBenchmark(int argc, char *argv[])
+{
+    string folder = argValue(argc, argv, "--skybox", "skybox/sky");
+    int samples = (int)argNumber(argc, argv, "--samples", 128);
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    string out = argValue(argc, argv, "--out", "");
+    vector<int> sizes;
+    string sizeList = argValue(argc, argv, "--sizes", "32,64,128,256") + ",";
+    for (size_t start = 0, comma; (comma = sizeList.find(',', start)) != string::npos; start = comma + 1) {
+        int size = atoi(sizeList.substr(start, comma - start).c_str());
+        if (size > 0)
+            sizes.push_back(size);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    MipChain chains[6];
+    if (!skyMipChains(skyboxFaces(folder), chains, threads)) {
+        cout << "ERROR::PREFILTER:: could not load the faces of " << folder << endl;
+        return -1;
+    }
+    double mipMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "GGX prefilter of " << folder << " (" << chains[0].width << "x" << chains[0].height << " faces, mip chain in " << fixed
+         << setprecision(1) << mipMs << " ms), " << samples << " samples, " << (threads > 0 ? threads : hardwareThreads())
+         << " threads" << endl;
+    cout << right << setw(6) << "size" << setw(8) << "levels" << setw(11) << "ms" << setw(14) << "Msamples/s" << setw(11) << "VRAM" << endl;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        PrefilteredSky sky;
+        double ms = 0.0;
+        prefilterSky(chains, sizes[i], samples, sky, threads, &ms);
+        // the samples actually taken: one per texel at roughness 0
+        double taken = 0.0;
+        for (int level = 0; level < sky.levels(); level++)
+            taken += 6.0 * sky.faces[0].levelWidth(level) * sky.faces[0].levelWidth(level) * (level == 0 ? 1 : samples);
+        cout << setw(6) << sizes[i] << setw(8) << sky.levels() << setw(11) << ms << setw(14) << taken / (ms * 1000.0) << setw(11)
+             << MemoryRegistry::formatBytes(textureBytes(GL_RGB, sizes[i], sizes[i], 6, true)) << endl;
+        if (!out.empty()) {
+            ostringstream path;
+            path << out << sizes[i] << ".ppm";
+            writePrefilterStrip(path.str(), sky);
+        }
+    }
+    cout.unsetf(ios::floatfield);
+    return 0;
+}
+
+#endif /* prefilter_hpp */
@@ -0,0 +1,178 @@
+//
+//  probebench.hpp
+//  RefractionProject
+//
+//  Renders the glass sphere headless with shapes circling it, the environment probe of envprobe.hpp
+//  capturing them, for --frames frames of the same animation in every run: without a probe (the skybox
+//  only, what the refraction showed before), with all six faces every frame (the reference), with 1 and
+//  2 faces a frame in either order, with mips, and frozen after the first capture. Prints the probe's
+//  time a frame (synced, so the GPU work is in it), the whole frame's, and how far every frame is from
+//  the reference's: PSNR of the mean squared error over all frames, and of the worst frame (whole images,
+//  the shapes outside the glass are the same in all runs).
+//
+//  RefractionProject --bench-probe [--probe-size 256] [--frames 48] [--probe-objects 6] [--out probe.ppm] [--software]
+//
+
+#ifndef probebench_hpp
+#define probebench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "envprobe.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "imagediff.hpp"
+#include "memory.hpp"
+#include "model.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct ProbeConfig {
+    const char *name;
+    int facesPerFrame;  // 0 = no probe
+    int order;
+    bool mips, frozen;
+};
+
+struct ProbeRun {
+    double probeMs, frameMs, slowestMs;
+    double facesPerFrame;
+    double psnr, worstPsnr;    // of the mean squared error over all frames, and of the worst frame
+    int oldest;         // frames, the stalest face at worst
+};
+
+inline ProbeRun runProbeFlight(const ProbeConfig &config, int probeSize, int frames, Renderer &renderer, Model &object,
+                               OrbitingShapes &shapes, vector<Image> &images, const vector<Image> *reference)
+{
+    ProbeRun run = ProbeRun();
+    run.worstPsnr = 100.0;
+    double mse = 0.0;
+    EnvironmentProbe probe;
+    if (config.facesPerFrame > 0) {
+        probe.init(probeSize, config.mips, false);
+        probe.facesPerFrame = config.facesPerFrame;
+        probe.order = config.order;
+        probe.frozen = config.frozen;
+    }
+    renderer.probeTexture = probe.texture;
+    renderer.probeMaxLod = config.mips ? probe.maxLod() : 0.0f;
+
+    RenderTarget output = createRenderTarget(renderer.width, renderer.height, "probe benchmark");
+    glm::vec3 cameraPos(0.0f, 1.0f, 1.25f * 0.5f * 2.0f * (shapes.radius + 1.0f) * renderer.projection[1][1]);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    auto drawShapes = [&shapes](const glm::mat4 &faceView, const glm::mat4 &faceProjection) { shapes.draw(faceView, faceProjection); };
+    // the scene as it is at the start in every face, so the runs begin alike, and a few frames for the driver to warm up
+    shapes.animate(0.0);
+    while (probe.texture && !probe.complete())
+        probe.update(renderer, probe.center - cameraPos, drawShapes);
+    for (int frame = 0; frame < 3; frame++) {
+        renderer.renderFrame(object, vector<glm::mat4>(1, glm::mat4(1.0f)), view, cameraPos, output.framebuffer);
+        shapes.draw(view, renderer.projection);
+    }
+    probe.resetStats();
+    glFinish();
+
+    for (int frame = 0; frame < frames; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        shapes.animate(frame / 30.0);
+        probe.update(renderer, probe.center - cameraPos, drawShapes);
+        glFinish();
+        run.probeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+        renderer.renderFrame(object, vector<glm::mat4>(1, glm::mat4(1.0f)), view, cameraPos, output.framebuffer);
+        shapes.draw(view, renderer.projection);
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        run.frameMs += ms / frames;
+        run.slowestMs = std::max(run.slowestMs, ms);
+
+        images.push_back(Image(output.width, output.height));
+        readRenderTarget(output, images.back().pixels);
+        ImageDiff diff;
+        if (reference && compareImages((*reference)[frame], images.back(), diff)) {
+            mse += diff.mse / frames;
+            run.worstPsnr = std::min(run.worstPsnr, diff.psnr);
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    run.psnr = mse > 0.0 ? std::min(100.0, 10.0 * std::log10(255.0 * 255.0 / mse)) : 100.0;
+    run.facesPerFrame = frames ? (double)probe.stats.faces / frames : 0.0;
+    run.oldest = probe.stats.worstOldest;
+
+    renderer.probeTexture = 0;
+    renderer.probeMaxLod = 0.0f;
+    probe.release();
+    deleteRenderTarget(output);
+    return run;
+}
+
+inline int runProbeBenchmark(int argc, char *argv[])
+{
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    int probeSize = std::max((int)argNumber(argc, argv, "--probe-size", 256), 1);
+    int frames = std::max((int)argNumber(argc, argv, "--frames", 48), 1);
+    int objects = std::max((int)argNumber(argc, argv, "--probe-objects", 6), 1);
+    string out = argValue(argc, argv, "--out", "");
+
+    vector<Mesh> sphere;
+    sphere.push_back(generateShape(SHAPE_SPHERE, 20000));
+    Model object(std::move(sphere));
+    unsigned int cubemap = loadCubemap(skyboxFaces("skybox/sky"));
+    Renderer renderer(800, 600, cubemap);
+    OrbitingShapes shapes(objects, 2.2f);
+    cout << "Glass sphere with " << objects << " shapes around it, " << frames << " frames at 800x600, probe " << probeSize << "^2 x6"
+         << endl;
+
+    const ProbeConfig configs[] = {
+        { "6 faces", 6, PROBE_ROUND_ROBIN, false, false },  // the reference, first
+        { "skybox only", 0, PROBE_ROUND_ROBIN, false, false },
+        { "1 face, in turn", 1, PROBE_ROUND_ROBIN, false, false },
+        { "2 faces, in turn", 2, PROBE_ROUND_ROBIN, false, false },
+        { "1 face, by view", 1, PROBE_VIEW, false, false },
+        { "2 faces, by view", 2, PROBE_VIEW, false, false },
+        { "1 face + mips", 1, PROBE_ROUND_ROBIN, true, false },
+        { "frozen", 1, PROBE_ROUND_ROBIN, false, true },
+    };
+    const int count = sizeof(configs) / sizeof(configs[0]);
+    vector<Image> reference;
+    cout << left << setw(20) << "" << right << setw(12) << "faces/frame" << setw(12) << "probe" << setw(12) << "frame" << setw(12)
+         << "slowest" << setw(14) << "stalest face" << setw(12) << "PSNR" << setw(12) << "worst" << endl;
+    for (int i = 0; i < count; i++) {
+        vector<Image> images;
+        ProbeRun run = runProbeFlight(configs[i], probeSize, frames, renderer, object, shapes, i ? images : reference,
+                                      i ? &reference : 0);
+        cout << left << setw(20) << configs[i].name << right << fixed << setprecision(2) << setw(12) << run.facesPerFrame
+             << setprecision(1) << setw(9) << run.probeMs << " ms" << setw(9) << run.frameMs << " ms" << setw(9) << run.slowestMs
+             << " ms" << setw(7) << run.oldest << " frames";
+        if (i)
+            cout << setw(9) << run.psnr << " dB" << setw(9) << run.worstPsnr << " dB";
+        cout << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    if (!out.empty() && !writePPM(out, reference.back()))
+        cout << "ERROR::PROBE:: Could not write " << out << endl;
+
+    shapes.release();
+    renderer.release();
+    object.release();
+    memoryRegistry().release(MEM_TEXTURE, cubemap);
+    glDeleteTextures(1, &cubemap);
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* probebench_hpp */
@@ -0,0 +1,205 @@
+//
+//  procedural.hpp
+//  RefractionProject
+//
+//  Meshes generated in code, so we can test with any number of triangles without
+//  shipping huge .obj files. All shapes fit inside the unit sphere (torus and blob slightly
+//  less) and are centered at the origin.
+//
+
+#ifndef procedural_hpp
+#define procedural_hpp
+
+#include "glm/glm.hpp"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+using namespace std;
+
+enum ProceduralShape { SHAPE_SPHERE, SHAPE_TORUS, SHAPE_BLOB };
+
+// Vertices and indices of a generated shape, before anything is uploaded to GL (the CPU renderers use these directly)
+struct MeshData {
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    string owner;
+};
+
+inline const char *proceduralShapeName(ProceduralShape shape)
+{
+    static const char *names[] = { "sphere", "torus", "blob" };
+    return names[shape];
+}
+
+/*
+    Smooth 3D value noise in [-1, 1]. Lattice values come from an integer hash so the
+    same point always gives the same value (no tables, no seeds to keep around).
+*/
+inline float latticeValue(int x, int y, int z, unsigned int seed)
+{
+    unsigned int h = seed;
+    h ^= (unsigned int)x * 73856093u;
+    h ^= (unsigned int)y * 19349663u;
+    h ^= (unsigned int)z * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffffff) / float(0xffffff) * 2.0f - 1.0f;
+}
+
+inline float valueNoise(const glm::vec3 &p, unsigned int seed)
+{
+    glm::vec3 cell = glm::floor(p);
+    glm::vec3 f = p - cell;
+    glm::vec3 w = f * f * (3.0f - 2.0f * f); // smoothstep weights
+    int x = (int)cell.x, y = (int)cell.y, z = (int)cell.z;
+    float result = 0.0f;
+    for (int i = 0; i < 8; i++) {
+        int dx = i & 1, dy = (i >> 1) & 1, dz = (i >> 2) & 1;
+        float weight = (dx ? w.x : 1.0f - w.x) * (dy ? w.y : 1.0f - w.y) * (dz ? w.z : 1.0f - w.z);
+        result += weight * latticeValue(x + dx, y + dy, z + dz, seed);
+    }
+    return result;
+}
+
+// a few octaves of noise, amplitude roughly within [-1, 1]
+inline float blobNoise(const glm::vec3 &p, unsigned int seed)
+{
+    return 0.6f * valueNoise(p * 1.5f, seed) + 0.3f * valueNoise(p * 3.0f, seed + 1) + 0.1f * valueNoise(p * 6.0f, seed + 2);
+}
+
+// point on the blob surface above the unit sphere direction dir
+inline glm::vec3 blobPoint(const glm::vec3 &dir, unsigned int seed)
+{
+    return dir * (0.8f + 0.2f * blobNoise(dir * 2.0f, seed));
+}
+
+/*
+    Subdivided sphere: a cube whose six faces are split into n x n quads, with every vertex
+    pushed out onto the sphere. Gives 12 * n * n triangles with no slivers at the poles
+    (which a latitude/longitude sphere has). The blob is the same sphere with its radius
+    displaced by noise; its normals come from finite differences of the displacement so
+    vertices shared by two cube faces get the same normal.
+*/
+inline MeshData buildSubdividedSphere(unsigned int targetTriangles, bool blob, unsigned int seed = 7)
+{
+    int n = (int)std::max(1.0, std::floor(std::sqrt(targetTriangles / 12.0) + 0.5));
+    MeshData mesh;
+    vector<Vertex> &vertices = mesh.vertices;
+    vector<unsigned int> &indices = mesh.indices;
+    vertices.reserve((size_t)6 * (n + 1) * (n + 1));
+    indices.reserve((size_t)6 * n * n * 6);
+
+    // the six cube faces as (normal, u axis, v axis), picked so all faces wind counter-clockwise
+    const glm::vec3 faces[6][3] = {
+        { glm::vec3( 1, 0, 0), glm::vec3( 0, 0,-1), glm::vec3(0, 1, 0) },
+        { glm::vec3(-1, 0, 0), glm::vec3( 0, 0, 1), glm::vec3(0, 1, 0) },
+        { glm::vec3( 0, 1, 0), glm::vec3( 1, 0, 0), glm::vec3(0, 0,-1) },
+        { glm::vec3( 0,-1, 0), glm::vec3( 1, 0, 0), glm::vec3(0, 0, 1) },
+        { glm::vec3( 0, 0, 1), glm::vec3( 1, 0, 0), glm::vec3(0, 1, 0) },
+        { glm::vec3( 0, 0,-1), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0) },
+    };
+    const float eps = 1e-3f;
+    for (int f = 0; f < 6; f++) {
+        unsigned int base = (unsigned int)vertices.size();
+        for (int j = 0; j <= n; j++) {
+            for (int i = 0; i <= n; i++) {
+                float u = 2.0f * i / n - 1.0f;
+                float v = 2.0f * j / n - 1.0f;
+                glm::vec3 dir = glm::normalize(faces[f][0] + u * faces[f][1] + v * faces[f][2]);
+                Vertex vertex;
+                vertex.TexCoords = glm::vec2((float)i / n, (float)j / n);
+                if (blob) {
+                    // two tangents on the sphere, displaced the same way as the vertex itself
+                    glm::vec3 t1 = glm::normalize(glm::cross(dir, std::fabs(dir.y) < 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0)));
+                    glm::vec3 t2 = glm::cross(dir, t1);
+                    vertex.Position = blobPoint(dir, seed);
+                    glm::vec3 du = blobPoint(glm::normalize(dir + eps * t1), seed) - blobPoint(glm::normalize(dir - eps * t1), seed);
+                    glm::vec3 dv = blobPoint(glm::normalize(dir + eps * t2), seed) - blobPoint(glm::normalize(dir - eps * t2), seed);
+                    vertex.Normal = glm::normalize(glm::cross(du, dv));
+                    if (glm::dot(vertex.Normal, dir) < 0.0f)
+                        vertex.Normal = -vertex.Normal;
+                } else {
+                    vertex.Position = dir;
+                    vertex.Normal = dir;
+                }
+                vertices.push_back(vertex);
+            }
+        }
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                unsigned int a = base + j * (n + 1) + i;
+                unsigned int b = a + 1;
+                unsigned int c = a + (n + 1);
+                unsigned int d = c + 1;
+                indices.push_back(a); indices.push_back(b); indices.push_back(d);
+                indices.push_back(a); indices.push_back(d); indices.push_back(c);
+            }
+        }
+    }
+    mesh.owner = blob ? "procedural blob" : "procedural sphere";
+    return mesh;
+}
+
+/*
+    Torus around the y axis, major radius 0.7 and minor radius 0.3.
+    The grid wraps in both directions and has twice as many segments around the ring as around
+    the tube, giving 2 * ring * tube = 4 * tube^2 triangles.
+*/
+inline MeshData buildTorus(unsigned int targetTriangles)
+{
+    const float R = 0.7f, r = 0.3f;
+    int tube = (int)std::max(3.0, std::floor(std::sqrt(targetTriangles / 4.0) + 0.5));
+    int ring = 2 * tube;
+    MeshData mesh;
+    vector<Vertex> &vertices = mesh.vertices;
+    vector<unsigned int> &indices = mesh.indices;
+    vertices.reserve((size_t)ring * tube);
+    indices.reserve((size_t)ring * tube * 6);
+    const float twoPi = 6.28318530718f;
+    for (int i = 0; i < ring; i++) {
+        float u = twoPi * i / ring;
+        glm::vec3 center(R * std::cos(u), 0.0f, R * std::sin(u));
+        glm::vec3 outward(std::cos(u), 0.0f, std::sin(u));
+        for (int j = 0; j < tube; j++) {
+            float v = twoPi * j / tube;
+            Vertex vertex;
+            vertex.Normal = std::cos(v) * outward + std::sin(v) * glm::vec3(0, 1, 0);
+            vertex.Position = center + r * vertex.Normal;
+            vertex.TexCoords = glm::vec2((float)i / ring, (float)j / tube);
+            vertices.push_back(vertex);
+        }
+    }
+    for (int i = 0; i < ring; i++) {
+        for (int j = 0; j < tube; j++) {
+            unsigned int a = i * tube + j;
+            unsigned int b = ((i + 1) % ring) * tube + j;
+            unsigned int c = i * tube + (j + 1) % tube;
+            unsigned int d = ((i + 1) % ring) * tube + (j + 1) % tube;
+            indices.push_back(a); indices.push_back(c); indices.push_back(d);
+            indices.push_back(a); indices.push_back(d); indices.push_back(b);
+        }
+    }
+    mesh.owner = "procedural torus";
+    return mesh;
+}
+
+// A shape with roughly targetTriangles triangles (check indices.size() / 3 for the real count)
+inline MeshData buildShape(ProceduralShape shape, unsigned int targetTriangles)
+{
+    if (shape == SHAPE_TORUS)
+        return buildTorus(targetTriangles);
+    return buildSubdividedSphere(targetTriangles, shape == SHAPE_BLOB);
+}
+
+// The same, uploaded to GL as a Mesh. Needs a current context.
+inline Mesh generateShape(ProceduralShape shape, unsigned int targetTriangles)
+{
+    MeshData data = buildShape(shape, targetTriangles);
+    return Mesh(std::move(data.vertices), std::move(data.indices), vector<Texture>(), data.owner);
+}
+
+#endif /* procedural_hpp */
@@ -0,0 +1,327 @@
+//
+//  progressive.hpp
+//  RefractionProject
+//
+//  Supersampled stills from the ray tracer without spending the samples where they aren't needed.
+//  The image is split into tiles that get samples in passes (a jittered Halton pattern per pixel, so
+//  sample n + 1 lands where the first n left the biggest gap). After every pass a tile estimates its
+//  noise from the spread of its pixels' samples, and only tiles still above --noise get the next
+//  pass: the sky converges after the first one, glass edges and the caustic-looking parts of the
+//  refraction keep going until --max-spp. The render stops when every tile is done or when --budget
+//  runs out (the first pass still gives every pixel at least one sample, so no tile is left black),
+//  and the image so far is written every --preview-every seconds.
+//
+//  Noise is the standard error of a pixel's mean, RMS over the tile, in 8-bit steps. Samples are
+//  clamped to [0, 1] before they're averaged, like the 8-bit image will be.
+//
+//  RefractionProject --progressive [--size 1600x1200] [--triangles 100000] [--instances 1] [--model path [--software]]
+//                    [--skybox skybox/sky] [--bounces 8] [--no-fresnel] [--tile 16] [--min-spp 8] [--batch 8]
+//                    [--max-spp 256] [--noise 1] [--budget 0] [--preview-every 5] [--threads N]
+//                    [--out progressive.ppm]
+//
+
+#ifndef progressive_hpp
+#define progressive_hpp
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "benchmark.hpp"
+#include "cmdline.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "raytrace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// i-th element of the van der Corput sequence in base
+inline float radicalInverse(unsigned int i, unsigned int base)
+{
+    float inverseBase = 1.0f / base, scale = inverseBase, result = 0.0f;
+    for (; i > 0; i /= base, scale *= inverseBase)
+        result += (i % base) * scale;
+    return result;
+}
+
+// a different, fixed offset in [0, 1) for every pixel, so neighbours don't share the sample pattern
+inline float pixelHash(int x, int y, unsigned int seed)
+{
+    unsigned int h = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ seed * 83492791u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+class ProgressiveRender {
+public:
+    int tileSize;
+    int minSamples;       // every pixel gets these in the first pass, enough to tell sky from glass
+    int batch;            // samples per pixel each later pass adds to the tiles still too noisy
+    int maxSamples;
+    float noise;          // in 8-bit steps, a tile is done below it
+    double budgetSeconds; // 0 = no limit
+    double previewSeconds;
+    string previewPath;   // "" = no previews
+
+    // results, valid after render()
+    long long rays, samples;
+    int passes, tilesConverged, tilesCapped, tilesUnfinished;
+    double seconds;
+
+    ProgressiveRender()
+        : tileSize(16), minSamples(8), batch(8), maxSamples(256), noise(1.0f), budgetSeconds(0.0), previewSeconds(5.0),
+          rays(0), samples(0), passes(0), tilesConverged(0), tilesCapped(0), tilesUnfinished(0), seconds(0.0) {}
+
+    void render(const RayTracer &tracer, const TraceScene &scene, const glm::mat4 &view, Image &out)
+    {
+        width = tracer.width;
+        height = tracer.height;
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+        sum.assign((size_t)width * height, glm::vec3(0.0f));
+        sumSquares.assign((size_t)width * height, 0.0f);
+        tiles.assign((size_t)tilesX * tilesY, Tile());
+        out = Image(width, height);
+        glm::mat4 inverseViewProjection = glm::inverse(tracer.projection * view);
+        glm::mat3 skyRotation = glm::inverse(glm::mat3(view));
+
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+        std::atomic<long long> traced(0), sampled(0);
+        std::mutex imageMutex;
+        double nextPreview = previewSeconds;
+        int previewCount = 0;
+        bool outOfTime = false;
+        passes = 0;
+        vector<int> active;
+        for (int t = 0; t < (int)tiles.size(); t++)
+            active.push_back(t);
+
+        while (!active.empty() && !outOfTime) {
+            int passSamples = passes == 0 ? minSamples : batch;
+            parallelFor((int)active.size(), tracer.threads, [&](int i, int) {
+                Tile &tile = tiles[active[i]];
+                int count = std::min(passSamples, maxSamples - tile.samples);
+                // past the budget the remaining tiles skip this pass, what they have so far is still valid;
+                // in the first pass they have nothing yet, so they get the one sample a pixel needs to show up
+                if (budgetSeconds > 0.0 && elapsed() > budgetSeconds) {
+                    if (passes > 0)
+                        return;
+                    count = 1;
+                }
+                long long tileRays = 0;
+                refine(tracer, scene, inverseViewProjection, skyRotation, active[i], count, tileRays);
+                traced += tileRays;
+                sampled += (long long)count * tilePixels(active[i]);
+                std::lock_guard<std::mutex> lock(imageMutex);
+                resolve(active[i], out);
+            });
+            passes++;
+            outOfTime = budgetSeconds > 0.0 && elapsed() > budgetSeconds;
+
+            vector<int> next;
+            for (size_t i = 0; i < active.size(); i++) {
+                const Tile &tile = tiles[active[i]];
+                if (tile.error > noise && tile.samples < maxSamples)
+                    next.push_back(active[i]);
+            }
+            active.swap(next);
+
+            if (!previewPath.empty() && previewSeconds > 0.0 && elapsed() >= nextPreview && !active.empty()) {
+                char path[512];
+                snprintf(path, sizeof(path), "%s_preview%02d.ppm", previewPath.c_str(), previewCount++);
+                writePPM(path, out);
+                cout << "  " << fixed << setprecision(2) << elapsed() << " s, pass " << passes << ", " << active.size()
+                     << " tiles left, wrote " << path << endl;
+                cout.unsetf(ios::floatfield);
+                while (nextPreview <= elapsed())
+                    nextPreview += previewSeconds;
+            }
+        }
+
+        seconds = elapsed();
+        rays = traced;
+        samples = sampled;
+        tilesConverged = tilesCapped = tilesUnfinished = 0;
+        for (size_t t = 0; t < tiles.size(); t++) {
+            if (tiles[t].samples > 0 && tiles[t].error <= noise)
+                tilesConverged++;
+            else if (tiles[t].samples >= maxSamples)
+                tilesCapped++;
+            else
+                tilesUnfinished++;
+        }
+    }
+
+    int tileCount() const { return (int)tiles.size(); }
+
+    // samples per pixel as a grey image, white = maxSamples
+    Image sampleMap() const
+    {
+        Image map(width, height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) {
+                const Tile &tile = tiles[(y / tileSize) * tilesX + x / tileSize];
+                unsigned char grey = (unsigned char)(255.0f * tile.samples / maxSamples + 0.5f);
+                unsigned char *p = map.row(height - 1 - y) + x * 3;
+                p[0] = p[1] = p[2] = grey;
+            }
+        return map;
+    }
+
+private:
+    struct Tile {
+        int samples;   // per pixel, the same for every pixel of the tile
+        float error;   // RMS standard error of its pixels, 8-bit steps
+        Tile() : samples(0), error(0.0f) {}
+    };
+
+    int width, height, tilesX, tilesY;
+    vector<glm::vec3> sum;      // clamped samples added up, per pixel, bottom row first like GL
+    vector<float> sumSquares;   // and their luminance squared
+    vector<Tile> tiles;
+
+    void tileBounds(int tile, int &x0, int &y0, int &x1, int &y1) const
+    {
+        x0 = (tile % tilesX) * tileSize;
+        y0 = (tile / tilesX) * tileSize;
+        x1 = std::min(x0 + tileSize, width);
+        y1 = std::min(y0 + tileSize, height);
+    }
+
+    int tilePixels(int tile) const
+    {
+        int x0, y0, x1, y1;
+        tileBounds(tile, x0, y0, x1, y1);
+        return (x1 - x0) * (y1 - y0);
+    }
+
+    // count more samples for every pixel of tile, then its new error
+    void refine(const RayTracer &tracer, const TraceScene &scene, const glm::mat4 &inverseViewProjection,
+                const glm::mat3 &skyRotation, int index, int count, long long &tileRays)
+    {
+        Tile &tile = tiles[index];
+        int x0, y0, x1, y1;
+        tileBounds(index, x0, y0, x1, y1);
+        const glm::vec3 luminanceWeights(0.2126f, 0.7152f, 0.0722f);
+        double squaredErrors = 0.0;
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++) {
+                size_t p = (size_t)y * width + x;
+                float jitterX = pixelHash(x, y, 1), jitterY = pixelHash(x, y, 2);
+                for (int s = tile.samples; s < tile.samples + count; s++) {
+                    float sx = radicalInverse(s + 1, 2) + jitterX, sy = radicalInverse(s + 1, 3) + jitterY;
+                    sx -= std::floor(sx);
+                    sy -= std::floor(sy);
+                    glm::vec3 color = tracer.pixelSample(scene, inverseViewProjection, skyRotation, x + sx, y + sy, tileRays);
+                    color = glm::clamp(color, glm::vec3(0.0f), glm::vec3(1.0f));
+                    float luminance = glm::dot(color, luminanceWeights);
+                    sum[p] += color;
+                    sumSquares[p] += luminance * luminance;
+                }
+                int n = tile.samples + count;
+                float mean = glm::dot(sum[p], luminanceWeights) / n;
+                float variance = std::max(sumSquares[p] / n - mean * mean, 0.0f) * n / std::max(n - 1, 1);
+                squaredErrors += variance / n;
+            }
+        tile.samples += count;
+        // one sample has no spread to go by, that isn't converged
+        if (tile.samples < 2)
+            tile.error = FLT_MAX;
+        else
+            tile.error = 255.0f * (float)std::sqrt(squaredErrors / ((x1 - x0) * (y1 - y0)));
+    }
+
+    void resolve(int index, Image &out) const
+    {
+        const Tile &tile = tiles[index];
+        int x0, y0, x1, y1;
+        tileBounds(index, x0, y0, x1, y1);
+        for (int y = y0; y < y1; y++) {
+            unsigned char *row = out.row(height - 1 - y);
+            for (int x = x0; x < x1; x++) {
+                glm::vec3 color = sum[(size_t)y * width + x] / (float)tile.samples;
+                for (int c = 0; c < 3; c++)
+                    row[x * 3 + c] = (unsigned char)(color[c] * 255.0f + 0.5f);
+            }
+        }
+    }
+};
+
+inline int runProgressiveRender(int argc, char *argv[])
+{
+    int width = 1600, height = 1200;
+    sscanf(argValue(argc, argv, "--size", "1600x1200").c_str(), "%dx%d", &width, &height);
+    int instances = (int)argNumber(argc, argv, "--instances", 1);
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    string outPath = argValue(argc, argv, "--out", "progressive.ppm");
+
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(skybox)))
+        return -1;
+    RayTracer tracer(width, height, &cubemap);
+    tracer.threads = (int)argNumber(argc, argv, "--threads", 0);
+    tracer.maxBounces = (int)argNumber(argc, argv, "--bounces", 8);
+    tracer.fresnel = !hasArg(argc, argv, "--no-fresnel");
+
+    ProgressiveRender progressive;
+    progressive.tileSize = std::max(1, (int)argNumber(argc, argv, "--tile", 16));
+    progressive.maxSamples = std::max(1, (int)argNumber(argc, argv, "--max-spp", 256));
+    progressive.minSamples = std::min(std::max(2, (int)argNumber(argc, argv, "--min-spp", 8)), progressive.maxSamples);
+    progressive.batch = std::max(1, (int)argNumber(argc, argv, "--batch", 8));
+    progressive.noise = (float)argNumber(argc, argv, "--noise", 1.0);
+    progressive.budgetSeconds = argNumber(argc, argv, "--budget", 0.0);
+    progressive.previewSeconds = argNumber(argc, argv, "--preview-every", 5.0);
+    string stem = outPath.size() > 4 && outPath.compare(outPath.size() - 4, 4, ".ppm") == 0 ? outPath.substr(0, outPath.size() - 4) : outPath;
+    progressive.previewPath = stem;
+
+    TraceMeshes meshes;
+    if (!loadTraceMeshes(argc, argv, meshes))
+        return -1;
+    vector<glm::mat4> models;
+    float distance = instanceGrid(instances, tracer.projection, models);
+    glm::vec3 cameraPos(0.0f, 0.0f, distance);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    TraceScene scene;
+    buildTraceScene(meshes.views, models, scene, tracer.threads);
+
+    cout << "Progressive render " << width << "x" << height << ", " << scene.bvh.triangleCount() << " triangles, "
+         << progressive.minSamples << " to " << progressive.maxSamples << " samples per pixel, noise below "
+         << progressive.noise << " steps";
+    if (progressive.budgetSeconds > 0.0)
+        cout << ", " << progressive.budgetSeconds << " s budget";
+    cout << endl;
+    Image image;
+    progressive.render(tracer, scene, view, image);
+
+    long long pixels = (long long)width * height;
+    double uniform = (double)progressive.maxSamples * pixels;
+    cout << fixed << setprecision(2);
+    cout << "  " << progressive.seconds << " s, " << progressive.passes << " passes, " << progressive.rays / (progressive.seconds * 1e6)
+         << " Mrays/s" << endl;
+    cout << "  " << (double)progressive.samples / pixels << " samples per pixel on average, "
+         << 100.0 * progressive.samples / uniform << "% of " << progressive.maxSamples << " everywhere" << endl;
+    cout << "  tiles: " << progressive.tilesConverged << " converged, " << progressive.tilesCapped << " stopped at --max-spp, "
+         << progressive.tilesUnfinished << " cut off by the budget, of " << progressive.tileCount() << endl;
+    cout.unsetf(ios::floatfield);
+    if (writePPM(outPath, image) && writePPM(stem + "_spp.ppm", progressive.sampleMap()))
+        cout << "Wrote " << outPath << " and the samples per pixel to " << stem << "_spp.ppm" << endl;
+
+    meshes.release();
+    return 0;
+}
+
+#endif /* progressive_hpp */
@@ -0,0 +1,564 @@
+//
+//  raytrace.hpp
+//  RefractionProject
+//
+//  Ground-truth refraction: traces the real path of every camera ray through the glass, where the
+//  two-pass shader only approximates it with the front and back surface. At every interface the ray
+//  is split into the reflected and refracted part by the Fresnel equations (total internal reflection
+//  sends everything back in), up to a bounce limit; whatever leaves the object samples the same cubemap.
+//  The surfaces are perfectly smooth and the cubemap is the only light, so following both branches
+//  gives the exact answer without any noise. Branches carrying less than 1% are dropped.
+//
+//  To stay comparable with the GL image, pixels that hit an object get the same +(0, 0.1, 0.1) tint
+//  objFshader adds, and pixels that miss show the skybox pass (which uses a wider projection than the
+//  scene) instead of the scene camera's ray.
+//
+//  RefractionProject --raytrace [--size 1600x1200] [--triangles 100000] [--instances 1] [--skybox skybox/sky]
+//                    [--model path [--software]] [--bounces 8] [--no-fresnel] [--threads N] [--out raytrace.ppm]
+//  RefractionProject --bench-bvh [--triangles 1000000] [--instances 1] [--model path [--software]]
+//                    [--max-threads N] [--builds 3]
+//  RefractionProject --bench-rays [--triangles 1000000] [--instances 1] [--model path [--software]]
+//                    [--size 1024x1024] [--rays 1000000] [--threads 1] [--isa scalar|sse2|neon|avx2]
+//
+
+#ifndef raytrace_hpp
+#define raytrace_hpp
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "benchmark.hpp"
+#include "bvh.hpp"
+#include "bvh8.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+#include "swrender.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Every instance of every mesh flattened into world-space triangles, with the vertex normals to shade with
+struct TraceScene {
+    Bvh bvh;
+    Bvh8 wide;                   // what we trace against, bvh keeps the vertices
+    vector<glm::vec3> normals;   // 3 per triangle, same order as bvh.vertices
+};
+
+// world-space positions of every instance's triangles, 3 per triangle
+inline vector<glm::vec3> worldTriangles(const vector<MeshView> &meshes, const vector<glm::mat4> &models)
+{
+    vector<glm::vec3> positions;
+    for (size_t m = 0; m < models.size(); m++)
+        for (size_t i = 0; i < meshes.size(); i++)
+            for (size_t k = 0; k < meshes[i].indexCount; k++)
+                positions.push_back(glm::vec3(models[m] * glm::vec4(meshes[i].vertices[meshes[i].indices[k]].Position, 1.0f)));
+    return positions;
+}
+
+inline void buildTraceScene(const vector<MeshView> &meshes, const vector<glm::mat4> &models, TraceScene &scene, int threads = 0)
+{
+    scene.normals.clear();
+    for (size_t m = 0; m < models.size(); m++) {
+        // the same normal matrix objVshader uses
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(models[m])));
+        for (size_t i = 0; i < meshes.size(); i++) {
+            const MeshView &mesh = meshes[i];
+            for (size_t k = 0; k < mesh.indexCount; k++)
+                scene.normals.push_back(normalMatrix * mesh.vertices[mesh.indices[k]].Normal);
+        }
+    }
+    scene.bvh.build(worldTriangles(meshes, models), threads);
+    scene.wide.build(scene.bvh);
+}
+
+class RayTracer {
+public:
+    int width, height;
+    int threads;              // 0 = one per core
+    int maxBounces;           // interfaces a path may cross or reflect off before we give up on it
+    bool fresnel;             // false: always refract (reflect only on total internal reflection)
+    float ior;                // the glass; 1.309 like the shaders
+    glm::mat4 projection, skyboxProjection;
+    const CpuCubemap *cubemap;
+    long long rays;           // rays traced by the last render
+
+    RayTracer(int width, int height, const CpuCubemap *cubemap)
+        : width(width), height(height), threads(0), maxBounces(8), fresnel(true), ior(1.309f),
+          projection(sceneProjection(width, height)), skyboxProjection(skyProjection(width, height)),
+          cubemap(cubemap), rays(0) {}
+
+    void render(const TraceScene &scene, const glm::mat4 &view, Image &out)
+    {
+        out = Image(width, height);
+        glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+        glm::mat3 skyRotation = glm::inverse(glm::mat3(view));
+        std::atomic<long long> traced(0);
+        parallelFor(height, threads, [&](int y, int) {
+            long long rowRays = 0;
+            unsigned char *row = out.row(height - 1 - y); // out is top row first
+            for (int x = 0; x < width; x++) {
+                glm::vec3 color = pixelSample(scene, inverseViewProjection, skyRotation, x + 0.5f, y + 0.5f, rowRays);
+                for (int c = 0; c < 3; c++)
+                    row[x * 3 + c] = (unsigned char)(std::min(std::max(color[c], 0.0f), 1.0f) * 255.0f + 0.5f);
+            }
+            traced += rowRays;
+        });
+        rays = traced;
+    }
+
+    /*
+        Light arriving through one point of the image, x and y in pixels with y going up like gl_FragCoord,
+        unclamped. inverseViewProjection and skyRotation are what render() computes from the view.
+    */
+    glm::vec3 pixelSample(const TraceScene &scene, const glm::mat4 &inverseViewProjection, const glm::mat3 &skyRotation,
+                          float x, float y, long long &count) const
+    {
+        float ndcX = x / width * 2.0f - 1.0f, ndcY = y / height * 2.0f - 1.0f;
+        glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+        glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+        Ray ray;
+        ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+        ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+        RayHit hit;
+        hit.t = FLT_MAX;
+        count++;
+        if (scene.wide.intersect(ray, hit))
+            return shade(scene, ray, hit, 0, 1.0f, count) + glm::vec3(0.0f, 0.1f, 0.1f);
+        glm::vec3 dir = skyRotation * glm::vec3(ndcX / skyboxProjection[0][0], ndcY / skyboxProjection[1][1], -1.0f);
+        return cubemap->sample(dir);
+    }
+
+private:
+    // Fresnel reflectance for unpolarized light, cosI and cosT both positive
+    static float dielectricReflectance(float etaI, float etaT, float cosI, float cosT)
+    {
+        float parallel = (etaT * cosI - etaI * cosT) / (etaT * cosI + etaI * cosT);
+        float perpendicular = (etaI * cosI - etaT * cosT) / (etaI * cosI + etaT * cosT);
+        return 0.5f * (parallel * parallel + perpendicular * perpendicular);
+    }
+
+    glm::vec3 trace(const TraceScene &scene, const Ray &ray, int bounce, float weight, long long &count) const
+    {
+        RayHit hit;
+        hit.t = FLT_MAX;
+        count++;
+        if (!scene.wide.intersect(ray, hit))
+            return cubemap->sample(ray.direction);
+        return shade(scene, ray, hit, bounce, weight, count);
+    }
+
+    // light arriving along ray from the surface point hit; weight is how much of the pixel this path carries
+    glm::vec3 shade(const TraceScene &scene, const Ray &ray, const RayHit &hit, int bounce, float weight, long long &count) const
+    {
+        if (bounce >= maxBounces)
+            return cubemap->sample(ray.direction); // give up, as if the path went straight on
+        Interface surface = interfaceAt(scene, ray, hit);
+        float reflectance = 1.0f;
+        if (surface.cosT > 0.0f)
+            reflectance = fresnel ? dielectricReflectance(surface.etaI, surface.etaT, surface.cosI, surface.cosT) : 0.0f;
+
+        glm::vec3 color(0.0f);
+        if (reflectance > 0.0f && weight * reflectance >= 0.01f)
+            color += reflectance * trace(scene, surface.reflected(ray), bounce + 1, weight * reflectance, count);
+        if (reflectance < 1.0f && weight * (1.0f - reflectance) >= 0.01f)
+            color += (1.0f - reflectance) * trace(scene, surface.refracted(ray), bounce + 1, weight * (1.0f - reflectance), count);
+        return color;
+    }
+
+public:
+    /*
+        Follows only the refracted part of a ray (reflecting just on total internal reflection) until
+        it comes out of the object again: the exact version of the shaders' T2, leaving from point.
+        False if the ray misses or is still inside after maxBounces.
+    */
+    bool exitPath(const TraceScene &scene, Ray ray, glm::vec3 &point, glm::vec3 &direction) const
+    {
+        bool inside = false;
+        for (int bounce = 0; bounce < maxBounces; bounce++) {
+            RayHit hit;
+            hit.t = FLT_MAX;
+            if (!scene.wide.intersect(ray, hit))
+                return false;
+            Interface surface = interfaceAt(scene, ray, hit);
+            if (surface.cosT > 0.0f) {
+                ray = surface.refracted(ray);
+                inside = surface.entering;
+                if (!inside) {
+                    point = surface.point;
+                    direction = ray.direction;
+                    return true;
+                }
+            } else {
+                ray = surface.reflected(ray);
+            }
+        }
+        return false;
+    }
+
+private:
+    // what happens where a ray meets the glass; both normals face the side the ray came from
+    struct Interface {
+        glm::vec3 point, geometric, normal;
+        bool entering;
+        float etaI, etaT, cosI, cosT;   // cosT = 0: total internal reflection
+        float offset;                   // how far new rays start off the surface, scaled to the scene's size
+
+        Ray reflected(const Ray &ray) const
+        {
+            Ray out;
+            out.direction = ray.direction + 2.0f * cosI * normal;
+            out.origin = point + offset * geometric;
+            return out;
+        }
+
+        Ray refracted(const Ray &ray) const
+        {
+            float eta = etaI / etaT;
+            Ray out;
+            out.direction = glm::normalize(eta * ray.direction + (eta * cosI - cosT) * normal);
+            out.origin = point - offset * geometric;
+            return out;
+        }
+    };
+
+    Interface interfaceAt(const TraceScene &scene, const Ray &ray, const RayHit &hit) const
+    {
+        Interface surface;
+        unsigned int t = hit.triangle;
+        const glm::vec3 *v = &scene.bvh.vertices[3 * t];
+        const glm::vec3 *n = &scene.normals[3 * t];
+        surface.point = ray.origin + hit.t * ray.direction;
+        // the geometric normal decides inside/outside, the interpolated one bends the ray
+        surface.geometric = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+        surface.normal = glm::normalize((1.0f - hit.u - hit.v) * n[0] + hit.u * n[1] + hit.v * n[2]);
+        surface.entering = glm::dot(ray.direction, surface.geometric) < 0.0f;
+        surface.etaI = surface.entering ? 1.0f : ior;
+        surface.etaT = surface.entering ? ior : 1.0f;
+        if (!surface.entering) {
+            surface.geometric = -surface.geometric;
+            surface.normal = -surface.normal;
+        }
+        if (glm::dot(surface.normal, surface.geometric) <= 0.0f)
+            surface.normal = surface.geometric;
+
+        surface.cosI = std::min(-glm::dot(ray.direction, surface.normal), 1.0f);
+        if (surface.cosI <= 0.0f) { // grazing the shading normal from behind, use the real surface
+            surface.normal = surface.geometric;
+            surface.cosI = std::min(-glm::dot(ray.direction, surface.normal), 1.0f);
+        }
+        float eta = surface.etaI / surface.etaT;
+        float sinT2 = eta * eta * (1.0f - surface.cosI * surface.cosI);
+        surface.cosT = sinT2 < 1.0f ? std::sqrt(1.0f - sinT2) : 0.0f;
+        surface.offset = 1e-4f * std::max(1.0f, glm::length(surface.point));
+        return surface;
+    }
+};
+
+/*
+    The meshes a CPU tool works on: --model path, or a procedural shape of --triangles (triangles when
+    it isn't given). A loaded Model needs a GL context for its meshes, even though only their vertices
+    are read; release() frees the model and the context.
+*/
+class TraceMeshes {
+public:
+    vector<MeshView> views;
+    string name;          // the model path or the shape's owner name
+    Model *model;         // 0 for a procedural shape
+    MeshData shape;
+    GLFWwindow *window;
+
+    TraceMeshes() : model(0), window(0) {}
+    ~TraceMeshes() { release(); }
+
+    void release()
+    {
+        if (model) {
+            model->release();
+            delete model;
+            destroyHeadlessContext(window);
+        }
+        model = 0;
+        window = 0;
+    }
+
+private:
+    // the views point into shape
+    TraceMeshes(const TraceMeshes &);
+    TraceMeshes &operator=(const TraceMeshes &);
+};
+
+// false if there is a --model but no GL context to load it with
+inline bool loadTraceMeshes(int argc, char *argv[], TraceMeshes &meshes, ProceduralShape shape = SHAPE_BLOB,
+                            unsigned int triangles = 100000)
+{
+    string modelPath = argValue(argc, argv, "--model", "");
+    if (!modelPath.empty()) {
+        meshes.window = createHeadlessContext(hasArg(argc, argv, "--software"));
+        if (!meshes.window)
+            return false;
+        meshes.model = new Model(modelPath);
+        meshes.views = meshViews(*meshes.model);
+        meshes.name = modelPath;
+    } else {
+        meshes.shape = buildShape(shape, (unsigned int)argNumber(argc, argv, "--triangles", triangles));
+        meshes.views.push_back(meshView(meshes.shape));
+        meshes.name = meshes.shape.owner;
+    }
+    return true;
+}
+
+inline int runRayTracer(int argc, char *argv[])
+{
+    int width = 1600, height = 1200;
+    sscanf(argValue(argc, argv, "--size", "1600x1200").c_str(), "%dx%d", &width, &height);
+    int instances = (int)argNumber(argc, argv, "--instances", 1);
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    string outPath = argValue(argc, argv, "--out", "raytrace.ppm");
+
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(skybox)))
+        return -1;
+    RayTracer tracer(width, height, &cubemap);
+    tracer.threads = (int)argNumber(argc, argv, "--threads", 0);
+    tracer.maxBounces = (int)argNumber(argc, argv, "--bounces", 8);
+    tracer.fresnel = !hasArg(argc, argv, "--no-fresnel");
+
+    TraceMeshes meshes;
+    if (!loadTraceMeshes(argc, argv, meshes))
+        return -1;
+    vector<glm::mat4> models;
+    float distance = instanceGrid(instances, tracer.projection, models);
+    glm::vec3 cameraPos(0.0f, 0.0f, distance);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    auto start = std::chrono::steady_clock::now();
+    TraceScene scene;
+    buildTraceScene(meshes.views, models, scene, tracer.threads);
+    auto built = std::chrono::steady_clock::now();
+    Image image;
+    tracer.render(scene, view, image);
+    auto done = std::chrono::steady_clock::now();
+    double buildMs = std::chrono::duration<double, std::milli>(built - start).count();
+    double renderMs = std::chrono::duration<double, std::milli>(done - built).count();
+
+    cout << "Ray traced " << width << "x" << height << ", " << scene.bvh.triangleCount() << " triangles, "
+         << (tracer.threads > 0 ? tracer.threads : hardwareThreads()) << " threads" << endl;
+    cout << "  BVH build " << buildMs << " ms, " << scene.wide.nodes.size() << " 8-wide nodes, "
+         << scene.wide.kernels->name << " kernels" << endl;
+    cout << "  render " << renderMs << " ms, " << tracer.rays << " rays, "
+         << tracer.rays / (renderMs * 1000.0) << " Mrays/s" << endl;
+    if (writePPM(outPath, image))
+        cout << "Wrote " << outPath << endl;
+
+    meshes.release();
+    return 0;
+}
+
+/*
+    Builds the BVH over one scene at every thread count from 1 to --max-threads (doubling) and prints
+    the best of --builds build times, normalized per million triangles, with the tree's SAH cost.
+*/
+inline int runBvhBenchmark(int argc, char *argv[])
+{
+    int instances = (int)argNumber(argc, argv, "--instances", 1);
+    int maxThreads = (int)argNumber(argc, argv, "--max-threads", hardwareThreads());
+    int builds = std::max(1, (int)argNumber(argc, argv, "--builds", 3));
+
+    TraceMeshes meshes;
+    if (!loadTraceMeshes(argc, argv, meshes, SHAPE_BLOB, 1000000))
+        return -1;
+    vector<glm::mat4> models;
+    instanceGrid(instances, sceneProjection(1600, 1200), models);
+    vector<glm::vec3> positions = worldTriangles(meshes.views, models);
+    double millions = positions.size() / 3 / 1e6;
+
+    cout << "BVH build, " << positions.size() / 3 << " triangles, " << hardwareThreads() << " hardware threads" << endl;
+    cout << setw(8) << "threads" << setw(10) << "ms" << setw(11) << "ms/Mtri" << setw(9) << "speedup"
+         << setw(10) << "nodes" << setw(7) << "depth" << setw(10) << "SAH cost" << setw(10) << "node MB" << endl;
+    double singleThreadMs = 0.0;
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        Bvh bvh;
+        double best = 0.0;
+        for (int build = 0; build < builds; build++) {
+            vector<glm::vec3> copy = positions;
+            auto start = std::chrono::steady_clock::now();
+            bvh.build(std::move(copy), threads);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            best = build == 0 ? ms : std::min(best, ms);
+        }
+        if (threads == 1)
+            singleThreadMs = best;
+        cout << fixed << setprecision(2) << setw(8) << threads << setw(10) << best << setw(11) << best / millions
+             << setw(9) << singleThreadMs / best << setw(10) << bvh.nodes.size() << setw(7) << bvh.depth()
+             << setw(10) << bvh.sahCost() << setw(10) << bvh.nodes.size() * sizeof(BvhNode) / (1024.0 * 1024.0) << endl;
+        if (threads >= maxThreads)
+            break;
+    }
+    cout.unsetf(ios::floatfield);
+
+    meshes.release();
+    return 0;
+}
+
+// what one ray kernel found, to compare against the scalar Bvh
+struct RayResult {
+    float t;
+    unsigned int triangle;
+};
+
+/*
+    Rays per second per core for the scalar Bvh and every 8-wide kernel, one ray at a time and in
+    packets of 8, on two workloads: coherent camera rays (4x2 pixel packets of a --size image) and
+    incoherent rays between random points around and inside the scene's box. Every kernel's hits are
+    checked against the scalar Bvh's; a mismatch is a different hit/miss or a distance off by > 1e-5.
+*/
+inline int runRayKernelBenchmark(int argc, char *argv[])
+{
+    int width = 1024, height = 1024;
+    sscanf(argValue(argc, argv, "--size", "1024x1024").c_str(), "%dx%d", &width, &height);
+    width = (width + 3) / 4 * 4;
+    height = (height + 1) / 2 * 2;
+    int instances = (int)argNumber(argc, argv, "--instances", 1);
+    size_t incoherentCount = (size_t)argNumber(argc, argv, "--rays", 1000000) / 8 * 8;
+    int threads = std::max(1, (int)argNumber(argc, argv, "--threads", 1));
+    string onlyIsa = argValue(argc, argv, "--isa", "");
+
+    TraceMeshes meshes;
+    if (!loadTraceMeshes(argc, argv, meshes, SHAPE_BLOB, 1000000))
+        return -1;
+    glm::mat4 projection = sceneProjection(width, height);
+    vector<glm::mat4> models;
+    float distance = instanceGrid(instances, projection, models);
+    glm::vec3 cameraPos(0.0f, 0.0f, distance);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    Bvh bvh;
+    bvh.build(worldTriangles(meshes.views, models));
+    Bvh8 wide;
+    wide.build(bvh);
+
+    // coherent: camera rays, every 8 in a row make up a 4x2 pixel block
+    vector<Ray> coherent;
+    coherent.reserve((size_t)width * height);
+    glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+    for (int by = 0; by < height; by += 2)
+        for (int bx = 0; bx < width; bx += 4)
+            for (int i = 0; i < 8; i++) {
+                float ndcX = (bx + i % 4 + 0.5f) / width * 2.0f - 1.0f, ndcY = (by + i / 4 + 0.5f) / height * 2.0f - 1.0f;
+                glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+                glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+                Ray ray;
+                ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+                ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+                coherent.push_back(ray);
+            }
+    // incoherent: from a random point on a sphere around the scene to a random point inside its box
+    vector<Ray> incoherent(incoherentCount);
+    glm::vec3 lo(bvh.nodes[0].min[0], bvh.nodes[0].min[1], bvh.nodes[0].min[2]);
+    glm::vec3 hi(bvh.nodes[0].max[0], bvh.nodes[0].max[1], bvh.nodes[0].max[2]);
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = glm::length(hi - lo);
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (size_t i = 0; i < incoherentCount; i++) {
+        glm::vec3 onSphere;
+        do {
+            onSphere = glm::vec3(unit(random), unit(random), unit(random)) * 2.0f - glm::vec3(1.0f);
+        } while (glm::dot(onSphere, onSphere) > 1.0f || glm::dot(onSphere, onSphere) < 1e-4f);
+        glm::vec3 target = lo + glm::vec3(unit(random), unit(random), unit(random)) * (hi - lo);
+        incoherent[i].origin = center + glm::normalize(onSphere) * radius;
+        incoherent[i].direction = glm::normalize(target - incoherent[i].origin);
+    }
+
+    cout << "Ray kernels, " << bvh.triangleCount() << " triangles, " << wide.nodes.size() << " 8-wide nodes, "
+         << wide.blocks.size() << " triangle blocks, " << threads << " thread(s), best: " << bvh8Kernels(bvh8BestIsa()).name << endl;
+    cout << setw(12) << "workload" << setw(18) << "kernel" << setw(15) << "Mrays/s/core" << setw(9) << "speedup"
+         << setw(9) << "hit %" << setw(12) << "mismatches" << endl;
+
+    const char *workloadNames[2] = { "coherent", "incoherent" };
+    const vector<Ray> *workloads[2] = { &coherent, &incoherent };
+    for (int w = 0; w < 2; w++) {
+        const vector<Ray> &rays = *workloads[w];
+        int packets = (int)(rays.size() / 8);
+        vector<RayResult> reference(rays.size()), results(rays.size());
+        double referenceRate = 0.0;
+        // kernel -1 is the scalar Bvh, then one-ray and packet versions of every instruction set
+        for (int kernel = -1; kernel < 2 * BVH8_ISA_COUNT; kernel++) {
+            int isa = kernel / 2;
+            bool packet = kernel >= 0 && kernel % 2 == 1;
+            string name = "bvh2 scalar";
+            if (kernel >= 0) {
+                if (!bvh8IsaSupported(isa) || (!onlyIsa.empty() && onlyIsa != bvh8Kernels(isa).name))
+                    continue;
+                wide.setIsa(isa);
+                name = string(bvh8Kernels(isa).name) + (packet ? " packet" : " 1-ray");
+            }
+            vector<RayResult> &out = kernel < 0 ? reference : results;
+            auto start = std::chrono::steady_clock::now();
+            parallelFor((packets + 63) / 64, threads, [&](int chunk, int) {
+                for (int p = chunk * 64; p < std::min(packets, (chunk + 1) * 64); p++) {
+                    if (packet) {
+                        RayPacket8 packet8;
+                        RayHit8 hits;
+                        for (int i = 0; i < 8; i++) {
+                            for (int axis = 0; axis < 3; axis++) {
+                                packet8.origin[axis][i] = rays[p * 8 + i].origin[axis];
+                                packet8.direction[axis][i] = rays[p * 8 + i].direction[axis];
+                            }
+                            hits.t[i] = FLT_MAX;
+                            hits.triangle[i] = BVH8_EMPTY;
+                        }
+                        wide.intersect(packet8, hits);
+                        for (int i = 0; i < 8; i++) {
+                            out[p * 8 + i].t = hits.t[i];
+                            out[p * 8 + i].triangle = hits.triangle[i];
+                        }
+                        continue;
+                    }
+                    for (int i = p * 8; i < p * 8 + 8; i++) {
+                        RayHit hit;
+                        hit.t = FLT_MAX;
+                        hit.triangle = BVH8_EMPTY;
+                        if (kernel < 0)
+                            bvh.intersect(rays[i], hit);
+                        else
+                            wide.intersect(rays[i], hit);
+                        out[i].t = hit.t;
+                        out[i].triangle = hit.triangle;
+                    }
+                }
+            });
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double rate = rays.size() / seconds / 1e6 / threads;
+            if (kernel < 0)
+                referenceRate = rate;
+            size_t hits = 0, mismatches = 0;
+            for (size_t i = 0; i < rays.size(); i++) {
+                bool hit = out[i].triangle != BVH8_EMPTY, expected = reference[i].triangle != BVH8_EMPTY;
+                hits += hit;
+                if (hit != expected || (hit && std::fabs(out[i].t - reference[i].t) > 1e-5f * std::max(1.0f, reference[i].t)))
+                    mismatches++;
+            }
+            cout << fixed << setprecision(2) << setw(12) << workloadNames[w] << setw(18) << name << setw(15) << rate
+                 << setw(9) << rate / referenceRate << setw(9) << 100.0 * hits / rays.size() << setw(12) << mismatches << endl;
+        }
+    }
+    cout.unsetf(ios::floatfield);
+
+    meshes.release();
+    return 0;
+}
+
+#endif /* raytrace_hpp */
@@ -0,0 +1,686 @@
+//
+//  renderer.hpp
+//  RefractionProject
+//
+//  The three passes that used to live in main()'s render loop:
+//  1. Front normals + distance into a framebuffer texture
+//  2. Back normals + distance into a second framebuffer texture
+//  3. The refraction shader (reads both textures) followed by the skybox
+//  Wrapped in a class so the same passes can render into the window or into an
+//  offscreen framebuffer of any size (headless runs, benchmarks).
+//
+
+#ifndef renderer_hpp
+#define renderer_hpp
+
+#include <glad/glad.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "shader.hpp"
+#include "model.hpp"
+#include "glstats.hpp"
+#include "memory.hpp"
+#include "timeline.hpp"
+#include "jobs.hpp"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+unsigned int loadCubemap(vector<std::string> faces);
+
+struct DecodedFace {
+    unsigned char *data;
+    int width, height, channels;
+    MipChain mips;                // with --mips, in place of data
+    CompressedTexture compressed; // with --compress, in place of both
+};
+
+/*
+    A cubemap on its way in: the faces decode on the job system's workers and a main-thread job uploads
+    each one as soon as it is decoded. startCubemapLoad() returns right away so the caller can do something
+    else (import the model, ...) before finishCubemapLoad() waits for the rest.
+    With --mips the faces have to wait for each other: one job filters all six together (across their
+    edges, mipgen.hpp) once they are decoded, and the uploads come after it.
+    With a texture pack (texpack.hpp) there is nothing to decode: the faces are uploaded from the mapping.
+    A streamed load (environment.hpp) has no upload jobs: its owner uploads the faces itself, a few per
+    frame, with uploadCubemapFace() once ready[i] is done, and calls finishCubemapLoad() after the last.
+*/
+struct CubemapLoad {
+    unsigned int texture;
+    string folder;
+    vector<std::string> faces;
+    std::shared_ptr<vector<DecodedFace> > decoded;
+    vector<JobHandle> ready;    // per face, done when it can be uploaded
+    vector<JobHandle> uploads;
+    TexturePack pack;           // mapped, in place of decoded
+};
+
+CubemapLoad startCubemapLoad(const vector<std::string> &faces, bool streamed = false);
+size_t uploadCubemapFace(CubemapLoad &load, int face);
+unsigned int finishCubemapLoad(CubemapLoad &load);
+
+// The six face paths of a skybox folder ("skybox/sky"), in the order loadCubemap wants them
+vector<std::string> skyboxFaces(const std::string &folder)
+{
+    const char *names[] = { "right", "left", "top", "bottom", "front", "back" };
+    vector<std::string> faces;
+    for (int i = 0; i < 6; i++)
+        faces.push_back(folder + "/" + names[i] + ".jpg");
+    return faces;
+}
+
+// A 3D cube
+float skyboxVertices[] = {
+    -1.0f,  1.0f, -1.0f,
+    -1.0f, -1.0f, -1.0f,
+     1.0f, -1.0f, -1.0f,
+     1.0f, -1.0f, -1.0f,
+     1.0f,  1.0f, -1.0f,
+    -1.0f,  1.0f, -1.0f,
+
+    -1.0f, -1.0f,  1.0f,
+    -1.0f, -1.0f, -1.0f,
+    -1.0f,  1.0f, -1.0f,
+    -1.0f,  1.0f, -1.0f,
+    -1.0f,  1.0f,  1.0f,
+    -1.0f, -1.0f,  1.0f,
+
+     1.0f, -1.0f, -1.0f,
+     1.0f, -1.0f,  1.0f,
+     1.0f,  1.0f,  1.0f,
+     1.0f,  1.0f,  1.0f,
+     1.0f,  1.0f, -1.0f,
+     1.0f, -1.0f, -1.0f,
+
+    -1.0f, -1.0f,  1.0f,
+    -1.0f,  1.0f,  1.0f,
+     1.0f,  1.0f,  1.0f,
+     1.0f,  1.0f,  1.0f,
+     1.0f, -1.0f,  1.0f,
+    -1.0f, -1.0f,  1.0f,
+
+    -1.0f,  1.0f, -1.0f,
+     1.0f,  1.0f, -1.0f,
+     1.0f,  1.0f,  1.0f,
+     1.0f,  1.0f,  1.0f,
+    -1.0f,  1.0f,  1.0f,
+    -1.0f,  1.0f, -1.0f,
+
+    -1.0f, -1.0f, -1.0f,
+    -1.0f, -1.0f,  1.0f,
+     1.0f, -1.0f, -1.0f,
+     1.0f, -1.0f, -1.0f,
+    -1.0f, -1.0f,  1.0f,
+     1.0f, -1.0f,  1.0f
+};
+
+/*
+    A framebuffer with an RGBA8 color texture we can sample later, and a depth/stencil
+    renderbuffer (we won't be sampling that one). GL_RGBA32F gives a float color texture instead.
+*/
+struct RenderTarget {
+    unsigned int framebuffer;
+    unsigned int texture;
+    unsigned int rbo;
+    int width, height;
+};
+
+RenderTarget createRenderTarget(int width, int height, const std::string &owner, GLenum format = GL_RGBA)
+{
+    RenderTarget target;
+    target.width = width;
+    target.height = height;
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    // create a color attachment texture
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, format == GL_RGBA32F ? GL_FLOAT : GL_UNSIGNED_BYTE, NULL); //Create the texture, no data inside=NULL
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    //Attach your texture to the framebuffer's color buffer
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    // use a single renderbuffer object for both a depth AND stencil buffer.
+    glGenRenderbuffers(1, &target.rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target.rbo);
+    // now that we actually created the framebuffer and added all attachments we want to check if it is actually complete now
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    memoryRegistry().track(MEM_FRAMEBUFFER, target.framebuffer, 0, "color + depth/stencil", owner);
+    memoryRegistry().track(MEM_TEXTURE, target.texture, textureBytes(format, width, height), describeImage(format, width, height), owner);
+    memoryRegistry().track(MEM_RENDERBUFFER, target.rbo, textureBytes(GL_DEPTH24_STENCIL8, width, height),
+                           describeImage(GL_DEPTH24_STENCIL8, width, height), owner);
+    return target;
+}
+
+void deleteRenderTarget(RenderTarget &target)
+{
+    memoryRegistry().release(MEM_FRAMEBUFFER, target.framebuffer);
+    memoryRegistry().release(MEM_TEXTURE, target.texture);
+    memoryRegistry().release(MEM_RENDERBUFFER, target.rbo);
+    glDeleteFramebuffers(1, &target.framebuffer);
+    glDeleteTextures(1, &target.texture);
+    glDeleteRenderbuffers(1, &target.rbo);
+    target.framebuffer = target.texture = target.rbo = 0;
+}
+
+// compiles a shader and charges the time to the startup timeline
+Shader timedShader(const char *vertexPath, const char *fragmentPath, const char *phase)
+{
+    Shader compiled(vertexPath, fragmentPath);
+    startupTimeline().mark(phase);
+    return compiled;
+}
+
+/*
+    The projections the passes use. glm here takes the field of view in degrees, so radians(180.0f) is
+    a ~3 degree telephoto lens and radians(5000.0f) ~87 degrees for the skybox.
+    Free functions so the CPU renderers use exactly the same ones.
+*/
+glm::mat4 sceneProjection(int width, int height)
+{
+    return glm::perspective(glm::radians(180.0f), (float)width/(float)height, 0.1f, 1000.0f); //first param is field of view
+}
+
+glm::mat4 skyProjection(int width, int height)
+{
+    //fov should be larger for cubemap
+    return glm::perspective(glm::radians(5000.0f), (float)width/(float)height, 0.1f, 1000.0f);
+}
+
+enum RenderPass { PASS_FRONT, PASS_BACK, PASS_REFRACTION, PASS_SKYBOX, PASS_COUNT };
+
+/*
+    Where the refraction shader gets the distance through the object from.
+    The baked modes need the meshes' thickness attribute (loadOrBakeThickness in thickness.hpp),
+    the SDF one a distance field texture (loadOrBakeSdf and useSdf in sdf.hpp).
+*/
+enum ThicknessMode {
+    THICKNESS_DEPTH,        // back pass distance - front pass distance, the paper's method
+    THICKNESS_BAKED,        // baked per-vertex thickness, the front pass is skipped
+    THICKNESS_BAKED_CONVEX, // baked thickness, back normal guessed as if the object were a sphere: no normal passes
+    THICKNESS_SDF,          // refracted ray sphere-traced through the signed distance field: no normal passes
+};
+
+const char *renderPassName(int pass)
+{
+    static const char *names[] = { "front", "back", "refraction", "skybox" };
+    return names[pass];
+}
+
+struct PassStats {
+    double cpuMs;  // time to submit the pass on the CPU
+    double gpuMs;  // GL_TIME_ELAPSED for the pass, only when profiling
+    unsigned long long glCalls;
+    unsigned long long drawCalls;
+};
+
+class Renderer {
+public:
+    Shader shader;         // refraction
+    Shader skyboxShader;
+    Shader normalShader;   // front and back normals
+    unsigned int skyboxVAO, skyboxVBO;
+    unsigned int cubemapTexture;
+    RenderTarget front, back;
+    int width, height;
+    glm::mat4 projection;
+    glm::mat4 skyboxProjection;
+    // profiling = true times every pass on the GPU and makes stats valid after renderFrame()
+    bool profiling;
+    int thicknessMode;     // a ThicknessMode
+    int debugOutput;       // 0 = color; 1 = T2, 2 = newUV in a float target, for the error report (errorreport.hpp)
+    unsigned int sdfTexture;      // 3D distance field for THICKNESS_SDF, not owned
+    glm::vec3 sdfMin, sdfMax;     // the box it covers, in the model's own space
+    float roughness;              // of the glass, 0 = smooth; needs prefilterTexture
+    unsigned int prefilterTexture; // the GGX prefiltered skybox (prefilter.hpp), not owned
+    float prefilterMaxLod;        // its last level, roughness 1
+    float exposure;               // 0 = the skybox is sRGB bytes; above, it's a linear HDR probe to tone map (hdrenv.hpp)
+    unsigned int probeTexture;    // the refraction reads this cubemap instead of the skybox when set (envprobe.hpp), not owned
+    float probeMaxLod;            // its last level; above 0 rough glass reads its mips instead of prefilterTexture
+    PassStats stats[PASS_COUNT];
+    PassTimer timer;
+
+    Renderer(int width, int height, unsigned int cubemapTexture)
+        : shader(timedShader("shaders/objVshader.txt", "shaders/objFshader.txt", "compile refraction shader")),
+          skyboxShader(timedShader("shaders/skyboxVshader.txt", "shaders/skyboxFshader.txt", "compile skybox shader")),
+          normalShader(timedShader("shaders/normVshader.txt", "shaders/normFshader.txt", "compile normal shader")),
+          cubemapTexture(cubemapTexture), width(width), height(height), profiling(false),
+          thicknessMode(THICKNESS_DEPTH), debugOutput(0), sdfTexture(0), roughness(0.0f), prefilterTexture(0),
+          prefilterMaxLod(0.0f), exposure(0.0f), probeTexture(0), probeMaxLod(0.0f)
+    {
+        //VAO and VBO for skybox
+        glGenVertexArrays(1, &skyboxVAO);
+        glGenBuffers(1, &skyboxVBO);
+        glBindVertexArray(skyboxVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glBindVertexArray(0);
+        memoryRegistry().track(MEM_BUFFER, skyboxVBO, sizeof(skyboxVertices), "skybox cube", "skybox");
+
+        skyboxShader.use();
+        glUniform1i(glGetUniformLocation(skyboxShader.ID, "skybox"), 0); //0 represents GL_TEXTURE0
+
+        shader.use(); //Activate the shader before setting its values! important
+        glUniform1i(glGetUniformLocation(shader.ID, "skybox"), 0);
+        //The normal textures are bound to units 1 and 2 while drawing
+        glUniform1i(glGetUniformLocation(shader.ID, "normalFrontTexture"), 1);
+        glUniform1i(glGetUniformLocation(shader.ID, "normalBackTexture"), 2);
+        glUniform1i(glGetUniformLocation(shader.ID, "sdfTexture"), 3);
+        glUniform1i(glGetUniformLocation(shader.ID, "prefilteredSkybox"), 4);
+
+        updateProjection();
+        front = createRenderTarget(width, height, "front normals pass");
+        back = createRenderTarget(width, height, "back normals pass");
+        startupTimeline().mark("create framebuffers");
+        timer.init(PASS_COUNT);
+        for (int i = 0; i < PASS_COUNT; i++)
+            stats[i] = PassStats();
+    }
+
+    // Reallocates the normal textures, call when the output size changes
+    void resize(int newWidth, int newHeight)
+    {
+        if (newWidth == width && newHeight == height)
+            return;
+        if (newWidth <= 0 || newHeight <= 0) // minimized window
+            return;
+        width = newWidth;
+        height = newHeight;
+        updateProjection();
+        deleteRenderTarget(front);
+        deleteRenderTarget(back);
+        front = createRenderTarget(width, height, "front normals pass");
+        back = createRenderTarget(width, height, "back normals pass");
+    }
+
+    void release()
+    {
+        deleteRenderTarget(front);
+        deleteRenderTarget(back);
+        memoryRegistry().release(MEM_BUFFER, skyboxVBO);
+        glDeleteVertexArrays(1, &skyboxVAO);
+        glDeleteBuffers(1, &skyboxVBO);
+        glDeleteProgram(shader.ID);
+        glDeleteProgram(skyboxShader.ID);
+        glDeleteProgram(normalShader.ID);
+        timer.release();
+    }
+
+    /*
+        Renders one frame into targetFramebuffer (0 = our main screen).
+        Every matrix in models draws the model once, so the same mesh can be instanced around the scene.
+        cameraPos is what the shaders get as their cameraPos uniform.
+    */
+    void renderFrame(Model &object, const vector<glm::mat4> &models, const glm::mat4 &view,
+                     const glm::vec3 &cameraPos, unsigned int targetFramebuffer)
+    {
+        //what the streamed textures should have by the next frame
+        if (textureResidency().enabled)
+            for (size_t i = 0; i < models.size(); i++)
+                textureResidency().request(object.meshes, models[i], view, projection, height);
+        //First Pass
+        //Render the front normals
+        //The baked thickness modes don't read the front pass (only its distance in alpha is used),
+        //and the convex and SDF ones don't read the back pass either, so those are skipped
+        beginPass(PASS_FRONT);
+        glEnable(GL_DEPTH_TEST);
+        normalShader.use();
+        glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "view"), 1, GL_FALSE, &view[0][0]);
+        glUniform3fv(glGetUniformLocation(normalShader.ID, "cameraPos"), 1, &cameraPos[0]);
+        if (thicknessMode == THICKNESS_DEPTH) {
+            glBindFramebuffer(GL_FRAMEBUFFER, front.framebuffer);
+            glViewport(0, 0, width, height);
+            glDepthFunc(GL_LESS);
+            glClearColor(0.0f, 0.1f, 0.1f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            //Draw the model with normalShader and it will end up in our framebuffer
+            //Remember to activate the shader before putting in the variables
+            drawInstances(object, normalShader, models);
+        }
+        endPass(PASS_FRONT);
+
+        //Render the back normals
+        beginPass(PASS_BACK);
+        if (thicknessMode == THICKNESS_DEPTH || thicknessMode == THICKNESS_BAKED) {
+            glBindFramebuffer(GL_FRAMEBUFFER, back.framebuffer);
+            glViewport(0, 0, width, height);
+            glClearDepth(0.0f);
+            glDepthFunc(GL_GREATER);
+            glClearColor(1.0f, 0.1f, 0.1f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // this is what sets the depth to 0.0 as we told the program on glClearDepth(0.0);
+            drawInstances(object, normalShader, models);
+        }
+        endPass(PASS_BACK);
+
+        //Second pass
+        beginPass(PASS_REFRACTION);
+        glClearDepth(1.0f); //This goes into effect when doing glClear(GL_DEPTH_BUFFER_BIT)
+        glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+        glViewport(0, 0, width, height);
+        glDepthFunc(GL_LESS);
+        glClearColor(0.0f, 0.1f, 0.0f, 0.3f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        shader.use();
+        glUniform3fv(glGetUniformLocation(shader.ID, "cameraPos"), 1, &cameraPos[0]); //Update uniform cameraPos in fragment shader every frame
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "view"), 1, GL_FALSE, &view[0][0]);
+        glUniform2f(glGetUniformLocation(shader.ID, "screenSize"), (float)width, (float)height);
+        glUniform1i(glGetUniformLocation(shader.ID, "thicknessMode"), thicknessMode);
+        glUniform1i(glGetUniformLocation(shader.ID, "debugOutput"), debugOutput);
+        glActiveTexture(GL_TEXTURE0 + 1);
+        glBindTexture(GL_TEXTURE_2D, front.texture);
+        glActiveTexture(GL_TEXTURE0 + 2);
+        glBindTexture(GL_TEXTURE_2D, back.texture);
+        if (thicknessMode == THICKNESS_SDF) {
+            glActiveTexture(GL_TEXTURE0 + 3);
+            glBindTexture(GL_TEXTURE_3D, sdfTexture);
+            glUniform3fv(glGetUniformLocation(shader.ID, "sdfMin"), 1, &sdfMin[0]);
+            glUniform3fv(glGetUniformLocation(shader.ID, "sdfMax"), 1, &sdfMax[0]);
+        }
+        //a mipmapped environment probe stands in for the prefiltered skybox too (box filtered, not GGX)
+        bool probeMips = probeTexture && probeMaxLod > 0.0f;
+        unsigned int rough = probeMips ? probeTexture : prefilterTexture;
+        glUniform1f(glGetUniformLocation(shader.ID, "roughness"), rough ? roughness : 0.0f);
+        glUniform1f(glGetUniformLocation(shader.ID, "exposure"), exposure);
+        if (rough) {
+            glActiveTexture(GL_TEXTURE0 + 4);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, rough);
+            glUniform1f(glGetUniformLocation(shader.ID, "prefilterMaxLod"), probeMips ? probeMaxLod : prefilterMaxLod);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, probeTexture ? probeTexture : cubemapTexture);
+        drawInstances(object, shader, models);
+        endPass(PASS_REFRACTION);
+
+        // draw skybox as last
+        beginPass(PASS_SKYBOX);
+        glDepthFunc(GL_LEQUAL); // change depth function so depth test passes when values are equal to depth buffer's content
+        skyboxShader.use();
+        glm::mat4 skyboxView = glm::mat4(glm::mat3(view)); // remove translation from the view matrix
+        glUniformMatrix4fv(glGetUniformLocation(skyboxShader.ID, "view"), 1, GL_FALSE, &skyboxView[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(skyboxShader.ID, "projection"), 1, GL_FALSE, &skyboxProjection[0][0]);
+        glUniform1f(glGetUniformLocation(skyboxShader.ID, "exposure"), exposure);
+        // skybox cube
+        glBindVertexArray(skyboxVAO);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glBindVertexArray(0);
+        glDepthFunc(GL_LESS); // set depth function back to default
+        endPass(PASS_SKYBOX);
+
+        if (profiling)
+            for (int i = 0; i < PASS_COUNT; i++)
+                stats[i].gpuMs = timer.milliseconds(i);
+    }
+
+private:
+    std::chrono::steady_clock::time_point passStart;
+    unsigned long long passCalls, passDraws;
+
+    /*
+        Drawing in 3D.
+        1. We need a model matrix, which turns local coordinates to world coordinates.
+        2. View matrix: We put the coordinates to cameras point of view before projecting them to clip coordinates.
+        3. Projection matrix (perspective or orthographic)
+    */
+    void updateProjection()
+    {
+        projection = sceneProjection(width, height);
+        skyboxProjection = skyProjection(width, height);
+
+        normalShader.use(); //Remember to activate it first!
+        glUniformMatrix4fv(glGetUniformLocation(normalShader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+        shader.use();
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+    }
+
+    void drawInstances(Model &object, Shader &pass, const vector<glm::mat4> &models)
+    {
+        GLint modelLocation = glGetUniformLocation(pass.ID, "model");
+        //only the SDF mode needs to get back into the model's own space
+        GLint inverseLocation = thicknessMode == THICKNESS_SDF ? glGetUniformLocation(pass.ID, "inverseModel") : -1;
+        for (unsigned int i = 0; i < models.size(); i++) {
+            glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &models[i][0][0]);
+            if (inverseLocation >= 0) {
+                glm::mat4 inverseModel = glm::inverse(models[i]);
+                glUniformMatrix4fv(inverseLocation, 1, GL_FALSE, &inverseModel[0][0]);
+            }
+            object.Draw(pass);
+        }
+    }
+
+    void beginPass(int pass)
+    {
+        if (!profiling)
+            return;
+        passStart = std::chrono::steady_clock::now();
+        passCalls = glCallCounts().total();
+        passDraws = glCallCounts().drawCalls();
+        timer.begin(pass);
+    }
+
+    void endPass(int pass)
+    {
+        if (!profiling)
+            return;
+        timer.end(pass);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - passStart;
+        stats[pass].cpuMs = elapsed.count();
+        stats[pass].glCalls = glCallCounts().total() - passCalls;
+        stats[pass].drawCalls = glCallCounts().drawCalls() - passDraws;
+    }
+};
+
+// builds the mip chains of the decoded faces (and compresses them) unless they all came from a cache
+void buildCubemapMips(vector<DecodedFace> &faces, const vector<std::string> &paths, int filter)
+{
+    string mipTag = mipCacheTag(filter, true);
+    bool cached = true, complete = faces.size() == 6;
+    for (size_t i = 0; i < faces.size(); i++) {
+        cached = cached && (!faces[i].compressed.empty() || !faces[i].mips.empty());
+        complete = complete && (faces[i].data || !faces[i].mips.empty()) && faces[i].width == faces[0].width &&
+                   faces[i].width == faces[i].height && faces[i].channels == faces[0].channels;
+    }
+    if (cached)
+        return;
+    auto start = std::chrono::steady_clock::now();
+    vector<const unsigned char *> pixels(faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+        pixels[i] = faces[i].data ? faces[i].data : faces[i].mips.empty() ? 0 : faces[i].mips.levels[0].data();
+    vector<MipChain> chains(faces.size());
+    if (complete) {
+        //the skybox texels are sRGB even though they are sampled as they are, so they're filtered in linear
+        buildMipChains(&pixels[0], 6, faces[0].width, faces[0].height, faces[0].channels, filter, true, &chains[0]);
+    } else {
+        //some faces came from the compressed cache (or don't match), the rest are filtered on their own
+        for (size_t i = 0; i < faces.size(); i++)
+            if (pixels[i] && faces[i].compressed.empty())
+                buildMipChains(&pixels[i], 1, faces[i].width, faces[i].height, faces[i].channels, filter, true, &chains[i]);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    for (size_t i = 0; i < faces.size(); i++) {
+        DecodedFace &face = faces[i];
+        if (chains[i].empty() || !face.compressed.empty())
+            continue;
+        if (!face.mips.empty())
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)face.mips.levels[0].data());
+        face.mips.levels.swap(chains[i].levels);
+        face.mips.width = chains[i].width;
+        face.mips.height = chains[i].height;
+        face.mips.components = chains[i].components;
+        if (face.data) {
+            memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)face.data);
+            stbi_image_free(face.data);
+            face.data = 0;
+        }
+        saveCachedMips(paths[i], true, face.mips);
+        if (compressDecoded(paths[i], face.mips.levels[0].data(), face.width, face.height, face.channels, &face.mips, mipTag,
+                            face.compressed))
+            face.mips = MipChain();
+        else
+            memoryRegistry().track(MEM_CPU_IMAGE, (unsigned long long)(size_t)face.mips.levels[0].data(), face.mips.bytes(),
+                                   "face mips", paths[i]);
+    }
+    cout << "Mips (" << mipFilterName(filter) << (complete ? ", across the cube edges" : ", per face") << ") of " << paths.size()
+         << " faces in " << ms << " ms" << endl;
+}
+
+CubemapLoad startCubemapLoad(const vector<std::string> &faces, bool streamed)
+{
+    //Texture for cubemap
+    CubemapLoad load;
+    glGenTextures(1, &load.texture);
+    load.folder = faces.empty() ? "skybox" : faces[0].substr(0, faces[0].find_last_of('/'));
+    load.faces = faces;
+    load.decoded = std::make_shared<vector<DecodedFace> >(faces.size(), DecodedFace());
+    std::shared_ptr<vector<DecodedFace> > decoded = load.decoded;
+    JobSystem &jobs = jobSystem();
+    int filter = mipSettings().filter;
+    string mipTag = mipCacheTag(filter, true);
+    vector<JobHandle> decodes;
+    //a pack is ready to upload as it is, every face's ready handle stays empty (done)
+    bool packed = openCubemapPack(faces, load.pack);
+    for (GLuint i = 0; i < faces.size() && !packed; i++) {
+        string face = faces[i];
+        decodes.push_back(jobs.submit([decoded, face, i, filter, mipTag] {
+            DecodedFace &out = (*decoded)[i];
+            out.data = 0;
+            out.channels = 3;
+            if (loadCachedTexture(face, mipTag, out.compressed)) {
+                out.width = out.compressed.width;
+                out.height = out.compressed.height;
+                return;
+            }
+            if (loadCachedMips(face, true, out.mips)) {
+                out.width = out.mips.width;
+                out.height = out.mips.height;
+                out.channels = out.mips.components;
+                memoryRegistry().track(MEM_CPU_IMAGE, (unsigned long long)(size_t)out.mips.levels[0].data(), out.mips.bytes(),
+                                       "face mips", face);
+                return;
+            }
+            out.data = stbi_load(face.c_str(), &out.width, &out.height, &out.channels, 0);
+            //with mips the compression waits for buildCubemapMips
+            if (filter == MIP_NONE && compressDecoded(face, out.data, out.width, out.height, out.channels, 0, mipTag, out.compressed)) {
+                stbi_image_free(out.data);
+                out.data = 0;
+            }
+            if (out.data)
+                memoryRegistry().track(MEM_CPU_IMAGE, (unsigned long long)(size_t)out.data,
+                                       (size_t)out.width * out.height * out.channels, "decoded face", face);
+        }));
+    }
+    JobHandle mips;
+    if (filter != MIP_NONE && !packed)
+        mips = jobs.submit([decoded, faces, filter] { buildCubemapMips(*decoded, faces, filter); }, decodes);
+    for (GLuint i = 0; i < faces.size(); i++)
+        load.ready.push_back(packed ? JobHandle() : filter != MIP_NONE ? mips : decodes[i]);
+    if (streamed)
+        return load;
+    std::shared_ptr<CubemapLoad> self = std::make_shared<CubemapLoad>(load);
+    for (GLuint i = 0; i < faces.size(); i++)
+        load.uploads.push_back(jobs.submitMain([self, i] { uploadCubemapFace(*self, (int)i); }, vector<JobHandle>(1, load.ready[i])));
+    return load;
+}
+
+// uploads a decoded face (main thread, once load.ready[face] is done) and frees its pixels; returns the bytes sent
+size_t uploadCubemapFace(CubemapLoad &load, int face)
+{
+    DecodedFace &in = (*load.decoded)[face];
+    const string &path = load.faces[face];
+    GLenum target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+    //RGBA faces (the space skyboxes are RGBA PNGs) are read as RGBA and kept as RGB
+    GLenum format = in.channels == 4 ? GL_RGBA : GL_RGB;
+    size_t bytes = 0;
+    if (!load.pack.empty()) {
+        glBindTexture(GL_TEXTURE_CUBE_MAP, load.texture);
+        bytes = uploadTexturePack(target, load.pack, face);
+        startupTimeline().mark("upload " + path);
+    } else if (!in.compressed.empty()) {
+        glBindTexture(GL_TEXTURE_CUBE_MAP, load.texture);
+        uploadCompressedTexture(target, in.compressed);
+        bytes = in.compressed.bytes();
+        startupTimeline().mark("upload " + path);
+    } else if (!in.mips.empty()) {
+        glBindTexture(GL_TEXTURE_CUBE_MAP, load.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t level = 0; level < in.mips.levels.size(); level++)
+            stagedTexImage2D(target, (GLint)level, GL_RGB, in.mips.levelWidth((int)level), in.mips.levelHeight((int)level), format,
+                             GL_UNSIGNED_BYTE, in.mips.levels[level].data(), in.mips.levels[level].size());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        bytes = in.mips.bytes();
+        startupTimeline().mark("upload " + path);
+        memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)in.mips.levels[0].data());
+        in.mips.levels.clear();
+    } else if (in.data) {
+        glBindTexture(GL_TEXTURE_CUBE_MAP, load.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        stagedTexImage2D(target, 0, GL_RGB, in.width, in.height, format, GL_UNSIGNED_BYTE, in.data,
+                         (size_t)in.width * in.height * in.channels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        bytes = (size_t)in.width * in.height * in.channels;
+        startupTimeline().mark("upload " + path);
+        memoryRegistry().release(MEM_CPU_IMAGE, (unsigned long long)(size_t)in.data);
+        stbi_image_free(in.data);
+        in.data = 0;
+    } else {
+        std::cout << "Cubemap texture failed to load at path: " << path << std::endl;
+    }
+    return bytes;
+}
+
+unsigned int finishCubemapLoad(CubemapLoad &load)
+{
+    jobSystem().wait(load.uploads); // runs the uploads on this (the main) thread as the faces come in
+    load.uploads.clear();
+    int width = 0, height = 0, levels = 1;
+    GLenum format = GL_RGB;
+    if (!load.pack.empty()) {
+        width = load.pack.width;
+        height = load.pack.height;
+        levels = load.pack.levels;
+        format = load.pack.internalFormat;
+        load.pack = TexturePack(); // unmaps it, the driver has its copy
+    }
+    for (size_t i = 0; i < load.decoded->size(); i++)
+        if ((*load.decoded)[i].width > 0) {
+            width = (*load.decoded)[i].width;
+            height = (*load.decoded)[i].height;
+            if (!(*load.decoded)[i].compressed.empty()) {
+                format = blockFormatGL((*load.decoded)[i].compressed.format);
+                levels = (int)(*load.decoded)[i].compressed.levels.size();
+            } else if ((*load.decoded)[i].mips.width > 0) {
+                levels = mipLevelCount(width, height);
+            }
+            (*load.decoded)[i].compressed = CompressedTexture();
+        }
+    //Settings for cubemap
+    glBindTexture(GL_TEXTURE_CUBE_MAP, load.texture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    memoryRegistry().track(MEM_TEXTURE, load.texture, textureBytes(format, width, height, (int)load.decoded->size(), levels > 1),
+                           describeImage(format, width, height, levels > 1 ? " cubemap +mips" : " cubemap"), load.folder);
+    return load.texture;
+}
+
+unsigned int loadCubemap(vector<std::string> faces) {
+    CubemapLoad load = startCubemapLoad(faces);
+    return finishCubemapLoad(load);
+}
+
+#endif /* renderer_hpp */
@@ -0,0 +1,505 @@
+//
+//  sdf.hpp
+//  RefractionProject
+//
+//  Signed distance field of a model on a 3D grid, for thick objects that aren't convex: the refraction
+//  shader (Renderer::thicknessMode = THICKNESS_SDF) sphere-traces the refracted ray through the inside
+//  of the object instead of trusting one back pass sample, and takes the exit normal from the gradient.
+//
+//  Distances come from closest-point queries on a Bvh, the sign from the generalized winding number
+//  (Jacobson et al. 2013), which doesn't mind small holes or self-intersections. The winding number is
+//  evaluated like Barill et al.'s fast winding number: BVH nodes far from the point are replaced by a
+//  dipole (their area-weighted normal at their area-weighted center), close ones are summed exactly.
+//  Exact distances are only looked up in a narrow band around the surface; the rest of the grid is
+//  filled by sweeping the nearest triangle of every voxel to its neighbours, axis by axis, in parallel
+//  lines (like Bridson's makelevelset3). The sign is looked up along x rows and only has to be looked
+//  up again after a voxel within a voxel of the surface, otherwise the neighbour's sign carries over.
+//
+//  The grid is a cube around the model with a few voxels of padding, stored as negative-inside floats
+//  in object space. On the GPU it's a GL_R16F 3D texture. Bakes of a model are cached next to it
+//  (cat.obj -> cat.obj.sdf128) with a hash of the vertex positions, like the thickness sidecars.
+//
+//  RefractionProject --bake-sdf [--model path [--software]] [--triangles 100000] [--resolutions 64,128,256]
+//                    [--threads N] [--band 2 | --exact] [--verify 2000]
+//
+
+#ifndef sdf_hpp
+#define sdf_hpp
+
+#include "glm/glm.hpp"
+#include "bvh.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "procedural.hpp"
+#include "raytrace.hpp"
+#include "thickness.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct SdfGrid {
+    int resolution;
+    glm::vec3 lo;              // corner of the grid in object space, voxel centers are at lo + (i + 0.5) * voxel
+    float voxel;               // edge length of a voxel
+    vector<float> distance;    // resolution^3, x fastest, negative inside
+
+    SdfGrid() : resolution(0), voxel(0.0f) {}
+    glm::vec3 hi() const { return lo + glm::vec3(voxel * resolution); }
+};
+
+struct SdfBakeStats {
+    size_t voxels;
+    size_t windingQueries;   // voxels whose sign had to be looked up, the rest took their neighbour's
+    size_t bakeBytes;        // the grid plus the nearest triangle and sign per voxel while baking
+    double ms;
+};
+
+// solid angle of triangle abc seen from q, Van Oosterom and Strackee
+inline float triangleSolidAngle(const glm::vec3 &q, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2)
+{
+    glm::vec3 a = v0 - q, b = v1 - q, c = v2 - q;
+    float la = glm::length(a), lb = glm::length(b), lc = glm::length(c);
+    float numerator = glm::dot(a, glm::cross(b, c));
+    float denominator = la * lb * lc + glm::dot(a, b) * lc + glm::dot(b, c) * la + glm::dot(c, a) * lb;
+    return 2.0f * std::atan2(numerator, denominator);
+}
+
+/*
+    Generalized winding number over the triangles of a Bvh: about 1 inside a closed mesh, 0 outside
+    (-1 inside if the triangles wind the other way, so callers compare the magnitude against 0.5).
+*/
+class WindingNumber {
+public:
+    float accuracy;   // a node is approximated when the point is this many node radii from its center
+
+    WindingNumber() : accuracy(2.0f), bvh(0) {}
+
+    void build(const Bvh &source)
+    {
+        bvh = &source;
+        size_t count = source.nodes.size();
+        areaNormal.assign(count, glm::vec3(0.0f));
+        center.assign(count, glm::vec3(0.0f));
+        radius.assign(count, 0.0f);
+        vector<float> area(count, 0.0f);
+        // children always come after their parent in the node array, so walking it backwards is bottom-up
+        for (size_t i = count; i-- > 0;) {
+            const BvhNode &node = source.nodes[i];
+            glm::vec3 weighted(0.0f);
+            if (node.count > 0) {
+                for (unsigned int t = node.leftFirst; t < node.leftFirst + node.count; t++) {
+                    const glm::vec3 *v = &source.vertices[3 * source.triangles[t]];
+                    glm::vec3 normal = 0.5f * glm::cross(v[1] - v[0], v[2] - v[0]);
+                    float a = glm::length(normal);
+                    areaNormal[i] += normal;
+                    weighted += a * (v[0] + v[1] + v[2]) / 3.0f;
+                    area[i] += a;
+                }
+            } else {
+                for (unsigned int child = node.leftFirst; child < node.leftFirst + 2; child++) {
+                    areaNormal[i] += areaNormal[child];
+                    weighted += area[child] * center[child];
+                    area[i] += area[child];
+                }
+            }
+            glm::vec3 lo(node.min[0], node.min[1], node.min[2]), hi(node.max[0], node.max[1], node.max[2]);
+            center[i] = area[i] > 0.0f ? weighted / area[i] : 0.5f * (lo + hi);
+            glm::vec3 farCorner = glm::max(glm::abs(center[i] - lo), glm::abs(hi - center[i]));
+            radius[i] = glm::length(farCorner);
+        }
+    }
+
+    float at(const glm::vec3 &q) const
+    {
+        if (!bvh || bvh->triangles.empty())
+            return 0.0f;
+        const float inverseFourPi = 0.25f / 3.14159265f;
+        float sum = 0.0f;
+        unsigned int stack[128];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            unsigned int i = stack[--top];
+            glm::vec3 offset = center[i] - q;
+            float distance2 = glm::dot(offset, offset);
+            float limit = accuracy * radius[i];
+            if (distance2 > limit * limit) {
+                // far away the node looks like a dipole: solid angle ~ (c - q) . N / |c - q|^3
+                sum += glm::dot(offset, areaNormal[i]) * inverseFourPi / (distance2 * std::sqrt(distance2));
+                continue;
+            }
+            const BvhNode &node = bvh->nodes[i];
+            if (node.count > 0) {
+                for (unsigned int t = node.leftFirst; t < node.leftFirst + node.count; t++) {
+                    const glm::vec3 *v = &bvh->vertices[3 * bvh->triangles[t]];
+                    sum += triangleSolidAngle(q, v[0], v[1], v[2]) * inverseFourPi;
+                }
+            } else if (top + 2 <= 128) {
+                stack[top++] = node.leftFirst;
+                stack[top++] = node.leftFirst + 1;
+            }
+        }
+        return sum;
+    }
+
+    // brute force over every triangle, to check at() against
+    float exactAt(const glm::vec3 &q) const
+    {
+        float sum = 0.0f;
+        for (size_t t = 0; bvh && t < bvh->triangleCount(); t++)
+            sum += triangleSolidAngle(q, bvh->vertices[3 * t], bvh->vertices[3 * t + 1], bvh->vertices[3 * t + 2]);
+        return sum * 0.25f / 3.14159265f;
+    }
+
+private:
+    const Bvh *bvh;
+    vector<glm::vec3> areaNormal;   // sum of the triangles' normals scaled by their area
+    vector<glm::vec3> center;       // area-weighted center of the triangles
+    vector<float> radius;           // from center to the farthest corner of the node's box
+};
+
+// the grid the model gets: a cube around it with padding voxels on every side
+inline SdfGrid sdfGridFor(const Bvh &bvh, int resolution)
+{
+    const int padding = 4;
+    SdfGrid grid;
+    grid.resolution = resolution;
+    glm::vec3 lo(bvh.nodes[0].min[0], bvh.nodes[0].min[1], bvh.nodes[0].min[2]);
+    glm::vec3 hi(bvh.nodes[0].max[0], bvh.nodes[0].max[1], bvh.nodes[0].max[2]);
+    if (bvh.triangles.empty())
+        lo = hi = glm::vec3(0.0f);
+    glm::vec3 size = hi - lo;
+    float extent = std::max(std::max(size.x, size.y), std::max(size.z, 1e-6f));
+    grid.voxel = extent / std::max(resolution - 2 * padding, 1);
+    grid.lo = 0.5f * (lo + hi) - glm::vec3(0.5f * grid.voxel * resolution);
+    return grid;
+}
+
+/*
+    band is in voxels: closer than that to the surface the distances are exact, farther out they come
+    from the sweeps (the distance to the nearest triangle any neighbour knows of, an upper bound that is
+    almost always the true one). A band as big as the grid makes every voxel exact, for reference. It is
+    at least a voxel: with less, voxels next to the surface can be left with no triangle to sweep out
+    from, and the sign carried along a row can cross the surface between two of them.
+*/
+inline SdfGrid bakeSdf(const vector<MeshView> &meshes, int resolution, int threads, SdfBakeStats &stats, float band = 2.0f)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    band = std::max(band, 1.0f);
+    Bvh bvh;
+    bvh.build(worldTriangles(meshes, vector<glm::mat4>(1, glm::mat4(1.0f))), threads);
+    WindingNumber winding;
+    winding.build(bvh);
+
+    SdfGrid grid = sdfGridFor(bvh, resolution);
+    size_t n = (size_t)resolution;
+    grid.distance.assign(n * n * n, FLT_MAX);
+    const unsigned int none = 0xffffffffu;
+    vector<unsigned int> nearest(grid.distance.size(), none);
+    vector<unsigned char> inside(grid.distance.size(), 0);
+    std::atomic<size_t> windingQueries(0);
+    if (bvh.triangles.empty()) {
+        grid.distance.assign(grid.distance.size(), grid.voxel * resolution);
+        band = 0.0f;
+    }
+    auto center = [&](size_t x, size_t y, size_t z) {
+        return grid.lo + grid.voxel * glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f);
+    };
+
+    // 1. exact distances near the surface and the sign everywhere, one z slice per task
+    if (band > 0.0f) {
+        parallelFor(resolution, threads, [&](int z, int) {
+            size_t queries = 0;
+            for (size_t y = 0; y < n; y++) {
+                bool previousFar = false;
+                for (size_t x = 0; x < n; x++) {
+                    size_t i = ((size_t)z * n + y) * n + x;
+                    glm::vec3 p = center(x, y, z);
+                    ClosestHit hit;
+                    bool near = bvh.closestPoint(p, band * grid.voxel, hit);
+                    if (near) {
+                        grid.distance[i] = hit.distance;
+                        nearest[i] = hit.triangle;
+                    }
+                    // the surface can't be between two voxels if it is more than a voxel away from the first
+                    if (x > 0 && previousFar) {
+                        inside[i] = inside[i - 1];
+                    } else {
+                        inside[i] = std::fabs(winding.at(p)) > 0.5f;
+                        queries++;
+                    }
+                    previousFar = !near || hit.distance > grid.voxel;
+                }
+            }
+            windingQueries += queries;
+        });
+    }
+
+    // 2. every voxel takes its neighbour's nearest triangle if that one is closer than its own. A sweep
+    //    goes along one axis in both directions, with every line along that axis its own task.
+    auto relax = [&](size_t to, size_t from, const glm::vec3 &p) {
+        unsigned int triangle = nearest[from];
+        if (triangle == none || triangle == nearest[to])
+            return;
+        const glm::vec3 *v = &bvh.vertices[3 * triangle];
+        float d = glm::length(closestPointOnTriangle(p, v[0], v[1], v[2]) - p);
+        if (d < grid.distance[to]) {
+            grid.distance[to] = d;
+            nearest[to] = triangle;
+        }
+    };
+    for (int round = 0; round < 3 && band > 0.0f; round++) {
+        // x: rows of a slice
+        parallelFor(resolution, threads, [&](int z, int) {
+            for (size_t y = 0; y < n; y++) {
+                size_t row = ((size_t)z * n + y) * n;
+                for (size_t x = 1; x < n; x++)
+                    relax(row + x, row + x - 1, center(x, y, z));
+                for (size_t x = n - 1; x-- > 0;)
+                    relax(row + x, row + x + 1, center(x, y, z));
+            }
+        });
+        // y: a whole row at a time from the row before it, per slice
+        parallelFor(resolution, threads, [&](int z, int) {
+            size_t slice = (size_t)z * n * n;
+            for (size_t y = 1; y < n; y++)
+                for (size_t x = 0; x < n; x++)
+                    relax(slice + y * n + x, slice + (y - 1) * n + x, center(x, y, z));
+            for (size_t y = n - 1; y-- > 0;)
+                for (size_t x = 0; x < n; x++)
+                    relax(slice + y * n + x, slice + (y + 1) * n + x, center(x, y, z));
+        });
+        // z: the same with the slice before, per y
+        parallelFor(resolution, threads, [&](int y, int) {
+            for (size_t z = 1; z < n; z++)
+                for (size_t x = 0; x < n; x++)
+                    relax((z * n + y) * n + x, ((z - 1) * n + y) * n + x, center(x, y, z));
+            for (size_t z = n - 1; z-- > 0;)
+                for (size_t x = 0; x < n; x++)
+                    relax((z * n + y) * n + x, ((z + 1) * n + y) * n + x, center(x, y, z));
+        });
+    }
+    for (size_t i = 0; i < grid.distance.size(); i++)
+        if (inside[i])
+            grid.distance[i] = -grid.distance[i];
+    stats.voxels = grid.distance.size();
+    stats.windingQueries = windingQueries;
+    stats.bakeBytes = grid.distance.size() * (sizeof(float) + sizeof(unsigned int) + sizeof(unsigned char));
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return grid;
+}
+
+// bytes of the grid on the CPU (float) and as the GL_R16F texture (depth passed as faces)
+inline size_t sdfCpuBytes(const SdfGrid &grid)
+{
+    return grid.distance.size() * sizeof(float);
+}
+
+inline size_t sdfTextureBytes(const SdfGrid &grid)
+{
+    return textureBytes(GL_R16F, grid.resolution, grid.resolution, grid.resolution);
+}
+
+inline unsigned int createSdfTexture(const SdfGrid &grid, const string &owner)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R16F, grid.resolution, grid.resolution, grid.resolution, 0, GL_RED, GL_FLOAT,
+                 grid.distance.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    std::ostringstream size;
+    size << "x" << grid.resolution;
+    memoryRegistry().track(MEM_TEXTURE, texture, sdfTextureBytes(grid),
+                           describeImage(GL_R16F, grid.resolution, grid.resolution, size.str().c_str()), owner + " SDF");
+    return texture;
+}
+
+inline void deleteSdfTexture(unsigned int &texture)
+{
+    if (!texture)
+        return;
+    memoryRegistry().release(MEM_TEXTURE, texture);
+    glDeleteTextures(1, &texture);
+    texture = 0;
+}
+
+inline string sdfSidecarPath(const string &modelPath, int resolution)
+{
+    std::ostringstream path;
+    path << modelPath << ".sdf" << resolution;
+    return path.str();
+}
+
+inline unsigned int modelPositionHash(const Model &model)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t m = 0; m < model.meshes.size(); m++)
+        hash = (hash ^ vertexPositionHash(model.meshes[m].vertices.data(), model.meshes[m].vertices.size())) * 16777619u;
+    return hash;
+}
+
+// Sidecar layout, little endian: "SDF1", resolution, position hash, lo (3 floats), voxel, then the distances
+inline bool saveSdf(const string &path, const Model &model, const SdfGrid &grid)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file) {
+        cout << "ERROR::SDF:: Could not write " << path << endl;
+        return false;
+    }
+    unsigned int hash = modelPositionHash(model);
+    file.write("SDF1", 4);
+    file.write((const char *)&grid.resolution, sizeof(grid.resolution));
+    file.write((const char *)&hash, sizeof(hash));
+    file.write((const char *)&grid.lo[0], 3 * sizeof(float));
+    file.write((const char *)&grid.voxel, sizeof(grid.voxel));
+    file.write((const char *)grid.distance.data(), grid.distance.size() * sizeof(float));
+    return (bool)file;
+}
+
+inline bool loadSdf(const string &path, const Model &model, int resolution, SdfGrid &grid)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    char magic[4];
+    unsigned int hash = 0;
+    file.read(magic, 4);
+    file.read((char *)&grid.resolution, sizeof(grid.resolution));
+    file.read((char *)&hash, sizeof(hash));
+    if (!file || string(magic, 4) != "SDF1" || grid.resolution != resolution || hash != modelPositionHash(model))
+        return false;
+    file.read((char *)&grid.lo[0], 3 * sizeof(float));
+    file.read((char *)&grid.voxel, sizeof(grid.voxel));
+    grid.distance.resize((size_t)resolution * resolution * resolution);
+    file.read((char *)grid.distance.data(), grid.distance.size() * sizeof(float));
+    return (bool)file;
+}
+
+inline void printSdfStats(const SdfBakeStats &stats, const SdfGrid &grid, const string &name)
+{
+    cout << "Baked a " << grid.resolution << "^3 SDF of " << name << " in " << stats.ms << " ms (winding number at "
+         << 100.0 * stats.windingQueries / std::max(stats.voxels, (size_t)1) << "% of the voxels), "
+         << sdfCpuBytes(grid) / (1024.0 * 1024.0) << " MB as floats, " << sdfTextureBytes(grid) / (1024.0 * 1024.0)
+         << " MB as GL_R16F" << endl;
+}
+
+/*
+    The SDF of model at resolution: from the sidecar if it is up to date, otherwise baked now (and saved
+    next to the model when it came from a file).
+*/
+inline SdfGrid loadOrBakeSdf(const Model &model, bool fromFile, int resolution, int threads = 0)
+{
+    SdfGrid grid;
+    string sidecar = sdfSidecarPath(model.path, resolution);
+    if (fromFile && loadSdf(sidecar, model, resolution, grid))
+        return grid;
+    SdfBakeStats stats;
+    grid = bakeSdf(meshViews(model), resolution, threads, stats);
+    printSdfStats(stats, grid, model.path);
+    if (fromFile && saveSdf(sidecar, model, grid))
+        cout << "Wrote " << sidecar << endl;
+    return grid;
+}
+
+inline void useSdf(Renderer &renderer, unsigned int texture, const SdfGrid &grid)
+{
+    renderer.sdfTexture = texture;
+    renderer.sdfMin = grid.lo;
+    renderer.sdfMax = grid.hi();
+}
+
+// distances at random voxels against brute force over every triangle, and the fast winding number against the exact one
+inline void verifySdf(const vector<MeshView> &meshes, const SdfGrid &grid, int samples)
+{
+    Bvh bvh;
+    bvh.build(worldTriangles(meshes, vector<glm::mat4>(1, glm::mat4(1.0f))));
+    WindingNumber winding;
+    winding.build(bvh);
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> cell(0, grid.resolution - 1);
+    double maxError = 0.0, sumError = 0.0, maxWindingError = 0.0;
+    int signErrors = 0;
+    for (int s = 0; s < samples; s++) {
+        int x = cell(random), y = cell(random), z = cell(random);
+        glm::vec3 p = grid.lo + grid.voxel * glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f);
+        float nearest = FLT_MAX;
+        for (size_t t = 0; t < bvh.triangleCount(); t++)
+            nearest = std::min(nearest, glm::length(closestPointOnTriangle(p, bvh.vertices[3 * t], bvh.vertices[3 * t + 1],
+                                                                            bvh.vertices[3 * t + 2]) - p));
+        float exact = winding.exactAt(p);
+        float baked = grid.distance[((size_t)z * grid.resolution + y) * grid.resolution + x];
+        double error = std::fabs(std::fabs(baked) - nearest);
+        maxError = std::max(maxError, error);
+        sumError += error;
+        maxWindingError = std::max(maxWindingError, (double)std::fabs(winding.at(p) - exact));
+        if ((baked < 0.0f) != (std::fabs(exact) > 0.5f))
+            signErrors++;
+    }
+    cout << "Checked " << samples << " voxels against brute force: distance error max " << maxError / grid.voxel
+         << " / mean " << sumError / samples / grid.voxel << " voxels, max winding number error " << maxWindingError << ", " << signErrors << " wrong signs" << endl;
+}
+
+inline int runSdfBaker(int argc, char *argv[])
+{
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    int samples = (int)argNumber(argc, argv, "--verify", 0);
+    float band = (float)argNumber(argc, argv, "--band", 2.0);
+    if (band < 1.0f) {
+        cout << "--band " << band << " is less than a voxel, using 1" << endl;
+        band = 1.0f;
+    }
+    string modelPath = argValue(argc, argv, "--model", "");
+    vector<int> resolutions;
+    std::istringstream list(argValue(argc, argv, "--resolutions", "64,128,256"));
+    for (string item; getline(list, item, ',');)
+        if (atoi(item.c_str()) > 0)
+            resolutions.push_back(atoi(item.c_str()));
+
+    // no model: a procedural torus, it has a hole for the sign to get right
+    TraceMeshes meshes;
+    if (!loadTraceMeshes(argc, argv, meshes, SHAPE_TORUS))
+        return -1;
+    size_t triangles = 0;
+    for (size_t m = 0; m < meshes.views.size(); m++)
+        triangles += meshes.views[m].indexCount / 3;
+    cout << meshes.name << ": " << triangles << " triangles, " << (threads > 0 ? threads : hardwareThreads()) << " threads" << endl;
+    cout << setw(10) << "grid" << setw(12) << "bake ms" << setw(12) << "Mvoxel/s" << setw(10) << "winding"
+         << setw(11) << "bake MB" << setw(11) << "CPU MB" << setw(11) << "GPU MB" << endl;
+    for (int resolution : resolutions) {
+        SdfBakeStats stats;
+        SdfGrid grid = bakeSdf(meshes.views, resolution, threads, stats, hasArg(argc, argv, "--exact") ? (float)resolution * 2.0f : band);
+        cout << fixed << setprecision(1) << setw(9) << resolution << "^" << setw(12) << stats.ms << setw(12)
+             << setprecision(2) << stats.voxels / (stats.ms * 1000.0) << setprecision(1) << setw(9)
+             << 100.0 * stats.windingQueries / stats.voxels << "%" << setw(11) << stats.bakeBytes / (1024.0 * 1024.0)
+             << setw(11) << sdfCpuBytes(grid) / (1024.0 * 1024.0)
+             << setw(11) << sdfTextureBytes(grid) / (1024.0 * 1024.0) << endl;
+        cout.unsetf(ios::floatfield);
+        if (samples > 0)
+            verifySdf(meshes.views, grid, samples);
+        if (meshes.model && saveSdf(sdfSidecarPath(modelPath, resolution), *meshes.model, grid))
+            cout << "Wrote " << sdfSidecarPath(modelPath, resolution) << endl;
+    }
+    meshes.release();
+    return 0;
+}
+
+#endif /* sdf_hpp */
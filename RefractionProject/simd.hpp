@@ -0,0 +1,203 @@
+//
+//  simd.hpp
+//  RefractionProject
+//
+//  A 4-wide float type for the CPU renderers, so the same code runs on SSE2 (x86), NEON (ARM) or
+//  plain C++. Only what the rasterizer and shaders need: arithmetic, min/max, sqrt, floor, compares
+//  that give a lane mask, and select. Lanes are loaded/stored from float arrays; gathers are done by hand.
+//
+
+#ifndef simd_hpp
+#define simd_hpp
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#endif
+
+#include <cmath>
+
+struct vfloat4 {
+#if defined(SIMD_SSE2)
+    __m128 v;
+    vfloat4() {}
+    vfloat4(__m128 v) : v(v) {}
+    vfloat4(float x) : v(_mm_set1_ps(x)) {}
+    vfloat4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    static vfloat4 load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+#elif defined(SIMD_NEON)
+    float32x4_t v;
+    vfloat4() {}
+    vfloat4(float32x4_t v) : v(v) {}
+    vfloat4(float x) : v(vdupq_n_f32(x)) {}
+    vfloat4(float a, float b, float c, float d) { float lanes[4] = { a, b, c, d }; v = vld1q_f32(lanes); }
+    static vfloat4 load(const float *p) { return vld1q_f32(p); }
+    void store(float *p) const { vst1q_f32(p, v); }
+#else
+    float v[4];
+    vfloat4() {}
+    vfloat4(float x) { v[0] = v[1] = v[2] = v[3] = x; }
+    vfloat4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+    static vfloat4 load(const float *p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    void store(float *p) const { p[0] = v[0]; p[1] = v[1]; p[2] = v[2]; p[3] = v[3]; }
+#endif
+    float operator[](int lane) const { float lanes[4]; store(lanes); return lanes[lane]; }
+};
+
+// Result of a compare: all bits set in the lanes where it was true
+struct vmask4 {
+#if defined(SIMD_SSE2)
+    __m128 v;
+    vmask4(__m128 v) : v(v) {}
+#elif defined(SIMD_NEON)
+    uint32x4_t v;
+    vmask4(uint32x4_t v) : v(v) {}
+#else
+    bool v[4];
+    vmask4(bool a, bool b, bool c, bool d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+#endif
+    vmask4() {}
+};
+
+#if defined(SIMD_SSE2)
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat4 min(vfloat4 a, vfloat4 b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat4 max(vfloat4 a, vfloat4 b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat4 sqrt(vfloat4 a) { return _mm_sqrt_ps(a.v); }
+inline vfloat4 abs(vfloat4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+// SSE2 has no round instruction: truncate and step down where that rounded up (|a| < 2^31 only)
+inline vfloat4 floor(vfloat4 a)
+{
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a.v), _mm_set1_ps(1.0f)));
+}
+inline vmask4 operator<(vfloat4 a, vfloat4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vmask4 operator>(vfloat4 a, vfloat4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vmask4 operator<=(vfloat4 a, vfloat4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline vmask4 operator>=(vfloat4 a, vfloat4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vmask4 operator==(vfloat4 a, vfloat4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline vmask4 operator&(vmask4 a, vmask4 b) { return _mm_and_ps(a.v, b.v); }
+inline vmask4 operator|(vmask4 a, vmask4 b) { return _mm_or_ps(a.v, b.v); }
+inline vmask4 andNot(vmask4 a, vmask4 b) { return _mm_andnot_ps(b.v, a.v); } // a & ~b
+inline vfloat4 select(vmask4 m, vfloat4 a, vfloat4 b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+inline int maskBits(vmask4 m) { return _mm_movemask_ps(m.v); }
+inline vmask4 maskFromBits(int bits)
+{
+    return _mm_castsi128_ps(_mm_setr_epi32(bits & 1 ? -1 : 0, bits & 2 ? -1 : 0, bits & 4 ? -1 : 0, bits & 8 ? -1 : 0));
+}
+
+#elif defined(SIMD_NEON)
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return vaddq_f32(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return vsubq_f32(a.v, b.v); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return vmulq_f32(a.v, b.v); }
+#if defined(__aarch64__)
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return vdivq_f32(a.v, b.v); }
+inline vfloat4 sqrt(vfloat4 a) { return vsqrtq_f32(a.v); }
+#else
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { float x[4], y[4]; a.store(x); b.store(y); return vfloat4(x[0] / y[0], x[1] / y[1], x[2] / y[2], x[3] / y[3]); }
+inline vfloat4 sqrt(vfloat4 a) { float x[4]; a.store(x); return vfloat4(std::sqrt(x[0]), std::sqrt(x[1]), std::sqrt(x[2]), std::sqrt(x[3])); }
+#endif
+inline vfloat4 min(vfloat4 a, vfloat4 b) { return vminq_f32(a.v, b.v); }
+inline vfloat4 max(vfloat4 a, vfloat4 b) { return vmaxq_f32(a.v, b.v); }
+inline vfloat4 abs(vfloat4 a) { return vabsq_f32(a.v); }
+#if defined(__aarch64__)
+inline vfloat4 floor(vfloat4 a) { return vrndmq_f32(a.v); }
+#else
+inline vfloat4 floor(vfloat4 a) { float x[4]; a.store(x); return vfloat4(std::floor(x[0]), std::floor(x[1]), std::floor(x[2]), std::floor(x[3])); }
+#endif
+inline vmask4 operator<(vfloat4 a, vfloat4 b) { return vcltq_f32(a.v, b.v); }
+inline vmask4 operator>(vfloat4 a, vfloat4 b) { return vcgtq_f32(a.v, b.v); }
+inline vmask4 operator<=(vfloat4 a, vfloat4 b) { return vcleq_f32(a.v, b.v); }
+inline vmask4 operator>=(vfloat4 a, vfloat4 b) { return vcgeq_f32(a.v, b.v); }
+inline vmask4 operator==(vfloat4 a, vfloat4 b) { return vceqq_f32(a.v, b.v); }
+inline vmask4 operator&(vmask4 a, vmask4 b) { return vandq_u32(a.v, b.v); }
+inline vmask4 operator|(vmask4 a, vmask4 b) { return vorrq_u32(a.v, b.v); }
+inline vmask4 andNot(vmask4 a, vmask4 b) { return vbicq_u32(a.v, b.v); }
+inline vfloat4 select(vmask4 m, vfloat4 a, vfloat4 b) { return vbslq_f32(m.v, a.v, b.v); }
+inline int maskBits(vmask4 m)
+{
+    unsigned int lanes[4];
+    vst1q_u32(lanes, m.v);
+    return (lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8);
+}
+inline vmask4 maskFromBits(int bits)
+{
+    unsigned int lanes[4] = { bits & 1 ? ~0u : 0, bits & 2 ? ~0u : 0, bits & 4 ? ~0u : 0, bits & 8 ? ~0u : 0 };
+    return vld1q_u32(lanes);
+}
+
+#else
+
+#define SIMD_LANES(expr) vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = (expr); return r;
+#define SIMD_MASK(expr) return vmask4(a.v[0] expr b.v[0], a.v[1] expr b.v[1], a.v[2] expr b.v[2], a.v[3] expr b.v[3]);
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] + b.v[i]) }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] - b.v[i]) }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] * b.v[i]) }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] / b.v[i]) }
+inline vfloat4 min(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+inline vfloat4 max(vfloat4 a, vfloat4 b) { SIMD_LANES(a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline vfloat4 sqrt(vfloat4 a) { SIMD_LANES(std::sqrt(a.v[i])) }
+inline vfloat4 abs(vfloat4 a) { SIMD_LANES(std::fabs(a.v[i])) }
+inline vfloat4 floor(vfloat4 a) { SIMD_LANES(std::floor(a.v[i])) }
+inline vmask4 operator<(vfloat4 a, vfloat4 b) { SIMD_MASK(<) }
+inline vmask4 operator>(vfloat4 a, vfloat4 b) { SIMD_MASK(>) }
+inline vmask4 operator<=(vfloat4 a, vfloat4 b) { SIMD_MASK(<=) }
+inline vmask4 operator>=(vfloat4 a, vfloat4 b) { SIMD_MASK(>=) }
+inline vmask4 operator==(vfloat4 a, vfloat4 b) { SIMD_MASK(==) }
+inline vmask4 operator&(vmask4 a, vmask4 b) { SIMD_MASK(&&) }
+inline vmask4 operator|(vmask4 a, vmask4 b) { SIMD_MASK(||) }
+inline vmask4 andNot(vmask4 a, vmask4 b) { return vmask4(a.v[0] && !b.v[0], a.v[1] && !b.v[1], a.v[2] && !b.v[2], a.v[3] && !b.v[3]); }
+inline vfloat4 select(vmask4 m, vfloat4 a, vfloat4 b) { SIMD_LANES(m.v[i] ? a.v[i] : b.v[i]) }
+inline int maskBits(vmask4 m) { return (m.v[0] ? 1 : 0) | (m.v[1] ? 2 : 0) | (m.v[2] ? 4 : 0) | (m.v[3] ? 8 : 0); }
+inline vmask4 maskFromBits(int bits) { return vmask4((bits & 1) != 0, (bits & 2) != 0, (bits & 4) != 0, (bits & 8) != 0); }
+#undef SIMD_LANES
+#undef SIMD_MASK
+
+#endif
+
+inline vfloat4 operator-(vfloat4 a) { return vfloat4(0.0f) - a; }
+inline vfloat4 &operator+=(vfloat4 &a, vfloat4 b) { return a = a + b; }
+inline vfloat4 &operator*=(vfloat4 &a, vfloat4 b) { return a = a * b; }
+
+// three vfloat4 = four 3D vectors, one per lane
+struct vvec3 {
+    vfloat4 x, y, z;
+    vvec3() {}
+    vvec3(vfloat4 x, vfloat4 y, vfloat4 z) : x(x), y(y), z(z) {}
+};
+
+inline vvec3 operator+(const vvec3 &a, const vvec3 &b) { return vvec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline vvec3 operator-(const vvec3 &a, const vvec3 &b) { return vvec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline vvec3 operator*(vfloat4 s, const vvec3 &a) { return vvec3(s * a.x, s * a.y, s * a.z); }
+inline vvec3 operator-(const vvec3 &a) { return vvec3(-a.x, -a.y, -a.z); }
+inline vfloat4 dot(const vvec3 &a, const vvec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+// like GLSL normalize(), but zero-length vectors stay zero instead of becoming NaN
+inline vvec3 normalize(const vvec3 &a)
+{
+    vfloat4 length = sqrt(dot(a, a));
+    vfloat4 scale = select(length > vfloat4(0.0f), vfloat4(1.0f) / length, vfloat4(0.0f));
+    return scale * a;
+}
+
+// GLSL refract(): zero vector where there is total internal reflection
+inline vvec3 refract(const vvec3 &I, const vvec3 &N, float eta)
+{
+    vfloat4 d = dot(N, I);
+    vfloat4 k = vfloat4(1.0f) - vfloat4(eta * eta) * (vfloat4(1.0f) - d * d);
+    vmask4 ok = k >= vfloat4(0.0f);
+    vfloat4 s = vfloat4(eta) * d + sqrt(max(k, vfloat4(0.0f)));
+    vvec3 result = vfloat4(eta) * I - s * N;
+    return vvec3(select(ok, result.x, 0.0f), select(ok, result.y, 0.0f), select(ok, result.z, 0.0f));
+}
+
+#endif /* simd_hpp */
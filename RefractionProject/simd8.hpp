@@ -0,0 +1,265 @@
+//
+//  simd8.hpp
+//  RefractionProject
+//
+//  8-lane float and int types for the kernels that are compiled once per instruction set (bvh8.hpp,
+//  cubesampler.hpp). Each set lives in its own namespace with the same names, so a kernel file is
+//  included inside a namespace that pulls one of them in:
+//
+//    simd8_scalar  plain C++ loops
+//    simd8_sse     two vfloat4s from simd.hpp (SSE2, NEON or its fallback); the int lanes are loops,
+//                  SSE2 has no 32-bit multiply and neither has a gather
+//    simd8_avx2    one 256-bit register, built with the AVX2 target switched on just for these
+//                  functions so the program still runs on CPUs without it
+//
+//  Callers pick the best set the CPU supports at runtime with simd8BestIsa().
+//
+
+#ifndef simd8_hpp
+#define simd8_hpp
+
+#include "simd.hpp"
+
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SIMD8_AVX2 1
+#endif
+
+enum Simd8Isa { SIMD8_SCALAR, SIMD8_SSE, SIMD8_AVX2_ISA, SIMD8_ISA_COUNT };
+
+// ---- plain C++, 8 lanes in a loop ----
+
+namespace simd8_scalar {
+
+struct vmask8 {
+    int bits;
+    vmask8(int bits) : bits(bits) {}
+};
+
+struct vfloat8 {
+    float v[8];
+    vfloat8() {}
+    vfloat8(float x) { for (int i = 0; i < 8; i++) v[i] = x; }
+    static vfloat8 load(const float *p) { vfloat8 r; for (int i = 0; i < 8; i++) r.v[i] = p[i]; return r; }
+    void store(float *p) const { for (int i = 0; i < 8; i++) p[i] = v[i]; }
+};
+
+struct vint8 {
+    int v[8];
+    vint8() {}
+    vint8(int x) { for (int i = 0; i < 8; i++) v[i] = x; }
+    void store(int *p) const { for (int i = 0; i < 8; i++) p[i] = v[i]; }
+};
+
+#define SIMD8_LANES(type, expr) type r; for (int i = 0; i < 8; i++) r.v[i] = (expr); return r;
+#define SIMD8_MASK(expr) int bits = 0; for (int i = 0; i < 8; i++) bits |= (a.v[i] expr b.v[i]) ? 1 << i : 0; return vmask8(bits);
+inline vfloat8 operator+(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] + b.v[i]) }
+inline vfloat8 operator-(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] - b.v[i]) }
+inline vfloat8 operator*(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] * b.v[i]) }
+inline vfloat8 operator/(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] / b.v[i]) }
+inline vfloat8 min(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] < b.v[i] ? a.v[i] : b.v[i]) } // b on NaN, like minps
+inline vfloat8 max(const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline vfloat8 abs(const vfloat8 &a) { SIMD8_LANES(vfloat8, std::fabs(a.v[i])) }
+inline vfloat8 floor(const vfloat8 &a) { SIMD8_LANES(vfloat8, std::floor(a.v[i])) }
+inline vmask8 operator<(const vfloat8 &a, const vfloat8 &b) { SIMD8_MASK(<) }
+inline vmask8 operator>(const vfloat8 &a, const vfloat8 &b) { SIMD8_MASK(>) }
+inline vmask8 operator<=(const vfloat8 &a, const vfloat8 &b) { SIMD8_MASK(<=) }
+inline vmask8 operator>=(const vfloat8 &a, const vfloat8 &b) { SIMD8_MASK(>=) }
+inline vmask8 operator&(vmask8 a, vmask8 b) { return vmask8(a.bits & b.bits); }
+inline vmask8 operator|(vmask8 a, vmask8 b) { return vmask8(a.bits | b.bits); }
+inline vmask8 andNot(vmask8 a, vmask8 b) { return vmask8(a.bits & ~b.bits); } // a & ~b
+inline vfloat8 select(vmask8 m, const vfloat8 &a, const vfloat8 &b) { SIMD8_LANES(vfloat8, m.bits & (1 << i) ? a.v[i] : b.v[i]) }
+inline int maskBits(vmask8 m) { return m.bits; }
+
+inline vint8 operator+(const vint8 &a, const vint8 &b) { SIMD8_LANES(vint8, a.v[i] + b.v[i]) }
+inline vint8 operator*(const vint8 &a, const vint8 &b) { SIMD8_LANES(vint8, a.v[i] * b.v[i]) }
+inline vint8 operator&(const vint8 &a, const vint8 &b) { SIMD8_LANES(vint8, a.v[i] & b.v[i]) }
+inline vint8 operator>>(const vint8 &a, int shift) { SIMD8_LANES(vint8, (int)((unsigned int)a.v[i] >> shift)) }
+inline vint8 toInt(const vfloat8 &a) { SIMD8_LANES(vint8, (int)a.v[i]) } // truncates
+inline vfloat8 toFloat(const vint8 &a) { SIMD8_LANES(vfloat8, (float)a.v[i]) }
+inline vint8 gather(const int *base, const vint8 &index) { SIMD8_LANES(vint8, base[index.v[i]]) }
+#undef SIMD8_LANES
+#undef SIMD8_MASK
+
+}
+
+// ---- two vfloat4s: SSE2, NEON, or simd.hpp's own fallback ----
+
+namespace simd8_sse {
+
+struct vmask8 {
+    vmask4 lo, hi;
+    vmask8(vmask4 lo, vmask4 hi) : lo(lo), hi(hi) {}
+};
+
+struct vfloat8 {
+    vfloat4 lo, hi;
+    vfloat8() {}
+    vfloat8(float x) : lo(x), hi(x) {}
+    vfloat8(vfloat4 lo, vfloat4 hi) : lo(lo), hi(hi) {}
+    static vfloat8 load(const float *p) { return vfloat8(vfloat4::load(p), vfloat4::load(p + 4)); }
+    void store(float *p) const { lo.store(p); hi.store(p + 4); }
+};
+
+struct vint8 {
+    int v[8];
+    vint8() {}
+    vint8(int x) { for (int i = 0; i < 8; i++) v[i] = x; }
+    void store(int *p) const { for (int i = 0; i < 8; i++) p[i] = v[i]; }
+};
+
+inline vfloat8 operator+(const vfloat8 &a, const vfloat8 &b) { return vfloat8(a.lo + b.lo, a.hi + b.hi); }
+inline vfloat8 operator-(const vfloat8 &a, const vfloat8 &b) { return vfloat8(a.lo - b.lo, a.hi - b.hi); }
+inline vfloat8 operator*(const vfloat8 &a, const vfloat8 &b) { return vfloat8(a.lo * b.lo, a.hi * b.hi); }
+inline vfloat8 operator/(const vfloat8 &a, const vfloat8 &b) { return vfloat8(a.lo / b.lo, a.hi / b.hi); }
+inline vfloat8 min(const vfloat8 &a, const vfloat8 &b) { return vfloat8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+inline vfloat8 max(const vfloat8 &a, const vfloat8 &b) { return vfloat8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+inline vfloat8 abs(const vfloat8 &a) { return vfloat8(abs(a.lo), abs(a.hi)); }
+inline vfloat8 floor(const vfloat8 &a) { return vfloat8(floor(a.lo), floor(a.hi)); }
+inline vmask8 operator<(const vfloat8 &a, const vfloat8 &b) { return vmask8(a.lo < b.lo, a.hi < b.hi); }
+inline vmask8 operator>(const vfloat8 &a, const vfloat8 &b) { return vmask8(a.lo > b.lo, a.hi > b.hi); }
+inline vmask8 operator<=(const vfloat8 &a, const vfloat8 &b) { return vmask8(a.lo <= b.lo, a.hi <= b.hi); }
+inline vmask8 operator>=(const vfloat8 &a, const vfloat8 &b) { return vmask8(a.lo >= b.lo, a.hi >= b.hi); }
+inline vmask8 operator&(vmask8 a, vmask8 b) { return vmask8(a.lo & b.lo, a.hi & b.hi); }
+inline vmask8 operator|(vmask8 a, vmask8 b) { return vmask8(a.lo | b.lo, a.hi | b.hi); }
+inline vmask8 andNot(vmask8 a, vmask8 b) { return vmask8(andNot(a.lo, b.lo), andNot(a.hi, b.hi)); }
+inline vfloat8 select(vmask8 m, const vfloat8 &a, const vfloat8 &b) { return vfloat8(select(m.lo, a.lo, b.lo), select(m.hi, a.hi, b.hi)); }
+inline int maskBits(vmask8 m) { return maskBits(m.lo) | maskBits(m.hi) << 4; }
+
+#define SIMD8_LANES(expr) vint8 r; for (int i = 0; i < 8; i++) r.v[i] = (expr); return r;
+inline vint8 operator+(const vint8 &a, const vint8 &b) { SIMD8_LANES(a.v[i] + b.v[i]) }
+inline vint8 operator*(const vint8 &a, const vint8 &b) { SIMD8_LANES(a.v[i] * b.v[i]) }
+inline vint8 operator&(const vint8 &a, const vint8 &b) { SIMD8_LANES(a.v[i] & b.v[i]) }
+inline vint8 operator>>(const vint8 &a, int shift) { SIMD8_LANES((int)((unsigned int)a.v[i] >> shift)) }
+inline vint8 gather(const int *base, const vint8 &index) { SIMD8_LANES(base[index.v[i]]) }
+#undef SIMD8_LANES
+
+inline vint8 toInt(const vfloat8 &a)
+{
+    float lanes[8];
+    a.store(lanes);
+    vint8 r;
+    for (int i = 0; i < 8; i++)
+        r.v[i] = (int)lanes[i];
+    return r;
+}
+inline vfloat8 toFloat(const vint8 &a)
+{
+    float lanes[8];
+    for (int i = 0; i < 8; i++)
+        lanes[i] = (float)a.v[i];
+    return vfloat8::load(lanes);
+}
+
+}
+
+// ---- AVX2, compiled for that target only ----
+
+#ifdef SIMD8_AVX2
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace simd8_avx2 {
+
+struct vmask8 {
+    __m256 v;
+    vmask8(__m256 v) : v(v) {}
+};
+
+struct vfloat8 {
+    __m256 v;
+    vfloat8() {}
+    vfloat8(__m256 v) : v(v) {}
+    vfloat8(float x) : v(_mm256_set1_ps(x)) {}
+    static vfloat8 load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+struct vint8 {
+    __m256i v;
+    vint8() {}
+    vint8(__m256i v) : v(v) {}
+    vint8(int x) : v(_mm256_set1_epi32(x)) {}
+    void store(int *p) const { _mm256_storeu_si256((__m256i *)p, v); }
+};
+
+inline vfloat8 operator+(const vfloat8 &a, const vfloat8 &b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat8 operator-(const vfloat8 &a, const vfloat8 &b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat8 operator*(const vfloat8 &a, const vfloat8 &b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat8 operator/(const vfloat8 &a, const vfloat8 &b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat8 min(const vfloat8 &a, const vfloat8 &b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat8 max(const vfloat8 &a, const vfloat8 &b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat8 abs(const vfloat8 &a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline vfloat8 floor(const vfloat8 &a) { return _mm256_floor_ps(a.v); }
+inline vmask8 operator<(const vfloat8 &a, const vfloat8 &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vmask8 operator>(const vfloat8 &a, const vfloat8 &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vmask8 operator<=(const vfloat8 &a, const vfloat8 &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vmask8 operator>=(const vfloat8 &a, const vfloat8 &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vmask8 operator&(vmask8 a, vmask8 b) { return _mm256_and_ps(a.v, b.v); }
+inline vmask8 operator|(vmask8 a, vmask8 b) { return _mm256_or_ps(a.v, b.v); }
+inline vmask8 andNot(vmask8 a, vmask8 b) { return _mm256_andnot_ps(b.v, a.v); }
+inline vfloat8 select(vmask8 m, const vfloat8 &a, const vfloat8 &b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+inline int maskBits(vmask8 m) { return _mm256_movemask_ps(m.v); }
+
+inline vint8 operator+(const vint8 &a, const vint8 &b) { return _mm256_add_epi32(a.v, b.v); }
+inline vint8 operator*(const vint8 &a, const vint8 &b) { return _mm256_mullo_epi32(a.v, b.v); }
+inline vint8 operator&(const vint8 &a, const vint8 &b) { return _mm256_and_si256(a.v, b.v); }
+inline vint8 operator>>(const vint8 &a, int shift) { return _mm256_srli_epi32(a.v, shift); }
+inline vint8 toInt(const vfloat8 &a) { return _mm256_cvttps_epi32(a.v); }
+inline vfloat8 toFloat(const vint8 &a) { return _mm256_cvtepi32_ps(a.v); }
+inline vint8 gather(const int *base, const vint8 &index) { return _mm256_i32gather_epi32(base, index.v, 4); }
+
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif /* SIMD8_AVX2 */
+
+inline bool simd8IsaSupported(int isa)
+{
+    if (isa == SIMD8_AVX2_ISA) {
+#ifdef SIMD8_AVX2
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+    return isa >= 0 && isa < SIMD8_ISA_COUNT;
+}
+
+inline int simd8BestIsa()
+{
+    static const int best = simd8IsaSupported(SIMD8_AVX2_ISA) ? SIMD8_AVX2_ISA : SIMD8_SSE;
+    return best;
+}
+
+inline const char *simd8IsaName(int isa)
+{
+    if (isa == SIMD8_SCALAR)
+        return "scalar";
+    if (isa == SIMD8_SSE) {
+#if defined(SIMD_SSE2)
+        return "sse2";
+#elif defined(SIMD_NEON)
+        return "neon";
+#else
+        return "vfloat4";
+#endif
+    }
+#ifdef SIMD8_AVX2
+    return "avx2";
+#else
+    return "avx2 (not built)";
+#endif
+}
+
+#endif /* simd8_hpp */
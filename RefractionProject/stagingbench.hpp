@@ -0,0 +1,203 @@
+//
+//  stagingbench.hpp
+//  RefractionProject
+//
+//  Streams textures and vertex buffers while drawing with them, the way residency streaming and skybox
+//  switches do: every frame one texture gets all its levels again (the same texture object, which the
+//  frame before drew with) and every fourth frame a mesh's buffers do, then the grid of textured meshes
+//  is drawn. Once with the usual client memory uploads, once through the staging ring of stagingring.hpp,
+//  and once more through a ring a quarter of the size, which has to wait for its fences. Prints MB/s and
+//  stalls of the upload calls and the frame times, and reads a texture and a buffer back to check them.
+//
+//  RefractionProject --bench-staging [--staging-ring-mb 64] [--textures 12] [--rounds 4] [--stall-ms 2] [--software]
+//
+
+#ifndef stagingbench_hpp
+#define stagingbench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "memory.hpp"
+#include "mipgen.hpp"
+#include "model.hpp"
+#include "procedural.hpp"
+#include "stagingring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct StagingRun {
+    UploadStats uploads;
+    double meanMs, slowestMs, totalMs;
+    bool verified;
+    bool persistent;    // the ring's mapping
+};
+
+inline StagingRun runStagingFlight(size_t ringBytes, const vector<MipChain> &chains, const vector<MeshData> &shapes, int rounds,
+                                   Shader &textured)
+{
+    StagingRun run = StagingRun();
+    StagingRing &ring = stagingRing();
+    ring.init(ringBytes);
+    RenderTarget target = createRenderTarget(800, 600, "staging benchmark");
+
+    vector<unsigned int> textures(chains.size());
+    glGenTextures((GLsizei)textures.size(), textures.data());
+    for (size_t i = 0; i < textures.size(); i++) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)chains[i].levels.size() - 1);
+    }
+    // small meshes to draw the textures on; the big ones only get their buffers filled again and again
+    vector<Mesh> meshes;
+    meshes.push_back(generateShape(SHAPE_SPHERE, 2000));
+    meshes.push_back(generateShape(SHAPE_TORUS, 2000));
+    unsigned int streamed[2];
+    glGenBuffers(2, streamed);
+
+    int cols = (int)std::ceil(std::sqrt((double)textures.size())), rows = ((int)textures.size() + cols - 1) / cols;
+    glm::mat4 projection = glm::ortho(-(float)cols, (float)cols, -(float)rows, (float)rows, -10.0f, 10.0f);
+    glm::mat4 identity(1.0f);
+    int frames = rounds * (int)textures.size();
+    ring.resetStats();
+    glFinish();
+    auto begin = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        int index = frame % (int)textures.size();
+        const MipChain &chain = chains[index];
+        glBindTexture(GL_TEXTURE_2D, textures[index]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t level = 0; level < chain.levels.size(); level++)
+            stagedTexImage2D(GL_TEXTURE_2D, (GLint)level, GL_RGBA8, chain.levelWidth((int)level), chain.levelHeight((int)level), GL_RGBA,
+                             GL_UNSIGNED_BYTE, chain.levels[level].data(), chain.levels[level].size());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (frame % 4 == 0) {
+            const MeshData &shape = shapes[(frame / 4) % shapes.size()];
+            stagedBufferData(streamed[0], shape.vertices.size() * sizeof(Vertex), shape.vertices.data(), GL_STATIC_DRAW);
+            stagedBufferData(streamed[1], shape.indices.size() * sizeof(unsigned int), shape.indices.data(), GL_STATIC_DRAW);
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+        glViewport(0, 0, 800, 600);
+        glEnable(GL_DEPTH_TEST);
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        textured.use();
+        glUniformMatrix4fv(glGetUniformLocation(textured.ID, "view"), 1, GL_FALSE, &identity[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(textured.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+        for (size_t i = 0; i < textures.size(); i++) {
+            int col = (int)i % cols, row = (int)i / cols;
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(2.0f * col - cols + 1.0f, rows - 1.0f - 2.0f * row, 0.0f));
+            model = glm::scale(model, glm::vec3(0.7f));
+            glUniformMatrix4fv(glGetUniformLocation(textured.ID, "model"), 1, GL_FALSE, &model[0][0]);
+            glBindTexture(GL_TEXTURE_2D, textures[i]);
+            meshes[i % meshes.size()].Draw(textured);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glFlush(); // like a swap, the frame goes to the GPU but nobody waits for it
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        run.meanMs += ms / frames;
+        run.slowestMs = std::max(run.slowestMs, ms);
+    }
+    glFinish();
+    run.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    run.uploads = ringBytes ? ring.staged : ring.direct;
+    run.persistent = ring.persistent;
+
+    // what's on the GPU has to be what was sent
+    const MipChain &last = chains[(frames - 1) % chains.size()];
+    vector<unsigned char> pixels(last.levels[0].size());
+    glBindTexture(GL_TEXTURE_2D, textures[(frames - 1) % textures.size()]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    run.verified = memcmp(pixels.data(), last.levels[0].data(), pixels.size()) == 0;
+    const MeshData &shape = shapes[((frames - 1) / 4) % shapes.size()];
+    vector<unsigned int> indices(shape.indices.size());
+    glBindBuffer(GL_COPY_READ_BUFFER, streamed[1]);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, (GLsizeiptr)(indices.size() * sizeof(unsigned int)), indices.data());
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    run.verified = run.verified && indices == shape.indices;
+
+    glDeleteBuffers(2, streamed);
+    glDeleteTextures((GLsizei)textures.size(), textures.data());
+    for (size_t i = 0; i < meshes.size(); i++)
+        meshes[i].release();
+    deleteRenderTarget(target);
+    ring.release();
+    return run;
+}
+
+inline int runStagingBenchmark(int argc, char *argv[])
+{
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    int count = std::max((int)argNumber(argc, argv, "--textures", 12), 1);
+    int rounds = std::max((int)argNumber(argc, argv, "--rounds", 4), 1);
+    size_t ringBytes = (size_t)(std::max(argNumber(argc, argv, "--staging-ring-mb", 64), 1.0) * 1048576);
+    stagingRing().stallMs = argNumber(argc, argv, "--stall-ms", 2);
+
+    // the skybox faces as RGBA with box mips, made before anything is timed
+    const char *folders[] = { "skybox/sky", "skybox/space", "skybox/space2" };
+    vector<MipChain> chains;
+    size_t bytes = 0, largest = 0;
+    for (int i = 0; (int)chains.size() < count; i++) {
+        string file = skyboxFaces(folders[(i / 6) % 3])[i % 6];
+        int width, height, components;
+        unsigned char *data = stbi_load(file.c_str(), &width, &height, &components, 4);
+        if (!data) {
+            cout << "ERROR::STAGING:: Could not read " << file << endl;
+            destroyHeadlessContext(window);
+            return -1;
+        }
+        chains.push_back(MipChain());
+        const unsigned char *source = data;
+        buildMipChains(&source, 1, width, height, 4, MIP_BOX, false, &chains.back());
+        stbi_image_free(data);
+        bytes += chains.back().bytes();
+        largest = std::max(largest, chains.back().levels[0].size());
+    }
+    // a quarter of the ring, but every level has to fit
+    size_t smallRing = std::max(ringBytes / 4, largest);
+    vector<MeshData> shapes;
+    shapes.push_back(buildShape(SHAPE_SPHERE, 100000));
+    shapes.push_back(buildShape(SHAPE_TORUS, 100000));
+    Shader textured("shaders/texturedVshader.txt", "shaders/texturedFshader.txt");
+    cout << "Streaming " << count << " textures (" << MemoryRegistry::formatBytes(bytes) << " with mips) " << rounds
+         << " times, and meshes of 100k triangles, while drawing with them at 800x600" << endl;
+
+    StagingRun runs[3];
+    runs[0] = runStagingFlight(0, chains, shapes, rounds, textured);
+    runs[1] = runStagingFlight(ringBytes, chains, shapes, rounds, textured);
+    runs[2] = runStagingFlight(smallRing, chains, shapes, rounds, textured);
+    string names[3] = { "client memory", "ring " + MemoryRegistry::formatBytes(ringBytes), "ring " + MemoryRegistry::formatBytes(smallRing) };
+    cout << "Staging ring: " << (runs[1].persistent ? "persistent, coherent mapping (ARB_buffer_storage)" : "mapped per region") << endl;
+    cout << left << setw(16) << "" << right << setw(12) << "MB/s" << setw(10) << "stalls" << setw(14) << "fence waits" << setw(12)
+         << "mean frame" << setw(12) << "slowest" << setw(12) << "total" << setw(10) << "check" << endl;
+    for (int i = 0; i < 3; i++) {
+        const StagingRun &run = runs[i];
+        cout << left << setw(16) << names[i] << right << fixed << setprecision(1) << setw(12) << run.uploads.megabytesPerSecond()
+             << setw(10) << run.uploads.stalls << setw(14) << run.uploads.fenceWaits << setw(9) << run.meanMs << " ms" << setw(9)
+             << run.slowestMs << " ms" << setw(9) << run.totalMs << " ms" << setw(10) << (run.verified ? "ok" : "FAILED") << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    glDeleteProgram(textured.ID);
+    destroyHeadlessContext(window);
+    return runs[0].verified && runs[1].verified && runs[2].verified ? 0 : 1;
+}
+
+#endif /* stagingbench_hpp */
@@ -0,0 +1,391 @@
+//
+//  stagingring.hpp
+//  RefractionProject
+//
+//  A staging ring for texture and buffer uploads. glTexImage2D and glBufferData with a pointer to client
+//  memory make the driver copy the data before the call returns, and often wait for the GPU too. Here the
+//  data goes into one big buffer that stays mapped (ARB_buffer_storage, persistent and coherent), and the
+//  uploads read it from an offset: GL_PIXEL_UNPACK_BUFFER for the textures, glCopyBufferSubData for the
+//  buffers. Every region gets a fence after its upload call, and it's only written again once that fence
+//  has signalled. Waiting for one is a fence wait; the ring is too small for what's in flight then.
+//
+//  The 4.1 context the viewer asks for doesn't have glBufferStorage, so it's looked up with
+//  glfwGetProcAddress when the driver has GL_ARB_buffer_storage (or 4.4). Without it each region is mapped
+//  unsynchronized on its own and unmapped before the upload; the fences work the same way.
+//
+//  The staged*() helpers replace the upload calls of the loaders (uploadTexture, cubemap faces, texture
+//  packs, compressed textures, residency streaming, mesh buffers). Every call copies the data into the
+//  ring, which is the copy the driver would have made; nothing writes into it in place, the decoders and
+//  mipgen.hpp run on worker threads and the ring belongs to the thread that set it up (the render
+//  thread). Other threads, like the loader thread of loader.hpp, upload the usual way.
+//
+//  Both paths are measured: MB/s through the upload calls, and stalls, calls that held up their thread
+//  for more than --stall-ms (2). --upload-report prints them when the viewer exits.
+//
+//  RefractionProject [--staging-ring-mb 64] [--stall-ms 2] [--upload-report]
+//  RefractionProject --bench-staging [--staging-ring-mb 64] [--textures 12] [--rounds 4] [--software]
+//
+
+#ifndef stagingring_hpp
+#define stagingring_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "cmdline.hpp"
+#include "memory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+using namespace std;
+
+// ARB_buffer_storage, which GLAD doesn't load for a 4.1 context
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+#define GL_CLIENT_STORAGE_BIT 0x0200
+#endif
+typedef void (APIENTRYP StagingBufferStorageProc)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+// one path's upload calls
+struct UploadStats {
+    unsigned long long calls;
+    size_t bytes;
+    double ms;                      // in the calls, copies into the ring included
+    unsigned long long stalls;      // calls that took longer than stallMs
+    unsigned long long fenceWaits;  // ring only: regions that were still in use
+    double fenceWaitMs;
+
+    double megabytesPerSecond() const { return ms > 0.0 ? bytes / 1048576.0 / (ms / 1000.0) : 0.0; }
+};
+
+class StagingRing {
+public:
+    // a piece of the ring: write bytes at data, then upload from offset
+    struct Region {
+        unsigned char *data;
+        size_t offset, bytes;
+    };
+
+    bool persistent;            // glBufferStorage, mapped once
+    double stallMs;
+    UploadStats direct, staged;
+
+    StagingRing() : persistent(false), stallMs(2.0), buffer(0), size(0), head(0), mapped(0), owner()
+    {
+        direct = staged = UploadStats();
+    }
+
+    /*
+        Render thread, context current. size 0 leaves the ring off but still measures the direct uploads
+        made on this thread. False if the buffer couldn't be made (the uploads go the direct way then).
+    */
+    bool init(size_t bytes)
+    {
+        release();
+        owner = std::this_thread::get_id();
+        if (bytes == 0)
+            return true;
+        while (glGetError() != GL_NO_ERROR) {
+        }
+        StagingBufferStorageProc bufferStorage = bufferStorageSupported() ? (StagingBufferStorageProc)glfwGetProcAddress("glBufferStorage") : 0;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        if (bufferStorage) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            bufferStorage(GL_COPY_READ_BUFFER, (GLsizeiptr)bytes, NULL, flags);
+            mapped = (unsigned char *)glMapBufferRange(GL_COPY_READ_BUFFER, 0, (GLsizeiptr)bytes, flags);
+            persistent = mapped != 0;
+        }
+        if (!persistent) {
+            if (bufferStorage) {
+                // storage is immutable, it takes a new buffer to try again without it
+                glDeleteBuffers(1, &buffer);
+                glGenBuffers(1, &buffer);
+                glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            }
+            glBufferData(GL_COPY_READ_BUFFER, (GLsizeiptr)bytes, NULL, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        if (glGetError() != GL_NO_ERROR) {
+            cout << "ERROR::STAGING:: Could not make a " << MemoryRegistry::formatBytes(bytes) << " staging ring" << endl;
+            release();
+            owner = std::this_thread::get_id();
+            return false;
+        }
+        size = bytes;
+        head = 0;
+        memoryRegistry().track(MEM_BUFFER, buffer, bytes, persistent ? "staging ring, persistent" : "staging ring", "staging");
+        return true;
+    }
+
+    void release()
+    {
+        for (size_t i = 0; i < inFlight.size(); i++)
+            glDeleteSync(inFlight[i].fence);
+        inFlight.clear();
+        if (buffer) {
+            if (mapped) {
+                glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+                glUnmapBuffer(GL_COPY_READ_BUFFER);
+                glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            }
+            memoryRegistry().release(MEM_BUFFER, buffer);
+            glDeleteBuffers(1, &buffer);
+        }
+        buffer = 0;
+        mapped = 0;
+        size = head = 0;
+        persistent = false;
+        owner = std::thread::id();
+    }
+
+    // the ring is there and this thread may use it
+    bool usable() const { return buffer != 0 && std::this_thread::get_id() == owner; }
+    // this thread's uploads are measured
+    bool measuring() const { return std::this_thread::get_id() == owner; }
+    size_t capacity() const { return size; }
+
+    /*
+        Space for bytes, waiting for the GPU to be done with it first if it has to. data is NULL when the
+        ring can't be used from this thread or is smaller than bytes.
+    */
+    Region reserve(size_t bytes)
+    {
+        Region region = { 0, 0, bytes };
+        if (!usable() || bytes == 0 || bytes > size)
+            return region;
+        // what the GPU is done with doesn't need its fence any more
+        while (!inFlight.empty() && glClientWaitSync(inFlight.front().fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+            glDeleteSync(inFlight.front().fence);
+            inFlight.pop_front();
+        }
+        size_t start = (head + alignment - 1) / alignment * alignment;
+        if (start + bytes > size)
+            start = 0;
+        // fences signal in order, so waiting for the oldest overlapping one means everything before it is done too
+        while (overlapsInFlight(start, bytes))
+            waitOldest();
+        head = start + bytes;
+        region.offset = start;
+        if (persistent) {
+            region.data = mapped + start;
+        } else {
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            region.data = (unsigned char *)glMapBufferRange(GL_COPY_READ_BUFFER, (GLintptr)start, (GLsizeiptr)bytes,
+                                                            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        }
+        return region;
+    }
+
+    // the region is written; unmaps it when it isn't persistent. Call before the upload that reads it.
+    void ready(const Region &region)
+    {
+        if (persistent || !region.data)
+            return;
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    // the upload reading the region has been issued: fences it
+    void retire(const Region &region)
+    {
+        InFlight used = { region.offset, region.bytes, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) };
+        inFlight.push_back(used);
+    }
+
+    unsigned int id() const { return buffer; }
+
+    void record(bool ring, size_t bytes, double ms)
+    {
+        UploadStats &stats = ring ? staged : direct;
+        stats.calls++;
+        stats.bytes += bytes;
+        stats.ms += ms;
+        if (ms > stallMs)
+            stats.stalls++;
+    }
+
+    void resetStats()
+    {
+        direct = staged = UploadStats();
+    }
+
+    void printStats(std::ostream &out) const
+    {
+        const UploadStats *paths[] = { &direct, &staged };
+        const char *names[] = { "direct", persistent ? "staging ring (persistent)" : "staging ring (mapped per region)" };
+        for (int i = 0; i < 2; i++) {
+            if (paths[i]->calls == 0)
+                continue;
+            out << "Uploads, " << names[i] << ": " << paths[i]->calls << " calls, " << MemoryRegistry::formatBytes(paths[i]->bytes)
+                << ", " << fixed << setprecision(1) << paths[i]->megabytesPerSecond() << " MB/s, " << paths[i]->stalls
+                << " stalls over " << stallMs << " ms";
+            if (i == 1)
+                out << ", " << paths[i]->fenceWaits << " fence waits (" << paths[i]->fenceWaitMs << " ms)";
+            out << endl;
+            out.unsetf(ios::floatfield);
+        }
+    }
+
+private:
+    struct InFlight {
+        size_t offset, bytes;
+        GLsync fence;
+    };
+    static const size_t alignment = 256;
+    unsigned int buffer;
+    size_t size, head;
+    unsigned char *mapped;
+    std::deque<InFlight> inFlight;
+    std::thread::id owner;
+
+    static bool bufferStorageSupported()
+    {
+        GLint major = 0, minor = 0, count = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major > 4 || (major == 4 && minor >= 4))
+            return true;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++)
+            if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, (GLuint)i), "GL_ARB_buffer_storage") == 0)
+                return true;
+        return false;
+    }
+
+    bool overlapsInFlight(size_t start, size_t bytes) const
+    {
+        for (size_t i = 0; i < inFlight.size(); i++)
+            if (inFlight[i].offset < start + bytes && start < inFlight[i].offset + inFlight[i].bytes)
+                return true;
+        return false;
+    }
+
+    void waitOldest()
+    {
+        InFlight oldest = inFlight.front();
+        inFlight.pop_front();
+        if (glClientWaitSync(oldest.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            auto start = std::chrono::steady_clock::now();
+            while (glClientWaitSync(oldest.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED) {
+            }
+            staged.fenceWaits++;
+            staged.fenceWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        glDeleteSync(oldest.fence);
+    }
+};
+
+inline StagingRing &stagingRing()
+{
+    static StagingRing ring;
+    return ring;
+}
+
+// --staging-ring-mb 64 turns the ring on (render thread, after GLAD is loaded); the direct uploads are measured either way
+inline void configureStagingRing(int argc, char *argv[])
+{
+    StagingRing &ring = stagingRing();
+    ring.stallMs = argNumber(argc, argv, "--stall-ms", 2);
+    if (!hasArg(argc, argv, "--staging-ring-mb")) {
+        ring.init(0);
+        return;
+    }
+    if (ring.init((size_t)(argNumber(argc, argv, "--staging-ring-mb", 64) * 1048576)))
+        cout << "Staging ring: " << MemoryRegistry::formatBytes(ring.capacity())
+             << (ring.persistent ? ", persistent mapping" : ", mapped per region (no ARB_buffer_storage)") << endl;
+}
+
+/*
+    glTexImage2D / glCompressedTexImage2D of a region the caller wrote (level data in the layout GL reads
+    with the current unpack alignment), into the bound texture.
+*/
+inline void texImage2DFromRing(const StagingRing::Region &region, GLenum target, GLint level, GLenum internalFormat, GLsizei width,
+                               GLsizei height, GLenum format, GLenum type)
+{
+    StagingRing &ring = stagingRing();
+    ring.ready(region);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.id());
+    glTexImage2D(target, level, internalFormat, width, height, 0, format, type, (const void *)region.offset);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    ring.retire(region);
+}
+
+inline void compressedTexImage2DFromRing(const StagingRing::Region &region, GLenum target, GLint level, GLenum internalFormat,
+                                         GLsizei width, GLsizei height)
+{
+    StagingRing &ring = stagingRing();
+    ring.ready(region);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.id());
+    glCompressedTexImage2D(target, level, internalFormat, width, height, 0, (GLsizei)region.bytes, (const void *)region.offset);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    ring.retire(region);
+}
+
+// Through the ring when it's on for this thread, the usual call otherwise. bytes is what GL reads at pixels.
+inline void stagedTexImage2D(GLenum target, GLint level, GLenum internalFormat, GLsizei width, GLsizei height, GLenum format,
+                             GLenum type, const void *pixels, size_t bytes)
+{
+    StagingRing &ring = stagingRing();
+    auto start = std::chrono::steady_clock::now();
+    StagingRing::Region region = pixels ? ring.reserve(bytes) : StagingRing::Region();
+    if (region.data) {
+        memcpy(region.data, pixels, bytes);
+        texImage2DFromRing(region, target, level, internalFormat, width, height, format, type);
+    } else {
+        glTexImage2D(target, level, internalFormat, width, height, 0, format, type, pixels);
+    }
+    if (ring.measuring())
+        ring.record(region.data != 0, bytes, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+inline void stagedCompressedTexImage2D(GLenum target, GLint level, GLenum internalFormat, GLsizei width, GLsizei height,
+                                       const void *data, size_t bytes)
+{
+    StagingRing &ring = stagingRing();
+    auto start = std::chrono::steady_clock::now();
+    StagingRing::Region region = data ? ring.reserve(bytes) : StagingRing::Region();
+    if (region.data) {
+        memcpy(region.data, data, bytes);
+        compressedTexImage2DFromRing(region, target, level, internalFormat, width, height);
+    } else {
+        glCompressedTexImage2D(target, level, internalFormat, width, height, 0, (GLsizei)bytes, data);
+    }
+    if (ring.measuring())
+        ring.record(region.data != 0, bytes, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// glBufferData into buffer (any kind, it's bound to GL_COPY_WRITE_BUFFER), the contents copied from the ring
+inline void stagedBufferData(unsigned int buffer, size_t bytes, const void *data, GLenum usage)
+{
+    StagingRing &ring = stagingRing();
+    auto start = std::chrono::steady_clock::now();
+    StagingRing::Region region = data ? ring.reserve(bytes) : StagingRing::Region();
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    if (region.data) {
+        memcpy(region.data, data, bytes);
+        ring.ready(region);
+        glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)bytes, NULL, usage);
+        glBindBuffer(GL_COPY_READ_BUFFER, ring.id());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)region.offset, 0, (GLsizeiptr)bytes);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        ring.retire(region);
+    } else {
+        glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)bytes, data, usage);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (ring.measuring())
+        ring.record(region.data != 0, bytes, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+#endif /* stagingring_hpp */
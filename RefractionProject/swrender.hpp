@@ -0,0 +1,674 @@
+//
+//  swrender.hpp
+//  RefractionProject
+//
+//  The refraction pipeline on the CPU, for machines without a GPU and as a reference for the GL one.
+//  It produces the same image as Renderer::renderFrame:
+//  1. Front and back normal + distance buffers (normVshader/normFshader, depth LESS and GREATER),
+//     stored as RGBA8 like our framebuffer textures, so negative normals clamp to 0 just like on the GPU
+//  2. The refraction (objFshader): T1 at the front surface, the back surface found through newUV,
+//     T2 out of the back surface and a cubemap lookup
+//  3. The skybox where nothing was drawn
+//
+//  The screen is cut into 64x64 tiles. Triangles are set up and binned to tiles in parallel chunks,
+//  then every tile rasterizes its triangles into both normal buffers (4 pixels at a time, see simd.hpp).
+//  The refraction pass draws the same triangles with the same depth test as the front pass, so it shades
+//  exactly the front pass's visible fragments: we keep those and shade each pixel once, again 4 at a time,
+//  after all tiles are rasterized (newUV can point anywhere in the back buffer).
+//
+//  RefractionProject --bench-swrender [--size 1600x1200] [--triangles 100000] [--instances 1]
+//                    [--skybox skybox/sky] [--frames 5] [--max-threads N] [--out swrender.ppm]
+//                    [--compare-gl [--software]]
+//
+
+#ifndef swrender_hpp
+#define swrender_hpp
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "benchmark.hpp"
+#include "cmdline.hpp"
+#include "cubemap.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "imagediff.hpp"
+#include "parallel.hpp"
+#include "procedural.hpp"
+#include "renderer.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Triangles to draw, without needing a GL Mesh (procedural MeshData, or the CPU copy a Mesh keeps)
+struct MeshView {
+    const Vertex *vertices;
+    const unsigned int *indices;
+    size_t indexCount;
+    size_t vertexCount;
+};
+
+inline MeshView meshView(const MeshData &mesh)
+{
+    MeshView view = { &mesh.vertices[0], &mesh.indices[0], mesh.indices.size(), mesh.vertices.size() };
+    return view;
+}
+
+inline vector<MeshView> meshViews(const Model &model)
+{
+    vector<MeshView> views;
+    for (size_t i = 0; i < model.meshes.size(); i++) {
+        if (model.meshes[i].indices.empty())
+            continue;
+        const Mesh &mesh = model.meshes[i];
+        MeshView view = { &mesh.vertices[0], &mesh.indices[0], mesh.indices.size(), mesh.vertices.size() };
+        views.push_back(view);
+    }
+    return views;
+}
+
+// What the normal/objects vertex shaders output for one vertex
+struct SwVertex {
+    glm::vec4 clip;      // gl_Position
+    glm::vec3 pos;       // Pos, world space
+    glm::vec3 normal;    // Normal (not normalized)
+    float distance;      // worldDistance
+};
+
+// A triangle after clipping and the viewport transform, ready to rasterize
+struct SwTriangle {
+    float z[3], w[3], invW[3];     // window depth, clip w and 1/w per vertex
+    float a[3], b[3], c[3];        // edge i: a*(x - minX) + b*(y - minY) + c, positive inside, weight of vertex i
+    float invArea;
+    bool topLeft[3];               // fill convention, so shared edges are drawn once
+    int minX, minY, maxX, maxY;    // pixel bounds, inclusive
+    glm::vec3 pos[3], normal[3];
+    float distance[3];
+};
+
+// Times of the last frame, in milliseconds
+struct SwFrameStats {
+    double vertexMs, setupMs, rasterMs, shadeMs, totalMs;
+    size_t triangles;
+};
+
+class SoftwareRenderer {
+public:
+    static const int TILE = 64;
+    int width, height;
+    int threads;                  // 0 = one per core
+    glm::mat4 projection, skyboxProjection;
+    const CpuCubemap *cubemap;
+    SwFrameStats stats;
+
+    SoftwareRenderer(int width, int height, const CpuCubemap *cubemap) : threads(0), cubemap(cubemap)
+    {
+        resize(width, height);
+    }
+
+    void resize(int newWidth, int newHeight)
+    {
+        width = newWidth;
+        height = newHeight;
+        stride = (width + 3) & ~3; // rows padded so the 4-wide loops never cross into the next row
+        tilesX = (width + TILE - 1) / TILE;
+        tilesY = (height + TILE - 1) / TILE;
+        projection = sceneProjection(width, height);
+        skyboxProjection = skyProjection(width, height);
+        size_t pixels = (size_t)stride * height;
+        frontDepth.assign(pixels, 1.0f);
+        backDepth.assign(pixels, 0.0f);
+        frontTriangle.assign(pixels, (const SwTriangle *)NULL);
+        backTriangle.assign(pixels, (const SwTriangle *)NULL);
+        for (int i = 0; i < 2; i++) {
+            frontBary[i].assign(pixels, 0.0f);
+            backBary[i].assign(pixels, 0.0f);
+        }
+        for (int i = 0; i < 4; i++) {
+            frontColor[i].assign(pixels, 0.0f);
+            backColor[i].assign(pixels, 0.0f);
+        }
+        for (int i = 0; i < 3; i++) {
+            frontPos[i].assign(pixels, 0.0f);
+            frontNormal[i].assign(pixels, 0.0f);
+        }
+    }
+
+    /*
+        Same arguments as Renderer::renderFrame, but the meshes come as MeshViews and the result is
+        an RGB image (top row first, like readRenderTarget gives).
+    */
+    void renderFrame(const vector<MeshView> &meshes, const vector<glm::mat4> &models, const glm::mat4 &view,
+                     const glm::vec3 &cameraPos, Image &output)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), phase = start;
+        transformVertices(meshes, models, view, cameraPos);
+        stats.vertexMs = elapsedMs(phase);
+        setupTriangles(meshes);
+        stats.setupMs = elapsedMs(phase);
+        parallelFor(tilesX * tilesY, threads, [&](int tile, int) { rasterizeTile(tile); });
+        stats.rasterMs = elapsedMs(phase);
+        output.width = width;
+        output.height = height;
+        output.pixels.resize((size_t)width * height * 3);
+        parallelFor(tilesX * tilesY, threads, [&](int tile, int) { shadeTile(tile, view, cameraPos, output); });
+        stats.shadeMs = elapsedMs(phase);
+        stats.totalMs = std::chrono::duration<double, std::milli>(phase - start).count();
+    }
+
+private:
+    int stride, tilesX, tilesY;
+    // one draw = one mesh with one model matrix, like one glDrawElements
+    vector<vector<SwVertex> > drawVertices;
+    vector<size_t> drawMesh;
+    // triangles and tile bins, per chunk of the draw list so chunks can be set up in parallel
+    struct Chunk {
+        size_t draw, firstTriangle, triangleCount;
+        vector<SwTriangle> triangles;
+        vector<vector<unsigned int> > bins;
+    };
+    vector<Chunk> chunks;
+    // per pixel: nearest/farthest triangle, its depth and perspective-correct barycentrics (1 and 2)
+    vector<float> frontDepth, backDepth;
+    vector<const SwTriangle *> frontTriangle, backTriangle;
+    vector<float> frontBary[2], backBary[2];
+    // the RGBA8 normal textures (as floats), and Pos/Normal of the front fragment for the refraction shader
+    vector<float> frontColor[4], backColor[4];
+    vector<float> frontPos[3], frontNormal[3];
+
+    static double elapsedMs(std::chrono::steady_clock::time_point &since)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - since).count();
+        since = now;
+        return ms;
+    }
+
+    // what an RGBA8 render target stores for a shader output
+    static float unorm8(float x)
+    {
+        x = std::min(std::max(x, 0.0f), 1.0f);
+        return std::floor(x * 255.0f + 0.5f) / 255.0f;
+    }
+
+    // normVshader (objVshader outputs a subset of the same) for every vertex of every draw
+    void transformVertices(const vector<MeshView> &meshes, const vector<glm::mat4> &models, const glm::mat4 &view, const glm::vec3 &cameraPos)
+    {
+        size_t draws = meshes.size() * models.size();
+        drawVertices.resize(draws);
+        drawMesh.resize(draws);
+        vector<pair<size_t, size_t> > blocks; // (draw, first vertex)
+        const size_t blockSize = 16384;
+        for (size_t d = 0; d < draws; d++) {
+            drawMesh[d] = d % meshes.size();
+            const MeshView &mesh = meshes[drawMesh[d]];
+            size_t vertexCount = 0;
+            for (size_t i = 0; i < mesh.indexCount; i++)
+                vertexCount = std::max(vertexCount, (size_t)mesh.indices[i] + 1);
+            drawVertices[d].resize(vertexCount);
+            for (size_t first = 0; first < vertexCount; first += blockSize)
+                blocks.push_back(make_pair(d, first));
+        }
+        parallelFor((int)blocks.size(), threads, [&](int block, int) {
+            size_t d = blocks[block].first;
+            const glm::mat4 &model = models[d / meshes.size()];
+            glm::mat4 mvp = projection * view * model;
+            glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+            glm::vec3 worldCameraPos = glm::vec3(model * glm::vec4(cameraPos, 1.0f));
+            const Vertex *source = meshes[drawMesh[d]].vertices;
+            vector<SwVertex> &out = drawVertices[d];
+            size_t end = std::min(out.size(), blocks[block].second + blockSize);
+            for (size_t i = blocks[block].second; i < end; i++) {
+                glm::vec4 p(source[i].Position, 1.0f);
+                out[i].clip = mvp * p;
+                out[i].pos = glm::vec3(model * p);
+                out[i].normal = normalMatrix * source[i].Normal;
+                out[i].distance = glm::length(out[i].pos - worldCameraPos);
+            }
+        });
+    }
+
+    // clips against the near plane (z >= -w), splits into chunks, sets up edge functions and bins to tiles
+    void setupTriangles(const vector<MeshView> &meshes)
+    {
+        const size_t chunkSize = 8192;
+        size_t chunkCount = 0;
+        for (size_t d = 0; d < drawVertices.size(); d++)
+            for (size_t first = 0; first < meshes[drawMesh[d]].indexCount / 3; first += chunkSize)
+                chunkCount++;
+        chunks.resize(chunkCount);
+        size_t c = 0;
+        for (size_t d = 0; d < drawVertices.size(); d++) {
+            size_t triangles = meshes[drawMesh[d]].indexCount / 3;
+            for (size_t first = 0; first < triangles; first += chunkSize, c++) {
+                chunks[c].draw = d;
+                chunks[c].firstTriangle = first;
+                chunks[c].triangleCount = std::min(chunkSize, triangles - first);
+            }
+        }
+        parallelFor((int)chunks.size(), threads, [&](int index, int) {
+            Chunk &chunk = chunks[index];
+            chunk.triangles.clear();
+            chunk.bins.resize(tilesX * tilesY);
+            for (size_t t = 0; t < chunk.bins.size(); t++)
+                chunk.bins[t].clear();
+            const unsigned int *indices = meshes[drawMesh[chunk.draw]].indices;
+            const vector<SwVertex> &vertices = drawVertices[chunk.draw];
+            for (size_t t = chunk.firstTriangle; t < chunk.firstTriangle + chunk.triangleCount; t++)
+                clipTriangle(vertices[indices[3 * t]], vertices[indices[3 * t + 1]], vertices[indices[3 * t + 2]], chunk);
+        });
+        stats.triangles = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+            stats.triangles += chunks[i].triangles.size();
+    }
+
+    static SwVertex lerpVertex(const SwVertex &a, const SwVertex &b, float t)
+    {
+        SwVertex v;
+        v.clip = a.clip + (b.clip - a.clip) * t;
+        v.pos = a.pos + (b.pos - a.pos) * t;
+        v.normal = a.normal + (b.normal - a.normal) * t;
+        v.distance = a.distance + (b.distance - a.distance) * t;
+        return v;
+    }
+
+    void clipTriangle(const SwVertex &v0, const SwVertex &v1, const SwVertex &v2, Chunk &chunk)
+    {
+        const SwVertex *in[3] = { &v0, &v1, &v2 };
+        float dist[3];
+        int inside = 0;
+        for (int i = 0; i < 3; i++) {
+            dist[i] = in[i]->clip.z + in[i]->clip.w;
+            inside += dist[i] >= 0.0f;
+        }
+        if (inside == 3) {
+            addTriangle(v0, v1, v2, chunk);
+            return;
+        }
+        if (inside == 0)
+            return;
+        // Sutherland-Hodgman against one plane gives 3 or 4 vertices
+        SwVertex polygon[4];
+        int count = 0;
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            if (dist[i] >= 0.0f)
+                polygon[count++] = *in[i];
+            if ((dist[i] >= 0.0f) != (dist[j] >= 0.0f))
+                polygon[count++] = lerpVertex(*in[i], *in[j], dist[i] / (dist[i] - dist[j]));
+        }
+        for (int i = 1; i + 1 < count; i++)
+            addTriangle(polygon[0], polygon[i], polygon[i + 1], chunk);
+    }
+
+    void addTriangle(const SwVertex &v0, const SwVertex &v1, const SwVertex &v2, Chunk &chunk)
+    {
+        const SwVertex *v[3] = { &v0, &v1, &v2 };
+        SwTriangle tri;
+        float x[3], y[3];
+        for (int i = 0; i < 3; i++) {
+            tri.w[i] = v[i]->clip.w;
+            tri.invW[i] = 1.0f / v[i]->clip.w;
+            // viewport transform, window coordinates with y up like gl_FragCoord
+            x[i] = (v[i]->clip.x * tri.invW[i] * 0.5f + 0.5f) * width;
+            y[i] = (v[i]->clip.y * tri.invW[i] * 0.5f + 0.5f) * height;
+            tri.z[i] = v[i]->clip.z * tri.invW[i] * 0.5f + 0.5f;
+            tri.pos[i] = v[i]->pos;
+            tri.normal[i] = v[i]->normal;
+            tri.distance[i] = v[i]->distance;
+        }
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (area == 0.0f || !std::isfinite(area))
+            return;
+        // no face culling in the GL passes, so flip clockwise triangles instead of dropping them
+        float sign = area > 0.0f ? 1.0f : -1.0f;
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            tri.a[i] = sign * (y[j] - y[k]);
+            tri.b[i] = sign * (x[k] - x[j]);
+            tri.topLeft[i] = tri.a[i] > 0.0f || (tri.a[i] == 0.0f && tri.b[i] < 0.0f);
+        }
+        tri.invArea = 1.0f / (sign * area);
+        // pixel centers (px + 0.5) inside the bounding box, clamped to the screen
+        tri.minX = std::max(0, (int)std::ceil(std::min(x[0], std::min(x[1], x[2])) - 0.5f));
+        tri.maxX = std::min(width - 1, (int)std::floor(std::max(x[0], std::max(x[1], x[2])) - 0.5f));
+        tri.minY = std::max(0, (int)std::ceil(std::min(y[0], std::min(y[1], y[2])) - 0.5f));
+        tri.maxY = std::min(height - 1, (int)std::floor(std::max(y[0], std::max(y[1], y[2])) - 0.5f));
+        if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+            return;
+        // Edges relative to the bounding box corner: with screen-sized numbers in c, the barycentrics of small
+        // triangles don't sum to 1 exactly any more, and depth (all close to 1.0 with our far camera) goes wrong
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            tri.c[i] = -(tri.a[i] * (x[j] - tri.minX) + tri.b[i] * (y[j] - tri.minY));
+        }
+        unsigned int index = (unsigned int)chunk.triangles.size();
+        chunk.triangles.push_back(tri);
+        for (int ty = tri.minY / TILE; ty <= tri.maxY / TILE; ty++)
+            for (int tx = tri.minX / TILE; tx <= tri.maxX / TILE; tx++)
+                chunk.bins[ty * tilesX + tx].push_back(index);
+    }
+
+    void tileBounds(int tile, int &x0, int &y0, int &x1, int &y1) const
+    {
+        x0 = (tile % tilesX) * TILE;
+        y0 = (tile / tilesX) * TILE;
+        x1 = std::min(x0 + TILE, width) - 1;
+        y1 = std::min(y0 + TILE, height) - 1;
+    }
+
+    // front and back pass for one tile, then resolve both into the RGBA8 normal textures
+    void rasterizeTile(int tile)
+    {
+        int x0, y0, x1, y1;
+        tileBounds(tile, x0, y0, x1, y1);
+        for (int y = y0; y <= y1; y++) {
+            size_t row = (size_t)y * stride;
+            std::fill(&frontDepth[row + x0], &frontDepth[row + x1] + 1, 1.0f);   // glClearDepth(1.0)
+            std::fill(&backDepth[row + x0], &backDepth[row + x1] + 1, 0.0f);     // glClearDepth(0.0)
+            std::fill(&frontTriangle[row + x0], &frontTriangle[row + x1] + 1, (const SwTriangle *)NULL);
+            std::fill(&backTriangle[row + x0], &backTriangle[row + x1] + 1, (const SwTriangle *)NULL);
+        }
+        // chunks in draw order, so equal depths resolve like they do on the GPU
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const vector<unsigned int> &bin = chunks[c].bins[tile];
+            for (size_t i = 0; i < bin.size(); i++)
+                rasterizeTriangle(chunks[c].triangles[bin[i]], x0, y0, x1, y1);
+        }
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                resolvePixel((size_t)y * stride + x);
+    }
+
+    void rasterizeTriangle(const SwTriangle &tri, int x0, int y0, int x1, int y1)
+    {
+        int minX = std::max(tri.minX, x0), maxX = std::min(tri.maxX, x1);
+        int minY = std::max(tri.minY, y0), maxY = std::min(tri.maxY, y1);
+        if (minX > maxX || minY > maxY)
+            return;
+        minX &= ~3; // 4-aligned so loads/stores line up with the padded rows
+        const vfloat4 laneOffsets(0.5f, 1.5f, 2.5f, 3.5f), zero(0.0f), one(1.0f);
+        vmask4 topLeft[3];
+        for (int i = 0; i < 3; i++)
+            topLeft[i] = maskFromBits(tri.topLeft[i] ? 15 : 0);
+        for (int y = minY; y <= maxY; y++) {
+            vfloat4 py((float)(y - tri.minY) + 0.5f);
+            size_t row = (size_t)y * stride;
+            for (int x = minX; x <= maxX; x += 4) {
+                vfloat4 px = vfloat4((float)(x - tri.minX)) + laneOffsets;
+                vfloat4 e[3];
+                vmask4 inside = maskFromBits(15);
+                for (int i = 0; i < 3; i++) {
+                    e[i] = vfloat4(tri.a[i]) * px + vfloat4(tri.b[i]) * py + vfloat4(tri.c[i]);
+                    inside = inside & ((e[i] > zero) | (topLeft[i] & (e[i] == zero)));
+                }
+                if (maskBits(inside) == 0)
+                    continue;
+                vfloat4 invArea(tri.invArea);
+                vfloat4 l0 = e[0] * invArea, l1 = e[1] * invArea, l2 = e[2] * invArea;
+                // relative to z0, so errors in the barycentrics don't get multiplied by a depth of ~1
+                vfloat4 z = vfloat4(tri.z[0]) + l1 * vfloat4(tri.z[1] - tri.z[0]) + l2 * vfloat4(tri.z[2] - tri.z[0]);
+                inside = inside & (z >= zero) & (z <= one); // far plane clipping
+                // perspective-correct barycentrics
+                vfloat4 q0 = l0 * vfloat4(tri.invW[0]), q1 = l1 * vfloat4(tri.invW[1]), q2 = l2 * vfloat4(tri.invW[2]);
+                vfloat4 invSum = one / (q0 + q1 + q2);
+                vfloat4 p1 = q1 * invSum, p2 = q2 * invSum;
+
+                size_t at = row + x;
+                vfloat4 front = vfloat4::load(&frontDepth[at]);
+                vmask4 nearer = inside & (z < front);        // GL_LESS
+                int nearerBits = maskBits(nearer);
+                if (nearerBits) {
+                    select(nearer, z, front).store(&frontDepth[at]);
+                    select(nearer, p1, vfloat4::load(&frontBary[0][at])).store(&frontBary[0][at]);
+                    select(nearer, p2, vfloat4::load(&frontBary[1][at])).store(&frontBary[1][at]);
+                    for (int lane = 0; lane < 4; lane++)
+                        if (nearerBits & (1 << lane))
+                            frontTriangle[at + lane] = &tri;
+                }
+                vfloat4 back = vfloat4::load(&backDepth[at]);
+                vmask4 farther = inside & (z > back);        // GL_GREATER
+                int fartherBits = maskBits(farther);
+                if (fartherBits) {
+                    select(farther, z, back).store(&backDepth[at]);
+                    select(farther, p1, vfloat4::load(&backBary[0][at])).store(&backBary[0][at]);
+                    select(farther, p2, vfloat4::load(&backBary[1][at])).store(&backBary[1][at]);
+                    for (int lane = 0; lane < 4; lane++)
+                        if (fartherBits & (1 << lane))
+                            backTriangle[at + lane] = &tri;
+                }
+            }
+        }
+    }
+
+    // normFshader: color = vec4(Normal, worldDistance * gl_FragCoord.w), written to an RGBA8 texture
+    void resolvePixel(size_t at)
+    {
+        for (int side = 0; side < 2; side++) {
+            const SwTriangle *tri = side == 0 ? frontTriangle[at] : backTriangle[at];
+            vector<float> *color = side == 0 ? frontColor : backColor;
+            if (!tri) {
+                // the clear colors of the two passes
+                color[0][at] = unorm8(side == 0 ? 0.0f : 1.0f);
+                color[1][at] = unorm8(0.1f);
+                color[2][at] = unorm8(0.1f);
+                color[3][at] = unorm8(1.0f);
+                continue;
+            }
+            float p1 = side == 0 ? frontBary[0][at] : backBary[0][at];
+            float p2 = side == 0 ? frontBary[1][at] : backBary[1][at];
+            float p0 = 1.0f - p1 - p2;
+            glm::vec3 normal = p0 * tri->normal[0] + p1 * tri->normal[1] + p2 * tri->normal[2];
+            float distance = p0 * tri->distance[0] + p1 * tri->distance[1] + p2 * tri->distance[2];
+            float fragW = 1.0f / (p0 * tri->w[0] + p1 * tri->w[1] + p2 * tri->w[2]); // gl_FragCoord.w
+            color[0][at] = unorm8(normal.x);
+            color[1][at] = unorm8(normal.y);
+            color[2][at] = unorm8(normal.z);
+            color[3][at] = unorm8(distance * fragW);
+            if (side == 0) {
+                glm::vec3 pos = p0 * tri->pos[0] + p1 * tri->pos[1] + p2 * tri->pos[2];
+                frontPos[0][at] = pos.x; frontPos[1][at] = pos.y; frontPos[2][at] = pos.z;
+                frontNormal[0][at] = normal.x; frontNormal[1][at] = normal.y; frontNormal[2][at] = normal.z;
+            }
+        }
+    }
+
+    // texture(normalBackTexture, uv): GL_LINEAR, and GL_REPEAT since the render target never sets a wrap mode
+    glm::vec3 sampleBack(float u, float v) const
+    {
+        if (!std::isfinite(u) || !std::isfinite(v))
+            return glm::vec3(0.0f);
+        float x = u * width - 0.5f, y = v * height - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float wx = x - fx, wy = y - fy;
+        long ix = (long)fx, iy = (long)fy;
+        int xs[2] = { (int)(((ix % width) + width) % width), (int)((((ix + 1) % width) + width) % width) };
+        int ys[2] = { (int)(((iy % height) + height) % height), (int)((((iy + 1) % height) + height) % height) };
+        glm::vec3 result(0.0f);
+        for (int j = 0; j < 2; j++) {
+            for (int i = 0; i < 2; i++) {
+                size_t at = (size_t)ys[j] * stride + xs[i];
+                float weight = (i ? wx : 1.0f - wx) * (j ? wy : 1.0f - wy);
+                result += weight * glm::vec3(backColor[0][at], backColor[1][at], backColor[2][at]);
+            }
+        }
+        return result;
+    }
+
+    // objFshader for the front fragments, skybox shader everywhere else
+    void shadeTile(int tile, const glm::mat4 &view, const glm::vec3 &cameraPos, Image &output)
+    {
+        int x0, y0, x1, y1;
+        tileBounds(tile, x0, y0, x1, y1);
+        const float ratio = 1.00f / 1.309f;
+        glm::mat4 viewProjection = projection * view;
+        glm::mat3 skyRotation = glm::inverse(glm::mat3(view));
+        const vfloat4 zero(0.0f), half(0.5f);
+        for (int y = y0; y <= y1; y++) {
+            size_t row = (size_t)y * stride;
+            unsigned char *out = output.row(height - 1 - y); // output is top row first
+            for (int x = x0; x <= x1; x += 4) {
+                size_t at = row + x;
+                int lanes = std::min(4, x1 - x + 1);
+                int covered = 0;
+                for (int lane = 0; lane < lanes; lane++)
+                    if (frontTriangle[at + lane])
+                        covered |= 1 << lane;
+
+                float color[3][4];
+                if (covered) {
+                    // vec4 frontData/backData = normalize(texture(...)), only the alpha is used
+                    vfloat4 fr = vfloat4::load(&frontColor[0][at]), fg = vfloat4::load(&frontColor[1][at]);
+                    vfloat4 fb = vfloat4::load(&frontColor[2][at]), fa = vfloat4::load(&frontColor[3][at]);
+                    vfloat4 br = vfloat4::load(&backColor[0][at]), bg = vfloat4::load(&backColor[1][at]);
+                    vfloat4 bb = vfloat4::load(&backColor[2][at]), ba = vfloat4::load(&backColor[3][at]);
+                    vfloat4 frontAlpha = fa / sqrt(fr * fr + fg * fg + fb * fb + fa * fa);
+                    vfloat4 backAlpha = ba / sqrt(br * br + bg * bg + bb * bb + ba * ba);
+
+                    vvec3 pos(vfloat4::load(&frontPos[0][at]), vfloat4::load(&frontPos[1][at]), vfloat4::load(&frontPos[2][at]));
+                    vvec3 N1 = normalize(vvec3(vfloat4::load(&frontNormal[0][at]), vfloat4::load(&frontNormal[1][at]),
+                                               vfloat4::load(&frontNormal[2][at])));
+                    vvec3 V = normalize(pos - vvec3(cameraPos.x, cameraPos.y, cameraPos.z));
+                    vvec3 T1 = normalize(refract(V, N1, ratio));
+                    vfloat4 d = abs(backAlpha - frontAlpha);
+                    vvec3 P2 = pos + d * T1;
+                    // newUV = (projection * view * P2).xy / w * 0.5 + 0.5
+                    const glm::mat4 &m = viewProjection;
+                    vfloat4 cx = vfloat4(m[0][0]) * P2.x + vfloat4(m[1][0]) * P2.y + vfloat4(m[2][0]) * P2.z + vfloat4(m[3][0]);
+                    vfloat4 cy = vfloat4(m[0][1]) * P2.x + vfloat4(m[1][1]) * P2.y + vfloat4(m[2][1]) * P2.z + vfloat4(m[3][1]);
+                    vfloat4 cw = vfloat4(m[0][3]) * P2.x + vfloat4(m[1][3]) * P2.y + vfloat4(m[2][3]) * P2.z + vfloat4(m[3][3]);
+                    float u[4], v[4];
+                    (cx / cw * half + half).store(u);
+                    (cy / cw * half + half).store(v);
+                    float n2[3][4] = {};
+                    for (int lane = 0; lane < 4; lane++) {
+                        if (!(covered & (1 << lane)))
+                            continue;
+                        glm::vec3 N2 = sampleBack(u[lane], v[lane]);
+                        n2[0][lane] = N2.x; n2[1][lane] = N2.y; n2[2][lane] = N2.z;
+                    }
+                    vvec3 T2 = refract(T1, -vvec3(vfloat4::load(n2[0]), vfloat4::load(n2[1]), vfloat4::load(n2[2])), ratio);
+                    float t2[3][4];
+                    T2.x.store(t2[0]); T2.y.store(t2[1]); T2.z.store(t2[2]);
+                    for (int lane = 0; lane < 4; lane++) {
+                        if (!(covered & (1 << lane)))
+                            continue;
+                        glm::vec3 sky = cubemap->sample(glm::vec3(t2[0][lane], t2[1][lane], t2[2][lane]));
+                        color[0][lane] = sky.x;
+                        color[1][lane] = sky.y + 0.1f;
+                        color[2][lane] = sky.z + 0.1f;
+                    }
+                }
+                for (int lane = 0; lane < lanes; lane++) {
+                    if (!(covered & (1 << lane))) {
+                        // skybox: the direction through this pixel, rotated by the view
+                        float ndcX = (x + lane + 0.5f) / width * 2.0f - 1.0f, ndcY = (y + 0.5f) / height * 2.0f - 1.0f;
+                        glm::vec3 dir = skyRotation * glm::vec3(ndcX / skyboxProjection[0][0], ndcY / skyboxProjection[1][1], -1.0f);
+                        glm::vec3 sky = cubemap->sample(dir);
+                        color[0][lane] = sky.x; color[1][lane] = sky.y; color[2][lane] = sky.z;
+                    }
+                    unsigned char *pixel = out + (size_t)(x + lane) * 3;
+                    for (int c = 0; c < 3; c++)
+                        pixel[c] = (unsigned char)(unorm8(color[c][lane]) * 255.0f + 0.5f);
+                }
+            }
+        }
+    }
+};
+
+/*
+    Renders one scene at every thread count from 1 to --max-threads (doubling) and prints frames per second.
+    --compare-gl renders the same frame with the GL renderer and prints how close the two are.
+*/
+inline int runSoftwareBenchmark(int argc, char *argv[])
+{
+    int width = 1600, height = 1200;
+    sscanf(argValue(argc, argv, "--size", "1600x1200").c_str(), "%dx%d", &width, &height);
+    unsigned int triangles = (unsigned int)argNumber(argc, argv, "--triangles", 100000);
+    int instances = (int)argNumber(argc, argv, "--instances", 1);
+    int frames = (int)argNumber(argc, argv, "--frames", 5);
+    int maxThreads = (int)argNumber(argc, argv, "--max-threads", hardwareThreads());
+    string skybox = argValue(argc, argv, "--skybox", "skybox/sky");
+    string outPath = argValue(argc, argv, "--out", "swrender.ppm");
+
+    CpuCubemap cubemap;
+    if (!cubemap.load(skyboxFaces(skybox)))
+        return -1;
+    MeshData blob = buildShape(SHAPE_BLOB, triangles);
+    vector<MeshView> meshes(1, meshView(blob));
+    SoftwareRenderer renderer(width, height, &cubemap);
+    vector<glm::mat4> models;
+    float distance = instanceGrid(instances, renderer.projection, models);
+    glm::vec3 cameraPos(0.0f, 0.0f, distance);
+    glm::mat4 view = glm::lookAt(cameraPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    cout << "CPU renderer, " << width << "x" << height << ", " << blob.indices.size() / 3 * instances << " triangles, "
+         << hardwareThreads() << " hardware threads" << endl;
+    cout << setw(8) << "threads" << setw(11) << "ms/frame" << setw(9) << "fps" << setw(9) << "speedup"
+         << setw(10) << "vertex" << setw(10) << "setup" << setw(10) << "raster" << setw(10) << "shade" << endl;
+    Image image;
+    double singleThreadMs = 0.0;
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        renderer.threads = threads;
+        renderer.renderFrame(meshes, models, view, cameraPos, image); // warm up
+        SwFrameStats total = SwFrameStats();
+        for (int frame = 0; frame < frames; frame++) {
+            renderer.renderFrame(meshes, models, view, cameraPos, image);
+            total.vertexMs += renderer.stats.vertexMs;
+            total.setupMs += renderer.stats.setupMs;
+            total.rasterMs += renderer.stats.rasterMs;
+            total.shadeMs += renderer.stats.shadeMs;
+            total.totalMs += renderer.stats.totalMs;
+        }
+        double ms = total.totalMs / frames;
+        if (threads == 1)
+            singleThreadMs = ms;
+        cout << fixed << setprecision(2) << setw(8) << threads << setw(11) << ms << setw(9) << 1000.0 / ms
+             << setw(9) << singleThreadMs / ms << setw(10) << total.vertexMs / frames << setw(10) << total.setupMs / frames
+             << setw(10) << total.rasterMs / frames << setw(10) << total.shadeMs / frames << endl;
+        if (threads >= maxThreads)
+            break;
+    }
+    cout.unsetf(ios::floatfield);
+    if (writePPM(outPath, image))
+        cout << "Wrote " << outPath << endl;
+
+    if (!hasArg(argc, argv, "--compare-gl"))
+        return 0;
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    unsigned int cubemapTexture = loadCubemap(skyboxFaces(skybox));
+    Renderer gpu(width, height, cubemapTexture);
+    vector<Mesh> gpuMeshes;
+    gpuMeshes.push_back(Mesh(blob.vertices, blob.indices, vector<Texture>(), blob.owner));
+    Model object(std::move(gpuMeshes));
+    RenderTarget target = createRenderTarget(width, height, "CPU renderer comparison");
+    gpu.renderFrame(object, models, view, cameraPos, target.framebuffer);
+    Image gpuImage;
+    gpuImage.width = width;
+    gpuImage.height = height;
+    readRenderTarget(target, gpuImage.pixels);
+    ImageDiff diff;
+    if (compareImages(gpuImage, image, diff)) {
+        cout << "CPU vs GL: PSNR " << diff.psnr << " dB, SSIM " << diff.ssim << ", max abs " << diff.maxAbs << endl;
+        writePPM("swrender_gl.ppm", gpuImage);
+        writePPM("swrender_diff.ppm", diffHeatmap(gpuImage, image));
+    }
+    deleteRenderTarget(target);
+    object.release();
+    gpu.release();
+    memoryRegistry().release(MEM_TEXTURE, cubemapTexture);
+    glDeleteTextures(1, &cubemapTexture);
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* swrender_hpp */
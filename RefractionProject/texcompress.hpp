@@ -0,0 +1,1037 @@
+//
+//  texcompress.hpp
+//  RefractionProject
+//
+//  Block compression on the CPU for the skybox faces and the material textures, so they take a quarter
+//  (BC1: an eighth) of the VRAM and sampling bandwidth of plain GL_RGB8. Every format works on 4x4
+//  blocks, and every block is fit the same way: the principal axis of its colors gives two endpoints,
+//  each texel gets the index of the nearest color interpolated between them, and the quality preset
+//  then refits the endpoints by least squares for those indices a few times, keeping the best.
+//
+//    BC1   RGB, 8 bytes a block: 565 endpoints, 2-bit indices                  (fast, opaque)
+//    BC3   BC1 color + an 8-byte alpha block with 3-bit indices                 (fast, with alpha)
+//    BC7   mode 6 only: 7777 + p-bit RGBA endpoints, 4-bit indices, 16 bytes   (quality)
+//    BC6H  mode 11 only: 10-bit unsigned half-float endpoints, 4-bit indices   (HDR)
+//
+//  BC7 and BC6H have many more modes (two and three subsets with partition tables, delta-coded
+//  endpoints); the single-subset mode of each is a fraction of the encoder and still well ahead of BC1.
+//  The decoders here read only what the encoders write; they are for PSNR and for checking the driver.
+//
+//  Mip levels are compressed the same way once mipgen.hpp has filtered them.
+//
+//  Results are cached next to the source (right.jpg -> right.jpg.quality.bc) with a hash of the file,
+//  so the second start doesn't decode the JPEG at all. Textures with one or two channels stay as they
+//  are (GL_RED would need BC4/BC5).
+//
+//  RefractionProject [--compress fast|quality] [--compress-format bc1|bc3|bc7] [--no-compress-cache]
+//  (--bench-compress is in texcompressbench.hpp)
+//
+
+#ifndef texcompress_hpp
+#define texcompress_hpp
+
+#include <glad/glad.h>
+
+#include "cmdline.hpp"
+#include "memory.hpp"
+#include "mipgen.hpp"
+#include "parallel.hpp"
+#include "stagingring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+enum BlockFormat { BLOCK_BC1, BLOCK_BC3, BLOCK_BC7, BLOCK_BC6H, BLOCK_FORMAT_COUNT };
+enum CompressPreset { COMPRESS_FAST, COMPRESS_QUALITY };
+
+inline const char *blockFormatName(int format)
+{
+    const char *names[] = { "bc1", "bc3", "bc7", "bc6h" };
+    return format >= 0 && format < BLOCK_FORMAT_COUNT ? names[format] : "none";
+}
+
+inline const char *compressPresetName(int preset) { return preset == COMPRESS_QUALITY ? "quality" : "fast"; }
+
+// srgb: the texels are sRGB encoded and sampling should linearize them (there is no sRGB BC6H)
+inline GLenum blockFormatGL(int format, bool srgb = false)
+{
+    switch (format) {
+        case BLOCK_BC1: return srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BLOCK_BC3: return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BLOCK_BC7: return srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+        default: return GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;
+    }
+}
+
+inline int blockBytes(int format) { return format == BLOCK_BC1 ? 8 : 16; }
+
+// interpolation weights of the 4-bit BC7/BC6H indices, out of 64
+static const int bptcWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// half floats, for BC6H and the float cubemaps (no denormals on the way in, they flush to zero)
+inline unsigned short floatToHalf(float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, 4);
+    unsigned int sign = (bits >> 16) & 0x8000u;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffffu;
+    if (((bits >> 23) & 0xff) == 0xff)
+        return (unsigned short)(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+    if (exponent <= 0)
+        return (unsigned short)sign;
+    if (exponent >= 31)
+        return (unsigned short)(sign | 0x7bffu); // clamp to the largest finite half
+    unsigned int half = sign | ((unsigned int)exponent << 10) | (mantissa >> 13);
+    // round to nearest even, carrying into the exponent is what we want
+    unsigned int rest = mantissa & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u)))
+        half++;
+    if ((half & 0x7fffu) >= 0x7c00u)
+        half = sign | 0x7bffu;
+    return (unsigned short)half;
+}
+
+inline float halfToFloat(unsigned short half)
+{
+    unsigned int sign = (half & 0x8000u) << 16, exponent = (half >> 10) & 0x1fu, mantissa = half & 0x3ffu;
+    unsigned int bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else { // denormal, normalize it
+            exponent = 1;
+            while (!(mantissa & 0x400u)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3ffu;
+            bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+// LSB-first bit packing, the order BC7 and BC6H blocks are laid out in
+struct BlockBits {
+    unsigned char *bytes;
+    int position;
+
+    explicit BlockBits(unsigned char *bytes) : bytes(bytes), position(0) {}
+
+    void write(unsigned int value, int bits)
+    {
+        for (int i = 0; i < bits; i++, position++)
+            if (value >> i & 1u)
+                bytes[position >> 3] |= (unsigned char)(1u << (position & 7));
+    }
+    unsigned int read(int bits)
+    {
+        unsigned int value = 0;
+        for (int i = 0; i < bits; i++, position++)
+            value |= (unsigned int)(bytes[position >> 3] >> (position & 7) & 1u) << i;
+        return value;
+    }
+};
+
+/*
+    Endpoints of the line through the block's colors along their principal axis (power iteration on
+    the covariance), at the first and last color projected onto it. channels is 3 or 4.
+*/
+inline void fitEndpoints(const float pixels[16][4], int channels, float e0[4], float e1[4])
+{
+    float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < channels; c++)
+            mean[c] += pixels[i][c] * (1.0f / 16.0f);
+    float covariance[4][4] = {};
+    for (int i = 0; i < 16; i++)
+        for (int a = 0; a < channels; a++)
+            for (int b = 0; b < channels; b++)
+                covariance[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+    // start on the channel that varies most, so the iteration can't start orthogonal to the answer
+    float axis[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    int widest = 0;
+    for (int c = 1; c < channels; c++)
+        if (covariance[c][c] > covariance[widest][widest])
+            widest = c;
+    axis[widest] = 1.0f;
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[4] = { 0.0f, 0.0f, 0.0f, 0.0f }, length = 0.0f;
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++)
+                next[a] += covariance[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length < 1e-12f)
+            break;
+        length = 1.0f / std::sqrt(length);
+        for (int c = 0; c < channels; c++)
+            axis[c] = next[c] * length;
+    }
+    float lo = 0.0f, hi = 0.0f;
+    for (int i = 0; i < 16; i++) {
+        float t = 0.0f;
+        for (int c = 0; c < channels; c++)
+            t += (pixels[i][c] - mean[c]) * axis[c];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+    for (int c = 0; c < channels; c++) {
+        e0[c] = mean[c] + lo * axis[c];
+        e1[c] = mean[c] + hi * axis[c];
+    }
+}
+
+// the endpoints that minimize the squared error when texel i is e0 + weights[i] * (e1 - e0); false if singular
+inline bool refitEndpoints(const float pixels[16][4], int channels, const float weights[16], float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[4] = { 0.0f, 0.0f, 0.0f, 0.0f }, bx[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; i++) {
+        float b = weights[i], a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; c++) {
+            ax[c] += a * pixels[i][c];
+            bx[c] += b * pixels[i][c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+        return false;
+    for (int c = 0; c < channels; c++) {
+        e0[c] = (bb * ax[c] - ab * bx[c]) / determinant;
+        e1[c] = (aa * bx[c] - ab * ax[c]) / determinant;
+    }
+    return true;
+}
+
+inline int quantize(float value, int maximum)
+{
+    return std::min(std::max((int)std::floor(value + 0.5f), 0), maximum);
+}
+
+// ---- BC1 / BC3 ----
+
+inline unsigned short packRGB565(const float rgb[3])
+{
+    return (unsigned short)(quantize(rgb[0] * 31.0f / 255.0f, 31) << 11 | quantize(rgb[1] * 63.0f / 255.0f, 63) << 5 |
+                            quantize(rgb[2] * 31.0f / 255.0f, 31));
+}
+
+inline void unpackRGB565(unsigned short color, int rgb[3])
+{
+    int r = color >> 11, g = color >> 5 & 63, b = color & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+}
+
+// the four colors of a BC1 block in 4-color mode (color0 > color1, and always in BC3)
+inline void bc1Palette(unsigned short color0, unsigned short color1, int palette[4][3])
+{
+    unpackRGB565(color0, palette[0]);
+    unpackRGB565(color1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+}
+
+// indices and squared error of a BC1 block with these endpoints (swapped into 4-color order)
+inline unsigned int bc1Evaluate(const float pixels[16][4], unsigned short &color0, unsigned short &color1, unsigned int &indices)
+{
+    if (color0 < color1)
+        std::swap(color0, color1);
+    int palette[4][3];
+    bc1Palette(color0, color1, palette);
+    unsigned int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; i++) {
+        unsigned int best = ~0u;
+        int bestIndex = 0;
+        for (int p = 0; p < (color0 == color1 ? 1 : 4); p++) {
+            unsigned int distance = 0;
+            for (int c = 0; c < 3; c++) {
+                int d = palette[p][c] - (int)pixels[i][c];
+                distance += d * d;
+            }
+            if (distance < best) {
+                best = distance;
+                bestIndex = p;
+            }
+        }
+        error += best;
+        indices |= (unsigned int)bestIndex << (2 * i);
+    }
+    return error;
+}
+
+inline void encodeBC1Color(const float pixels[16][4], int preset, unsigned char out[8])
+{
+    static const float weightOfIndex[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    float e0[4], e1[4];
+    fitEndpoints(pixels, 3, e1, e0); // e0 the brighter end, it ends up as color0 most of the time
+    unsigned int bestError = ~0u, bestIndices = 0;
+    unsigned short best0 = 0, best1 = 0;
+    for (int iteration = 0; iteration < (preset == COMPRESS_QUALITY ? 3 : 1); iteration++) {
+        unsigned short color0 = packRGB565(e0), color1 = packRGB565(e1);
+        unsigned int indices;
+        unsigned int error = bc1Evaluate(pixels, color0, color1, indices);
+        if (error < bestError) {
+            bestError = error;
+            bestIndices = indices;
+            best0 = color0;
+            best1 = color1;
+        }
+        if (error == 0)
+            break;
+        float weights[16];
+        for (int i = 0; i < 16; i++)
+            weights[i] = weightOfIndex[indices >> (2 * i) & 3];
+        if (!refitEndpoints(pixels, 3, weights, e0, e1))
+            break;
+        for (int c = 0; c < 3; c++) {
+            e0[c] = std::min(std::max(e0[c], 0.0f), 255.0f);
+            e1[c] = std::min(std::max(e1[c], 0.0f), 255.0f);
+        }
+    }
+    out[0] = (unsigned char)best0;
+    out[1] = (unsigned char)(best0 >> 8);
+    out[2] = (unsigned char)best1;
+    out[3] = (unsigned char)(best1 >> 8);
+    for (int b = 0; b < 4; b++)
+        out[4 + b] = (unsigned char)(bestIndices >> (8 * b));
+}
+
+inline void bc3AlphaPalette(int alpha0, int alpha1, int palette[8])
+{
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    if (alpha0 > alpha1) {
+        for (int i = 1; i < 7; i++)
+            palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+    } else {
+        for (int i = 1; i < 5; i++)
+            palette[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+inline unsigned int bc3AlphaEvaluate(const float pixels[16][4], int alpha0, int alpha1, unsigned long long &indices)
+{
+    int palette[8];
+    bc3AlphaPalette(alpha0, alpha1, palette);
+    unsigned int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 1 << 30, bestIndex = 0;
+        for (int p = 0; p < 8; p++) {
+            int d = palette[p] - (int)pixels[i][3];
+            if (d * d < best) {
+                best = d * d;
+                bestIndex = p;
+            }
+        }
+        error += best;
+        indices |= (unsigned long long)bestIndex << (3 * i);
+    }
+    return error;
+}
+
+// 8 interpolated alphas between the extremes; the quality preset also tries 6 plus exact 0 and 255
+inline void encodeBC3Alpha(const float pixels[16][4], int preset, unsigned char out[8])
+{
+    int lo = 255, hi = 0, innerLo = 255, innerHi = 0;
+    for (int i = 0; i < 16; i++) {
+        int a = (int)pixels[i][3];
+        lo = std::min(lo, a);
+        hi = std::max(hi, a);
+        if (a > 0 && a < 255) {
+            innerLo = std::min(innerLo, a);
+            innerHi = std::max(innerHi, a);
+        }
+    }
+    int alpha0 = hi, alpha1 = lo;
+    unsigned long long indices;
+    unsigned int error = bc3AlphaEvaluate(pixels, alpha0, alpha1, indices);
+    if (preset == COMPRESS_QUALITY && error > 0 && innerLo <= innerHi) {
+        unsigned long long sixIndices;
+        unsigned int sixError = bc3AlphaEvaluate(pixels, innerLo, innerHi, sixIndices);
+        if (sixError < error) {
+            alpha0 = innerLo;
+            alpha1 = innerHi;
+            indices = sixIndices;
+        }
+    }
+    out[0] = (unsigned char)alpha0;
+    out[1] = (unsigned char)alpha1;
+    for (int b = 0; b < 6; b++)
+        out[2 + b] = (unsigned char)(indices >> (8 * b));
+}
+
+// ---- BC7 mode 6 ----
+
+// squared error and indices of RGBA endpoints (8 bits each, p-bit included) over the block
+inline unsigned int bc7Evaluate(const float pixels[16][4], const int e0[4], const int e1[4], bool exhaustive, int indices[16])
+{
+    int palette[16][4];
+    for (int p = 0; p < 16; p++)
+        for (int c = 0; c < 4; c++)
+            palette[p][c] = ((64 - bptcWeights4[p]) * e0[c] + bptcWeights4[p] * e1[c] + 32) >> 6;
+    float axis[4], axisLength = 0.0f;
+    for (int c = 0; c < 4; c++) {
+        axis[c] = (float)(e1[c] - e0[c]);
+        axisLength += axis[c] * axis[c];
+    }
+    unsigned int error = 0;
+    for (int i = 0; i < 16; i++) {
+        int first = 0, last = 15;
+        if (!exhaustive) { // project onto the line, then only look at the neighbours of that index
+            float t = 0.0f;
+            for (int c = 0; c < 4; c++)
+                t += (pixels[i][c] - e0[c]) * axis[c];
+            int guess = axisLength > 0.0f ? quantize(t / axisLength * 15.0f, 15) : 0;
+            first = std::max(guess - 1, 0);
+            last = std::min(guess + 1, 15);
+        }
+        unsigned int best = ~0u;
+        for (int p = first; p <= last; p++) {
+            unsigned int distance = 0;
+            for (int c = 0; c < 4; c++) {
+                int d = palette[p][c] - (int)pixels[i][c];
+                distance += d * d;
+            }
+            if (distance < best) {
+                best = distance;
+                indices[i] = p;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+// 7 bits + p-bit nearest to value for the given p-bit
+inline int bc7Quantize(float value, int pbit) { return quantize((value - pbit) * 0.5f, 127) * 2 + pbit; }
+
+inline void encodeBC7(const float pixels[16][4], int preset, unsigned char out[16])
+{
+    bool quality = preset == COMPRESS_QUALITY;
+    float f0[4], f1[4];
+    fitEndpoints(pixels, 4, f0, f1);
+    unsigned int bestError = ~0u;
+    int best0[4] = { 0, 0, 0, 0 }, best1[4] = { 0, 0, 0, 0 }, bestIndices[16] = {};
+    for (int iteration = 0; iteration < (quality ? 3 : 1); iteration++) {
+        int indices[16];
+        unsigned int iterationError = ~0u;
+        for (int pbits = 0; pbits < 4; pbits++) {
+            int p0 = pbits & 1, p1 = pbits >> 1;
+            int e0[4], e1[4];
+            for (int c = 0; c < 4; c++) {
+                e0[c] = bc7Quantize(f0[c], p0);
+                e1[c] = bc7Quantize(f1[c], p1);
+            }
+            if (!quality) { // the fast preset takes each endpoint's better p-bit on its own instead of trying all four
+                for (int end = 0; end < 2; end++) {
+                    const float *f = end ? f1 : f0;
+                    int *e = end ? e1 : e0;
+                    float error[2] = { 0.0f, 0.0f };
+                    int candidate[2][4];
+                    for (int p = 0; p < 2; p++)
+                        for (int c = 0; c < 4; c++) {
+                            candidate[p][c] = bc7Quantize(f[c], p);
+                            error[p] += (candidate[p][c] - f[c]) * (candidate[p][c] - f[c]);
+                        }
+                    memcpy(e, candidate[error[1] < error[0]], sizeof(candidate[0]));
+                }
+            }
+            int candidateIndices[16];
+            unsigned int error = bc7Evaluate(pixels, e0, e1, quality, candidateIndices);
+            if (error < iterationError) {
+                iterationError = error;
+                memcpy(indices, candidateIndices, sizeof(indices));
+            }
+            if (error < bestError) {
+                bestError = error;
+                memcpy(best0, e0, sizeof(best0));
+                memcpy(best1, e1, sizeof(best1));
+                memcpy(bestIndices, candidateIndices, sizeof(bestIndices));
+            }
+            if (!quality)
+                break;
+        }
+        if (bestError == 0)
+            break;
+        float weights[16];
+        for (int i = 0; i < 16; i++)
+            weights[i] = bptcWeights4[indices[i]] / 64.0f;
+        if (!refitEndpoints(pixels, 4, weights, f0, f1))
+            break;
+        for (int c = 0; c < 4; c++) {
+            f0[c] = std::min(std::max(f0[c], 0.0f), 255.0f);
+            f1[c] = std::min(std::max(f1[c], 0.0f), 255.0f);
+        }
+    }
+    // the anchor (texel 0) index is stored without its top bit, so it has to be below 8
+    if (bestIndices[0] >= 8) {
+        std::swap(best0, best1);
+        for (int i = 0; i < 16; i++)
+            bestIndices[i] = 15 - bestIndices[i];
+    }
+    memset(out, 0, 16);
+    BlockBits bits(out);
+    bits.write(1u << 6, 7); // mode 6
+    for (int c = 0; c < 4; c++) {
+        bits.write(best0[c] >> 1, 7);
+        bits.write(best1[c] >> 1, 7);
+    }
+    bits.write(best0[0] & 1, 1);
+    bits.write(best1[0] & 1, 1);
+    bits.write(bestIndices[0], 3);
+    for (int i = 1; i < 16; i++)
+        bits.write(bestIndices[i], 4);
+}
+
+// ---- BC6H mode 11 ----
+
+/*
+    BC6H interpolates in a space where the stored 16-bit value v becomes the half float (v * 31) >> 6,
+    so we fit in that space: a half's bits times 64 / 31.
+*/
+inline int bc6hUnquantize(int value)
+{
+    if (value == 0)
+        return 0;
+    if (value == 1023)
+        return 0xffff;
+    return ((value << 16) + 0x8000) >> 10;
+}
+
+inline int bc6hQuantize(float value)
+{
+    int q = std::min(std::max((int)(value / 64.0f), 0), 1022);
+    return std::fabs(bc6hUnquantize(q + 1) - value) < std::fabs(bc6hUnquantize(q) - value) ? q + 1 : q;
+}
+
+inline float bc6hEvaluate(const float pixels[16][4], const int q0[3], const int q1[3], int indices[16])
+{
+    int e0[3], e1[3];
+    for (int c = 0; c < 3; c++) {
+        e0[c] = bc6hUnquantize(q0[c]);
+        e1[c] = bc6hUnquantize(q1[c]);
+    }
+    float error = 0.0f;
+    for (int i = 0; i < 16; i++) {
+        float best = 1e30f;
+        for (int p = 0; p < 16; p++) {
+            float distance = 0.0f;
+            for (int c = 0; c < 3; c++) {
+                float d = (float)(((64 - bptcWeights4[p]) * e0[c] + bptcWeights4[p] * e1[c] + 32) >> 6) - pixels[i][c];
+                distance += d * d;
+            }
+            if (distance < best) {
+                best = distance;
+                indices[i] = p;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+// pixels are linear RGB floats; negative values clamp to zero (this is the unsigned variant)
+inline void encodeBC6H(const float rgb[16][4], int preset, unsigned char out[16])
+{
+    float pixels[16][4];
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            pixels[i][c] = floatToHalf(std::max(rgb[i][c], 0.0f)) * (64.0f / 31.0f);
+    float f0[4], f1[4];
+    fitEndpoints(pixels, 3, f0, f1);
+    float bestError = 1e30f;
+    int best0[3] = { 0, 0, 0 }, best1[3] = { 0, 0, 0 }, bestIndices[16] = {};
+    for (int iteration = 0; iteration < (preset == COMPRESS_QUALITY ? 3 : 1); iteration++) {
+        int q0[3], q1[3], indices[16];
+        for (int c = 0; c < 3; c++) {
+            q0[c] = bc6hQuantize(f0[c]);
+            q1[c] = bc6hQuantize(f1[c]);
+        }
+        float error = bc6hEvaluate(pixels, q0, q1, indices);
+        if (error < bestError) {
+            bestError = error;
+            memcpy(best0, q0, sizeof(best0));
+            memcpy(best1, q1, sizeof(best1));
+            memcpy(bestIndices, indices, sizeof(bestIndices));
+        }
+        float weights[16];
+        for (int i = 0; i < 16; i++)
+            weights[i] = bptcWeights4[indices[i]] / 64.0f;
+        if (error == 0.0f || !refitEndpoints(pixels, 3, weights, f0, f1))
+            break;
+    }
+    if (bestIndices[0] >= 8) {
+        std::swap(best0, best1);
+        for (int i = 0; i < 16; i++)
+            bestIndices[i] = 15 - bestIndices[i];
+    }
+    memset(out, 0, 16);
+    BlockBits bits(out);
+    bits.write(3, 5); // mode 11: one region, 10-bit endpoints stored as they are
+    for (int c = 0; c < 3; c++)
+        bits.write(best0[c], 10);
+    for (int c = 0; c < 3; c++)
+        bits.write(best1[c], 10);
+    bits.write(bestIndices[0], 3);
+    for (int i = 1; i < 16; i++)
+        bits.write(bestIndices[i], 4);
+}
+
+// ---- decoders, for what the encoders above write ----
+
+inline void decodeBC1Color(const unsigned char *block, unsigned char rgba[16][4], bool alwaysFourColors)
+{
+    unsigned short color0 = (unsigned short)(block[0] | block[1] << 8), color1 = (unsigned short)(block[2] | block[3] << 8);
+    int palette[4][3];
+    bc1Palette(color0, color1, palette);
+    if (!alwaysFourColors && color0 <= color1)
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    unsigned int indices = block[4] | block[5] << 8 | block[6] << 16 | (unsigned int)block[7] << 24;
+    for (int i = 0; i < 16; i++) {
+        int index = indices >> (2 * i) & 3;
+        for (int c = 0; c < 3; c++)
+            rgba[i][c] = (unsigned char)palette[index][c];
+        rgba[i][3] = 255;
+    }
+}
+
+inline void decodeBC3Alpha(const unsigned char *block, unsigned char rgba[16][4])
+{
+    int palette[8];
+    bc3AlphaPalette(block[0], block[1], palette);
+    unsigned long long indices = 0;
+    for (int b = 0; b < 6; b++)
+        indices |= (unsigned long long)block[2 + b] << (8 * b);
+    for (int i = 0; i < 16; i++)
+        rgba[i][3] = (unsigned char)palette[indices >> (3 * i) & 7];
+}
+
+// mode 6 only; any other mode decodes to magenta
+inline void decodeBC7(const unsigned char *block, unsigned char rgba[16][4])
+{
+    BlockBits bits(const_cast<unsigned char *>(block));
+    if (bits.read(7) != 1u << 6) {
+        for (int i = 0; i < 16; i++)
+            rgba[i][0] = 255, rgba[i][1] = 0, rgba[i][2] = 255, rgba[i][3] = 255;
+        return;
+    }
+    int e0[4], e1[4];
+    for (int c = 0; c < 4; c++) {
+        e0[c] = bits.read(7) << 1;
+        e1[c] = bits.read(7) << 1;
+    }
+    int p0 = bits.read(1), p1 = bits.read(1);
+    for (int c = 0; c < 4; c++) {
+        e0[c] |= p0;
+        e1[c] |= p1;
+    }
+    for (int i = 0; i < 16; i++) {
+        int w = bptcWeights4[bits.read(i == 0 ? 3 : 4)];
+        for (int c = 0; c < 4; c++)
+            rgba[i][c] = (unsigned char)(((64 - w) * e0[c] + w * e1[c] + 32) >> 6);
+    }
+}
+
+// mode 11 only, to half floats; any other mode decodes to zero
+inline void decodeBC6H(const unsigned char *block, unsigned short rgb[16][3])
+{
+    BlockBits bits(const_cast<unsigned char *>(block));
+    if (bits.read(5) != 3) {
+        memset(rgb, 0, sizeof(unsigned short) * 16 * 3);
+        return;
+    }
+    int e0[3], e1[3];
+    for (int c = 0; c < 3; c++)
+        e0[c] = bc6hUnquantize(bits.read(10));
+    for (int c = 0; c < 3; c++)
+        e1[c] = bc6hUnquantize(bits.read(10));
+    for (int i = 0; i < 16; i++) {
+        int w = bptcWeights4[bits.read(i == 0 ? 3 : 4)];
+        for (int c = 0; c < 3; c++)
+            rgb[i][c] = (unsigned short)(((((64 - w) * e0[c] + w * e1[c] + 32) >> 6) * 31) >> 6);
+    }
+}
+
+// ---- whole images ----
+
+inline int blocksAcross(int size) { return (size + 3) / 4; }
+
+inline size_t compressedLevelBytes(int format, int width, int height)
+{
+    return (size_t)blocksAcross(width) * blocksAcross(height) * blockBytes(format);
+}
+
+/*
+    Compresses an 8-bit image with components 3 or 4 (RGB images get alpha 255) into format, which
+    must not be BC6H. Blocks hanging over the right or bottom edge repeat the last column or row.
+    Block rows are spread over threads (0 = one per core).
+*/
+inline void compressImage(const unsigned char *pixels, int width, int height, int components, int format, int preset,
+                          vector<unsigned char> &blocks, int threads = 0)
+{
+    int across = blocksAcross(width), down = blocksAcross(height), size = blockBytes(format);
+    blocks.assign((size_t)across * down * size, 0);
+    parallelFor(down, threads, [&](int by, int) {
+        for (int bx = 0; bx < across; bx++) {
+            float block[16][4];
+            for (int i = 0; i < 16; i++) {
+                int x = std::min(bx * 4 + (i & 3), width - 1), y = std::min(by * 4 + (i >> 2), height - 1);
+                const unsigned char *p = pixels + ((size_t)y * width + x) * components;
+                for (int c = 0; c < 4; c++)
+                    block[i][c] = c < components ? p[c] : 255.0f;
+            }
+            unsigned char *out = &blocks[((size_t)by * across + bx) * size];
+            if (format == BLOCK_BC1) {
+                encodeBC1Color(block, preset, out);
+            } else if (format == BLOCK_BC3) {
+                encodeBC3Alpha(block, preset, out);
+                encodeBC1Color(block, preset, out + 8);
+            } else {
+                encodeBC7(block, preset, out);
+            }
+        }
+    });
+}
+
+// linear RGB floats (3 per texel) to BC6H
+inline void compressImageHDR(const float *pixels, int width, int height, int preset, vector<unsigned char> &blocks, int threads = 0)
+{
+    int across = blocksAcross(width), down = blocksAcross(height);
+    blocks.assign((size_t)across * down * 16, 0);
+    parallelFor(down, threads, [&](int by, int) {
+        for (int bx = 0; bx < across; bx++) {
+            float block[16][4];
+            for (int i = 0; i < 16; i++) {
+                int x = std::min(bx * 4 + (i & 3), width - 1), y = std::min(by * 4 + (i >> 2), height - 1);
+                for (int c = 0; c < 3; c++)
+                    block[i][c] = pixels[((size_t)y * width + x) * 3 + c];
+                block[i][3] = 0.0f;
+            }
+            encodeBC6H(block, preset, &blocks[((size_t)by * across + bx) * 16]);
+        }
+    });
+}
+
+// back to RGBA8 (BC1, BC3, BC7)
+inline void decompressImage(const vector<unsigned char> &blocks, int width, int height, int format, vector<unsigned char> &rgba)
+{
+    int across = blocksAcross(width), size = blockBytes(format);
+    rgba.assign((size_t)width * height * 4, 0);
+    for (int by = 0; by < blocksAcross(height); by++)
+        for (int bx = 0; bx < across; bx++) {
+            const unsigned char *block = &blocks[((size_t)by * across + bx) * size];
+            unsigned char texels[16][4];
+            if (format == BLOCK_BC1) {
+                decodeBC1Color(block, texels, false);
+            } else if (format == BLOCK_BC3) {
+                decodeBC1Color(block + 8, texels, true);
+                decodeBC3Alpha(block, texels);
+            } else {
+                decodeBC7(block, texels);
+            }
+            for (int i = 0; i < 16; i++) {
+                int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+                if (x < width && y < height)
+                    memcpy(&rgba[((size_t)y * width + x) * 4], texels[i], 4);
+            }
+        }
+}
+
+// BC6H back to RGB floats
+inline void decompressImageHDR(const vector<unsigned char> &blocks, int width, int height, vector<float> &rgb)
+{
+    int across = blocksAcross(width);
+    rgb.assign((size_t)width * height * 3, 0.0f);
+    for (int by = 0; by < blocksAcross(height); by++)
+        for (int bx = 0; bx < across; bx++) {
+            unsigned short texels[16][3];
+            decodeBC6H(&blocks[((size_t)by * across + bx) * 16], texels);
+            for (int i = 0; i < 16; i++) {
+                int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+                if (x < width && y < height)
+                    for (int c = 0; c < 3; c++)
+                        rgb[((size_t)y * width + x) * 3 + c] = halfToFloat(texels[i][c]);
+            }
+        }
+}
+
+// PSNR of the first channels of two images, in dB (100 when they're identical)
+inline double imagePSNR(const unsigned char *a, int aComponents, const unsigned char *b, int bComponents, size_t texels, int channels)
+{
+    double squared = 0.0;
+    for (size_t i = 0; i < texels; i++)
+        for (int c = 0; c < channels; c++) {
+            double d = (double)a[i * aComponents + c] - b[i * bComponents + c];
+            squared += d * d;
+        }
+    if (squared == 0.0)
+        return 100.0;
+    return 10.0 * std::log10(255.0 * 255.0 / (squared / (texels * channels)));
+}
+
+// A compressed texture with its mip levels, what goes to glCompressedTexImage2D and to the cache
+struct CompressedTexture {
+    int format;      // a BlockFormat, -1 = nothing compressed
+    int preset;
+    int width, height;
+    float psnr;      // of level 0 against the source, RGB (and alpha where the format keeps it)
+    vector<vector<unsigned char> > levels;
+
+    CompressedTexture() : format(-1), preset(COMPRESS_FAST), width(0), height(0), psnr(0.0f) {}
+
+    bool empty() const { return levels.empty(); }
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+            total += levels[i].size();
+        return total;
+    }
+};
+
+// What the loaders compress to; set from the command line once GL is up (it asks the driver what it takes)
+struct TextureCompression {
+    bool enabled;
+    int preset;
+    int forcedFormat;   // -1 = BC7 for quality, BC1/BC3 for fast
+    bool cache;
+    int threads;        // per texture; the loaders already decode several textures at once
+    bool supported[BLOCK_FORMAT_COUNT];
+
+    TextureCompression() : enabled(false), preset(COMPRESS_FAST), forcedFormat(-1), cache(true), threads(0)
+    {
+        for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+            supported[f] = false;
+    }
+
+    // the format for an 8-bit texture with this many components, -1 = leave it uncompressed
+    int formatFor(int components) const
+    {
+        if (!enabled || components < 3)
+            return -1;
+        int format = forcedFormat >= 0 ? forcedFormat : preset == COMPRESS_QUALITY ? BLOCK_BC7 : components == 4 ? BLOCK_BC3 : BLOCK_BC1;
+        return format != BLOCK_BC6H && supported[format] ? format : -1;
+    }
+};
+
+inline TextureCompression &textureCompression()
+{
+    static TextureCompression settings;
+    return settings;
+}
+
+// which block formats the driver takes, from its list of compressed formats and its extensions
+inline void queryCompressedFormats(bool supported[BLOCK_FORMAT_COUNT])
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+    vector<GLint> formats(std::max(count, 1));
+    if (count > 0)
+        glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    bool s3tc = false, bptc = false;
+    for (GLint i = 0; i < extensionCount; i++) {
+        string name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        s3tc = s3tc || name == "GL_EXT_texture_compression_s3tc";
+        bptc = bptc || name == "GL_ARB_texture_compression_bptc";
+    }
+    for (int f = 0; f < BLOCK_FORMAT_COUNT; f++) {
+        supported[f] = f == BLOCK_BC1 || f == BLOCK_BC3 ? s3tc : bptc;
+        for (GLint i = 0; i < count; i++)
+            supported[f] = supported[f] || (GLenum)formats[i] == blockFormatGL(f);
+    }
+}
+
+inline int parseBlockFormat(const string &name)
+{
+    for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+        if (name == blockFormatName(f))
+            return f;
+    return -1;
+}
+
+// --compress fast|quality [--compress-format bc1|bc3|bc7] [--no-compress-cache]; needs the GL context
+inline void configureTextureCompression(int argc, char *argv[])
+{
+    TextureCompression &settings = textureCompression();
+    string preset = argValue(argc, argv, "--compress", "");
+    if (preset.empty())
+        return;
+    settings.enabled = true;
+    settings.preset = preset == "quality" ? COMPRESS_QUALITY : COMPRESS_FAST;
+    settings.forcedFormat = parseBlockFormat(argValue(argc, argv, "--compress-format", ""));
+    settings.cache = !hasArg(argc, argv, "--no-compress-cache");
+    queryCompressedFormats(settings.supported);
+    for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+        if (!settings.supported[f])
+            cout << "WARNING::TEXCOMPRESS:: the driver doesn't take " << blockFormatName(f)
+                 << ", textures that would use it stay uncompressed" << endl;
+}
+
+// right.jpg -> right.jpg.quality.bc, or right.jpg.quality.box-srgb.bc with the mips of mipCacheTag()
+inline string compressedCachePath(const string &source, const TextureCompression &settings, const string &mipTag)
+{
+    string name = compressPresetName(settings.preset);
+    if (settings.forcedFormat >= 0)
+        name = string(blockFormatName(settings.forcedFormat)) + "-" + name;
+    if (!mipTag.empty())
+        name += "." + mipTag;
+    return source + "." + name + ".bc";
+}
+
+/*
+    Cache layout, little endian: "BCT1", format, preset, width, height, level count, source hash,
+    psnr, then per level its byte count and the blocks.
+*/
+inline bool saveCompressedTexture(const string &path, const CompressedTexture &texture, unsigned int sourceHash)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    int header[5] = { texture.format, texture.preset, texture.width, texture.height, (int)texture.levels.size() };
+    file.write("BCT1", 4);
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)&sourceHash, sizeof(sourceHash));
+    file.write((const char *)&texture.psnr, sizeof(texture.psnr));
+    for (size_t i = 0; i < texture.levels.size(); i++) {
+        unsigned int size = (unsigned int)texture.levels[i].size();
+        file.write((const char *)&size, sizeof(size));
+        file.write((const char *)texture.levels[i].data(), size);
+    }
+    return (bool)file;
+}
+
+inline bool loadCompressedTexture(const string &path, unsigned int sourceHash, CompressedTexture &texture)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    char magic[4];
+    int header[5];
+    unsigned int hash = 0;
+    file.read(magic, 4);
+    file.read((char *)header, sizeof(header));
+    file.read((char *)&hash, sizeof(hash));
+    file.read((char *)&texture.psnr, sizeof(texture.psnr));
+    if (!file || string(magic, 4) != "BCT1" || hash != sourceHash || header[0] < 0 || header[0] >= BLOCK_FORMAT_COUNT ||
+        header[4] < 1 || header[4] > 16)
+        return false;
+    texture.format = header[0];
+    texture.preset = header[1];
+    texture.width = header[2];
+    texture.height = header[3];
+    texture.levels.resize(header[4]);
+    for (int i = 0; i < header[4]; i++) {
+        unsigned int size = 0;
+        file.read((char *)&size, sizeof(size));
+        int width = std::max(texture.width >> i, 1), height = std::max(texture.height >> i, 1);
+        if (!file || size != compressedLevelBytes(texture.format, width, height))
+            return false;
+        texture.levels[i].resize(size);
+        file.read((char *)texture.levels[i].data(), size);
+    }
+    return (bool)file;
+}
+
+// the cached blocks for source (with the mips of mipTag) if the settings want it compressed and the cache matches the file
+inline bool loadCachedTexture(const string &source, const string &mipTag, CompressedTexture &texture)
+{
+    const TextureCompression &settings = textureCompression();
+    if (!settings.enabled || !settings.cache)
+        return false;
+    CompressedTexture cached;
+    if (!loadCompressedTexture(compressedCachePath(source, settings, mipTag), fileHash(source), cached) ||
+        cached.format < 0 || !settings.supported[cached.format])
+        return false;
+    texture = cached;
+    cout << "Loaded " << source << " as " << blockFormatName(texture.format) << " from the cache, PSNR " << texture.psnr
+         << " dB, " << MemoryRegistry::formatBytes(texture.bytes()) << endl;
+    return true;
+}
+
+/*
+    Compresses freshly decoded pixels (stbi_load layout), and the rest of mips if there are any
+    (mipgen.hpp, made with mipTag), reports it and writes the cache. False, leaving texture empty, if
+    the settings keep this one uncompressed.
+*/
+inline bool compressDecoded(const string &source, const unsigned char *pixels, int width, int height, int components,
+                            const MipChain *mips, const string &mipTag, CompressedTexture &texture)
+{
+    const TextureCompression &settings = textureCompression();
+    int format = settings.formatFor(components);
+    if (!pixels || format < 0)
+        return false;
+    auto start = std::chrono::steady_clock::now();
+    texture.format = format;
+    texture.preset = settings.preset;
+    texture.width = width;
+    texture.height = height;
+    texture.levels.assign(1, vector<unsigned char>());
+    compressImage(pixels, width, height, components, format, settings.preset, texture.levels[0], settings.threads);
+    double texels = (double)width * height;
+    bool mipmapped = mips && mips->levels.size() > 1;
+    for (size_t i = 1; mipmapped && i < mips->levels.size(); i++) {
+        texture.levels.push_back(vector<unsigned char>());
+        compressImage(mips->levels[i].data(), mips->levelWidth((int)i), mips->levelHeight((int)i), components, format,
+                      settings.preset, texture.levels.back(), settings.threads);
+        texels += (double)mips->levelWidth((int)i) * mips->levelHeight((int)i);
+    }
+    //the whole chain, the mips are a third more work on top of level 0
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    vector<unsigned char> decoded;
+    decompressImage(texture.levels[0], width, height, format, decoded);
+    int channels = format == BLOCK_BC1 || components == 3 ? 3 : 4;
+    texture.psnr = (float)imagePSNR(pixels, components, &decoded[0], 4, (size_t)width * height, channels);
+    if (settings.cache)
+        saveCompressedTexture(compressedCachePath(source, settings, mipTag), texture, fileHash(source));
+
+    size_t uncompressed = textureBytes(components == 4 ? GL_RGBA : GL_RGB, width, height, 1, mipmapped);
+    ostringstream report;
+    report << "Compressed " << source << " to " << blockFormatName(format) << " (" << compressPresetName(settings.preset)
+           << ") in " << ms << " ms" << (mipmapped ? " with mips, " : ", ") << texels / (ms * 1000.0) << " Mpixels/s, PSNR " << texture.psnr
+           << " dB, " << MemoryRegistry::formatBytes(texture.bytes()) << " instead of " << MemoryRegistry::formatBytes(uncompressed) << endl;
+    cout << report.str();
+    return true;
+}
+
+// uploads every level of texture to target (a 2D texture or one cubemap face), which must be bound
+inline void uploadCompressedTexture(GLenum target, const CompressedTexture &texture, bool srgb = false)
+{
+    for (size_t i = 0; i < texture.levels.size(); i++) {
+        int width = std::max(texture.width >> (int)i, 1), height = std::max(texture.height >> (int)i, 1);
+        stagedCompressedTexImage2D(target, (GLint)i, blockFormatGL(texture.format, srgb), width, height, texture.levels[i].data(),
+                                   texture.levels[i].size());
+    }
+}
+
+#endif /* texcompress_hpp */
@@ -0,0 +1,214 @@
+//
+//  texcompressbench.hpp
+//  RefractionProject
+//
+//  Measures the block compressors of texcompress.hpp on the skybox faces (or any image): encode
+//  throughput, PSNR and the memory saved per format and preset. Then, if the driver takes the format,
+//  uploads the blocks with glCompressedTexImage2D and reads them back, to check that our decoder (which the PSNR
+//  comes from) agrees with the driver's. BC6H gets the faces as HDR, linearized and scaled by 4 so
+//  the bright parts go past 1; its PSNR is measured after undoing that.
+//
+//  RefractionProject --bench-compress [--skybox skybox/space2] [--faces 6] [--image path]
+//                    [--formats bc1,bc3,bc7,bc6h] [--preset fast|quality|both] [--threads N] [--no-gl] [--software]
+//
+
+#ifndef texcompressbench_hpp
+#define texcompressbench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "renderer.hpp"
+#include "texcompress.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct CompressResult {
+    double ms, psnr, bytes, uncompressed, pixels;
+    int glDifference;    // largest difference from the driver's decode, 8-bit steps (BC6H: 1/1000 relative); -1 = not checked
+};
+
+// the 8-bit sRGB image as linear HDR floats, RGB
+inline void hdrFromImage(const unsigned char *pixels, size_t texels, int components, vector<float> &hdr)
+{
+    hdr.resize(texels * 3);
+    for (size_t i = 0; i < texels; i++)
+        for (int c = 0; c < 3; c++)
+            hdr[i * 3 + c] = 4.0f * std::pow(pixels[i * components + std::min(c, components - 1)] / 255.0f, 2.2f);
+}
+
+// what the driver makes of the blocks, compared with decoded (RGBA8, or RGB floats for BC6H)
+inline int compareWithDriver(int format, const vector<unsigned char> &blocks, int width, int height,
+                             const vector<unsigned char> &decoded, const vector<float> &decodedHDR)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glCompressedTexImage2D(GL_TEXTURE_2D, 0, blockFormatGL(format), width, height, 0, (GLsizei)blocks.size(), blocks.data());
+    int difference = 0;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (format == BLOCK_BC6H) {
+        vector<float> driver((size_t)width * height * 3);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, driver.data());
+        for (size_t i = 0; i < driver.size(); i++) {
+            float relative = std::fabs(driver[i] - decodedHDR[i]) / std::max(std::fabs(decodedHDR[i]), 1e-3f);
+            difference = std::max(difference, (int)(relative * 1000.0f + 0.5f));
+        }
+    } else {
+        vector<unsigned char> driver((size_t)width * height * 4);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, driver.data());
+        for (size_t i = 0; i < driver.size(); i++)
+            difference = std::max(difference, std::abs((int)driver[i] - (int)decoded[i]));
+    }
+    glDeleteTextures(1, &texture);
+    return glGetError() == GL_NO_ERROR ? difference : -1;
+}
+
+inline CompressResult benchmarkCompression(const unsigned char *pixels, int width, int height, int components, int format,
+                                           int preset, int threads, bool checkDriver)
+{
+    CompressResult result;
+    size_t texels = (size_t)width * height;
+    result.pixels = (double)texels;
+    result.uncompressed = (double)textureBytes(components == 4 ? GL_RGBA : GL_RGB, width, height);
+    vector<unsigned char> blocks, decoded;
+    vector<float> hdr, decodedHDR;
+    if (format == BLOCK_BC6H) {
+        hdrFromImage(pixels, texels, components, hdr);
+        result.uncompressed = (double)textureBytes(GL_RGB16F, width, height);
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (format == BLOCK_BC6H)
+        compressImageHDR(hdr.data(), width, height, preset, blocks, threads);
+    else
+        compressImage(pixels, width, height, components, format, preset, blocks, threads);
+    result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    result.bytes = (double)blocks.size();
+
+    if (format == BLOCK_BC6H) {
+        decompressImageHDR(blocks, width, height, decodedHDR);
+        decoded.resize(texels * 4);
+        for (size_t i = 0; i < texels; i++) {
+            for (int c = 0; c < 3; c++)
+                decoded[i * 4 + c] = (unsigned char)(std::min(std::pow(decodedHDR[i * 3 + c] / 4.0f, 1.0f / 2.2f), 1.0f) * 255.0f + 0.5f);
+            decoded[i * 4 + 3] = 255;
+        }
+    } else {
+        decompressImage(blocks, width, height, format, decoded);
+    }
+    int channels = format == BLOCK_BC1 || format == BLOCK_BC6H || components == 3 ? 3 : 4;
+    result.psnr = imagePSNR(pixels, components, decoded.data(), 4, texels, channels);
+    result.glDifference = checkDriver ? compareWithDriver(format, blocks, width, height, decoded, decodedHDR) : -1;
+    return result;
+}
+
+inline int runCompressionBenchmark(int argc, char *argv[])
+{
+    string skybox = argValue(argc, argv, "--skybox", "skybox/space2");
+    string image = argValue(argc, argv, "--image", "");
+    int faces = std::min(std::max((int)argNumber(argc, argv, "--faces", 6), 1), 6);
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    string presetName = argValue(argc, argv, "--preset", "both");
+    bool useGL = !hasArg(argc, argv, "--no-gl");
+    vector<int> formats;
+    string formatList = argValue(argc, argv, "--formats", "bc1,bc3,bc7,bc6h") + ",";
+    for (size_t start = 0, comma; (comma = formatList.find(',', start)) != string::npos; start = comma + 1) {
+        int format = parseBlockFormat(formatList.substr(start, comma - start));
+        if (format >= 0)
+            formats.push_back(format);
+    }
+    vector<int> presets;
+    if (presetName != "quality")
+        presets.push_back(COMPRESS_FAST);
+    if (presetName != "fast")
+        presets.push_back(COMPRESS_QUALITY);
+    vector<string> sources;
+    if (!image.empty())
+        sources.push_back(image);
+    else
+        sources = skyboxFaces(skybox);
+    sources.resize(std::min((int)sources.size(), image.empty() ? faces : 1));
+
+    GLFWwindow *window = 0;
+    bool supported[BLOCK_FORMAT_COUNT] = {};
+    if (useGL) {
+        window = createHeadlessContext(hasArg(argc, argv, "--software"));
+        if (!window)
+            return -1;
+        queryCompressedFormats(supported);
+    }
+
+    cout << "Block compression, " << (threads > 0 ? threads : hardwareThreads()) << " threads";
+    if (useGL) {
+        cout << ", the driver takes";
+        for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+            if (supported[f])
+                cout << " " << blockFormatName(f);
+    }
+    cout << endl;
+    cout << left << setw(26) << "image" << setw(6) << "fmt" << setw(9) << "preset" << right << setw(10) << "ms"
+         << setw(11) << "Mpixels/s" << setw(9) << "PSNR" << setw(11) << "MB" << setw(11) << "saved MB" << setw(9)
+         << "vs GL" << endl;
+    CompressResult empty = CompressResult();
+    empty.glDifference = -1; // until a source checks it
+    vector<CompressResult> totals(formats.size() * presets.size(), empty);
+    for (size_t s = 0; s < sources.size(); s++) {
+        int width, height, components;
+        unsigned char *pixels = stbi_load(sources[s].c_str(), &width, &height, &components, 0);
+        if (!pixels || components < 3) {
+            cout << "ERROR::TEXCOMPRESS:: " << sources[s] << " is missing or has fewer than 3 channels" << endl;
+            stbi_image_free(pixels);
+            continue;
+        }
+        for (size_t f = 0; f < formats.size(); f++)
+            for (size_t p = 0; p < presets.size(); p++) {
+                CompressResult r = benchmarkCompression(pixels, width, height, components, formats[f], presets[p], threads,
+                                                        useGL && supported[formats[f]]);
+                CompressResult &total = totals[f * presets.size() + p];
+                total.ms += r.ms;
+                total.pixels += r.pixels;
+                total.psnr += r.psnr / sources.size();
+                total.bytes += r.bytes;
+                total.uncompressed += r.uncompressed;
+                total.glDifference = std::max(total.glDifference, r.glDifference);
+                string name = sources[s].size() > 25 ? sources[s].substr(sources[s].size() - 25) : sources[s];
+                cout << left << setw(26) << name << setw(6) << blockFormatName(formats[f]) << setw(9) << compressPresetName(presets[p])
+                     << right << fixed << setprecision(1) << setw(10) << r.ms << setw(11) << r.pixels / (r.ms * 1000.0)
+                     << setprecision(2) << setw(9) << r.psnr << setw(11) << r.bytes / 1048576.0 << setw(11)
+                     << (r.uncompressed - r.bytes) / 1048576.0 << setw(9);
+                if (r.glDifference >= 0)
+                    cout << r.glDifference << endl;
+                else
+                    cout << "-" << endl;
+                cout.unsetf(ios::floatfield);
+            }
+        stbi_image_free(pixels);
+    }
+    cout << "Totals:" << endl;
+    for (size_t f = 0; f < formats.size(); f++)
+        for (size_t p = 0; p < presets.size(); p++) {
+            const CompressResult &total = totals[f * presets.size() + p];
+            cout << "  " << left << setw(6) << blockFormatName(formats[f]) << setw(9) << compressPresetName(presets[p]) << right
+                 << fixed << setprecision(1) << total.pixels / (total.ms * 1000.0) << " Mpixels/s, PSNR " << setprecision(2)
+                 << total.psnr << " dB, " << total.bytes / 1048576.0 << " MB instead of " << total.uncompressed / 1048576.0
+                 << " MB (" << setprecision(1) << total.uncompressed / std::max(total.bytes, 1.0) << "x)";
+            if (total.glDifference >= 0)
+                cout << ", driver decode within " << total.glDifference << (formats[f] == BLOCK_BC6H ? "/1000" : " steps");
+            cout << endl;
+            cout.unsetf(ios::floatfield);
+        }
+    if (window)
+        destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* texcompressbench_hpp */
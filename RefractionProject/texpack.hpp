@@ -0,0 +1,404 @@
+//
+//  texpack.hpp
+//  RefractionProject
+//
+//  Texture packs: a texture (or the six faces of a skybox) stored the way GL wants it, every mip level of
+//  every face already decoded (or block-compressed, texcompress.hpp) and filtered (mipgen.hpp). Loading
+//  one is an mmap: the level slices are passed straight from the mapping to glTexImage2D or
+//  glCompressedTexImage2D, so nothing is decoded, filtered or copied on the way, and the pages the driver
+//  doesn't read yet aren't read from disk yet. (With --staging-ring-mb they are copied into the staging
+//  ring on the way, stagingring.hpp.)
+//
+//  The pack for a setting sits next to its sources, named after the same tags as the other caches:
+//  skybox/sky/cubemap.box-srgb.tpk, models/backpack/ao.jpg.bc1-fast.box-srgb.tpk. It is only used while
+//  the sources have the size and modification time it was made from (it doesn't hash them, that would
+//  read every JPEG again). Packs are made ahead of time with --pack-textures (texpackbench.hpp); the
+//  loaders use one whenever it's there.
+//
+//  RefractionProject [--no-texture-packs]
+//
+
+#ifndef texpack_hpp
+#define texpack_hpp
+
+#include <glad/glad.h>
+
+#include "cmdline.hpp"
+#include "memory.hpp"
+#include "mipgen.hpp"
+#include "stagingring.hpp"
+#include "texcompress.hpp"
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct TexturePackSettings {
+    bool enabled;
+
+    TexturePackSettings() : enabled(true) {}
+};
+
+inline TexturePackSettings &texturePackSettings()
+{
+    static TexturePackSettings settings;
+    return settings;
+}
+
+// --no-texture-packs decodes the sources even where there is a pack
+inline void configureTexturePacks(int argc, char *argv[])
+{
+    texturePackSettings().enabled = !hasArg(argc, argv, "--no-texture-packs");
+}
+
+// A read-only mapping of a whole file, unmapped when the last copy goes
+class MappedFile {
+public:
+    MappedFile() : data(0), size(0) {}
+    ~MappedFile()
+    {
+        if (data)
+            munmap((void *)data, size);
+    }
+
+    bool open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        void *mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+            mapped = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // the mapping keeps the file
+        if (mapped == MAP_FAILED)
+            return false;
+        data = (const unsigned char *)mapped;
+        size = (size_t)info.st_size;
+        return true;
+    }
+
+    const unsigned char *data;
+    size_t size;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+/*
+    File layout, little endian, 256-byte aligned slices:
+      "TPK1", faces, levels, width, height, internal format, format, type (0 = compressed), stamp, 0,
+      then a table of offset and byte count (two uint64 each) per face per level, face by face,
+      then the slices.
+    The formats are the GL enums; internal format is the linear one, the loaders pick the sRGB one.
+*/
+struct TexturePack {
+    std::shared_ptr<MappedFile> file;
+    int faces, levels, width, height;
+    GLenum internalFormat, format, type;
+    vector<unsigned long long> table;
+
+    TexturePack() : faces(0), levels(0), width(0), height(0), internalFormat(0), format(0), type(0) {}
+
+    bool empty() const { return !file; }
+    bool compressed() const { return type == 0; }
+    int levelWidth(int level) const { return std::max(width >> level, 1); }
+    int levelHeight(int level) const { return std::max(height >> level, 1); }
+    const unsigned char *slice(int face, int level) const { return file->data + table[(face * levels + level) * 2]; }
+    size_t sliceBytes(int face, int level) const { return (size_t)table[(face * levels + level) * 2 + 1]; }
+    size_t bytes() const { return file ? file->size : 0; }
+};
+
+static const size_t texturePackAlignment = 256;
+static const int texturePackHeaderInts = 9;
+
+// size and modification time of every source, what a pack checks instead of a hash
+inline unsigned int sourceStamp(const vector<string> &sources)
+{
+    unsigned int stamp = 2166136261u;
+    for (size_t i = 0; i < sources.size(); i++) {
+        struct stat info;
+        if (stat(sources[i].c_str(), &info) != 0)
+            return 0;
+        unsigned long long values[2] = { (unsigned long long)info.st_size, (unsigned long long)info.st_mtime };
+        const unsigned char *bytes = (const unsigned char *)values;
+        for (size_t b = 0; b < sizeof(values); b++)
+            stamp = (stamp ^ bytes[b]) * 16777619u;
+    }
+    return stamp;
+}
+
+// "bc1-fast.box-srgb", "box-srgb", ... from the compression and mip settings; "level0" with neither
+inline string texturePackTag(const string &mipTag)
+{
+    const TextureCompression &compression = textureCompression();
+    string tag;
+    if (compression.enabled) {
+        tag = compressPresetName(compression.preset);
+        if (compression.forcedFormat >= 0)
+            tag = string(blockFormatName(compression.forcedFormat)) + "-" + tag;
+    }
+    if (!mipTag.empty())
+        tag += (tag.empty() ? "" : ".") + mipTag;
+    return tag.empty() ? "level0" : tag;
+}
+
+// the mips the loaders want: compressed textures always get some, cubemap faces are filtered in linear light
+inline string texturePackMipTag(bool srgb)
+{
+    int filter = mipSettings().filter;
+    if (filter == MIP_NONE && textureCompression().enabled)
+        filter = MIP_BOX;
+    return mipCacheTag(filter, srgb);
+}
+
+inline string imagePackPath(const string &source, bool gamma)
+{
+    return source + "." + texturePackTag(texturePackMipTag(gamma)) + ".tpk";
+}
+
+inline string cubemapPackPath(const string &folder)
+{
+    return folder + "/cubemap." + texturePackTag(texturePackMipTag(true)) + ".tpk";
+}
+
+// writes the slices (face by face, level by level) with their header
+inline bool writeTexturePack(const string &path, int faces, int levels, int width, int height, GLenum internalFormat, GLenum format,
+                             GLenum type, unsigned int stamp, const vector<const unsigned char *> &slices, const vector<size_t> &sizes)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file || (int)slices.size() != faces * levels)
+        return false;
+    unsigned int header[texturePackHeaderInts] = { (unsigned int)faces, (unsigned int)levels, (unsigned int)width, (unsigned int)height,
+                                                   internalFormat, format, type, stamp, 0 };
+    vector<unsigned long long> table(slices.size() * 2);
+    size_t offset = 4 + sizeof(header) + table.size() * sizeof(unsigned long long);
+    for (size_t i = 0; i < slices.size(); i++) {
+        offset = (offset + texturePackAlignment - 1) / texturePackAlignment * texturePackAlignment;
+        table[i * 2] = offset;
+        table[i * 2 + 1] = sizes[i];
+        offset += sizes[i];
+    }
+    file.write("TPK1", 4);
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)table.data(), table.size() * sizeof(unsigned long long));
+    static const char padding[texturePackAlignment] = { 0 };
+    for (size_t i = 0; i < slices.size(); i++) {
+        file.write(padding, (std::streamsize)(table[i * 2] - (unsigned long long)file.tellp()));
+        file.write((const char *)slices[i], (std::streamsize)sizes[i]);
+    }
+    return (bool)file;
+}
+
+// what a level's slice must hold: its blocks, or its texels in rows without padding. 0 for formats packs don't use
+inline size_t texturePackLevelBytes(const TexturePack &pack, int level)
+{
+    int width = pack.levelWidth(level), height = pack.levelHeight(level);
+    if (pack.compressed()) {
+        for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+            if (blockFormatGL(f) == pack.internalFormat)
+                return compressedLevelBytes(f, width, height);
+        return 0;
+    }
+    int components = pack.format == GL_RED ? 1 : pack.format == GL_RG ? 2 : pack.format == GL_RGB ? 3 : pack.format == GL_RGBA ? 4 : 0;
+    int componentBytes = pack.type == GL_UNSIGNED_BYTE ? 1 : pack.type == GL_HALF_FLOAT ? 2 : pack.type == GL_FLOAT ? 4 : 0;
+    return (size_t)width * height * components * componentBytes;
+}
+
+/*
+    Maps a pack and checks it before anything is uploaded from it: the size and levels in the header
+    (cubemap faces square), every table entry inside the file, and every slice exactly the size of its
+    level. A pack that fails is ignored and the sources are decoded. stamp 0 skips the source check.
+*/
+inline bool openTexturePack(const string &path, unsigned int stamp, TexturePack &pack)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path))
+        return false;
+    size_t headerBytes = 4 + texturePackHeaderInts * sizeof(unsigned int);
+    if (file->size < headerBytes || string((const char *)file->data, 4) != "TPK1")
+        return false;
+    unsigned int header[texturePackHeaderInts];
+    memcpy(header, file->data + 4, sizeof(header));
+    if ((stamp && header[7] != stamp) || (header[0] != 1 && header[0] != 6) || header[1] < 1 || header[1] > 16)
+        return false;
+    TexturePack out;
+    out.faces = (int)header[0];
+    out.levels = (int)header[1];
+    out.width = (int)header[2];
+    out.height = (int)header[3];
+    out.internalFormat = header[4];
+    out.format = header[5];
+    out.type = header[6];
+    if (header[2] < 1 || header[3] < 1 || header[2] > 16384 || header[3] > 16384 || (out.faces == 6 && out.width != out.height) ||
+        out.levels > mipLevelCount(out.width, out.height)) {
+        cout << "ERROR::TEXPACK:: " << path << " has a bad size (" << header[2] << "x" << header[3] << ", " << header[1] << " levels)" << endl;
+        return false;
+    }
+    out.table.resize((size_t)out.faces * out.levels * 2);
+    if (file->size < headerBytes + out.table.size() * sizeof(unsigned long long))
+        return false;
+    memcpy(out.table.data(), file->data + headerBytes, out.table.size() * sizeof(unsigned long long));
+    for (size_t i = 0; i < out.table.size(); i += 2)
+        if (out.table[i] > file->size || out.table[i + 1] > file->size - out.table[i])
+            return false;
+    for (int face = 0; face < out.faces; face++)
+        for (int level = 0; level < out.levels; level++) {
+            size_t expected = texturePackLevelBytes(out, level);
+            if (expected == 0 || out.sliceBytes(face, level) != expected) {
+                cout << "ERROR::TEXPACK:: " << path << " face " << face << " level " << level << " has " << out.sliceBytes(face, level)
+                     << " bytes, " << expected << " expected" << endl;
+                return false;
+            }
+        }
+    out.file = file;
+    pack = out;
+    return true;
+}
+
+// the sRGB internal format for a linear one (what gamma-corrected textures get), itself if there is none
+inline GLenum srgbInternalFormat(GLenum internalFormat)
+{
+    if (internalFormat == GL_RGB)
+        return GL_SRGB8;
+    if (internalFormat == GL_RGBA)
+        return GL_SRGB8_ALPHA8;
+    for (int f = 0; f < BLOCK_FORMAT_COUNT; f++)
+        if (blockFormatGL(f) == internalFormat)
+            return blockFormatGL(f, true);
+    return internalFormat;
+}
+
+// uploads every level of one face from the mapping to target (a 2D texture or a cubemap face), which must be bound
+inline size_t uploadTexturePack(GLenum target, const TexturePack &pack, int face, bool srgb = false)
+{
+    GLenum internalFormat = srgb ? srgbInternalFormat(pack.internalFormat) : pack.internalFormat;
+    size_t bytes = 0;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int level = 0; level < pack.levels; level++) {
+        if (pack.compressed())
+            stagedCompressedTexImage2D(target, level, internalFormat, pack.levelWidth(level), pack.levelHeight(level),
+                                       pack.slice(face, level), pack.sliceBytes(face, level));
+        else
+            stagedTexImage2D(target, level, internalFormat, pack.levelWidth(level), pack.levelHeight(level), pack.format, pack.type,
+                             pack.slice(face, level), pack.sliceBytes(face, level));
+        bytes += pack.sliceBytes(face, level);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return bytes;
+}
+
+// the pack of a skybox folder (faces from skyboxFaces) if there is one for the current settings
+inline bool openCubemapPack(const vector<string> &faces, TexturePack &pack)
+{
+    if (!texturePackSettings().enabled || faces.size() != 6)
+        return false;
+    string folder = faces[0].substr(0, faces[0].find_last_of('/'));
+    if (!openTexturePack(cubemapPackPath(folder), sourceStamp(faces), pack) || pack.faces != 6) {
+        pack = TexturePack();
+        return false;
+    }
+    cout << "Mapped " << cubemapPackPath(folder) << ", " << MemoryRegistry::formatBytes(pack.bytes()) << endl;
+    return true;
+}
+
+inline bool openImagePack(const string &source, bool gamma, TexturePack &pack)
+{
+    if (!texturePackSettings().enabled)
+        return false;
+    if (!openTexturePack(imagePackPath(source, gamma), sourceStamp(vector<string>(1, source)), pack) || pack.faces != 1) {
+        pack = TexturePack();
+        return false;
+    }
+    return true;
+}
+
+/*
+    Makes the pack of a texture (one source) or a skybox (six, in skyboxFaces order) with the current mip and
+    compression settings: decodes, filters and compresses the way the loaders would, then writes it.
+    Skybox faces keep RGB, like the cubemap they go to. Compression needs the GL context (configured first).
+*/
+inline bool packTextures(const vector<string> &sources, bool gamma, const string &path, double *ms = 0)
+{
+    bool cube = sources.size() == 6;
+    bool srgb = cube || gamma;
+    auto start = std::chrono::steady_clock::now();
+    vector<unsigned char *> pixels;
+    int width = 0, height = 0, components = 0;
+    for (size_t i = 0; i < sources.size(); i++) {
+        int w, h, c;
+        unsigned char *data = stbi_load(sources[i].c_str(), &w, &h, &c, cube ? 3 : 0);
+        if (cube)
+            c = 3;
+        if (!data || (i > 0 && (w != width || h != height || c != components))) {
+            cout << "ERROR::TEXPACK:: " << sources[i] << " is missing or doesn't match the other faces" << endl;
+            stbi_image_free(data);
+            for (size_t f = 0; f < pixels.size(); f++)
+                stbi_image_free(pixels[f]);
+            return false;
+        }
+        width = w;
+        height = h;
+        components = c;
+        pixels.push_back(data);
+    }
+    // the mip filter of the tag; compressed textures get box mips like in decodeImage
+    int filter = mipSettings().filter;
+    if (filter == MIP_NONE && textureCompression().enabled)
+        filter = MIP_BOX;
+    srgb = srgb && components >= 3;
+    vector<MipChain> chains(pixels.size());
+    if (filter != MIP_NONE)
+        buildMipChains(&pixels[0], (int)pixels.size(), width, height, components, filter, srgb, &chains[0]);
+    int levels = filter != MIP_NONE ? mipLevelCount(width, height) : 1;
+
+    const TextureCompression &compression = textureCompression();
+    int blockFormat = compression.formatFor(components);
+    vector<vector<unsigned char> > blocks;
+    vector<const unsigned char *> slices;
+    vector<size_t> sizes;
+    if (blockFormat >= 0)
+        blocks.resize(pixels.size() * levels);
+    for (size_t face = 0; face < pixels.size(); face++)
+        for (int level = 0; level < levels; level++) {
+            const unsigned char *data = filter != MIP_NONE ? chains[face].levels[level].data() : pixels[face];
+            int w = std::max(width >> level, 1), h = std::max(height >> level, 1);
+            if (blockFormat >= 0) {
+                vector<unsigned char> &out = blocks[face * levels + level];
+                compressImage(data, w, h, components, blockFormat, compression.preset, out, compression.threads);
+                slices.push_back(out.data());
+                sizes.push_back(out.size());
+            } else {
+                slices.push_back(data);
+                sizes.push_back((size_t)w * h * components);
+            }
+        }
+    GLenum format = components == 1 ? GL_RED : components == 2 ? GL_RG : components == 3 ? GL_RGB : GL_RGBA;
+    GLenum internalFormat = blockFormat >= 0 ? blockFormatGL(blockFormat) : format;
+    bool written = writeTexturePack(path, (int)pixels.size(), levels, width, height, internalFormat, format,
+                                    blockFormat >= 0 ? 0 : GL_UNSIGNED_BYTE, sourceStamp(sources), slices, sizes);
+    for (size_t f = 0; f < pixels.size(); f++)
+        stbi_image_free(pixels[f]);
+    if (ms)
+        *ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!written)
+        cout << "ERROR::TEXPACK:: could not write " << path << endl;
+    return written;
+}
+
+#endif /* texpack_hpp */
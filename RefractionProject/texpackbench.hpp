@@ -0,0 +1,205 @@
+//
+//  texpackbench.hpp
+//  RefractionProject
+//
+//  Makes the texture packs of texpack.hpp, and times loading the skyboxes (and images) from them against
+//  decoding the JPEGs. Both go through the loaders the viewer uses (loadCubemap, decodeImage/uploadTexture)
+//  and wait for the driver. "cold" drops the files from the page cache first, where the system lets us
+//  (posix_fadvise), so the bytes come from the disk; "warm" is the second load.
+//
+//  --pack-textures takes the viewer's defaults (--mips box) so the viewer finds its packs; pass the same
+//  --mips and --compress to both.
+//
+//  RefractionProject --pack-textures [--skyboxes skybox/sky,skybox/space,skybox/space2] [--images models/backpack/ao.jpg]
+//                    [--gamma] [--mips box] [--compress fast|quality] [--software]
+//  RefractionProject --bench-texture-pack [the same] [--repeat 3]
+//
+
+#ifndef texpackbench_hpp
+#define texpackbench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "memory.hpp"
+#include "model.hpp"
+#include "renderer.hpp"
+#include "texpack.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+inline vector<string> packList(int argc, char *argv[], const char *flag, const string &fallback)
+{
+    vector<string> items;
+    string list = argValue(argc, argv, flag, fallback) + ",";
+    for (size_t start = 0, comma; (comma = list.find(',', start)) != string::npos; start = comma + 1)
+        if (comma > start)
+            items.push_back(list.substr(start, comma - start));
+    return items;
+}
+
+inline size_t fileBytes(const string &path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? (size_t)info.st_size : 0;
+}
+
+// asks the system to forget the file's cached pages; false where it can't
+inline bool dropFromPageCache(const string &path)
+{
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool dropped = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return dropped;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+// GL and the viewer's mip and compression settings; 0 if there's no context
+inline GLFWwindow *startTexturePackTool(int argc, char *argv[])
+{
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return 0;
+    configureTextureCompression(argc, argv);
+    configureMips(argc, argv, "box");
+    return window;
+}
+
+inline int runTexturePacker(int argc, char *argv[])
+{
+    GLFWwindow *window = startTexturePackTool(argc, argv);
+    if (!window)
+        return -1;
+    vector<string> skyboxes = packList(argc, argv, "--skyboxes", "skybox/sky,skybox/space,skybox/space2");
+    vector<string> images = packList(argc, argv, "--images", "models/backpack/ao.jpg");
+    bool gamma = hasArg(argc, argv, "--gamma");
+    int failed = 0;
+    for (size_t i = 0; i < skyboxes.size() + images.size(); i++) {
+        bool cube = i < skyboxes.size();
+        string name = cube ? skyboxes[i] : images[i - skyboxes.size()];
+        vector<string> sources = cube ? skyboxFaces(name) : vector<string>(1, name);
+        string path = cube ? cubemapPackPath(name) : imagePackPath(name, gamma);
+        double ms = 0.0;
+        if (!packTextures(sources, gamma, path, &ms)) {
+            failed++;
+            continue;
+        }
+        size_t sourceBytes = 0;
+        for (size_t s = 0; s < sources.size(); s++)
+            sourceBytes += fileBytes(sources[s]);
+        cout << "Packed " << name << " into " << path << " in " << fixed << setprecision(1) << ms << " ms, "
+             << MemoryRegistry::formatBytes(fileBytes(path)) << " (sources " << MemoryRegistry::formatBytes(sourceBytes) << ")" << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    destroyHeadlessContext(window);
+    return failed ? -1 : 0;
+}
+
+// one load of a skybox or an image through the viewer's loaders, up to the driver being done, ms
+inline double timeTextureLoad(const string &name, bool cube, bool gamma, bool usePack, bool cold)
+{
+    vector<string> sources = cube ? skyboxFaces(name) : vector<string>(1, name);
+    texturePackSettings().enabled = usePack;
+    if (cold) {
+        if (usePack)
+            dropFromPageCache(cube ? cubemapPackPath(name) : imagePackPath(name, gamma));
+        else
+            for (size_t i = 0; i < sources.size(); i++)
+                dropFromPageCache(sources[i]);
+    }
+    glFinish();
+    auto start = std::chrono::steady_clock::now();
+    unsigned int texture;
+    if (cube) {
+        texture = loadCubemap(sources);
+    } else {
+        DecodedImage image = decodeImage(name, gamma);
+        texture = uploadTexture(image, gamma);
+    }
+    glFinish();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    memoryRegistry().release(MEM_TEXTURE, texture);
+    glDeleteTextures(1, &texture);
+    return ms;
+}
+
+/*
+    Per skybox (and image): the size of the sources and of the pack, then the load time from each, cold
+    and warm (the best of --repeat). The JPEG side doesn't use the .bc and .mips caches, so it is what a
+    first start costs; the pack is made first if it isn't there.
+*/
+inline int runTexturePackBenchmark(int argc, char *argv[])
+{
+    GLFWwindow *window = startTexturePackTool(argc, argv);
+    if (!window)
+        return -1;
+    vector<string> skyboxes = packList(argc, argv, "--skyboxes", "skybox/sky,skybox/space,skybox/space2");
+    vector<string> images = packList(argc, argv, "--images", "models/backpack/ao.jpg");
+    bool gamma = hasArg(argc, argv, "--gamma");
+    int repeat = std::max((int)argNumber(argc, argv, "--repeat", 3), 1);
+    textureCompression().cache = false;
+    mipSettings().cache = false;
+    bool canDrop = dropFromPageCache(skyboxes.empty() ? images[0] : skyboxFaces(skyboxes[0])[0]);
+    cout << "Texture packs against decoding, " << texturePackTag(texturePackMipTag(true)) << ", "
+         << jobSystem().threadCount() << " threads" << (canDrop ? "" : " (can't drop the page cache here, cold = warm)") << endl;
+
+    struct Row { string name; size_t sourceBytes, packBytes; double jpegCold, jpegWarm, packCold, packWarm; };
+    vector<Row> rows;
+    for (size_t i = 0; i < skyboxes.size() + images.size(); i++) {
+        bool cube = i < skyboxes.size();
+        Row row;
+        row.name = cube ? skyboxes[i] : images[i - skyboxes.size()];
+        vector<string> sources = cube ? skyboxFaces(row.name) : vector<string>(1, row.name);
+        string path = cube ? cubemapPackPath(row.name) : imagePackPath(row.name, gamma);
+        TexturePack existing;
+        if (!openTexturePack(path, sourceStamp(sources), existing) && !packTextures(sources, gamma, path))
+            continue;
+        existing = TexturePack();
+        row.sourceBytes = 0;
+        for (size_t s = 0; s < sources.size(); s++)
+            row.sourceBytes += fileBytes(sources[s]);
+        row.packBytes = fileBytes(path);
+        row.jpegCold = timeTextureLoad(row.name, cube, gamma, false, true);
+        row.packCold = timeTextureLoad(row.name, cube, gamma, true, true);
+        row.jpegWarm = row.packWarm = 1e30;
+        for (int r = 0; r < repeat; r++) {
+            row.jpegWarm = std::min(row.jpegWarm, timeTextureLoad(row.name, cube, gamma, false, false));
+            row.packWarm = std::min(row.packWarm, timeTextureLoad(row.name, cube, gamma, true, false));
+        }
+        rows.push_back(row);
+    }
+    texturePackSettings().enabled = true;
+
+    cout << left << setw(26) << "texture" << right << setw(11) << "sources" << setw(11) << "pack" << setw(12) << "jpeg cold"
+         << setw(12) << "jpeg warm" << setw(12) << "pack cold" << setw(12) << "pack warm" << setw(10) << "speedup" << endl;
+    for (size_t i = 0; i < rows.size(); i++) {
+        const Row &row = rows[i];
+        cout << left << setw(26) << row.name << right << setw(11) << MemoryRegistry::formatBytes(row.sourceBytes) << setw(11)
+             << MemoryRegistry::formatBytes(row.packBytes) << fixed << setprecision(1) << setw(12) << row.jpegCold << setw(12)
+             << row.jpegWarm << setw(12) << row.packCold << setw(12) << row.packWarm << setw(9) << row.jpegWarm / row.packWarm
+             << "x" << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* texpackbench_hpp */
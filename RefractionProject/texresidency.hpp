@@ -0,0 +1,420 @@
+//
+//  texresidency.hpp
+//  RefractionProject
+//
+//  Keeps only the mip levels of the model textures that are actually needed on the GPU. A texture
+//  starts with its small levels (64x64 and down) and nothing else. Every frame the renderer works out
+//  how big each textured mesh is on screen (texel density from its bounding sphere and uv layout, see
+//  Mesh::measure) and asks for the level that density needs. update() streams finer levels in, coarse
+//  to fine, up to a byte budget per frame, and keeps the total under the VRAM budget by dropping the
+//  least recently used levels nobody asked for this frame.
+//
+//  The textures stay mutable: GL_TEXTURE_BASE_LEVEL points at the finest level on the GPU, and a level
+//  that leaves is respecified as 0x0 so the driver can free it. The levels that aren't resident wait on
+//  the CPU, or in the mapping of the texture pack (texpack.hpp), which only costs page cache.
+//
+//  RefractionProject --texture-budget-mb 64 [--stream-budget-mb 8] [--resident-tail 64] [--residency-bias 0]
+//                    [--residency-report] [--residency-csv frames.csv]
+//
+
+#ifndef texresidency_hpp
+#define texresidency_hpp
+
+#include <glad/glad.h>
+
+#include "glm/glm.hpp"
+#include "cmdline.hpp"
+#include "memory.hpp"
+#include "mesh.h"
+#include "mipgen.hpp"
+#include "stagingring.hpp"
+#include "texcompress.hpp"
+#include "texpack.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// A texture under the manager
+struct ResidentTexture {
+    unsigned int id;
+    string filename;
+    int width, height, levels;
+    GLenum internalFormat, format, type;   // type 0 = block-compressed
+    TexturePack pack;                      // where the levels come from...
+    vector<vector<unsigned char> > data;   // ...or these, on the CPU
+    int base;                  // finest level on the GPU, base..levels-1 are resident
+    int tail;                  // the small levels from here on never leave
+    int wanted;                // finest level asked for since the last update, levels = none
+    unsigned long long lastUsed;
+
+    int levelWidth(int level) const { return std::max(width >> level, 1); }
+    int levelHeight(int level) const { return std::max(height >> level, 1); }
+    size_t levelBytes(int level) const { return textureBytes(internalFormat, levelWidth(level), levelHeight(level)); }
+    const unsigned char *levelData(int level) const { return pack.empty() ? data[level].data() : pack.slice(0, level); }
+    size_t levelDataBytes(int level) const { return pack.empty() ? data[level].size() : pack.sliceBytes(0, level); }
+};
+
+// What one update() did, and where residency stood after it
+struct ResidencyFrame {
+    unsigned long long frame;
+    int textures, blurry;          // blurry: resident, but coarser than asked for
+    size_t residentBytes, wantedBytes, fullBytes;
+    size_t streamedBytes, evictedBytes;
+    int streamedLevels, evictedLevels;
+    float ms;
+};
+
+class TextureResidency {
+public:
+    bool enabled;
+    size_t budget;          // bytes of texture levels on the GPU, 0 = no limit
+    size_t streamBudget;    // bytes uploaded per update (at least one level)
+    int tailSize;           // levels this big and smaller are resident from the start
+    float bias;             // added to the level the texel density asks for, > 0 is blurrier
+    bool report;            // print the frames where something moved
+    bool recording;         // keep every frame in history, for writeCsv
+    vector<ResidencyFrame> history;
+    ResidencyFrame last;
+
+    TextureResidency()
+        : enabled(false), budget(0), streamBudget(8 << 20), tailSize(64), bias(0.0f), report(false), recording(false), last(), frame(0)
+    {
+    }
+
+    /*
+        Takes over a texture the loaders made: the levels move out of pack, compressed or mips (one of
+        them has to have them all) and only the tail goes up. Returns the GL texture.
+    */
+    unsigned int add(const string &filename, int width, int height, bool srgb, TexturePack &pack, CompressedTexture &compressed,
+                     MipChain &mips)
+    {
+        ResidentTexture texture;
+        texture.filename = filename;
+        texture.width = width;
+        texture.height = height;
+        if (!pack.empty()) {
+            texture.levels = pack.levels;
+            texture.internalFormat = srgb ? srgbInternalFormat(pack.internalFormat) : pack.internalFormat;
+            texture.format = pack.format;
+            texture.type = pack.compressed() ? 0 : pack.type;
+            texture.pack = pack;
+            pack = TexturePack();
+        } else if (!compressed.empty()) {
+            texture.levels = (int)compressed.levels.size();
+            texture.internalFormat = blockFormatGL(compressed.format, srgb);
+            texture.format = GL_RGBA;
+            texture.type = 0;
+            texture.data.swap(compressed.levels);
+            compressed = CompressedTexture();
+        } else {
+            texture.levels = (int)mips.levels.size();
+            texture.format = mips.components == 1 ? GL_RED : mips.components == 2 ? GL_RG : mips.components == 3 ? GL_RGB : GL_RGBA;
+            texture.internalFormat = srgb ? (mips.components == 4 ? GL_SRGB8_ALPHA8 : GL_SRGB8) : texture.format;
+            texture.type = GL_UNSIGNED_BYTE;
+            texture.data.swap(mips.levels);
+            mips = MipChain();
+        }
+        texture.tail = texture.levels - 1;
+        while (texture.tail > 0 && std::max(texture.levelWidth(texture.tail - 1), texture.levelHeight(texture.tail - 1)) <= tailSize)
+            texture.tail--;
+        texture.base = texture.levels;
+        texture.wanted = texture.levels;
+        texture.lastUsed = frame;
+
+        glGenTextures(1, &texture.id);
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture.levels - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, texture.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        while (texture.base > texture.tail)
+            streamIn(texture);
+        if (texture.pack.empty())
+            memoryRegistry().track(MEM_CPU_IMAGE, texture.id, cpuBytes(texture), "streaming source", filename);
+        track(texture);
+        unsigned int id = texture.id;
+        textures[id] = std::move(texture);
+        return id;
+    }
+
+    // this frame needs the texture at pixelsPerUv: how many pixels its whole [0, 1] uv square would cover
+    void request(unsigned int id, float pixelsPerUv)
+    {
+        map<unsigned int, ResidentTexture>::iterator it = textures.find(id);
+        if (it == textures.end() || !(pixelsPerUv > 0.0f))
+            return;
+        ResidentTexture &texture = it->second;
+        float texelsPerPixel = std::max(texture.width, texture.height) / pixelsPerUv;
+        int level = (int)std::floor(std::log2(std::max(texelsPerPixel, 1.0f)) + bias);
+        texture.wanted = std::min(texture.wanted, std::max(std::min(level, texture.levels - 1), 0));
+        texture.lastUsed = frame;
+    }
+
+    /*
+        The textures of meshes drawn with model, from how close their bounding spheres come to the camera.
+        Meshes outside the view ask for nothing, so their levels are the first to go.
+    */
+    void request(const vector<Mesh> &meshes, const glm::mat4 &model, const glm::mat4 &view, const glm::mat4 &projection,
+                 int viewportHeight)
+    {
+        glm::mat4 clip = projection * view;
+        float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        for (size_t m = 0; m < meshes.size(); m++) {
+            const Mesh &mesh = meshes[m];
+            if (mesh.textures.empty() || mesh.uvDensity <= 0.0f)
+                continue;
+            glm::vec4 center = model * glm::vec4(mesh.boundsCenter, 1.0f);
+            float radius = mesh.boundsRadius * scale;
+            if (!sphereVisible(clip, center, radius))
+                continue;
+            float distance = std::max(glm::length(glm::vec3(view * center)) - radius, 1e-3f);
+            // pixels per world unit at that distance, times world units per uv unit
+            float pixelsPerUnit = projection[1][1] * viewportHeight * 0.5f / distance;
+            float pixelsPerUv = pixelsPerUnit * scale / mesh.uvDensity;
+            for (size_t t = 0; t < mesh.textures.size(); t++)
+                request(mesh.textures[t].id, pixelsPerUv);
+        }
+    }
+
+    /*
+        Once a frame, before drawing: streams in what the last frame asked for (the most starved
+        textures first), evicting what nobody asked for to make room, and records the frame.
+    */
+    void update()
+    {
+        auto start = std::chrono::steady_clock::now();
+        ResidencyFrame record = ResidencyFrame();
+        record.frame = frame;
+        size_t left = streamBudget;
+        bool uploaded = false, progress = true;
+        while (progress && (!uploaded || left > 0)) {
+            progress = false;
+            vector<ResidentTexture *> starved;
+            for (map<unsigned int, ResidentTexture>::iterator it = textures.begin(); it != textures.end(); it++)
+                if (it->second.wanted < it->second.base)
+                    starved.push_back(&it->second);
+            std::sort(starved.begin(), starved.end(), [](const ResidentTexture *a, const ResidentTexture *b) {
+                return a->base - a->wanted != b->base - b->wanted ? a->base - a->wanted > b->base - b->wanted : a->lastUsed > b->lastUsed;
+            });
+            // one level each per round, so a big texture doesn't hold everyone else up
+            for (size_t i = 0; i < starved.size() && (!uploaded || left > 0); i++) {
+                ResidentTexture &texture = *starved[i];
+                size_t bytes = texture.levelBytes(texture.base - 1);
+                if (budget && residentBytes() + bytes > budget && !evict(bytes, texture.id, record))
+                    continue;
+                streamIn(texture);
+                track(texture);
+                record.streamedBytes += bytes;
+                record.streamedLevels++;
+                left -= std::min(left, bytes);
+                uploaded = progress = true;
+            }
+        }
+        // a smaller budget than last frame
+        if (budget && residentBytes() > budget)
+            evict(residentBytes() - budget, 0, record);
+
+        record.textures = (int)textures.size();
+        for (map<unsigned int, ResidentTexture>::iterator it = textures.begin(); it != textures.end(); it++) {
+            ResidentTexture &texture = it->second;
+            if (texture.wanted < texture.base)
+                record.blurry++;
+            for (int level = 0; level < texture.levels; level++) {
+                record.fullBytes += texture.levelBytes(level);
+                if (level >= std::min(texture.wanted, texture.tail))
+                    record.wantedBytes += texture.levelBytes(level);
+            }
+            texture.wanted = texture.levels;
+        }
+        record.residentBytes = residentBytes();
+        record.ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        last = record;
+        if (recording)
+            history.push_back(record);
+        if (report && (record.streamedLevels || record.evictedLevels))
+            printFrame(cout, record);
+        frame++;
+    }
+
+    size_t residentBytes() const
+    {
+        size_t total = 0;
+        for (map<unsigned int, ResidentTexture>::const_iterator it = textures.begin(); it != textures.end(); it++)
+            for (int level = it->second.base; level < it->second.levels; level++)
+                total += it->second.levelBytes(level);
+        return total;
+    }
+
+    static void printFrame(ostream &out, const ResidencyFrame &record)
+    {
+        out << "Residency frame " << record.frame << ": " << MemoryRegistry::formatBytes(record.residentBytes) << " resident of "
+            << MemoryRegistry::formatBytes(record.fullBytes) << " (" << MemoryRegistry::formatBytes(record.wantedBytes) << " wanted), streamed "
+            << record.streamedLevels << " levels " << MemoryRegistry::formatBytes(record.streamedBytes) << ", evicted " << record.evictedLevels
+            << " levels " << MemoryRegistry::formatBytes(record.evictedBytes) << ", " << record.blurry << " of " << record.textures
+            << " textures blurry, " << fixed << setprecision(2) << record.ms << " ms" << endl;
+        out.unsetf(ios::floatfield);
+    }
+
+    bool writeCsv(const string &path) const
+    {
+        ofstream csv(path.c_str());
+        if (!csv)
+            return false;
+        csv << "frame,textures,blurry,resident_bytes,wanted_bytes,full_bytes,streamed_levels,streamed_bytes,evicted_levels,evicted_bytes,ms" << endl;
+        for (size_t i = 0; i < history.size(); i++) {
+            const ResidencyFrame &r = history[i];
+            csv << r.frame << ',' << r.textures << ',' << r.blurry << ',' << r.residentBytes << ',' << r.wantedBytes << ',' << r.fullBytes << ','
+                << r.streamedLevels << ',' << r.streamedBytes << ',' << r.evictedLevels << ',' << r.evictedBytes << ',' << r.ms << endl;
+        }
+        return true;
+    }
+
+    // deletes the texture (the models call this for theirs); false if it isn't one of ours
+    bool release(unsigned int id)
+    {
+        map<unsigned int, ResidentTexture>::iterator it = textures.find(id);
+        if (it == textures.end())
+            return false;
+        memoryRegistry().release(MEM_TEXTURE, id);
+        memoryRegistry().release(MEM_CPU_IMAGE, id);
+        glDeleteTextures(1, &id);
+        textures.erase(it);
+        return true;
+    }
+
+    void release()
+    {
+        while (!textures.empty())
+            release(textures.begin()->first);
+        history.clear();
+    }
+
+private:
+    map<unsigned int, ResidentTexture> textures;
+    unsigned long long frame;
+
+    // the next finer level goes up, and sampling starts at it
+    static void streamIn(ResidentTexture &texture)
+    {
+        int level = texture.base - 1;
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (texture.type == 0)
+            stagedCompressedTexImage2D(GL_TEXTURE_2D, level, texture.internalFormat, texture.levelWidth(level), texture.levelHeight(level),
+                                       texture.levelData(level), texture.levelDataBytes(level));
+        else
+            stagedTexImage2D(GL_TEXTURE_2D, level, texture.internalFormat, texture.levelWidth(level), texture.levelHeight(level),
+                             texture.format, texture.type, texture.levelData(level), texture.levelDataBytes(level));
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        texture.base = level;
+    }
+
+    // the finest level leaves: sampling stops using it first, then it's respecified empty
+    static void streamOut(ResidentTexture &texture)
+    {
+        int level = texture.base;
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+        if (texture.type == 0)
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, texture.internalFormat, 0, 0, 0, 0, 0);
+        else
+            glTexImage2D(GL_TEXTURE_2D, level, texture.internalFormat, 0, 0, 0, texture.format, texture.type, 0);
+        texture.base = level + 1;
+    }
+
+    /*
+        Frees at least bytes by dropping levels finer than their textures were asked for, least recently
+        used first and the biggest level of a texture before its smaller ones. Never touches keep, the
+        tails, or what this frame wants. False if that isn't enough (what it dropped stays dropped).
+    */
+    bool evict(size_t bytes, unsigned int keep, ResidencyFrame &record)
+    {
+        size_t freed = 0;
+        while (freed < bytes) {
+            ResidentTexture *victim = 0;
+            for (map<unsigned int, ResidentTexture>::iterator it = textures.begin(); it != textures.end(); it++) {
+                ResidentTexture &texture = it->second;
+                if (texture.id == keep || texture.base >= std::min(texture.wanted, texture.tail))
+                    continue;
+                if (!victim || texture.lastUsed < victim->lastUsed || (texture.lastUsed == victim->lastUsed && texture.base < victim->base))
+                    victim = &texture;
+            }
+            if (!victim)
+                return false;
+            size_t levelBytes = victim->levelBytes(victim->base);
+            streamOut(*victim);
+            track(*victim);
+            freed += levelBytes;
+            record.evictedBytes += levelBytes;
+            record.evictedLevels++;
+        }
+        return true;
+    }
+
+    static size_t cpuBytes(const ResidentTexture &texture)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < texture.data.size(); i++)
+            total += texture.data[i].size();
+        return total;
+    }
+
+    static void track(const ResidentTexture &texture)
+    {
+        size_t bytes = 0;
+        for (int level = texture.base; level < texture.levels; level++)
+            bytes += texture.levelBytes(level);
+        ostringstream levels;
+        levels << " levels " << texture.base << "-" << texture.levels - 1;
+        memoryRegistry().track(MEM_TEXTURE, texture.id, bytes, describeImage(texture.internalFormat, texture.width, texture.height,
+                               levels.str().c_str()), texture.filename);
+    }
+
+    // against the six planes of the clip matrix (Gribb & Hartmann), w > 0 is in front
+    static bool sphereVisible(const glm::mat4 &clip, const glm::vec4 &center, float radius)
+    {
+        for (int plane = 0; plane < 6; plane++) {
+            int axis = plane / 2;
+            float sign = plane % 2 ? -1.0f : 1.0f;
+            glm::vec4 p(clip[0][3] + sign * clip[0][axis], clip[1][3] + sign * clip[1][axis], clip[2][3] + sign * clip[2][axis],
+                        clip[3][3] + sign * clip[3][axis]);
+            float length = glm::length(glm::vec3(p));
+            if (length > 0.0f && glm::dot(glm::vec3(p), glm::vec3(center)) + p.w < -radius * length)
+                return false;
+        }
+        return true;
+    }
+};
+
+inline TextureResidency &textureResidency()
+{
+    static TextureResidency residency;
+    return residency;
+}
+
+// --texture-budget-mb <MB> streams the model textures under that budget (0 = no limit, streaming still on)
+inline void configureTextureResidency(int argc, char *argv[])
+{
+    TextureResidency &residency = textureResidency();
+    residency.enabled = hasArg(argc, argv, "--texture-budget-mb");
+    residency.budget = (size_t)(argNumber(argc, argv, "--texture-budget-mb", 0) * 1048576);
+    residency.streamBudget = (size_t)(argNumber(argc, argv, "--stream-budget-mb", 8) * 1048576);
+    residency.tailSize = std::max((int)argNumber(argc, argv, "--resident-tail", 64), 1);
+    residency.bias = (float)argNumber(argc, argv, "--residency-bias", 0);
+    residency.report = hasArg(argc, argv, "--residency-report");
+    residency.recording = hasArg(argc, argv, "--residency-csv");
+}
+
+#endif /* texresidency_hpp */
@@ -0,0 +1,229 @@
+//
+//  texresidencybench.hpp
+//  RefractionProject
+//
+//  Flies a camera down a corridor of textured panels, each with its own texture, and back, once with
+//  every mip level uploaded at the start (what uploadTexture does by default) and once with the
+//  residency manager of texresidency.hpp under a budget. Prints what went up at the start, how much
+//  was resident at the peak and streamed in total, frame times, and how often a texture on screen was
+//  blurrier than its texel density asked for.
+//
+//  RefractionProject --bench-residency [--textures 16] [--texture-size 1024] [--texture-budget-mb 24]
+//                    [--stream-budget-mb 4] [--frames 240] [--compress fast|quality] [--residency-csv frames.csv]
+//                    [--out frame.ppm] [--software]
+//
+
+#ifndef texresidencybench_hpp
+#define texresidencybench_hpp
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "image.hpp"
+#include "memory.hpp"
+#include "model.hpp"
+#include "renderer.hpp"
+#include "texresidency.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// a size x size RGBA texture: a checkerboard in the panel's own hue with fine stripes, so every level differs
+inline MipChain residencyTestTexture(int size, int index)
+{
+    vector<unsigned char> pixels((size_t)size * size * 4);
+    glm::vec3 hue(0.5f + 0.5f * std::cos(index * 2.4f), 0.5f + 0.5f * std::cos(index * 2.4f + 2.1f), 0.5f + 0.5f * std::cos(index * 2.4f + 4.2f));
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++) {
+            float shade = ((x / 64 + y / 64) % 2 ? 1.0f : 0.45f) * ((x / 2) % 2 ? 1.0f : 0.8f);
+            unsigned char *p = &pixels[((size_t)y * size + x) * 4];
+            for (int c = 0; c < 3; c++)
+                p[c] = (unsigned char)(255.0f * hue[c] * shade);
+            p[3] = 255;
+        }
+    MipChain chain;
+    const unsigned char *source = pixels.data();
+    buildMipChains(&source, 1, size, size, 4, MIP_BOX, false, &chain);
+    return chain;
+}
+
+// a 2x2 panel standing at x, facing the middle of the corridor
+inline Mesh residencyPanel(float x, float z, unsigned int texture)
+{
+    float facing = x > 0.0f ? -1.0f : 1.0f;
+    vector<Vertex> vertices(4);
+    const float corners[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+    for (int i = 0; i < 4; i++) {
+        vertices[i].Position = glm::vec3(x, corners[i][1], z + corners[i][0] * facing);
+        vertices[i].Normal = glm::vec3(facing, 0.0f, 0.0f);
+        vertices[i].TexCoords = glm::vec2(0.5f + 0.5f * corners[i][0], 0.5f + 0.5f * corners[i][1]);
+    }
+    const unsigned int quad[] = { 0, 1, 2, 0, 2, 3 };
+    Texture material = { texture, "texture_diffuse", "panel" };
+    return Mesh(vertices, vector<unsigned int>(quad, quad + 6), vector<Texture>(1, material), "residency panel");
+}
+
+struct ResidencyRun {
+    double startupMs, meanMs, slowestMs;
+    size_t startupBytes, peakBytes, streamedBytes;
+    long long textureFrames, blurryFrames;
+};
+
+inline ResidencyRun runResidencyFlight(bool streamed, int count, int size, int frames, const string &out)
+{
+    ResidencyRun run = ResidencyRun();
+    TextureResidency &residency = textureResidency();
+    residency.enabled = streamed;
+    residency.recording = true;
+    residency.history.clear();
+    Shader shader("shaders/texturedVshader.txt", "shaders/texturedFshader.txt");
+    RenderTarget target = createRenderTarget(800, 600, "residency benchmark");
+
+    // the mip chains are made before the clock starts, like a texture pack would have them
+    vector<DecodedImage> images(count);
+    for (int i = 0; i < count; i++) {
+        images[i].data = 0;
+        images[i].width = images[i].height = size;
+        images[i].components = 4;
+        ostringstream name;
+        name << "panel " << i;
+        images[i].filename = name.str();
+        images[i].mips = residencyTestTexture(size, i);
+        if (textureCompression().enabled &&
+            compressDecoded(images[i].filename, images[i].mips.levels[0].data(), size, size, 4, &images[i].mips, "", images[i].compressed))
+            images[i].mips = MipChain();
+    }
+    size_t before = memoryRegistry().currentBytes(MEM_TEXTURE);
+    glFinish();
+    auto start = std::chrono::steady_clock::now();
+    vector<Mesh> panels;
+    vector<unsigned int> textures;
+    const float spacing = 3.0f;
+    for (int i = 0; i < count; i++) {
+        textures.push_back(uploadTexture(images[i]));
+        panels.push_back(residencyPanel(i % 2 ? 2.5f : -2.5f, -spacing * i, textures.back()));
+    }
+    glFinish();
+    run.startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    run.startupBytes = run.peakBytes = memoryRegistry().currentBytes(MEM_TEXTURE) - before;
+    Model corridor(std::move(panels));
+
+    glm::mat4 projection = glm::perspective(60.0f, 800.0f / 600.0f, 0.1f, 200.0f); // this glm takes degrees
+    double total = 0.0;
+    for (int frame = 0; frame < frames; frame++) {
+        // down the corridor in the first half, back up it in the second
+        float t = (float)frame / std::max(frames / 2, 1);
+        float length = spacing * (count - 1) + 4.0f;
+        float z = t <= 1.0f ? 4.0f - length * t : 4.0f - length * (2.0f - t);
+        glm::vec3 eye(0.0f, 0.0f, z), forward(0.0f, 0.0f, t <= 1.0f ? -1.0f : 1.0f);
+        glm::mat4 view = glm::lookAt(eye, eye + forward, glm::vec3(0.0f, 1.0f, 0.0f));
+
+        auto frameStart = std::chrono::steady_clock::now();
+        if (streamed)
+            residency.update();
+        glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+        glViewport(0, 0, 800, 600);
+        glEnable(GL_DEPTH_TEST);
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        shader.use();
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "view"), 1, GL_FALSE, &view[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "projection"), 1, GL_FALSE, &projection[0][0]);
+        glm::mat4 model(1.0f);
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, "model"), 1, GL_FALSE, &model[0][0]);
+        if (streamed)
+            residency.request(corridor.meshes, model, view, projection, 600);
+        corridor.Draw(shader);
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        total += ms;
+        run.slowestMs = std::max(run.slowestMs, ms);
+        run.peakBytes = std::max(run.peakBytes, memoryRegistry().currentBytes(MEM_TEXTURE) - before);
+        // a quarter of the way down, with the corridor ahead
+        if (!out.empty() && frame == frames / 4) {
+            Image image(800, 600);
+            readRenderTarget(target, image.pixels);
+            if (!writePPM(out, image))
+                cout << "ERROR::RESIDENCY:: Could not write " << out << endl;
+        }
+        if (streamed && frame % 30 == 0)
+            TextureResidency::printFrame(cout, residency.last);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    run.meanMs = total / std::max(frames, 1);
+    // a frame's demand is served by the next update, so the last frame's isn't counted
+    for (size_t i = 0; i < residency.history.size(); i++) {
+        run.streamedBytes += i ? residency.history[i].streamedBytes : 0;
+        run.textureFrames += residency.history[i].textures;
+        run.blurryFrames += residency.history[i].blurry;
+    }
+    corridor.release(); // made from meshes, so the textures aren't its own
+    for (size_t i = 0; i < textures.size(); i++)
+        if (!residency.release(textures[i])) {
+            memoryRegistry().release(MEM_TEXTURE, textures[i]);
+            glDeleteTextures(1, &textures[i]);
+        }
+    deleteRenderTarget(target);
+    glDeleteProgram(shader.ID);
+    return run;
+}
+
+inline int runResidencyBenchmark(int argc, char *argv[])
+{
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    configureTextureResidency(argc, argv);
+    configureTextureCompression(argc, argv);
+    textureCompression().cache = false; // the textures aren't files
+    TextureResidency &residency = textureResidency();
+    if (!hasArg(argc, argv, "--texture-budget-mb"))
+        residency.budget = 24 << 20;
+    if (!hasArg(argc, argv, "--stream-budget-mb"))
+        residency.streamBudget = 4 << 20;
+    int count = std::max((int)argNumber(argc, argv, "--textures", 16), 1);
+    int size = std::max((int)argNumber(argc, argv, "--texture-size", 1024), 1);
+    int frames = std::max((int)argNumber(argc, argv, "--frames", 240), 1);
+    string out = argValue(argc, argv, "--out", "");
+    int block = textureCompression().enabled ? textureCompression().formatFor(4) : -1;
+    GLenum format = block >= 0 ? blockFormatGL(block) : GL_RGBA;
+    cout << "Texture streaming, " << count << " panels with a " << size << "x" << size << " " << formatName(format) << " texture each ("
+         << MemoryRegistry::formatBytes(count * textureBytes(format, size, size, 1, true)) << " with mips), 800x600, "
+         << frames << " frames" << endl;
+
+    ResidencyRun all = runResidencyFlight(false, count, size, frames, "");
+    cout << "Streamed, budget " << MemoryRegistry::formatBytes(residency.budget) << ", "
+         << MemoryRegistry::formatBytes(residency.streamBudget) << " a frame:" << endl;
+    ResidencyRun streamed = runResidencyFlight(true, count, size, frames, out);
+    string csv = argValue(argc, argv, "--residency-csv", "");
+    if (!csv.empty() && !residency.writeCsv(csv))
+        cout << "ERROR::RESIDENCY:: Could not write " << csv << endl;
+
+    cout << left << setw(18) << "" << right << setw(12) << "startup" << setw(12) << "at start" << setw(12) << "peak"
+         << setw(12) << "streamed" << setw(12) << "mean frame" << setw(12) << "slowest" << setw(10) << "blurry" << endl;
+    const ResidencyRun *runs[] = { &all, &streamed };
+    const char *names[] = { "all levels", "streamed" };
+    for (int i = 0; i < 2; i++) {
+        const ResidencyRun &run = *runs[i];
+        cout << left << setw(18) << names[i] << right << fixed << setprecision(1) << setw(9) << run.startupMs << " ms" << setw(12)
+             << MemoryRegistry::formatBytes(run.startupBytes) << setw(12) << MemoryRegistry::formatBytes(run.peakBytes) << setw(12)
+             << (i ? MemoryRegistry::formatBytes(run.streamedBytes) : string("-")) << setw(9) << run.meanMs << " ms" << setw(9)
+             << run.slowestMs << " ms" << setw(9) << (run.textureFrames ? 100.0 * run.blurryFrames / run.textureFrames : 0.0) << "%" << endl;
+        cout.unsetf(ios::floatfield);
+    }
+    residency.enabled = false;
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* texresidencybench_hpp */
@@ -0,0 +1,245 @@
+//
+//  thickness.hpp
+//  RefractionProject
+//
+//  Offline thickness baking, the d_N of Wyman's paper: for every vertex, how far a ray travels from
+//  the vertex along the inverted normal before it leaves the object again. The shaders can use it
+//  instead of the distance between the front and back depth buffers (Renderer::thicknessMode), which
+//  lets the renderer skip the normal passes for mostly-convex objects.
+//
+//  Baked values go into a sidecar file next to the model (cat.obj -> cat.obj.thickness) together with
+//  a hash of the vertex positions, so a changed model is baked again instead of using stale values.
+//
+//  RefractionProject --bake-thickness [--model path [--software]] [--triangles 100000] [--threads N]
+//
+
+#ifndef thickness_hpp
+#define thickness_hpp
+
+#include "glm/glm.hpp"
+#include "bvh.hpp"
+#include "bvh8.hpp"
+#include "cmdline.hpp"
+#include "headless.hpp"
+#include "parallel.hpp"
+#include "procedural.hpp"
+#include "raytrace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct ThicknessBakeStats {
+    size_t vertices;
+    size_t misses;       // rays that never left the object (open meshes, flipped normals), given the mean
+    double minThickness, meanThickness, maxThickness;
+    double ms;
+};
+
+/*
+    One value per vertex of every mesh, in the meshes' own space. The rays start a tiny step inside the
+    surface so they don't hit the triangles around their own vertex.
+*/
+inline vector<vector<float> > bakeThickness(const vector<MeshView> &meshes, int threads, ThicknessBakeStats &stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Bvh bvh;
+    bvh.build(worldTriangles(meshes, vector<glm::mat4>(1, glm::mat4(1.0f))), threads);
+    Bvh8 wide;
+    wide.build(bvh);
+    glm::vec3 lo(bvh.nodes[0].min[0], bvh.nodes[0].min[1], bvh.nodes[0].min[2]);
+    glm::vec3 hi(bvh.nodes[0].max[0], bvh.nodes[0].max[1], bvh.nodes[0].max[2]);
+    float epsilon = 1e-5f * std::max(glm::length(hi - lo), 1e-3f);
+
+    vector<vector<float> > thickness(meshes.size());
+    vector<unsigned int> firstVertex(meshes.size() + 1, 0);
+    for (size_t m = 0; m < meshes.size(); m++) {
+        thickness[m].assign(meshes[m].vertexCount, -1.0f);
+        firstVertex[m + 1] = firstVertex[m] + (unsigned int)meshes[m].vertexCount;
+    }
+    const int chunk = 1024;
+    int chunks = (int)((firstVertex.back() + chunk - 1) / chunk);
+    parallelFor(chunks, threads, [&](int c, int) {
+        for (unsigned int global = c * chunk; global < std::min(firstVertex.back(), (unsigned int)(c + 1) * chunk); global++) {
+            size_t m = std::upper_bound(firstVertex.begin(), firstVertex.end(), global) - firstVertex.begin() - 1;
+            unsigned int v = global - firstVertex[m];
+            const Vertex &vertex = meshes[m].vertices[v];
+            float length = glm::length(vertex.Normal);
+            if (!(length > 0.0f))
+                continue;
+            glm::vec3 inward = -vertex.Normal / length;
+            glm::vec3 side = glm::normalize(glm::cross(inward, std::fabs(inward.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0)));
+            glm::vec3 up = glm::cross(inward, side);
+            // a ray that lands exactly on an edge or vertex can slip between the triangles, nudge it and retry
+            for (int attempt = 0; attempt < 5; attempt++) {
+                static const float nudge[5][2] = { { 0, 0 }, { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+                Ray ray;
+                ray.direction = glm::normalize(inward + 1e-3f * (nudge[attempt][0] * side + nudge[attempt][1] * up));
+                ray.origin = vertex.Position + epsilon * inward;
+                RayHit hit;
+                hit.t = FLT_MAX;
+                if (wide.intersect(ray, hit)) {
+                    thickness[m][v] = hit.t + epsilon;
+                    break;
+                }
+            }
+        }
+    });
+
+    stats = ThicknessBakeStats();
+    stats.minThickness = FLT_MAX;
+    double sum = 0.0;
+    for (size_t m = 0; m < thickness.size(); m++)
+        for (size_t v = 0; v < thickness[m].size(); v++) {
+            stats.vertices++;
+            if (thickness[m][v] < 0.0f) {
+                stats.misses++;
+                continue;
+            }
+            sum += thickness[m][v];
+            stats.minThickness = std::min(stats.minThickness, (double)thickness[m][v]);
+            stats.maxThickness = std::max(stats.maxThickness, (double)thickness[m][v]);
+        }
+    size_t hits = stats.vertices - stats.misses;
+    stats.meanThickness = hits > 0 ? sum / hits : 0.0;
+    if (hits == 0)
+        stats.minThickness = 0.0;
+    for (size_t m = 0; m < thickness.size(); m++)
+        for (size_t v = 0; v < thickness[m].size(); v++)
+            if (thickness[m][v] < 0.0f)
+                thickness[m][v] = (float)stats.meanThickness;
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return thickness;
+}
+
+inline void printThicknessStats(const ThicknessBakeStats &stats, const string &name)
+{
+    cout << "Baked thickness for " << stats.vertices << " vertices of " << name << " in " << stats.ms << " ms ("
+         << stats.misses << " misses), min/mean/max " << stats.minThickness << " / " << stats.meanThickness
+         << " / " << stats.maxThickness << endl;
+}
+
+inline string thicknessSidecarPath(const string &modelPath)
+{
+    return modelPath + ".thickness";
+}
+
+// FNV-1a over the vertex positions, to notice when the model changed since the bake
+inline unsigned int vertexPositionHash(const Vertex *vertices, size_t count)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *bytes = (const unsigned char *)&vertices[i].Position;
+        for (size_t b = 0; b < sizeof(glm::vec3); b++)
+            hash = (hash ^ bytes[b]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Sidecar layout, little endian: "THK1", mesh count, then per mesh: vertex count, position hash and
+    one float per vertex.
+*/
+inline bool saveThickness(const string &path, const Model &model, const vector<vector<float> > &thickness)
+{
+    ofstream file(path.c_str(), ios::binary);
+    if (!file) {
+        cout << "ERROR::THICKNESS:: Could not write " << path << endl;
+        return false;
+    }
+    unsigned int meshCount = (unsigned int)model.meshes.size();
+    file.write("THK1", 4);
+    file.write((const char *)&meshCount, sizeof(meshCount));
+    for (size_t m = 0; m < model.meshes.size(); m++) {
+        const Mesh &mesh = model.meshes[m];
+        unsigned int count = (unsigned int)mesh.vertices.size();
+        unsigned int hash = vertexPositionHash(mesh.vertices.data(), count);
+        file.write((const char *)&count, sizeof(count));
+        file.write((const char *)&hash, sizeof(hash));
+        file.write((const char *)thickness[m].data(), count * sizeof(float));
+    }
+    return (bool)file;
+}
+
+// false if there is no sidecar or it was baked for different meshes
+inline bool loadThickness(const string &path, const Model &model, vector<vector<float> > &thickness)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+        return false;
+    char magic[4];
+    unsigned int meshCount = 0;
+    file.read(magic, 4);
+    file.read((char *)&meshCount, sizeof(meshCount));
+    if (!file || string(magic, 4) != "THK1" || meshCount != model.meshes.size())
+        return false;
+    thickness.assign(meshCount, vector<float>());
+    for (size_t m = 0; m < meshCount; m++) {
+        const Mesh &mesh = model.meshes[m];
+        unsigned int count = 0, hash = 0;
+        file.read((char *)&count, sizeof(count));
+        file.read((char *)&hash, sizeof(hash));
+        if (!file || count != mesh.vertices.size() || hash != vertexPositionHash(mesh.vertices.data(), count))
+            return false;
+        thickness[m].resize(count);
+        file.read((char *)thickness[m].data(), count * sizeof(float));
+    }
+    return (bool)file;
+}
+
+/*
+    Gives every mesh of model its thickness attribute: from the sidecar if it is up to date, otherwise
+    baked now (and saved next to the model when it came from a file).
+*/
+inline void loadOrBakeThickness(Model &model, bool fromFile, int threads = 0)
+{
+    vector<vector<float> > thickness;
+    string sidecar = thicknessSidecarPath(model.path);
+    if (!fromFile || !loadThickness(sidecar, model, thickness)) {
+        // one view per mesh (meshViews() skips empty ones), so the results line up with model.meshes
+        vector<MeshView> views;
+        for (size_t m = 0; m < model.meshes.size(); m++) {
+            const Mesh &mesh = model.meshes[m];
+            MeshView view = { mesh.vertices.data(), mesh.indices.data(), mesh.indices.size(), mesh.vertices.size() };
+            views.push_back(view);
+        }
+        ThicknessBakeStats stats;
+        thickness = bakeThickness(views, threads, stats);
+        printThicknessStats(stats, model.path);
+        if (fromFile && saveThickness(sidecar, model, thickness))
+            cout << "Wrote " << sidecar << endl;
+    }
+    for (size_t m = 0; m < model.meshes.size(); m++)
+        if (!model.meshes[m].vertices.empty())
+            model.meshes[m].setThickness(thickness[m]);
+}
+
+inline int runThicknessBaker(int argc, char *argv[])
+{
+    int threads = (int)argNumber(argc, argv, "--threads", 0);
+    string modelPath = argValue(argc, argv, "--model", "");
+    if (modelPath.empty()) {
+        // no model: bake a procedural blob just to see how fast it goes
+        MeshData blob = buildShape(SHAPE_BLOB, (unsigned int)argNumber(argc, argv, "--triangles", 100000));
+        ThicknessBakeStats stats;
+        bakeThickness(vector<MeshView>(1, meshView(blob)), threads, stats);
+        printThicknessStats(stats, blob.owner);
+        return 0;
+    }
+    GLFWwindow *window = createHeadlessContext(hasArg(argc, argv, "--software"));
+    if (!window)
+        return -1;
+    Model model(modelPath);
+    remove(thicknessSidecarPath(modelPath).c_str()); // always bake again
+    loadOrBakeThickness(model, true, threads);
+    model.release();
+    destroyHeadlessContext(window);
+    return 0;
+}
+
+#endif /* thickness_hpp */
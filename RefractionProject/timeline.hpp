@@ -0,0 +1,132 @@
+//
+//  timeline.hpp
+//  RefractionProject
+//
+//  Startup timeline: how long each step between launching the viewer and showing the first frame
+//  takes (window, GLAD, shader compiles, model import, cubemap faces, framebuffers...).
+//
+//  Steps call startupTimeline().mark("what just finished"). Each mark closes the phase that started at
+//  the previous mark, so everything between two marks is charged to the later one. finish() is called
+//  after the first swap; marks after that are ignored. So are marks from other threads than the one that
+//  (re)started it, e.g. the loader thread's uploads (loader.hpp), the timeline is the main thread's.
+//
+
+#ifndef timeline_hpp
+#define timeline_hpp
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TimelinePhase {
+    std::string name;
+    double startMs;     // since the timeline started
+    double durationMs;
+};
+
+class StartupTimeline {
+public:
+    std::vector<TimelinePhase> phases;
+    double timeToFirstFrameMs;
+
+    StartupTimeline() : timeToFirstFrameMs(0.0), finished(false)
+    {
+        restart();
+    }
+
+    void restart()
+    {
+        start = last = std::chrono::steady_clock::now();
+        owner = std::this_thread::get_id();
+        phases.clear();
+        finished = false;
+        timeToFirstFrameMs = 0.0;
+    }
+
+    void mark(const std::string &name)
+    {
+        if (std::this_thread::get_id() != owner || finished)
+            return;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        TimelinePhase phase;
+        phase.name = name;
+        phase.startMs = milliseconds(start, last);
+        phase.durationMs = milliseconds(last, now);
+        phases.push_back(phase);
+        last = now;
+    }
+
+    // call once the first frame is on screen
+    void finish()
+    {
+        if (finished)
+            return;
+        mark("first frame");
+        timeToFirstFrameMs = milliseconds(start, last);
+        finished = true;
+    }
+
+    bool isFinished() const { return finished; }
+
+    void print(std::ostream &out) const
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << "---- Startup timeline ----" << std::endl;
+        out << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < phases.size(); i++)
+            out << std::setw(9) << phases[i].startMs << " ms  +" << std::setw(8) << phases[i].durationMs << " ms  " << phases[i].name << std::endl;
+        out << "Time to first frame: " << timeToFirstFrameMs << " ms" << std::endl;
+        out << "--------------------------" << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    bool writeJson(const std::string &path) const
+    {
+        std::ofstream out(path.c_str());
+        if (!out)
+            return false;
+        out << "{\n  \"time_to_first_frame_ms\": " << timeToFirstFrameMs << ",\n  \"phases\": [\n";
+        for (size_t i = 0; i < phases.size(); i++) {
+            out << "    { \"name\": \"" << escape(phases[i].name) << "\", \"start_ms\": " << phases[i].startMs
+                << ", \"duration_ms\": " << phases[i].durationMs << " }" << (i + 1 < phases.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        return true;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start, last;
+    std::thread::id owner;
+    bool finished;
+
+    static double milliseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+    {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    static std::string escape(const std::string &text)
+    {
+        std::string result;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '"' || text[i] == '\\')
+                result += '\\';
+            result += text[i];
+        }
+        return result;
+    }
+};
+
+// one timeline for the whole program, it starts the first time this is called (first line of main)
+inline StartupTimeline &startupTimeline()
+{
+    static StartupTimeline timeline;
+    return timeline;
+}
+
+#endif /* timeline_hpp */